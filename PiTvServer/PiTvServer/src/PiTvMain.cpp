@@ -392,6 +392,74 @@ po::options_description create_options_description()
 		("recording-path", po::value<std::string>()->default_value("recordings"), "path where to store recordings")
 		("recording-segment-duration", po::value<int>()->default_value(3600), "duration of a single segment in seconds")
 		("recording-max-size", po::value<int>()->default_value(32 * 1024), "Maximum disk space for recordings in Megabytes")
+		("recording-container", po::value<std::string>()->default_value("mp4"), "mp4 finalizes each segment when it ends, fmp4 and ts keep every segment readable while recording and after a power loss")
+		("recording-fragment-duration", po::value<int>()->default_value(1000), "fragment duration of the fmp4 recording container in milliseconds")
+		("recording-bitrate", po::value<int>()->default_value(2048), "expected bitrate of recordings in kbit/s, segments are preallocated for it. 0 disables preallocation")
+		("recording-write-block", po::value<int>()->default_value(512), "size in KiB of the aligned blocks recordings are written in")
+		("recording-writer", po::value<std::string>()->default_value("sync"), "sync writes recordings on the streaming thread, io_uring submits them asynchronously (Linux, when built with liburing)")
+		("recording-writes-in-flight", po::value<int>()->default_value(4), "blocks the io_uring writer keeps in flight before the muxer waits")
+		("recording-direct-io", po::value<bool>()->default_value(false), "write whole recording blocks with O_DIRECT, bypassing the page cache")
+		("recording-flush", po::value<std::string>()->default_value("none"), "none leaves syncing recordings to the kernel, segment syncs every segment when it is closed, block syncs every block")
+		("recording-staging-path", po::value<std::string>()->default_value(""), "tmpfs directory the active segment is staged in before it is written to the recording path, empty disables staging")
+		("recording-staging-max-size", po::value<int>()->default_value(64), "MiB of staged footage kept in RAM before the muxer waits for the card")
+		("recording-staging-max-loss", po::value<int>()->default_value(10), "seconds of staged footage a power loss may cost, the staging is flushed and synced at least this often")
+		("recording-tier-path", po::value<std::string>()->default_value(""), "secondary directory (USB disk, network mount) aged recordings are moved to, empty keeps them on the card")
+		("recording-tier-min-age", po::value<int>()->default_value(24), "hours after which a recording moves to the secondary directory")
+		("recording-tier-bandwidth", po::value<int>()->default_value(4096), "KiB/s the move may take from the card, 0 does not limit it")
+		("recording-tier-max-size", po::value<int>()->default_value(0), "maximum total size of the recordings in the secondary directory in megabytes, 0 keeps everything")
+		("recording-upload-endpoint", po::value<std::string>()->default_value(""), "http(s)://host[:port] of an S3-compatible store closed recordings are uploaded to, empty disables uploads")
+		("recording-upload-region", po::value<std::string>()->default_value("us-east-1"), "region of the S3-compatible store")
+		("recording-upload-bucket", po::value<std::string>()->default_value(""), "bucket recordings are uploaded to")
+		("recording-upload-access-key", po::value<std::string>()->default_value(""), "access key of the store, AWS_ACCESS_KEY_ID is used when empty")
+		("recording-upload-secret-key", po::value<std::string>()->default_value(""), "secret key of the store, AWS_SECRET_ACCESS_KEY is used when empty")
+		("recording-upload-prefix", po::value<std::string>()->default_value(""), "prefix of the object keys, e.g. camera1/")
+		("recording-upload-part-size", po::value<int>()->default_value(8), "MiB per part of multipart uploads, smaller recordings go up in one request")
+		("recording-upload-parallel", po::value<int>()->default_value(2), "parts of a recording uploaded at the same time")
+		("recording-upload-bandwidth", po::value<int>()->default_value(0), "KiB/s uploads may take, 0 does not limit it")
+		("recording-upload-leased-bandwidth", po::value<int>()->default_value(256), "KiB/s uploads may take while camera leases are active, 0 does not limit it")
+		("recording-upload-delete-local", po::value<bool>()->default_value(false), "remove recordings from the recording path once they are uploaded")
+		("recording-mode", po::value<std::string>()->default_value("continuous"), "continuous records everything, event records only around motion events and POST /record triggers")
+		("recording-event-preroll", po::value<int>()->default_value(5000), "milliseconds kept in memory and written in front of an event")
+		("recording-event-postroll", po::value<int>()->default_value(10000), "milliseconds recorded after the last trigger of an event")
+		("rtp-fanout-threads", po::value<int>()->default_value(0), "number of RTP sender threads. 0 uses a single multiudpsink")
+		("rtp-multicast-group", po::value<std::string>(), "multicast group for LAN viewers. If set, leases without udp_address receive group membership")
+		("rtp-multicast-port", po::value<int>()->default_value(5004), "multicast group port")
+		("rtp-multicast-ttl", po::value<int>()->default_value(1), "multicast TTL")
+		("rtp-multicast-iface", po::value<std::string>(), "network interface to send multicast traffic from")
+		("rtp-dscp", po::value<int>()->default_value(-1), "DSCP value (0-63) to mark RTP packets with, -1 leaves packets unmarked")
+		("rtp-socket-priority", po::value<int>()->default_value(-1), "SO_PRIORITY of the RTP sockets, -1 keeps the default")
+		("rtp-sndbuf-size", po::value<int>()->default_value(0), "SO_SNDBUF of the RTP sockets in bytes, 0 keeps the kernel default")
+		("srt-port", po::value<int>()->default_value(0), "port of the SRT listener for leases with transport srt, 0 disables SRT output")
+		("srt-latency", po::value<int>()->default_value(120), "SRT latency in milliseconds")
+		("srt-passphrase", po::value<std::string>(), "SRT encryption passphrase (10-79 characters)")
+		("rtsp-port", po::value<int>()->default_value(0), "port of the embedded RTSP server, 0 disables RTSP")
+		("rtsp-mount", po::value<std::string>()->default_value("/live"), "RTSP mount point of the camera stream")
+		("hls", po::value<bool>()->default_value(false), "enable LL-HLS live output on /hls/live.m3u8")
+		("hls-part-duration", po::value<int>()->default_value(500), "LL-HLS part target duration in milliseconds")
+		("hls-segment-duration", po::value<int>()->default_value(2000), "LL-HLS segment target duration in milliseconds, segments are cut on the first keyframe after it")
+		("hls-segment-count", po::value<int>()->default_value(6), "number of complete LL-HLS segments kept in memory")
+		("live-fmp4", po::value<bool>()->default_value(false), "enable progressive fMP4 live output on /live.mp4")
+		("live-fmp4-buffer", po::value<int>()->default_value(8192), "live fMP4 fragment ring size in kilobytes")
+		("live-fmp4-max-lag", po::value<int>()->default_value(2000), "live fMP4 subscriber lag in milliseconds after which it skips to the newest keyframe")
+		("snapshot", po::value<bool>()->default_value(false), "serve JPEG stills of the latest keyframe on /snapshot.jpg")
+		("snapshot-quality", po::value<int>()->default_value(85), "snapshot JPEG quality (1-100)")
+		("rtp-tcp", po::value<bool>()->default_value(false), "enable \"tcp\" leases streaming RTP over WebSocket or TCP on /rtp")
+		("rtp-tcp-queue", po::value<int>()->default_value(1024), "per-connection RTP over TCP queue size in kilobytes, whole GOPs are dropped on overflow")
+		("shm", po::value<bool>()->default_value(false), "enable \"shm\" leases exposing encoded frames in a shared memory ring")
+		("shm-raw", po::value<bool>()->default_value(false), "tap raw frames in front of the encoder for \"shm-raw\" leases")
+		("shm-slot-count", po::value<int>()->default_value(64), "number of access units in an encoded shared memory ring")
+		("shm-slot-size", po::value<int>()->default_value(512), "capacity of an encoded shared memory ring slot in kilobytes")
+		("shm-raw-slot-count", po::value<int>()->default_value(4), "number of frames in a raw shared memory ring")
+		("motion", po::value<bool>()->default_value(false), "enable motion detection on a raw frame tap, events are served on /motion")
+		("motion-interval", po::value<int>()->default_value(200), "minimal interval between analysed frames in milliseconds")
+		("motion-threshold", po::value<int>()->default_value(12), "mean absolute luma difference for a block to count as changed")
+		("motion-min-area", po::value<double>()->default_value(1.0), "percent of changed blocks that is considered motion")
+		("motion-trigger", po::value<int>()->default_value(2), "consecutive analysed frames with motion that start an event")
+		("motion-hold", po::value<int>()->default_value(3000), "milliseconds without motion after which an event ends")
+		("motion-force-keyframe", po::value<bool>()->default_value(true), "request a keyframe from the encoder when a motion event starts")
+		("analytics-plugin", po::value<std::vector<std::string>>(), "analytics plugin shared object followed by its arguments, may be given several times")
+		("analytics-cpu-budget", po::value<int>()->default_value(25), "percent of one CPU core an analytics plugin may use, frames are dropped beyond it")
+		("webrtc-max-sessions", po::value<int>()->default_value(0), "maximum number of concurrent WebRTC viewers, 0 disables WebRTC signaling on /webrtc")
 		;
 
 	return desc;
@@ -461,12 +529,179 @@ bool read_configuration(int argc, char** argv, const po::options_description& de
 	pipeline_config.video_fps_denominator = vm["video-fps-denominator"].as<int>();
 	pipeline_config.recording_segment_duration = vm["recording-segment-duration"].as<int>();
 	pipeline_config.recording_max_size = vm["recording-max-size"].as<int>();
+	pipeline_config.recording_container = vm["recording-container"].as<std::string>();
+	if (pipeline_config.recording_container != "mp4" && pipeline_config.recording_container != "fmp4" && pipeline_config.recording_container != "ts")
+	{
+		std::cerr << "Unknown recording container " << pipeline_config.recording_container << ", expected mp4, fmp4 or ts" << std::endl;
+		return false;
+	}
+	pipeline_config.recording_fragment_msec = vm["recording-fragment-duration"].as<int>();
+	pipeline_config.recording_bitrate_kbps = vm["recording-bitrate"].as<int>();
+	if (pipeline_config.recording_bitrate_kbps < 0)
+	{
+		std::cerr << "Invalid recording bitrate " << pipeline_config.recording_bitrate_kbps << std::endl;
+		return false;
+	}
+	pipeline_config.recording_write_block_kib = vm["recording-write-block"].as<int>();
+	if (pipeline_config.recording_write_block_kib < 4 || pipeline_config.recording_write_block_kib % 4 != 0)
+	{
+		std::cerr << "Invalid recording write block " << pipeline_config.recording_write_block_kib << ", expected a multiple of 4 KiB" << std::endl;
+		return false;
+	}
+	pipeline_config.recording_writer = vm["recording-writer"].as<std::string>();
+	if (pipeline_config.recording_writer != "sync" && pipeline_config.recording_writer != "io_uring")
+	{
+		std::cerr << "Unknown recording writer " << pipeline_config.recording_writer << ", expected sync or io_uring" << std::endl;
+		return false;
+	}
+	pipeline_config.recording_writes_in_flight = vm["recording-writes-in-flight"].as<int>();
+	if (pipeline_config.recording_writes_in_flight < 1)
+	{
+		std::cerr << "Invalid number of recording writes in flight " << pipeline_config.recording_writes_in_flight << std::endl;
+		return false;
+	}
+	pipeline_config.recording_direct_io = vm["recording-direct-io"].as<bool>();
+	pipeline_config.recording_flush = vm["recording-flush"].as<std::string>();
+	if (pipeline_config.recording_flush != "none" && pipeline_config.recording_flush != "segment" && pipeline_config.recording_flush != "block")
+	{
+		std::cerr << "Unknown recording flush policy " << pipeline_config.recording_flush << ", expected none, segment or block" << std::endl;
+		return false;
+	}
+	pipeline_config.recording_staging_path = vm["recording-staging-path"].as<std::string>();
+	pipeline_config.recording_staging_max_size_mib = vm["recording-staging-max-size"].as<int>();
+	if (pipeline_config.recording_staging_max_size_mib * 1024 < pipeline_config.recording_write_block_kib * 2)
+	{
+		std::cerr << "Invalid recording staging size " << pipeline_config.recording_staging_max_size_mib << " MiB, expected at least two write blocks" << std::endl;
+		return false;
+	}
+	pipeline_config.recording_staging_max_loss_sec = vm["recording-staging-max-loss"].as<int>();
+	if (pipeline_config.recording_staging_max_loss_sec < 1)
+	{
+		std::cerr << "Invalid recording staging max loss " << pipeline_config.recording_staging_max_loss_sec << " s" << std::endl;
+		return false;
+	}
+	if (!vm["recording-tier-path"].as<std::string>().empty())
+	{
+		pipeline_config.recording_tier_path = fix_path(vm["recording-tier-path"].as<std::string>());
+	}
+	pipeline_config.recording_tier_min_age_hours = vm["recording-tier-min-age"].as<int>();
+	if (pipeline_config.recording_tier_min_age_hours < 1)
+	{
+		std::cerr << "Invalid recording tier min age " << pipeline_config.recording_tier_min_age_hours << " h" << std::endl;
+		return false;
+	}
+	pipeline_config.recording_tier_bandwidth_kib = vm["recording-tier-bandwidth"].as<int>();
+	pipeline_config.recording_tier_max_size_mib = vm["recording-tier-max-size"].as<int>();
+	if (pipeline_config.recording_tier_bandwidth_kib < 0 || pipeline_config.recording_tier_max_size_mib < 0)
+	{
+		std::cerr << "Recording tier bandwidth and max size cannot be negative" << std::endl;
+		return false;
+	}
+	pipeline_config.recording_upload_endpoint = vm["recording-upload-endpoint"].as<std::string>();
+	pipeline_config.recording_upload_region = vm["recording-upload-region"].as<std::string>();
+	pipeline_config.recording_upload_bucket = vm["recording-upload-bucket"].as<std::string>();
+	pipeline_config.recording_upload_access_key = vm["recording-upload-access-key"].as<std::string>();
+	pipeline_config.recording_upload_secret_key = vm["recording-upload-secret-key"].as<std::string>();
+	if (pipeline_config.recording_upload_access_key.empty() && getenv("AWS_ACCESS_KEY_ID"))
+	{
+		pipeline_config.recording_upload_access_key = getenv("AWS_ACCESS_KEY_ID");
+	}
+	if (pipeline_config.recording_upload_secret_key.empty() && getenv("AWS_SECRET_ACCESS_KEY"))
+	{
+		pipeline_config.recording_upload_secret_key = getenv("AWS_SECRET_ACCESS_KEY");
+	}
+	pipeline_config.recording_upload_prefix = vm["recording-upload-prefix"].as<std::string>();
+	pipeline_config.recording_upload_part_size_mib = vm["recording-upload-part-size"].as<int>();
+	pipeline_config.recording_upload_parallel = vm["recording-upload-parallel"].as<int>();
+	pipeline_config.recording_upload_bandwidth_kib = vm["recording-upload-bandwidth"].as<int>();
+	pipeline_config.recording_upload_leased_bandwidth_kib = vm["recording-upload-leased-bandwidth"].as<int>();
+	pipeline_config.recording_upload_delete_local = vm["recording-upload-delete-local"].as<bool>();
+	if (!pipeline_config.recording_upload_endpoint.empty() && pipeline_config.recording_upload_bucket.empty())
+	{
+		std::cerr << "recording-upload-endpoint needs recording-upload-bucket" << std::endl;
+		return false;
+	}
+	// S3 rejects parts below 5 MiB, except for the last one
+	if (pipeline_config.recording_upload_part_size_mib < 5 || pipeline_config.recording_upload_parallel < 1)
+	{
+		std::cerr << "Invalid recording upload part size " << pipeline_config.recording_upload_part_size_mib << " MiB or parallelism "
+			<< pipeline_config.recording_upload_parallel << ", expected at least 5 MiB and 1" << std::endl;
+		return false;
+	}
+	if (pipeline_config.recording_upload_bandwidth_kib < 0 || pipeline_config.recording_upload_leased_bandwidth_kib < 0)
+	{
+		std::cerr << "Recording upload bandwidth cannot be negative" << std::endl;
+		return false;
+	}
+	pipeline_config.recording_mode = vm["recording-mode"].as<std::string>();
+	if (pipeline_config.recording_mode != "continuous" && pipeline_config.recording_mode != "event")
+	{
+		std::cerr << "Unknown recording mode " << pipeline_config.recording_mode << ", expected continuous or event" << std::endl;
+		return false;
+	}
+	pipeline_config.event_preroll_msec = vm["recording-event-preroll"].as<int>();
+	pipeline_config.event_postroll_msec = vm["recording-event-postroll"].as<int>();
+	pipeline_config.rtp_fanout_threads = vm["rtp-fanout-threads"].as<int>();
+	pipeline_config.rtp_multicast_port = vm["rtp-multicast-port"].as<int>();
+	pipeline_config.rtp_multicast_ttl = vm["rtp-multicast-ttl"].as<int>();
+	pipeline_config.rtp_dscp = vm["rtp-dscp"].as<int>();
+	pipeline_config.rtp_socket_priority = vm["rtp-socket-priority"].as<int>();
+	pipeline_config.rtp_sndbuf_size = vm["rtp-sndbuf-size"].as<int>();
+	pipeline_config.srt_port = vm["srt-port"].as<int>();
+	pipeline_config.srt_latency_msec = vm["srt-latency"].as<int>();
+	pipeline_config.raw_tap_enabled = (vm["shm"].as<bool>() && vm["shm-raw"].as<bool>()) || vm["motion"].as<bool>() || vm.count("analytics-plugin");
+	pipeline_config.encoded_tap_enabled = vm["hls"].as<bool>() || vm["live-fmp4"].as<bool>() || vm["snapshot"].as<bool>() || vm["rtp-tcp"].as<bool>()
+		|| vm["shm"].as<bool>() || vm["rtsp-port"].as<int>() > 0 || vm["webrtc-max-sessions"].as<int>() > 0;
+	pipeline_config.motion_enabled = vm["motion"].as<bool>();
+	pipeline_config.motion_interval_msec = vm["motion-interval"].as<int>();
+	pipeline_config.motion_block_threshold = vm["motion-threshold"].as<int>();
+	pipeline_config.motion_min_area_percent = vm["motion-min-area"].as<double>();
+	pipeline_config.motion_trigger_frames = vm["motion-trigger"].as<int>();
+	pipeline_config.motion_hold_msec = vm["motion-hold"].as<int>();
+	pipeline_config.motion_force_keyframe = vm["motion-force-keyframe"].as<bool>();
+	if (vm.count("analytics-plugin"))
+	{
+		pipeline_config.analytics_plugins = vm["analytics-plugin"].as<std::vector<std::string>>();
+	}
+	pipeline_config.analytics_cpu_budget_percent = vm["analytics-cpu-budget"].as<int>();
+	if (vm.count("srt-passphrase"))
+	{
+		pipeline_config.srt_passphrase = vm["srt-passphrase"].as<std::string>();
+	}
+
+	if (vm.count("rtp-multicast-group"))
+	{
+		pipeline_config.rtp_multicast_group = vm["rtp-multicast-group"].as<std::string>();
+	}
+	if (vm.count("rtp-multicast-iface"))
+	{
+		pipeline_config.rtp_multicast_iface = vm["rtp-multicast-iface"].as<std::string>();
+	}
 
 	populate_listen_addresses(server_config, vm);
 	server_config.logger_ptr = http_logger_ptr;
 	server_config.recording_path = fix_path(vm["recording-path"].as<std::string>());
+	server_config.recording_tier_path = pipeline_config.recording_tier_path;
 	server_config.logging_path = fix_path(vm["log-dir"].as<std::string>());
 	server_config.user_db = fix_path(vm["user-db"].as<std::string>());
+	server_config.rtsp_port = vm["rtsp-port"].as<int>();
+	server_config.rtsp_mount_point = vm["rtsp-mount"].as<std::string>();
+	server_config.webrtc_max_sessions = vm["webrtc-max-sessions"].as<int>();
+	server_config.hls_enabled = vm["hls"].as<bool>();
+	server_config.hls_part_duration_msec = vm["hls-part-duration"].as<int>();
+	server_config.hls_segment_duration_msec = vm["hls-segment-duration"].as<int>();
+	server_config.hls_segment_count = vm["hls-segment-count"].as<int>();
+	server_config.live_fmp4_enabled = vm["live-fmp4"].as<bool>();
+	server_config.live_fmp4_buffer_kbytes = vm["live-fmp4-buffer"].as<int>();
+	server_config.live_fmp4_max_lag_msec = vm["live-fmp4-max-lag"].as<int>();
+	server_config.snapshot_enabled = vm["snapshot"].as<bool>();
+	server_config.snapshot_quality = vm["snapshot-quality"].as<int>();
+	server_config.rtp_tcp_enabled = vm["rtp-tcp"].as<bool>();
+	server_config.rtp_tcp_queue_kbytes = vm["rtp-tcp-queue"].as<int>();
+	server_config.shm_enabled = vm["shm"].as<bool>();
+	server_config.shm_slot_count = vm["shm-slot-count"].as<int>();
+	server_config.shm_slot_kbytes = vm["shm-slot-size"].as<int>();
+	server_config.shm_raw_slot_count = vm["shm-raw-slot-count"].as<int>();
 
 	if (vm.count("tls-ca"))
 	{
@@ -590,7 +825,7 @@ int main(int argc, char** argv)
 
 	server.reset();
 
-	if (pipeline->is_pipeline_running())
+	if (pipeline->is_pipeline_running() && !pipeline->is_event_recording_mode())
 	{
 		// spdlog::info("Pipeline is still running, pausing pipeline...");
 		// pipeline->pause_pipeline();
@@ -601,7 +836,7 @@ int main(int argc, char** argv)
 	}
 	else
 	{
-		spdlog::info("Pipeline was not running, no need to call splitmux_split_now().");
+		spdlog::info("Pipeline was not running or records only events, no need to call splitmux_split_now().");
 	}
 
 	pipeline->stop_pipeline();
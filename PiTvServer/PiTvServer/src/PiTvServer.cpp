@@ -1,3 +1,4 @@
+#include <ctime>
 #include <fstream>
 #include <boost/algorithm/string/replace.hpp>
 #include "PiTvServer.h"
@@ -5,6 +6,11 @@
 
 const int PiTvServer::guid_length = 64;
 const uint64_t PiTvServer::max_lease_time_msec = 60000;
+const int PiTvServer::live_poll_msec = 10;
+const size_t PiTvServer::live_fmp4_send_watermark = 256 * 1024;
+const size_t PiTvServer::rtp_tcp_send_watermark = 64 * 1024;
+const size_t PiTvServer::clip_export_send_watermark = 256 * 1024;
+const size_t PiTvServer::max_clip_exports = 2;
 
 void PiTvServer::timer_fn(void* data)
 {
@@ -13,6 +19,13 @@ void PiTvServer::timer_fn(void* data)
 
 	uint64_t current_uptime = mg_millis();
 
+	server->update_lease_transport_stats();
+
+	if (server->rtp_tcp_output)
+	{
+		server->rtp_tcp_output->poll_bus();
+	}
+
 	for (auto& user_entry : server->user_map)
 	{
 		std::vector<std::string> timeout_leases;
@@ -30,6 +43,14 @@ void PiTvServer::timer_fn(void* data)
 			server->end_camera_lease(user_entry.second.username, lease_guid);
 		}
 	}
+
+	if (server->pipeline_main_ptr)
+	{
+		// Recording uploads must not take the uplink from active viewers
+		bool has_leases = std::any_of(server->user_map.begin(), server->user_map.end(),
+			[](const auto& user_entry) { return !user_entry.second.lease_map.empty(); });
+		server->pipeline_main_ptr->set_recording_upload_throttled(has_leases);
+	}
 }
 
 void PiTvServer::server_http_handler(mg_connection* c, int ev, void* ev_data, void* fn_data)
@@ -51,28 +72,58 @@ void PiTvServer::server_http_handler(mg_connection* c, int ev, void* ev_data, vo
 		{
 			server->on_status_request(c, hm);
 		}
+		else if (mg_http_match_uri(hm, "/leases"))
+		{
+			server->on_leases_request(c, hm);
+		}
+		else if (mg_http_match_uri(hm, "/motion"))
+		{
+			server->on_motion_request(c, hm);
+		}
+		else if (mg_http_match_uri(hm, "/analytics"))
+		{
+			server->on_analytics_request(c, hm);
+		}
+		else if (mg_http_match_uri(hm, "/snapshot") || mg_http_match_uri(hm, "/snapshot.jpg"))
+		{
+			server->on_snapshot_request(c, hm);
+		}
+		else if (mg_http_match_uri(hm, "/record"))
+		{
+			server->on_record_request(c, hm);
+		}
+		else if (mg_http_match_uri(hm, "/catalog"))
+		{
+			server->on_catalog_request(c, hm);
+		}
+		else if (mg_http_match_uri(hm, "/export"))
+		{
+			server->on_export_request(c, hm);
+		}
+		else if (mg_http_match_uri(hm, "/vod/*"))
+		{
+			server->on_vod_request(c, hm);
+		}
+		else if (mg_http_match_uri(hm, "/webrtc"))
+		{
+			server->on_webrtc_request(c, hm);
+		}
+		else if (mg_http_match_uri(hm, "/hls/*"))
+		{
+			server->on_hls_request(c, hm);
+		}
+		else if (mg_http_match_uri(hm, "/live.mp4"))
+		{
+			server->on_live_fmp4_request(c, hm);
+		}
+		else if (mg_http_match_uri(hm, "/rtp"))
+		{
+			server->on_rtp_stream_request(c, hm);
+		}
 		else if (mg_http_match_uri(hm, "/recordings") || mg_http_match_uri(hm, "/recordings/#"))
 		{
-			if (server->config.recording_path.empty())
-			{
-				mg_http_reply(c, 404, "", "Not found");
-				return;
-			}
-
-			std::string auth_user = server->get_auth_username(hm);
-			if (auth_user.empty())
-			{
-				mg_http_reply(c, 401, "WWW-Authenticate: Basic realm=\"Access to the recordings\"", "Unathorized");
-				return;
-			}
-
-			server->config.logger_ptr->info("Serving directory {}", server->config.recording_path);
-			mg_http_serve_opts opts = { 0 };
-			std::string root_dir_str = server->config.recording_path + ",/recordings=" + server->config.recording_path;
-			opts.root_dir = root_dir_str.c_str();
-			mg_http_serve_dir(c, hm, &opts);
+			server->on_recordings_request(c, hm);
 			return;
-
 		}
 		else if (mg_http_match_uri(hm, "/logs") || mg_http_match_uri(hm, "/logs/#"))
 		{
@@ -107,6 +158,70 @@ void PiTvServer::server_http_handler(mg_connection* c, int ev, void* ev_data, vo
 			mg_http_reply(c, 404, "", "Not found");
 		}
 	}
+	else if (ev == MG_EV_WS_MSG)
+	{
+		// RTP stream connections only send, anything the viewer writes is ignored
+		if (server->rtp_tcp_connections.count(c->id) == 0)
+		{
+			server->on_webrtc_message(c, (mg_ws_message*)ev_data);
+		}
+	}
+	else if (ev == MG_EV_POLL && server->rtp_tcp_connections.count(c->id))
+	{
+		server->pump_rtp_tcp_connection(c, server->rtp_tcp_connections[c->id]);
+	}
+	else if (ev == MG_EV_POLL && c->is_websocket)
+	{
+		server->poll_webrtc_session(c);
+	}
+	else if (ev == MG_EV_POLL)
+	{
+		auto iter = server->hls_pending_requests.find(c->id);
+		if (iter != server->hls_pending_requests.end() && server->serve_hls_request(c, iter->second))
+		{
+			server->hls_pending_requests.erase(iter);
+		}
+
+		auto snapshot_iter = server->snapshot_pending_requests.find(c->id);
+		if (snapshot_iter != server->snapshot_pending_requests.end() && server->serve_snapshot_request(c, snapshot_iter->second))
+		{
+			server->snapshot_pending_requests.erase(snapshot_iter);
+		}
+
+		auto subscriber_iter = server->live_fmp4_subscribers.find(c->id);
+		if (subscriber_iter != server->live_fmp4_subscribers.end())
+		{
+			server->pump_live_fmp4_subscriber(c, subscriber_iter->second);
+		}
+
+		auto export_iter = server->clip_exports.find(c->id);
+		if (export_iter != server->clip_exports.end())
+		{
+			server->pump_clip_export(c, export_iter->second);
+		}
+
+		auto vod_iter = server->vod_pending_requests.find(c->id);
+		if (vod_iter != server->vod_pending_requests.end() && server->serve_vod_request(c, vod_iter->second))
+		{
+			server->vod_pending_requests.erase(vod_iter);
+		}
+	}
+	else if (ev == MG_EV_CLOSE)
+	{
+		server->webrtc_sessions.erase(c->id);
+		server->hls_pending_requests.erase(c->id);
+		server->snapshot_pending_requests.erase(c->id);
+		server->live_fmp4_subscribers.erase(c->id);
+		size_t recording_reads = server->clip_exports.erase(c->id) + server->vod_pending_requests.erase(c->id);
+		if (recording_reads && server->recording_reader)
+		{
+			server->recording_reader->cancel(c->id);
+		}
+		if (server->rtp_tcp_connections.erase(c->id) && server->rtp_tcp_output)
+		{
+			server->rtp_tcp_output->remove_client(c->id);
+		}
+	}
 }
 
 void PiTvServer::mongoose_log_handler(char ch, void* param)
@@ -128,9 +243,11 @@ std::string PiTvServer::get_auth_username(mg_http_message* hm) const
 	char username_c[256], pass_c[256];
 	mg_http_creds(hm, username_c, sizeof(username_c), pass_c, sizeof(pass_c));
 
-	std::string username(username_c);
-	std::string password(pass_c);
+	return get_auth_username(std::string(username_c), std::string(pass_c));
+}
 
+std::string PiTvServer::get_auth_username(const std::string& username, const std::string& password) const
+{
 	if (username.empty() || password.empty())
 	{
 		config.logger_ptr->error("Failed to get auth user from request: username or password is empty");
@@ -174,11 +291,78 @@ void PiTvServer::on_status_request(mg_connection* c, mg_http_message* hm) const
 		"\"load_cpu_process_ok\": %d,"
 		"\"load_cpu_process\": %3.2f,"
 		"\"load_cpu_total_ok\": %d,"
-		"\"load_cpu_total\": %3.2f"
+		"\"load_cpu_total\": %3.2f,"
+		"\"rtp_fanout_ok\": %d,"
+		"\"rtp_fanout_endpoints\": %d,"
+		"\"rtp_fanout_packets_sent\": %llu,"
+		"\"rtp_fanout_send_errors\": %llu,"
+		"\"rtp_fanout_queue_drops\": %llu,"
+		"\"rtp_fanout_enobufs\": %llu,"
+		"\"rtp_fanout_send_drops\": %llu,"
+		"\"recording_writes_ok\": %d,"
+		"\"recording_writes\": %llu,"
+		"\"recording_bytes_written\": %llu,"
+		"\"recording_preallocation_failures\": %llu,"
+		"\"recording_write_p50_usec\": %llu,"
+		"\"recording_write_p90_usec\": %llu,"
+		"\"recording_write_p99_usec\": %llu,"
+		"\"recording_write_max_usec\": %llu,"
+		"\"recording_tiering_ok\": %d,"
+		"\"recording_tiering_moved\": %llu,"
+		"\"recording_tiering_bytes_moved\": %llu,"
+		"\"recording_tiering_copy_failures\": %llu,"
+		"\"recording_tiering_verify_failures\": %llu,"
+		"\"recording_tiering_expired\": %llu,"
+		"\"recording_staged_bytes\": %llu,"
+		"\"recording_staging_stalls\": %llu,"
+		"\"recording_upload_ok\": %d,"
+		"\"recording_upload_uploaded\": %llu,"
+		"\"recording_upload_bytes_uploaded\": %llu,"
+		"\"recording_upload_failures\": %llu,"
+		"\"recording_upload_missing\": %llu,"
+		"\"recording_upload_queue_length\": %llu,"
+		"\"recording_upload_throttled\": %d,"
+		"\"udp_sndbuf_errors_ok\": %d,"
+		"\"udp_sndbuf_errors\": %llu,"
+		"\"webrtc_sessions\": %d,"
+		"\"live_fmp4_subscribers\": %d"
 		"}\n",
 		status.temperature_cpu_ok, status.temperature_cpu,
 		status.load_cpu_process_ok, status.load_cpu_process,
-		status.load_cpu_total_ok, status.load_cpu_total
+		status.load_cpu_total_ok, status.load_cpu_total,
+		status.rtp_fanout_ok, status.rtp_fanout.endpoints,
+		(unsigned long long)status.rtp_fanout.packets_sent,
+		(unsigned long long)status.rtp_fanout.send_errors,
+		(unsigned long long)status.rtp_fanout.queue_drops,
+		(unsigned long long)status.rtp_fanout.enobufs,
+		(unsigned long long)status.rtp_fanout.send_drops,
+		status.recording_writes_ok,
+		(unsigned long long)status.recording_writes.writes,
+		(unsigned long long)status.recording_writes.bytes_written,
+		(unsigned long long)status.recording_writes.preallocation_failures,
+		(unsigned long long)status.recording_writes.write_latency_p50_usec,
+		(unsigned long long)status.recording_writes.write_latency_p90_usec,
+		(unsigned long long)status.recording_writes.write_latency_p99_usec,
+		(unsigned long long)status.recording_writes.write_latency_max_usec,
+		status.recording_tiering_ok,
+		(unsigned long long)status.recording_tiering.segments_moved,
+		(unsigned long long)status.recording_tiering.bytes_moved,
+		(unsigned long long)status.recording_tiering.copy_failures,
+		(unsigned long long)status.recording_tiering.verify_failures,
+		(unsigned long long)status.recording_tiering.segments_expired,
+		(unsigned long long)status.recording_writes.staged_bytes,
+		(unsigned long long)status.recording_writes.staging_stalls,
+		status.recording_upload_ok,
+		(unsigned long long)status.recording_upload.segments_uploaded,
+		(unsigned long long)status.recording_upload.bytes_uploaded,
+		(unsigned long long)status.recording_upload.upload_failures,
+		(unsigned long long)status.recording_upload.segments_missing,
+		(unsigned long long)status.recording_upload.queue_length,
+		status.recording_upload.throttled,
+		status.udp_sndbuf_errors_ok,
+		(unsigned long long)status.udp_sndbuf_errors,
+		status.webrtc_sessions,
+		status.live_fmp4_subscribers
 	);
 }
 
@@ -220,7 +404,39 @@ void PiTvServer::on_pitv_request(mg_connection* c, mg_http_message* hm)
 		return;
 	}
 
-	if (lease_time != 0)
+	bool multicast_requested = false;
+	mg_json_get_bool(hm->body, "$.multicast", &multicast_requested);
+
+	int udp_address_len = 0;
+	bool udp_address_present = mg_json_get(hm->body, "$.udp_address", &udp_address_len) >= 0;
+
+	std::string transport = "udp";
+	char* transport_c = mg_json_get_str(hm->body, "$.transport");
+	if (transport_c)
+	{
+		transport = transport_c;
+		free(transport_c);
+	}
+	else if (pipeline_main_ptr && pipeline_main_ptr->rtp_multicast_enabled() && (multicast_requested || !udp_address_present))
+	{
+		transport = "multicast";
+	}
+
+	if (lease_time != 0 && transport != "udp")
+	{
+		std::string lease_guid_new = std::string(lease_guid);
+		auto result = lease_camera_transport(lease_guid_new, auth_user, transport, lease_time);
+
+		if (result.first == 200)
+		{
+			reply_lease(c, user_map[auth_user].lease_map[lease_guid_new]);
+		}
+		else
+		{
+			mg_http_reply(c, result.first, "", result.second.c_str());
+		}
+	}
+	else if (lease_time != 0)
 	{
 
 		char* udp_address = mg_json_get_str(hm->body, "$.udp_address");
@@ -304,6 +520,39 @@ void PiTvServer::server_https_handler(mg_connection* c, int ev, void* ev_data, v
 	}
 }
 
+std::string PiTvServer::escape_json_string(const std::string& str)
+{
+	std::stringstream escaped;
+	for (char ch : str)
+	{
+		switch (ch)
+		{
+		case '"':
+			escaped << "\\\"";
+			break;
+		case '\\':
+			escaped << "\\\\";
+			break;
+		case '\n':
+			escaped << "\\n";
+			break;
+		default:
+			if (static_cast<unsigned char>(ch) < 0x20)
+			{
+				char code[8];
+				snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned char>(ch));
+				escaped << code;
+			}
+			else
+			{
+				escaped << ch;
+			}
+			break;
+		}
+	}
+	return escaped.str();
+}
+
 std::string PiTvServer::addr_to_str(const mg_addr& addr)
 {
 	// TODO implement IPv6 correctly
@@ -429,6 +678,48 @@ PiTvServer::PiTvServer(const PiTvServerConfig& config, std::shared_ptr<Pipeline>
 
 PiTvServer::~PiTvServer()
 {
+	webrtc_sessions.clear();
+
+	if (hls_output)
+	{
+		hls_output->stop();
+	}
+
+	live_fmp4_subscribers.clear();
+	if (live_fmp4_output)
+	{
+		live_fmp4_output->stop();
+	}
+
+	rtp_tcp_connections.clear();
+	if (rtp_tcp_output)
+	{
+		rtp_tcp_output->stop();
+	}
+
+	if (shm_egress)
+	{
+		shm_egress->stop();
+	}
+
+	snapshot_pending_requests.clear();
+	if (snapshot_cache)
+	{
+		snapshot_cache->stop();
+	}
+
+	clip_exports.clear();
+	vod_pending_requests.clear();
+	if (recording_reader)
+	{
+		recording_reader->stop();
+	}
+
+	if (rtsp_server)
+	{
+		rtsp_server->stop();
+	}
+
 	mg_mgr_free(&mongoose_event_manager);
 }
 
@@ -466,6 +757,102 @@ bool PiTvServer::start_server()
 		config.logger_ptr->info("Listening on {}", https_addr);
 	}
 
+	if (config.hls_enabled)
+	{
+		HlsOutputConfig hls_config;
+		hls_config.logger_ptr = config.logger_ptr;
+		hls_config.part_duration_msec = config.hls_part_duration_msec;
+		hls_config.segment_duration_msec = config.hls_segment_duration_msec;
+		hls_config.segment_count = config.hls_segment_count;
+		hls_output = std::make_shared<HlsOutput>(hls_config, pipeline_main_ptr->get_encoded_tap());
+		if (!hls_output->start())
+		{
+			config.logger_ptr->error("Failed to start LL-HLS output, /hls will not be available!");
+			hls_output.reset();
+		}
+	}
+
+	if (config.live_fmp4_enabled)
+	{
+		LiveFmp4OutputConfig live_config;
+		live_config.logger_ptr = config.logger_ptr;
+		live_config.max_buffered_bytes = static_cast<size_t>(config.live_fmp4_buffer_kbytes) * 1024;
+		live_config.max_subscriber_lag_msec = config.live_fmp4_max_lag_msec;
+		live_fmp4_output = std::make_shared<LiveFmp4Output>(live_config, pipeline_main_ptr->get_encoded_tap());
+		if (!live_fmp4_output->start())
+		{
+			config.logger_ptr->error("Failed to start live fMP4 output, /live.mp4 will not be available!");
+			live_fmp4_output.reset();
+		}
+	}
+
+	if (config.snapshot_enabled)
+	{
+		SnapshotCacheConfig snapshot_config;
+		snapshot_config.logger_ptr = config.logger_ptr;
+		snapshot_config.jpeg_quality = config.snapshot_quality;
+		snapshot_cache = std::make_shared<SnapshotCache>(snapshot_config, pipeline_main_ptr->get_encoded_tap());
+		if (!snapshot_cache->start())
+		{
+			config.logger_ptr->error("Failed to start snapshot cache, /snapshot will not be available!");
+			snapshot_cache.reset();
+		}
+	}
+
+	if (pipeline_main_ptr && pipeline_main_ptr->get_recording_catalog())
+	{
+		RecordingReaderConfig reader_config;
+		reader_config.logger_ptr = config.logger_ptr;
+		recording_reader = std::make_shared<RecordingReader>(reader_config);
+		if (!recording_reader->start())
+		{
+			config.logger_ptr->error("Failed to start recording reader, /export and /vod will not be available!");
+			recording_reader.reset();
+		}
+	}
+
+	if (config.rtp_tcp_enabled)
+	{
+		RtpTcpOutputConfig rtp_tcp_config;
+		rtp_tcp_config.logger_ptr = config.logger_ptr;
+		rtp_tcp_config.max_queued_bytes = static_cast<size_t>(config.rtp_tcp_queue_kbytes) * 1024;
+		rtp_tcp_output = std::make_shared<RtpTcpOutput>(rtp_tcp_config, pipeline_main_ptr->get_encoded_tap());
+		if (!rtp_tcp_output->start())
+		{
+			config.logger_ptr->error("Failed to start RTP over TCP output, tcp leases will not be available!");
+			rtp_tcp_output.reset();
+		}
+	}
+
+	if (config.shm_enabled)
+	{
+		ShmEgressConfig shm_config;
+		shm_config.logger_ptr = config.logger_ptr;
+		shm_config.encoded_slot_count = static_cast<uint32_t>(config.shm_slot_count);
+		shm_config.encoded_slot_capacity = static_cast<uint32_t>(config.shm_slot_kbytes) * 1024;
+		shm_config.raw_slot_count = static_cast<uint32_t>(config.shm_raw_slot_count);
+		shm_egress = std::make_shared<ShmEgress>(shm_config, pipeline_main_ptr->get_encoded_tap(), pipeline_main_ptr->get_raw_tap());
+		if (!shm_egress->start())
+		{
+			config.logger_ptr->error("Failed to start shared memory egress, shm leases will not be available!");
+			shm_egress.reset();
+		}
+	}
+
+	if (config.rtsp_port > 0)
+	{
+		RtspServerConfig rtsp_config;
+		rtsp_config.logger_ptr = config.logger_ptr;
+		rtsp_config.port = config.rtsp_port;
+		rtsp_config.mount_point = config.rtsp_mount_point;
+		rtsp_server = std::make_shared<RtspServer>(rtsp_config, user_db, pipeline_main_ptr->get_encoded_tap());
+		if (!rtsp_server->start())
+		{
+			config.logger_ptr->error("Failed to start RTSP server, RTSP clients will not be served!");
+			rtsp_server.reset();
+		}
+	}
+
 	config.logger_ptr->info("Adding time function");
 
 	mg_timer_add(&mongoose_event_manager, 1000, MG_TIMER_REPEAT, timer_fn, this);
@@ -475,6 +862,13 @@ bool PiTvServer::start_server()
 
 bool PiTvServer::server_poll(int timeout_msec)
 {
+	// Blocked LL-HLS requests and stream connections must be served as soon as new media is available
+	if (!hls_pending_requests.empty() || !snapshot_pending_requests.empty() || !live_fmp4_subscribers.empty() || !rtp_tcp_connections.empty()
+		|| !clip_exports.empty() || !vod_pending_requests.empty())
+	{
+		timeout_msec = std::min(timeout_msec, live_poll_msec);
+	}
+
 	mg_mgr_poll(&mongoose_event_manager, timeout_msec);
 	return true;
 }
@@ -521,7 +915,15 @@ std::pair<int, std::string> PiTvServer::end_camera_lease(std::string username, s
 	LeaseEntry entry = user.lease_map[guid];
 	user.lease_map.erase(guid);
 
-	if (!pipeline_main_ptr->rtp_remove_endpoint(entry.udp_host, entry.udp_port))
+	if (entry.transport != "udp")
+	{
+		if (!release_lease_transport(entry))
+		{
+			config.logger_ptr->error("Lease end request from user {} failed: unable to release {} transport", username, entry.transport);
+			return { 500, "Internal server error" };
+		}
+	}
+	else if (!pipeline_main_ptr->rtp_remove_endpoint(entry.udp_host, entry.udp_port))
 	{
 		config.logger_ptr->error("Lease end request from user {} failed: unable to detach RTP bin", username);
 		return { 500, "Internal server error" };
@@ -599,6 +1001,12 @@ std::pair<int, std::string> PiTvServer::lease_camera(std::string& guid, std::str
 
 		LeaseEntry& lease_entry = user.lease_map[guid];
 		lease_entry.lease_end_time = current_uptime + lease_time_msec;
+		if (lease_entry.transport != "udp")
+		{
+			config.logger_ptr->error("Lease request failed: user {} requests unicast endpoint for {} lease {}", username, lease_entry.transport, guid);
+			return { 400, "Lease transport mismatch" };
+		}
+
 		if (lease_entry.udp_host != host || lease_entry.udp_port != port)
 		{
 			config.logger_ptr->info("User {} requested endpoint change for lease {}", username, guid);
@@ -615,22 +1023,1489 @@ std::pair<int, std::string> PiTvServer::lease_camera(std::string& guid, std::str
 	return { 200, "OK" };
 }
 
-PiTvServerStatus PiTvServer::get_server_status() const
+bool PiTvServer::acquire_lease_transport(const LeaseEntry& entry)
 {
-	PiTvServerStatus status;
-	if (system_stats_ok)
+	if (entry.transport == "multicast")
 	{
-		status.load_cpu_process_ok = true;
-		status.load_cpu_total_ok = true;
-		status.load_cpu_process = system_stats_get_cpu_process();
-		status.load_cpu_total = system_stats_get_cpu_total();
+		if (!pipeline_main_ptr->rtp_multicast_enabled())
+		{
+			config.logger_ptr->error("Multicast lease requested, but multicast group is not configured");
+			return false;
+		}
+		return pipeline_main_ptr->rtp_multicast_join();
+	}
+	else if (entry.transport == "srt")
+	{
+		auto srt_output = pipeline_main_ptr->get_srt_output();
+		if (!srt_output)
+		{
+			config.logger_ptr->error("SRT lease requested, but SRT output is not enabled");
+			return false;
+		}
+		srt_output->allow_stream_id(entry.guid);
+		return true;
+	}
+	else if (entry.transport == "tcp")
+	{
+		if (!rtp_tcp_output)
+		{
+			config.logger_ptr->error("TCP lease requested, but RTP over TCP output is not enabled");
+			return false;
+		}
+		return true;
+	}
+	else if (entry.transport == "shm" || entry.transport == "shm-raw")
+	{
+		if (!shm_egress)
+		{
+			config.logger_ptr->error("Shared memory lease requested, but shared memory egress is not enabled");
+			return false;
+		}
+		ShmRingInfo ring_info;
+		return shm_egress->open_ring(entry.guid, entry.transport == "shm" ? ShmRingEncoded : ShmRingRaw, ring_info);
 	}
 
-	if (system_stats_cpu_temp_ok)
+	config.logger_ptr->error("Unknown lease transport {}", entry.transport);
+	return false;
+}
+
+bool PiTvServer::release_lease_transport(const LeaseEntry& entry)
+{
+	if (entry.transport == "multicast")
 	{
-		status.temperature_cpu_ok = true;
-		status.temperature_cpu = system_stats_get_temp_cpu();
+		return pipeline_main_ptr->rtp_multicast_leave();
+	}
+	else if (entry.transport == "srt")
+	{
+		auto srt_output = pipeline_main_ptr->get_srt_output();
+		if (srt_output)
+		{
+			srt_output->revoke_stream_id(entry.guid);
+		}
+		return true;
+	}
+	else if (entry.transport == "tcp")
+	{
+		// The stream connection notices the missing lease on its next poll and closes
+		return true;
+	}
+	else if (entry.transport == "shm" || entry.transport == "shm-raw")
+	{
+		if (shm_egress)
+		{
+			shm_egress->close_ring(entry.guid);
+		}
+		return true;
+	}
+
+	return false;
+}
+
+void PiTvServer::update_lease_transport_stats()
+{
+	if (!pipeline_main_ptr)
+	{
+		return;
+	}
+
+	std::map<std::string, SrtCallerStats> srt_stats;
+	auto srt_output = pipeline_main_ptr->get_srt_output();
+	if (srt_output)
+	{
+		srt_output->get_caller_stats(srt_stats);
+	}
+
+	for (auto& user_entry : user_map)
+	{
+		for (auto& lease_entry : user_entry.second.lease_map)
+		{
+			LeaseEntry& lease = lease_entry.second;
+			if (lease.transport == "tcp")
+			{
+				lease.transport_connected = false;
+				for (auto& connection : rtp_tcp_connections)
+				{
+					RtpTcpClientStats rtp_tcp_stats;
+					if (connection.second.guid == lease.guid && rtp_tcp_output && rtp_tcp_output->get_client_stats(connection.first, rtp_tcp_stats))
+					{
+						lease.transport_connected = true;
+						lease.packets_sent = rtp_tcp_stats.packets_sent;
+						lease.packets_dropped = rtp_tcp_stats.packets_dropped;
+					}
+				}
+				continue;
+			}
+
+			if (lease.transport == "shm" || lease.transport == "shm-raw")
+			{
+				ShmRingInfo ring_info;
+				lease.transport_connected = shm_egress && shm_egress->get_ring_info(lease.guid, ring_info);
+				if (lease.transport_connected)
+				{
+					lease.packets_sent = ring_info.frames_written;
+					lease.packets_dropped = ring_info.frames_dropped;
+				}
+				continue;
+			}
+
+			if (lease.transport != "srt")
+			{
+				continue;
+			}
+
+			auto iter = srt_stats.find(lease.guid);
+			lease.transport_connected = iter != srt_stats.end();
+			if (lease.transport_connected)
+			{
+				lease.rtt_ms = iter->second.rtt_ms;
+				lease.packets_sent = iter->second.packets_sent;
+				lease.packets_retransmitted = iter->second.packets_retransmitted;
+				lease.packets_dropped = iter->second.packets_dropped + iter->second.packets_lost;
+			}
+		}
 	}
+}
+
+void PiTvServer::reply_lease(mg_connection* c, const LeaseEntry& entry) const
+{
+	ShmRingInfo ring_info;
+	if (entry.transport == "multicast")
+	{
+		mg_http_reply(c, 200, "", "{\"guid\": \"%s\", \"transport\": \"%s\", \"multicast_group\": \"%s\", \"multicast_port\": %d, \"multicast_ttl\": %d}\n",
+			entry.guid.c_str(),
+			entry.transport.c_str(),
+			pipeline_main_ptr->get_rtp_multicast_group().c_str(),
+			pipeline_main_ptr->get_rtp_multicast_port(),
+			pipeline_main_ptr->get_rtp_multicast_ttl());
+	}
+	else if (entry.transport == "srt")
+	{
+		auto srt_output = pipeline_main_ptr->get_srt_output();
+		mg_http_reply(c, 200, "", "{\"guid\": \"%s\", \"transport\": \"%s\", \"srt_port\": %d, \"srt_stream_id\": \"%s\", \"srt_latency\": %d}\n",
+			entry.guid.c_str(),
+			entry.transport.c_str(),
+			srt_output ? srt_output->get_port() : 0,
+			entry.guid.c_str(),
+			srt_output ? srt_output->get_latency_msec() : 0);
+	}
+	else if ((entry.transport == "shm" || entry.transport == "shm-raw") && shm_egress && shm_egress->get_ring_info(entry.guid, ring_info))
+	{
+		mg_http_reply(c, 200, "", "{\"guid\": \"%s\", \"transport\": \"%s\", \"shm_name\": \"%s\", \"shm_slot_count\": %u, \"shm_slot_size\": %u}\n",
+			entry.guid.c_str(),
+			entry.transport.c_str(),
+			ring_info.name.c_str(),
+			ring_info.slot_count,
+			ring_info.payload_capacity);
+	}
+	else if (entry.transport == "tcp")
+	{
+		mg_http_reply(c, 200, "", "{\"guid\": \"%s\", \"transport\": \"%s\", \"rtp_path\": \"/rtp?guid=%s\", \"rtp_framing\": \"rfc4571\"}\n",
+			entry.guid.c_str(),
+			entry.transport.c_str(),
+			entry.guid.c_str());
+	}
+	else
+	{
+		mg_http_reply(c, 200, "", "{\"guid\": \"%s\", \"transport\": \"%s\"}\n", entry.guid.c_str(), entry.transport.c_str());
+	}
+}
+
+std::pair<int, std::string> PiTvServer::lease_camera_transport(std::string& guid, std::string username, std::string transport, uint64_t lease_time_msec)
+{
+	if (!pipeline_main_ptr)
+	{
+		config.logger_ptr->error("Lease request failed: pipeline_ptr is nullptr.");
+		return { 500, "Internal server error" };
+	}
+
+	if (username.empty())
+	{
+		config.logger_ptr->error("Lease request failed: user not specified");
+		return { 401, "User not specified" };
+	}
+
+	if (user_map.count(username) == 0)
+	{
+		PiTvUser user_new;
+		user_new.username = username;
+		user_map[username] = user_new;
+		config.logger_ptr->info("User {} was not in user map. Entry created.", username);
+	}
+
+	PiTvUser& user = user_map[username];
+
+	uint64_t current_uptime = mg_millis();
+
+	if (lease_time_msec > max_lease_time_msec)
+	{
+		config.logger_ptr->warn("Lease request has too big lease time {} msec!", lease_time_msec);
+		lease_time_msec = max_lease_time_msec;
+	}
+
+	if (!guid.empty())
+	{
+		if (user.lease_map.count(guid) == 0 || user.lease_map[guid].transport != transport)
+		{
+			config.logger_ptr->error("Lease request failed: user {} requests non-existing {} GUID {}", username, transport, guid);
+			return { 400, "Non-existing GUID specified" };
+		}
+
+		user.lease_map[guid].lease_end_time = current_uptime + lease_time_msec;
+		return { 200, "OK" };
+	}
+
+	if (user.lease_map.size() >= config.user_max_leases)
+	{
+		config.logger_ptr->error("Lease request failed: user {} reached maximum number of leases", username);
+		return { 403, "Lease limit" };
+	}
+
+	LeaseEntry lease_entry;
+	lease_entry.guid = gen_random_string(guid_length);
+	lease_entry.lease_end_time = current_uptime + lease_time_msec;
+	lease_entry.udp_port = 0;
+	lease_entry.transport = transport;
+	lease_entry.user = username;
+
+	if (transport == "multicast")
+	{
+		lease_entry.udp_host = pipeline_main_ptr->get_rtp_multicast_group();
+		lease_entry.udp_port = pipeline_main_ptr->get_rtp_multicast_port();
+	}
+
+	if (!acquire_lease_transport(lease_entry))
+	{
+		config.logger_ptr->error("Failed to acquire {} transport for user {}!", transport, username);
+		return { 400, "Transport not available" };
+	}
+
+	user.lease_map[lease_entry.guid] = lease_entry;
+
+	config.logger_ptr->info("Camera leased to {} over {} with lease time {} msec, guid {} assigned!", username, transport, lease_time_msec, lease_entry.guid);
+	guid = lease_entry.guid;
+	return { 200, "OK" };
+}
+
+void PiTvServer::on_leases_request(mg_connection* c, mg_http_message* hm) const
+{
+	assert(hm);
+
+	std::string auth_user = get_auth_username(hm);
+	if (auth_user.empty())
+	{
+		mg_http_reply(c, 401, "", "Unauthorized");
+		return;
+	}
+
+	auto user_entry = user_db->get_userdata(auth_user);
+	bool is_admin = user_entry && user_entry->role == "admin";
+
+	uint64_t current_uptime = mg_millis();
+
+	std::stringstream leases_builder;
+	leases_builder << "[";
+	bool first = true;
+	for (auto& user : user_map)
+	{
+		if (!is_admin && user.first != auth_user)
+		{
+			continue;
+		}
+
+		for (auto& lease_entry : user.second.lease_map)
+		{
+			const LeaseEntry& lease = lease_entry.second;
+			if (!first)
+			{
+				leases_builder << ",";
+			}
+			first = false;
+
+			leases_builder << "{"
+				<< "\"guid\": \"" << escape_json_string(lease.guid) << "\","
+				<< "\"user\": \"" << escape_json_string(lease.user) << "\","
+				<< "\"transport\": \"" << escape_json_string(lease.transport) << "\","
+				<< "\"udp_address\": \"" << escape_json_string(lease.udp_host) << "\","
+				<< "\"udp_port\": " << lease.udp_port << ","
+				<< "\"time_left\": " << (lease.lease_end_time > current_uptime ? lease.lease_end_time - current_uptime : 0) << ","
+				<< "\"connected\": " << (lease.transport_connected ? "true" : "false") << ","
+				<< "\"rtt_ms\": " << lease.rtt_ms << ","
+				<< "\"packets_sent\": " << lease.packets_sent << ","
+				<< "\"packets_retransmitted\": " << lease.packets_retransmitted << ","
+				<< "\"packets_dropped\": " << lease.packets_dropped
+				<< "}";
+		}
+	}
+	leases_builder << "]\n";
+
+	mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%s", leases_builder.str().c_str());
+}
+
+void PiTvServer::on_motion_request(mg_connection* c, mg_http_message* hm) const
+{
+	assert(hm);
+
+	std::string auth_user = get_auth_username(hm);
+	if (auth_user.empty())
+	{
+		mg_http_reply(c, 401, "", "Unauthorized");
+		return;
+	}
+
+	auto motion_detector = pipeline_main_ptr ? pipeline_main_ptr->get_motion_detector() : nullptr;
+	if (!motion_detector)
+	{
+		mg_http_reply(c, 404, "", "Motion detection is disabled");
+		return;
+	}
+
+	uint64_t since_id = 0;
+	char var_buffer[32];
+	if (mg_http_get_var(&hm->query, "since", var_buffer, sizeof(var_buffer)) > 0)
+	{
+		since_id = std::strtoull(var_buffer, nullptr, 10);
+	}
+
+	std::vector<MotionEvent> events;
+	motion_detector->get_events(since_id, events);
+
+	// Timestamps are milliseconds since the Unix epoch, end is 0 while the event is active
+	std::stringstream motion_builder;
+	motion_builder << "{"
+		<< "\"active\": " << (motion_detector->is_active() ? "true" : "false") << ","
+		<< "\"area_percent\": " << motion_detector->get_current_area_percent() << ","
+		<< "\"events\": [";
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		if (i > 0)
+		{
+			motion_builder << ",";
+		}
+		motion_builder << "{"
+			<< "\"id\": " << events[i].id << ","
+			<< "\"start\": " << events[i].start_wallclock_usec / 1000 << ","
+			<< "\"end\": " << events[i].end_wallclock_usec / 1000 << ","
+			<< "\"peak_area_percent\": " << events[i].peak_area_percent
+			<< "}";
+	}
+	motion_builder << "]}\n";
+
+	mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%s", motion_builder.str().c_str());
+}
+
+void PiTvServer::on_analytics_request(mg_connection* c, mg_http_message* hm) const
+{
+	assert(hm);
+
+	std::string auth_user = get_auth_username(hm);
+	if (auth_user.empty())
+	{
+		mg_http_reply(c, 401, "", "Unauthorized");
+		return;
+	}
+
+	auto analytics_host = pipeline_main_ptr ? pipeline_main_ptr->get_analytics_host() : nullptr;
+	if (!analytics_host)
+	{
+		mg_http_reply(c, 404, "", "Analytics are disabled");
+		return;
+	}
+
+	uint64_t since_id = 0;
+	char var_buffer[32];
+	if (mg_http_get_var(&hm->query, "since", var_buffer, sizeof(var_buffer)) > 0)
+	{
+		since_id = std::strtoull(var_buffer, nullptr, 10);
+	}
+
+	std::vector<AnalyticsPluginStats> plugin_stats;
+	analytics_host->get_plugin_stats(plugin_stats);
+	std::vector<AnalyticsEvent> events;
+	analytics_host->get_events(since_id, events);
+
+	// Plugin strings are untrusted, they are always served escaped
+	std::stringstream analytics_builder;
+	analytics_builder << "{\"plugins\": [";
+	for (size_t i = 0; i < plugin_stats.size(); i++)
+	{
+		if (i > 0)
+		{
+			analytics_builder << ",";
+		}
+		analytics_builder << "{"
+			<< "\"name\": \"" << escape_json_string(plugin_stats[i].name) << "\","
+			<< "\"frames_received\": " << plugin_stats[i].frames_received << ","
+			<< "\"frames_processed\": " << plugin_stats[i].frames_processed << ","
+			<< "\"frames_dropped\": " << plugin_stats[i].frames_dropped << ","
+			<< "\"process_errors\": " << plugin_stats[i].process_errors << ","
+			<< "\"last_process_usec\": " << plugin_stats[i].last_process_usec << ","
+			<< "\"cpu_percent\": " << plugin_stats[i].cpu_percent
+			<< "}";
+	}
+	analytics_builder << "],\"events\": [";
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		if (i > 0)
+		{
+			analytics_builder << ",";
+		}
+		analytics_builder << "{"
+			<< "\"id\": " << events[i].id << ","
+			<< "\"plugin\": \"" << escape_json_string(events[i].plugin) << "\","
+			<< "\"time\": " << events[i].wallclock_usec / 1000 << ","
+			<< "\"frame\": " << events[i].frame_sequence << ","
+			<< "\"label\": \"" << escape_json_string(events[i].label) << "\","
+			<< "\"confidence\": " << events[i].confidence << ","
+			<< "\"data\": \"" << escape_json_string(events[i].data) << "\""
+			<< "}";
+	}
+	analytics_builder << "]}\n";
+
+	mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%s", analytics_builder.str().c_str());
+}
+
+void PiTvServer::on_record_request(mg_connection* c, mg_http_message* hm) const
+{
+	assert(hm);
+
+	std::string auth_user = get_auth_username(hm);
+	if (auth_user.empty())
+	{
+		mg_http_reply(c, 401, "", "Unauthorized");
+		return;
+	}
+
+	auto event_recorder = pipeline_main_ptr ? pipeline_main_ptr->get_event_recorder() : nullptr;
+	if (!event_recorder)
+	{
+		mg_http_reply(c, 404, "", "Event recording is disabled");
+		return;
+	}
+
+	// POST starts an event or extends the running one, GET only reports the state
+	std::string method(hm->method.ptr, hm->method.len);
+	if (method == "POST")
+	{
+		event_recorder->trigger("API request of " + auth_user);
+	}
+	else if (method != "GET")
+	{
+		mg_http_reply(c, 405, "", "Unsupported method");
+		return;
+	}
+
+	EventRecorderStats stats = event_recorder->get_stats();
+	mg_http_reply(c, 200, "Content-Type: application/json\r\n",
+		"{"
+		"\"recording\": %s,"
+		"\"event_id\": %llu,"
+		"\"until\": %lld,"
+		"\"events_recorded\": %llu,"
+		"\"bytes_written\": %llu,"
+		"\"frames_dropped\": %llu"
+		"}\n",
+		stats.recording ? "true" : "false",
+		(unsigned long long)stats.current_event_id,
+		(long long)(stats.record_until_usec / 1000),
+		(unsigned long long)stats.events_recorded,
+		(unsigned long long)stats.bytes_written,
+		(unsigned long long)stats.frames_dropped
+	);
+}
+
+void PiTvServer::on_catalog_request(mg_connection* c, mg_http_message* hm) const
+{
+	assert(hm);
+
+	std::string auth_user = get_auth_username(hm);
+	if (auth_user.empty())
+	{
+		mg_http_reply(c, 401, "", "Unauthorized");
+		return;
+	}
+
+	auto recording_catalog = pipeline_main_ptr ? pipeline_main_ptr->get_recording_catalog() : nullptr;
+	if (!recording_catalog)
+	{
+		mg_http_reply(c, 404, "", "Recording catalog is not available");
+		return;
+	}
+
+	// Bounds are Unix time in milliseconds, both optional
+	int64_t from_msec = 0;
+	int64_t to_msec = INT64_MAX / 1000;
+	char var_buffer[32];
+	if (mg_http_get_var(&hm->query, "from", var_buffer, sizeof(var_buffer)) > 0)
+	{
+		from_msec = std::strtoll(var_buffer, nullptr, 10);
+	}
+	if (mg_http_get_var(&hm->query, "to", var_buffer, sizeof(var_buffer)) > 0)
+	{
+		to_msec = std::strtoll(var_buffer, nullptr, 10);
+	}
+	if (from_msec > to_msec)
+	{
+		mg_http_reply(c, 400, "", "Invalid time range");
+		return;
+	}
+
+	std::vector<RecordingRange> ranges = recording_catalog->query(from_msec * 1000, to_msec * 1000);
+
+	std::stringstream catalog_builder;
+	catalog_builder << "{\"segments\": [";
+	for (size_t i = 0; i < ranges.size(); i++)
+	{
+		const RecordingRange& range = ranges[i];
+		if (i > 0)
+		{
+			catalog_builder << ",";
+		}
+		catalog_builder << "{"
+			<< "\"name\": \"" << escape_json_string(range.segment.name) << "\","
+			<< "\"start\": " << range.segment.start_wallclock_usec / 1000 << ","
+			<< "\"end\": " << range.segment.end_wallclock_usec / 1000 << ","
+			<< "\"size\": " << range.segment.size << ","
+			<< "\"event\": " << ((range.segment.flags & recording_segment_event) ? "true" : "false") << ","
+			<< "\"complete\": " << ((range.segment.flags & recording_segment_incomplete) ? "false" : "true") << ","
+			<< "\"range_start\": " << range.start_wallclock_usec / 1000 << ","
+			<< "\"range_end\": " << range.end_wallclock_usec / 1000 << ","
+			<< "\"offset\": " << range.offset << ","
+			<< "\"length\": " << range.length << ","
+			<< "\"exact\": " << (range.exact ? "true" : "false")
+			<< "}";
+	}
+	catalog_builder << "]}\n";
+
+	mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%s", catalog_builder.str().c_str());
+}
+
+void PiTvServer::on_export_request(mg_connection* c, mg_http_message* hm)
+{
+	assert(hm);
+
+	std::string auth_user = get_auth_username(hm);
+	if (auth_user.empty())
+	{
+		mg_http_reply(c, 401, "WWW-Authenticate: Basic realm=\"Access to the recordings\"\r\n", "Unauthorized");
+		return;
+	}
+
+	auto recording_catalog = pipeline_main_ptr ? pipeline_main_ptr->get_recording_catalog() : nullptr;
+	if (!recording_catalog || !recording_reader)
+	{
+		mg_http_reply(c, 404, "", "Recording catalog is not available");
+		return;
+	}
+
+	// Same Unix millisecond bounds as /catalog, both are required here
+	char from_buffer[32];
+	char to_buffer[32];
+	if (mg_http_get_var(&hm->query, "from", from_buffer, sizeof(from_buffer)) <= 0 ||
+		mg_http_get_var(&hm->query, "to", to_buffer, sizeof(to_buffer)) <= 0)
+	{
+		mg_http_reply(c, 400, "", "from and to parameters are required");
+		return;
+	}
+	int64_t from_msec = std::strtoll(from_buffer, nullptr, 10);
+	int64_t to_msec = std::strtoll(to_buffer, nullptr, 10);
+	if (from_msec > to_msec)
+	{
+		mg_http_reply(c, 400, "", "Invalid time range");
+		return;
+	}
+
+	if (clip_exports.size() >= max_clip_exports)
+	{
+		mg_http_reply(c, 503, "Retry-After: 10\r\n", "Too many exports in progress");
+		return;
+	}
+
+	ClipExporterConfig exporter_config;
+	exporter_config.logger_ptr = config.logger_ptr;
+	auto exporter = std::make_shared<ClipExporter>(exporter_config, recording_catalog, from_msec * 1000, to_msec * 1000);
+	// The sidecars and the first segment are read on the reader thread, the headers wait for it
+	bool submitted = recording_reader->submit(c->id, [exporter](std::vector<uint8_t>&) { return exporter->open(); });
+	if (!submitted)
+	{
+		mg_http_reply(c, 503, "Retry-After: 10\r\n", "Too many exports in progress");
+		return;
+	}
+
+	config.logger_ptr->info("User {} exports recordings from {} to {}", auth_user, from_msec, to_msec);
+	ClipExport& clip_export = clip_exports[c->id];
+	clip_export.username = auth_user;
+	clip_export.from_msec = from_msec;
+	clip_export.exporter = exporter;
+}
+
+void PiTvServer::pump_clip_export(mg_connection* c, ClipExport& clip_export)
+{
+	if (c->is_draining)
+	{
+		return;
+	}
+
+	bool ok = false;
+	std::shared_ptr<std::vector<uint8_t>> data;
+	if (recording_reader->take_result(c->id, ok, data))
+	{
+		if (!clip_export.is_open)
+		{
+			if (!ok)
+			{
+				mg_http_reply(c, 404, "", "No recordings in the requested range");
+				clip_exports.erase(c->id);
+				return;
+			}
+			mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: video/mp4; codecs=\"%s\"\r\n"
+				"Content-Disposition: attachment; filename=\"clip-%lld.mp4\"\r\n"
+				"Transfer-Encoding: chunked\r\nCache-Control: no-store\r\n\r\n", clip_export.exporter->get_codecs().c_str(), (long long)clip_export.from_msec);
+			clip_export.is_open = true;
+		}
+
+		if (!data->empty())
+		{
+			mg_http_write_chunk(c, reinterpret_cast<const char*>(data->data()), data->size());
+		}
+		if (!ok)
+		{
+			config.logger_ptr->info("Export of {} finished, {} samples", clip_export.username, clip_export.exporter->get_samples_exported());
+			mg_http_write_chunk(c, "", 0);
+			clip_exports.erase(c->id);
+			return;
+		}
+	}
+
+	// Reads from the recordings only as fast as the client takes the data, one batch ahead at most
+	if (!clip_export.is_open || c->send.len >= clip_export_send_watermark || recording_reader->is_pending(c->id))
+	{
+		return;
+	}
+	auto exporter = clip_export.exporter;
+	recording_reader->submit(c->id, [exporter](std::vector<uint8_t>& data)
+		{
+			std::vector<uint8_t> chunk;
+			while (data.size() < clip_export_send_watermark)
+			{
+				if (!exporter->read_chunk(chunk))
+				{
+					return false;
+				}
+				data.insert(data.end(), chunk.begin(), chunk.end());
+			}
+			return true;
+		});
+}
+
+void PiTvServer::on_recordings_request(mg_connection* c, mg_http_message* hm) const
+{
+	assert(hm);
+
+	if (config.recording_path.empty())
+	{
+		mg_http_reply(c, 404, "", "Not found");
+		return;
+	}
+
+	std::string auth_user = get_auth_username(hm);
+	if (auth_user.empty())
+	{
+		mg_http_reply(c, 401, "WWW-Authenticate: Basic realm=\"Access to the recordings\"", "Unathorized");
+		return;
+	}
+
+	std::string root_path = config.recording_path;
+	if (!config.recording_tier_path.empty())
+	{
+		// Both tiers are one directory: the listing merges them, a file comes from the tier that has it
+		std::string uri(hm->uri.ptr, hm->uri.len);
+		if (uri == "/recordings" || uri == "/recordings/")
+		{
+			std::string listing = make_recordings_listing();
+			mg_http_reply(c, 200, "Content-Type: text/html\r\nCache-Control: no-cache\r\n", "%s", listing.c_str());
+			return;
+		}
+
+		std::string encoded_name = uri.substr(strlen("/recordings/"));
+		char name_buffer[256];
+		int name_length = mg_url_decode(encoded_name.c_str(), encoded_name.size(), name_buffer, sizeof(name_buffer), 0);
+		std::string name = name_length > 0 ? std::string(name_buffer, name_length) : "";
+
+		std::error_code exists_error;
+		if (!name.empty() && name.find('/') == std::string::npos && name != "." && name != ".."
+			&& !std::filesystem::exists(std::filesystem::path(config.recording_path) / name, exists_error)
+			&& std::filesystem::exists(std::filesystem::path(config.recording_tier_path) / name, exists_error))
+		{
+			root_path = config.recording_tier_path;
+		}
+	}
+
+	config.logger_ptr->info("Serving directory {}", root_path);
+	mg_http_serve_opts opts = { 0 };
+	std::string root_dir_str = root_path + ",/recordings=" + root_path;
+	opts.root_dir = root_dir_str.c_str();
+	mg_http_serve_dir(c, hm, &opts);
+}
+
+std::string PiTvServer::make_recordings_listing() const
+{
+	struct ListedFile
+	{
+		uintmax_t size = 0;
+		std::filesystem::file_time_type last_write_time;
+		const char* tier = "";
+	};
+
+	// A file in both tiers is a move in progress, the card still has the authoritative copy
+	std::map<std::string, ListedFile> files;
+	for (const auto& [tier_path, tier] : { std::make_pair(config.recording_tier_path, "secondary"), std::make_pair(config.recording_path, "card") })
+	{
+		std::error_code iterate_error;
+		for (const auto& dir_entry : std::filesystem::directory_iterator(tier_path, iterate_error))
+		{
+			std::error_code entry_error;
+			if (!dir_entry.is_regular_file(entry_error) || !Pipeline::is_recording_file(dir_entry.path()))
+			{
+				continue;
+			}
+
+			ListedFile file;
+			file.size = dir_entry.file_size(entry_error);
+			file.last_write_time = dir_entry.last_write_time(entry_error);
+			file.tier = tier;
+			files[dir_entry.path().filename().string()] = file;
+		}
+	}
+
+	std::string listing = "<!DOCTYPE html><html><head><title>Recordings</title></head><body><h1>Recordings</h1>"
+		"<table cellpadding=\"2\"><tr><th align=\"left\">Name</th><th align=\"right\">Size</th><th align=\"left\">Modified</th><th align=\"left\">Tier</th></tr>";
+	for (const auto& [name, file] : files)
+	{
+		std::string escaped_name;
+		for (char ch : name)
+		{
+			switch (ch)
+			{
+			case '&': escaped_name += "&amp;"; break;
+			case '<': escaped_name += "&lt;"; break;
+			case '>': escaped_name += "&gt;"; break;
+			case '"': escaped_name += "&quot;"; break;
+			default: escaped_name += ch; break;
+			}
+		}
+
+		auto system_time = std::chrono::time_point_cast<std::chrono::system_clock::duration>(
+			file.last_write_time - std::filesystem::file_time_type::clock::now() + std::chrono::system_clock::now());
+		std::time_t modified = std::chrono::system_clock::to_time_t(system_time);
+		char modified_buffer[32] = "";
+		std::strftime(modified_buffer, sizeof(modified_buffer), "%Y-%m-%d %H:%M:%S", std::localtime(&modified));
+
+		listing += "<tr><td><a href=\"/recordings/" + escaped_name + "\">" + escaped_name + "</a></td><td align=\"right\">"
+			+ std::to_string(file.size / 1024) + " KiB</td><td>" + modified_buffer + "</td><td>" + file.tier + "</td></tr>";
+	}
+	listing += "</table></body></html>\n";
+	return listing;
+}
+
+void PiTvServer::on_vod_request(mg_connection* c, mg_http_message* hm)
+{
+	assert(hm);
+
+	std::string auth_user = get_auth_username(hm);
+	if (auth_user.empty())
+	{
+		mg_http_reply(c, 401, "WWW-Authenticate: Basic realm=\"Access to the recordings\"\r\n", "Unauthorized");
+		return;
+	}
+
+	auto recording_catalog = pipeline_main_ptr ? pipeline_main_ptr->get_recording_catalog() : nullptr;
+	if (!recording_catalog || !recording_reader)
+	{
+		mg_http_reply(c, 404, "", "Recording catalog is not available");
+		return;
+	}
+
+	std::string uri(hm->uri.ptr, hm->uri.len);
+	std::string resource = uri.substr(strlen("/vod/"));
+	char var_buffer[128];
+
+	// The sidecars and recordings are read on the reader thread, MG_EV_POLL sends the reply
+	VodRequest request;
+	RecordingReader::Job job;
+
+	if (resource == "playlist.m3u8")
+	{
+		// Same Unix millisecond bounds as /catalog
+		int64_t from_msec = 0;
+		int64_t to_msec = INT64_MAX / 1000;
+		if (mg_http_get_var(&hm->query, "from", var_buffer, sizeof(var_buffer)) > 0)
+		{
+			from_msec = std::strtoll(var_buffer, nullptr, 10);
+		}
+		if (mg_http_get_var(&hm->query, "to", var_buffer, sizeof(var_buffer)) > 0)
+		{
+			to_msec = std::strtoll(var_buffer, nullptr, 10);
+		}
+		if (from_msec > to_msec)
+		{
+			mg_http_reply(c, 400, "", "Invalid time range");
+			return;
+		}
+
+		job = [recording_catalog, from_msec, to_msec](std::vector<uint8_t>& data)
+			{
+				std::string playlist = VodPlaylist::make_playlist(recording_catalog->query(from_msec * 1000, to_msec * 1000));
+				data.assign(playlist.begin(), playlist.end());
+				return true;
+			};
+	}
+	else
+	{
+		RecordingSegment segment;
+		if (mg_http_get_var(&hm->query, "name", var_buffer, sizeof(var_buffer)) <= 0 || !recording_catalog->find_segment(var_buffer, segment))
+		{
+			mg_http_reply(c, 404, "", "Not found");
+			return;
+		}
+		std::string path = segment.path;
+
+		if (resource == "init.mp4")
+		{
+			request.content_type = "video/mp4";
+			request.error_status = 500;
+			request.error_message = "Recording is not readable";
+			job = [path](std::vector<uint8_t>& data) { return VodPlaylist::make_init_segment(path, data); };
+		}
+		else if (resource == "segment.m4s")
+		{
+			request.content_type = "video/iso.segment";
+			size_t first = 0;
+			size_t count = 0;
+			if (mg_http_get_var(&hm->query, "first", var_buffer, sizeof(var_buffer)) > 0)
+			{
+				first = std::strtoull(var_buffer, nullptr, 10);
+			}
+			if (mg_http_get_var(&hm->query, "count", var_buffer, sizeof(var_buffer)) > 0)
+			{
+				count = std::strtoull(var_buffer, nullptr, 10);
+			}
+			job = [path, first, count](std::vector<uint8_t>& data) { return VodPlaylist::make_media_segment(path, first, count, data); };
+		}
+		else
+		{
+			mg_http_reply(c, 404, "", "Not found");
+			return;
+		}
+	}
+
+	if (!recording_reader->submit(c->id, job))
+	{
+		mg_http_reply(c, 503, "Retry-After: 1\r\n", "Too many recording requests");
+		return;
+	}
+	vod_pending_requests[c->id] = request;
+}
+
+bool PiTvServer::serve_vod_request(mg_connection* c, const VodRequest& request)
+{
+	bool ok = false;
+	std::shared_ptr<std::vector<uint8_t>> data;
+	if (!recording_reader->take_result(c->id, ok, data))
+	{
+		return false;
+	}
+
+	if (!ok)
+	{
+		mg_http_reply(c, request.error_status, "", "%s", request.error_message);
+	}
+	else if (!request.content_type)
+	{
+		mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/vnd.apple.mpegurl\r\nContent-Length: %lu\r\nCache-Control: no-cache\r\n\r\n",
+			static_cast<unsigned long>(data->size()));
+		mg_send(c, data->data(), data->size());
+	}
+	else
+	{
+		send_hls_data(c, request.content_type, { data });
+	}
+	return true;
+}
+
+void PiTvServer::on_webrtc_request(mg_connection* c, mg_http_message* hm)
+{
+	assert(hm);
+
+	if (config.webrtc_max_sessions <= 0 || !pipeline_main_ptr || !pipeline_main_ptr->get_encoded_tap())
+	{
+		mg_http_reply(c, 404, "", "Not found");
+		return;
+	}
+
+	// Browsers cannot set headers on a WebSocket, so credentials may also arrive in a login message
+	std::string auth_user;
+	if (mg_http_get_header(hm, "Authorization"))
+	{
+		auth_user = get_auth_username(hm);
+		if (auth_user.empty())
+		{
+			mg_http_reply(c, 401, "", "Unauthorized");
+			return;
+		}
+	}
+
+	mg_ws_upgrade(c, hm, NULL);
+	config.logger_ptr->info("WebRTC signaling connection from {}", addr_to_str(c->rem));
+
+	if (!auth_user.empty())
+	{
+		start_webrtc_session(c, auth_user);
+	}
+}
+
+void PiTvServer::start_webrtc_session(mg_connection* c, const std::string& username)
+{
+	if (webrtc_sessions.size() >= static_cast<size_t>(config.webrtc_max_sessions))
+	{
+		config.logger_ptr->error("WebRTC session request from {} failed: session limit reached", username);
+		mg_ws_printf(c, WEBSOCKET_OP_TEXT, "{\"type\": \"error\", \"reason\": \"Session limit\"}");
+		c->is_draining = 1;
+		return;
+	}
+
+	WebRtcSessionConfig session_config;
+	session_config.logger_ptr = config.logger_ptr;
+	session_config.username = username;
+	session_config.peer_address = addr_to_str(c->rem);
+
+	auto session = std::make_shared<WebRtcSession>(session_config, pipeline_main_ptr->get_encoded_tap());
+	if (!session->start())
+	{
+		mg_ws_printf(c, WEBSOCKET_OP_TEXT, "{\"type\": \"error\", \"reason\": \"Internal server error\"}");
+		c->is_draining = 1;
+		return;
+	}
+
+	webrtc_sessions[c->id] = session;
+}
+
+void PiTvServer::on_webrtc_message(mg_connection* c, mg_ws_message* wm)
+{
+	assert(wm);
+
+	char* type_c = mg_json_get_str(wm->data, "$.type");
+	if (!type_c)
+	{
+		config.logger_ptr->error("WebRTC signaling message without type from {}", addr_to_str(c->rem));
+		return;
+	}
+	std::string type(type_c);
+	free(type_c);
+
+	auto iter = webrtc_sessions.find(c->id);
+
+	if (type == "login")
+	{
+		if (iter != webrtc_sessions.end())
+		{
+			config.logger_ptr->warn("WebRTC login message for an already authenticated connection");
+			return;
+		}
+
+		char* username_c = mg_json_get_str(wm->data, "$.username");
+		char* password_c = mg_json_get_str(wm->data, "$.password");
+		std::string auth_user = get_auth_username(username_c ? username_c : "", password_c ? password_c : "");
+		free(username_c);
+		free(password_c);
+
+		if (auth_user.empty())
+		{
+			mg_ws_printf(c, WEBSOCKET_OP_TEXT, "{\"type\": \"error\", \"reason\": \"Unauthorized\"}");
+			c->is_draining = 1;
+			return;
+		}
+
+		start_webrtc_session(c, auth_user);
+		return;
+	}
+
+	if (iter == webrtc_sessions.end())
+	{
+		config.logger_ptr->error("WebRTC {} message from {} before login", type, addr_to_str(c->rem));
+		mg_ws_printf(c, WEBSOCKET_OP_TEXT, "{\"type\": \"error\", \"reason\": \"Unauthorized\"}");
+		c->is_draining = 1;
+		return;
+	}
+
+	if (type == "answer")
+	{
+		char* sdp_c = mg_json_get_str(wm->data, "$.sdp");
+		if (!sdp_c || !iter->second->set_remote_answer(sdp_c))
+		{
+			mg_ws_printf(c, WEBSOCKET_OP_TEXT, "{\"type\": \"error\", \"reason\": \"Invalid answer\"}");
+		}
+		free(sdp_c);
+	}
+	else if (type == "ice")
+	{
+		char* candidate_c = mg_json_get_str(wm->data, "$.candidate");
+		long mline_index = mg_json_get_long(wm->data, "$.sdpMLineIndex", -1);
+		if (candidate_c && candidate_c[0] != 0)
+		{
+			iter->second->add_remote_candidate(mline_index, candidate_c);
+		}
+		free(candidate_c);
+	}
+	else
+	{
+		config.logger_ptr->warn("Unknown WebRTC signaling message type {}", type);
+	}
+}
+
+void PiTvServer::poll_webrtc_session(mg_connection* c)
+{
+	auto iter = webrtc_sessions.find(c->id);
+	if (iter == webrtc_sessions.end())
+	{
+		return;
+	}
+
+	std::vector<std::string> messages;
+	iter->second->poll(messages);
+	for (auto& message : messages)
+	{
+		mg_ws_send(c, message.c_str(), message.size(), WEBSOCKET_OP_TEXT);
+	}
+
+	if (iter->second->has_failed() && !c->is_draining)
+	{
+		mg_ws_printf(c, WEBSOCKET_OP_TEXT, "{\"type\": \"error\", \"reason\": \"Session failed\"}");
+		c->is_draining = 1;
+	}
+}
+
+void PiTvServer::on_hls_request(mg_connection* c, mg_http_message* hm)
+{
+	assert(hm);
+
+	if (!hls_output)
+	{
+		mg_http_reply(c, 404, "", "Not found");
+		return;
+	}
+
+	std::string auth_user = get_auth_username(hm);
+	if (auth_user.empty())
+	{
+		mg_http_reply(c, 401, "WWW-Authenticate: Basic realm=\"Access to the live stream\"\r\n", "Unauthorized");
+		return;
+	}
+
+	std::string uri(hm->uri.ptr, hm->uri.len);
+	HlsRequest request;
+	request.resource = uri.substr(strlen("/hls/"));
+
+	unsigned long long msn = 0;
+	int part = 0;
+	char tail = 0;
+	if (request.resource == "live.m3u8")
+	{
+		char var_buffer[32];
+		if (mg_http_get_var(&hm->query, "_HLS_msn", var_buffer, sizeof(var_buffer)) > 0)
+		{
+			request.blocking = true;
+			request.msn = std::strtoull(var_buffer, nullptr, 10);
+			if (mg_http_get_var(&hm->query, "_HLS_part", var_buffer, sizeof(var_buffer)) > 0)
+			{
+				request.part = std::atoi(var_buffer);
+			}
+		}
+	}
+	else if (sscanf(request.resource.c_str(), "part%llu.%d.m4%c", &msn, &part, &tail) == 3 && tail == 's')
+	{
+		request.blocking = true;
+		request.msn = msn;
+		request.part = part;
+	}
+	else if (sscanf(request.resource.c_str(), "seg%llu.m4%c", &msn, &tail) == 2 && tail == 's')
+	{
+		request.blocking = true;
+		request.msn = msn;
+		request.part = -1;
+	}
+	else if (request.resource != "init.mp4"
+		&& !(sscanf(request.resource.c_str(), "init%llu.mp%c", &msn, &tail) == 2 && tail == '4'))
+	{
+		mg_http_reply(c, 404, "", "Not found");
+		return;
+	}
+
+	request.deadline = mg_millis() + 3000 * static_cast<uint64_t>(hls_output->get_target_duration_sec());
+	if (!serve_hls_request(c, request))
+	{
+		hls_pending_requests[c->id] = request;
+	}
+}
+
+bool PiTvServer::serve_hls_request(mg_connection* c, const HlsRequest& request)
+{
+	if (request.blocking)
+	{
+		HlsMediaState state = hls_output->get_media_state(request.msn, request.part);
+		if (state == HlsMediaState::TooFar)
+		{
+			mg_http_reply(c, 400, "", "Media sequence number too far in the future");
+			return true;
+		}
+		if (state == HlsMediaState::Pending)
+		{
+			if (mg_millis() < request.deadline)
+			{
+				return false;
+			}
+			mg_http_reply(c, 503, "", "Media not available yet");
+			return true;
+		}
+	}
+
+	if (request.resource == "live.m3u8")
+	{
+		std::string playlist;
+		if (!hls_output->get_playlist(playlist))
+		{
+			mg_http_reply(c, 503, "Retry-After: 1\r\n", "Stream not ready");
+			return true;
+		}
+		mg_http_reply(c, 200, "Content-Type: application/vnd.apple.mpegurl\r\nCache-Control: no-cache\r\n", "%s", playlist.c_str());
+		return true;
+	}
+
+	std::vector<HlsData> data;
+	unsigned int init_id = 0;
+	char tail = 0;
+	if (request.resource == "init.mp4")
+	{
+		HlsData init_segment;
+		if (hls_output->get_init_segment(init_segment))
+		{
+			data.push_back(init_segment);
+		}
+	}
+	else if (sscanf(request.resource.c_str(), "init%u.mp%c", &init_id, &tail) == 2 && tail == '4')
+	{
+		// The playlist maps every stream configuration it still lists to its own initialization segment
+		HlsData init_segment;
+		if (hls_output->get_init_segment(init_id, init_segment))
+		{
+			data.push_back(init_segment);
+		}
+	}
+	else if (request.part >= 0)
+	{
+		HlsData part;
+		if (hls_output->get_part(request.msn, request.part, part))
+		{
+			data.push_back(part);
+		}
+	}
+	else
+	{
+		hls_output->get_segment(request.msn, data);
+	}
+
+	if (data.empty())
+	{
+		mg_http_reply(c, 404, "", "Not found");
+		return true;
+	}
+
+	send_hls_data(c, "video/mp4", data);
+	return true;
+}
+
+void PiTvServer::send_hls_data(mg_connection* c, const char* content_type, const std::vector<HlsData>& data)
+{
+	size_t content_length = 0;
+	for (auto& chunk : data)
+	{
+		content_length += chunk->size();
+	}
+
+	mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lu\r\nCache-Control: max-age=60\r\n\r\n",
+		content_type, static_cast<unsigned long>(content_length));
+	for (auto& chunk : data)
+	{
+		mg_send(c, chunk->data(), chunk->size());
+	}
+}
+
+void PiTvServer::on_snapshot_request(mg_connection* c, mg_http_message* hm)
+{
+	assert(hm);
+
+	if (!snapshot_cache)
+	{
+		mg_http_reply(c, 404, "", "Not found");
+		return;
+	}
+
+	std::string auth_user = get_auth_username(hm);
+	if (auth_user.empty())
+	{
+		mg_http_reply(c, 401, "WWW-Authenticate: Basic realm=\"Access to the snapshot\"\r\n", "Unauthorized");
+		return;
+	}
+
+	// stale=1 answers immediately with the previous picture while the newest keyframe is decoded
+	SnapshotRequest request;
+	char var_buffer[8];
+	if (mg_http_get_var(&hm->query, "stale", var_buffer, sizeof(var_buffer)) > 0)
+	{
+		request.allow_stale = std::atoi(var_buffer) != 0;
+	}
+	request.deadline = mg_millis() + 3000;
+
+	if (!serve_snapshot_request(c, request))
+	{
+		snapshot_pending_requests[c->id] = request;
+	}
+}
+
+bool PiTvServer::serve_snapshot_request(mg_connection* c, const SnapshotRequest& request)
+{
+	SnapshotData jpeg;
+	int64_t wallclock_usec = 0;
+	SnapshotState state = snapshot_cache->get_snapshot(request.allow_stale, jpeg, wallclock_usec);
+	if (state == SnapshotState::Pending && mg_millis() < request.deadline)
+	{
+		return false;
+	}
+
+	if (state != SnapshotState::Ready)
+	{
+		mg_http_reply(c, 503, "Retry-After: 1\r\n", "Snapshot is not available");
+		return true;
+	}
+
+	mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: image/jpeg\r\nContent-Length: %lu\r\nCache-Control: no-store\r\nX-Snapshot-Time: %lld\r\n\r\n",
+		static_cast<unsigned long>(jpeg->size()), static_cast<long long>(wallclock_usec / 1000));
+	mg_send(c, jpeg->data(), jpeg->size());
+	return true;
+}
+
+void PiTvServer::on_live_fmp4_request(mg_connection* c, mg_http_message* hm)
+{
+	assert(hm);
+
+	if (!live_fmp4_output)
+	{
+		mg_http_reply(c, 404, "", "Not found");
+		return;
+	}
+
+	std::string auth_user = get_auth_username(hm);
+	if (auth_user.empty())
+	{
+		mg_http_reply(c, 401, "WWW-Authenticate: Basic realm=\"Access to the live stream\"\r\n", "Unauthorized");
+		return;
+	}
+
+	LiveFmp4Subscriber subscriber;
+	Fmp4Data init_segment;
+	std::string codecs;
+	if (!live_fmp4_output->get_init_segment(init_segment, codecs, subscriber.generation))
+	{
+		mg_http_reply(c, 503, "Retry-After: 1\r\n", "Stream not ready");
+		return;
+	}
+
+	subscriber.username = auth_user;
+	subscriber.next_sequence = live_fmp4_output->get_start_sequence();
+
+	mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: video/mp4; codecs=\"%s\"\r\n"
+		"Transfer-Encoding: chunked\r\nCache-Control: no-cache\r\n\r\n", codecs.c_str());
+	mg_http_write_chunk(c, reinterpret_cast<const char*>(init_segment->data()), init_segment->size());
+
+	config.logger_ptr->info("User {} subscribed to live fMP4 stream", auth_user);
+	live_fmp4_subscribers[c->id] = subscriber;
+	pump_live_fmp4_subscriber(c, live_fmp4_subscribers[c->id]);
+}
+
+void PiTvServer::pump_live_fmp4_subscriber(mg_connection* c, LiveFmp4Subscriber& subscriber)
+{
+	if (c->is_draining)
+	{
+		return;
+	}
+
+	// A new init segment cannot be spliced into a running MSE source buffer, the player has to reconnect
+	if (live_fmp4_output->get_stream_generation() != subscriber.generation)
+	{
+		config.logger_ptr->info("Live fMP4 stream configuration changed, closing subscription of {}", subscriber.username);
+		mg_http_write_chunk(c, "", 0);
+		c->is_draining = 1;
+		return;
+	}
+
+	// Fragments stay in the shared ring until the socket drains, so a slow subscriber costs no extra memory
+	while (c->send.len < live_fmp4_send_watermark)
+	{
+		LiveFmp4Fragment fragment;
+		LiveFmp4ReadResult result = live_fmp4_output->read_fragment(subscriber.next_sequence, fragment);
+		if (result == LiveFmp4ReadResult::NotReady)
+		{
+			break;
+		}
+
+		if (result == LiveFmp4ReadResult::Skipped)
+		{
+			subscriber.skipped_fragments += fragment.sequence - subscriber.next_sequence;
+			config.logger_ptr->debug("Live fMP4 subscriber {} is lagging, skipped to keyframe {} ({} fragments skipped in total)",
+				subscriber.username, fragment.sequence, subscriber.skipped_fragments);
+		}
+
+		mg_http_write_chunk(c, reinterpret_cast<const char*>(fragment.data->data()), fragment.data->size());
+		subscriber.next_sequence = fragment.sequence + 1;
+	}
+}
+
+void PiTvServer::on_rtp_stream_request(mg_connection* c, mg_http_message* hm)
+{
+	assert(hm);
+
+	if (!rtp_tcp_output)
+	{
+		mg_http_reply(c, 404, "", "Not found");
+		return;
+	}
+
+	// Room for the terminating NUL, mg_http_get_var() fails otherwise
+	char guid_buffer[guid_length + 1];
+	if (mg_http_get_var(&hm->query, "guid", guid_buffer, sizeof(guid_buffer)) <= 0)
+	{
+		mg_http_reply(c, 400, "", "guid parameter missing");
+		return;
+	}
+	std::string guid(guid_buffer);
+
+	// The lease GUID was handed out to an authenticated user and serves as the stream credential,
+	// which lets browsers connect with a plain WebSocket
+	RtpTcpConnection connection;
+	for (auto& user_entry : user_map)
+	{
+		auto iter = user_entry.second.lease_map.find(guid);
+		if (iter != user_entry.second.lease_map.end() && iter->second.transport == "tcp")
+		{
+			connection.username = user_entry.first;
+			break;
+		}
+	}
+
+	if (connection.username.empty())
+	{
+		config.logger_ptr->error("RTP stream request from {} for unknown lease", addr_to_str(c->rem));
+		mg_http_reply(c, 403, "", "Unknown lease");
+		return;
+	}
+
+	if (mg_http_get_header(hm, "Authorization") && get_auth_username(hm) != connection.username)
+	{
+		mg_http_reply(c, 401, "", "Unauthorized");
+		return;
+	}
+
+	for (auto& other : rtp_tcp_connections)
+	{
+		if (other.second.guid == guid)
+		{
+			mg_http_reply(c, 409, "", "Lease already connected");
+			return;
+		}
+	}
+
+	connection.guid = guid;
+	connection.websocket = mg_http_get_header(hm, "Upgrade") != nullptr;
+	if (connection.websocket)
+	{
+		mg_ws_upgrade(c, hm, NULL);
+	}
+	else
+	{
+		// Raw stream of RFC 4571 framed packets: 16-bit big endian length followed by the RTP packet
+		mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nCache-Control: no-cache\r\n\r\n");
+	}
+
+	rtp_tcp_output->add_client(c->id);
+	rtp_tcp_connections[c->id] = connection;
+	config.logger_ptr->info("RTP stream of lease {} connected from {} over {}", guid, addr_to_str(c->rem), connection.websocket ? "WebSocket" : "TCP");
+}
+
+void PiTvServer::pump_rtp_tcp_connection(mg_connection* c, const RtpTcpConnection& connection)
+{
+	if (c->is_draining)
+	{
+		return;
+	}
+
+	auto user_iter = user_map.find(connection.username);
+	if (user_iter == user_map.end() || user_iter->second.lease_map.count(connection.guid) == 0)
+	{
+		config.logger_ptr->info("Lease {} ended, closing its RTP stream", connection.guid);
+		c->is_draining = 1;
+		return;
+	}
+
+	// Only a small window is handed to the socket, the rest waits in the GOP-leaking queue
+	if (c->send.len >= rtp_tcp_send_watermark)
+	{
+		return;
+	}
+
+	std::vector<RtpTcpPacket> packets;
+	rtp_tcp_output->pop_packets(c->id, rtp_tcp_send_watermark - c->send.len, packets);
+	for (auto& packet : packets)
+	{
+		if (connection.websocket)
+		{
+			mg_ws_send(c, reinterpret_cast<const char*>(packet.data->data()), packet.data->size(), WEBSOCKET_OP_BINARY);
+		}
+		else
+		{
+			uint8_t length[2] = { static_cast<uint8_t>(packet.data->size() >> 8), static_cast<uint8_t>(packet.data->size()) };
+			mg_send(c, length, sizeof(length));
+			mg_send(c, packet.data->data(), packet.data->size());
+		}
+	}
+}
+
+PiTvServerStatus PiTvServer::get_server_status() const
+{
+	PiTvServerStatus status;
+	if (system_stats_ok)
+	{
+		status.load_cpu_process_ok = true;
+		status.load_cpu_total_ok = true;
+		status.load_cpu_process = system_stats_get_cpu_process();
+		status.load_cpu_total = system_stats_get_cpu_total();
+	}
+
+	if (system_stats_cpu_temp_ok)
+	{
+		status.temperature_cpu_ok = true;
+		status.temperature_cpu = system_stats_get_temp_cpu();
+	}
+
+	if (pipeline_main_ptr)
+	{
+		status.rtp_fanout_ok = pipeline_main_ptr->get_rtp_fanout_stats(status.rtp_fanout);
+		status.recording_writes_ok = pipeline_main_ptr->get_recording_write_stats(status.recording_writes);
+		status.recording_tiering_ok = pipeline_main_ptr->get_recording_tiering_stats(status.recording_tiering);
+		status.recording_upload_ok = pipeline_main_ptr->get_recording_upload_stats(status.recording_upload);
+	}
+
+	status.udp_sndbuf_errors_ok = system_stats_get_udp_sndbuf_errors(status.udp_sndbuf_errors);
+	status.webrtc_sessions = static_cast<int>(webrtc_sessions.size());
+	status.live_fmp4_subscribers = static_cast<int>(live_fmp4_subscribers.size());
 
 	return status;
 }
@@ -7,6 +7,16 @@
 #include <mongoose.h>
 #include "video/Pipeline.h"
 #include "accounts/UserDb.h"
+#include "streaming/RtspServer.h"
+#include "streaming/WebRtcSession.h"
+#include "streaming/HlsOutput.h"
+#include "streaming/LiveFmp4Output.h"
+#include "streaming/RtpTcpOutput.h"
+#include "streaming/ShmEgress.h"
+#include "streaming/SnapshotCache.h"
+#include "recording/ClipExporter.h"
+#include "recording/VodPlaylist.h"
+#include "recording/RecordingReader.h"
 
 
 struct PiTvServerConfig
@@ -22,10 +32,37 @@ struct PiTvServerConfig
 
     std::string pitv_mount_point = "/camera";
     std::string recording_path;
+    // Secondary tier, /recordings shows it together with recording_path
+    std::string recording_tier_path;
     std::string logging_path;
 
     std::string user_db;
     int user_max_leases = 1;
+
+    int rtsp_port = 0;
+    std::string rtsp_mount_point = "/live";
+
+    int webrtc_max_sessions = 0;
+
+    bool hls_enabled = false;
+    int hls_part_duration_msec = 500;
+    int hls_segment_duration_msec = 2000;
+    int hls_segment_count = 6;
+
+    bool live_fmp4_enabled = false;
+    int live_fmp4_buffer_kbytes = 8192;
+    int live_fmp4_max_lag_msec = 2000;
+
+    bool rtp_tcp_enabled = false;
+    int rtp_tcp_queue_kbytes = 1024;
+
+    bool shm_enabled = false;
+    int shm_slot_count = 64;
+    int shm_slot_kbytes = 512;
+    int shm_raw_slot_count = 4;
+
+    bool snapshot_enabled = false;
+    int snapshot_quality = 85;
 };
 
 struct LeaseEntry
@@ -34,7 +71,61 @@ struct LeaseEntry
     std::string user;
     std::string udp_host;
     int udp_port;
+    std::string transport = "udp";
     uint64_t lease_end_time;
+
+    bool transport_connected = false;
+    double rtt_ms = 0;
+    int64_t packets_sent = 0;
+    int64_t packets_retransmitted = 0;
+    int64_t packets_dropped = 0;
+};
+
+struct HlsRequest
+{
+    std::string resource;
+    bool blocking = false;
+    uint64_t msn = 0;
+    int part = -1;
+    uint64_t deadline = 0;
+};
+
+struct SnapshotRequest
+{
+    bool allow_stale = false;
+    uint64_t deadline = 0;
+};
+
+struct ClipExport
+{
+    std::string username;
+    int64_t from_msec = 0;
+    std::shared_ptr<ClipExporter> exporter;
+    // Headers go out once the exporter opened on the reader thread
+    bool is_open = false;
+};
+
+struct VodRequest
+{
+    // Empty for the playlist, which is not cached
+    const char* content_type = nullptr;
+    int error_status = 404;
+    const char* error_message = "Not found";
+};
+
+struct RtpTcpConnection
+{
+    std::string username;
+    std::string guid;
+    bool websocket = false;
+};
+
+struct LiveFmp4Subscriber
+{
+    std::string username;
+    uint64_t generation = 0;
+    uint64_t next_sequence = 0;
+    uint64_t skipped_fragments = 0;
 };
 
 struct PiTvServerStatus
@@ -47,6 +138,24 @@ struct PiTvServerStatus
 
     bool load_cpu_total_ok = false;
     double load_cpu_total = 0;
+
+    bool rtp_fanout_ok = false;
+    UdpFanoutStats rtp_fanout;
+
+    bool recording_writes_ok = false;
+    SegmentSinkStats recording_writes;
+
+    bool recording_tiering_ok = false;
+    RecordingTieringStats recording_tiering;
+
+    bool recording_upload_ok = false;
+    RecordingUploaderStats recording_upload;
+
+    bool udp_sndbuf_errors_ok = false;
+    uint64_t udp_sndbuf_errors = 0;
+
+    int webrtc_sessions = 0;
+    int live_fmp4_subscribers = 0;
 };
 
 struct PiTvUser
@@ -73,9 +182,24 @@ private:
     std::shared_ptr<Pipeline> pipeline_main_ptr;
 
     std::shared_ptr<UserDb> user_db;
+    std::shared_ptr<RtspServer> rtsp_server;
+    std::map<unsigned long, std::shared_ptr<WebRtcSession>> webrtc_sessions;
+    std::shared_ptr<HlsOutput> hls_output;
+    std::map<unsigned long, HlsRequest> hls_pending_requests;
+    std::shared_ptr<LiveFmp4Output> live_fmp4_output;
+    std::map<unsigned long, LiveFmp4Subscriber> live_fmp4_subscribers;
+    std::shared_ptr<RtpTcpOutput> rtp_tcp_output;
+    std::map<unsigned long, RtpTcpConnection> rtp_tcp_connections;
+    std::shared_ptr<ShmEgress> shm_egress;
+    std::shared_ptr<SnapshotCache> snapshot_cache;
+    std::map<unsigned long, SnapshotRequest> snapshot_pending_requests;
+    std::shared_ptr<RecordingReader> recording_reader;
+    std::map<unsigned long, ClipExport> clip_exports;
+    std::map<unsigned long, VodRequest> vod_pending_requests;
     std::map<std::string, PiTvUser> user_map;
 
     std::string get_auth_username(mg_http_message* hm) const;
+    std::string get_auth_username(const std::string& username, const std::string& password) const;
 
     static void mongoose_log_handler(char ch, void* param);
     static void server_http_handler(struct mg_connection* c, int ev, void* ev_data, void* fn_data);
@@ -86,8 +210,38 @@ private:
     void on_index_request(mg_connection* c, mg_http_message* hm);
     void on_pitv_request(mg_connection* c, mg_http_message* hm);
     void on_status_request(mg_connection* c, mg_http_message* hm) const;
+    void on_leases_request(mg_connection* c, mg_http_message* hm) const;
+    void on_motion_request(mg_connection* c, mg_http_message* hm) const;
+    void on_record_request(mg_connection* c, mg_http_message* hm) const;
+    void on_catalog_request(mg_connection* c, mg_http_message* hm) const;
+    void on_export_request(mg_connection* c, mg_http_message* hm);
+    void pump_clip_export(mg_connection* c, ClipExport& clip_export);
+    void on_vod_request(mg_connection* c, mg_http_message* hm);
+    bool serve_vod_request(mg_connection* c, const VodRequest& request);
+    void on_recordings_request(mg_connection* c, mg_http_message* hm) const;
+    std::string make_recordings_listing() const;
+    void on_analytics_request(mg_connection* c, mg_http_message* hm) const;
+    void on_snapshot_request(mg_connection* c, mg_http_message* hm);
+    bool serve_snapshot_request(mg_connection* c, const SnapshotRequest& request);
+    void on_webrtc_request(mg_connection* c, mg_http_message* hm);
+    void on_webrtc_message(mg_connection* c, mg_ws_message* wm);
+    void start_webrtc_session(mg_connection* c, const std::string& username);
+    void poll_webrtc_session(mg_connection* c);
+    void on_hls_request(mg_connection* c, mg_http_message* hm);
+    bool serve_hls_request(mg_connection* c, const HlsRequest& request);
+    static void send_hls_data(mg_connection* c, const char* content_type, const std::vector<HlsData>& data);
+    void on_live_fmp4_request(mg_connection* c, mg_http_message* hm);
+    void pump_live_fmp4_subscriber(mg_connection* c, LiveFmp4Subscriber& subscriber);
+    void on_rtp_stream_request(mg_connection* c, mg_http_message* hm);
+    void pump_rtp_tcp_connection(mg_connection* c, const RtpTcpConnection& connection);
+
+    bool acquire_lease_transport(const LeaseEntry& entry);
+    bool release_lease_transport(const LeaseEntry& entry);
+    void update_lease_transport_stats();
+    void reply_lease(mg_connection* c, const LeaseEntry& entry) const;
 
     static std::string addr_to_str(const mg_addr& addr);
+    static std::string escape_json_string(const std::string& str);
 
     static std::string gen_random_string(const int len);
 
@@ -100,6 +254,11 @@ private:
 public:
     const static int guid_length;
     static const uint64_t max_lease_time_msec;
+    static const int live_poll_msec;
+    static const size_t live_fmp4_send_watermark;
+    static const size_t rtp_tcp_send_watermark;
+    static const size_t clip_export_send_watermark;
+    static const size_t max_clip_exports;
 
     PiTvServer& operator=(const PiTvServer&) = delete;
     PiTvServer(const PiTvServer& copy) = delete;
@@ -112,6 +271,7 @@ public:
     void set_config(const PiTvServerConfig& config);
 
     std::pair<int, std::string> lease_camera(std::string& guid, std::string username, std::string host, int port, uint64_t lease_time_msec);
+    std::pair<int, std::string> lease_camera_transport(std::string& guid, std::string username, std::string transport, uint64_t lease_time_msec);
     std::pair<int, std::string> end_camera_lease(std::string username, std::string guid);
 
     PiTvServerStatus get_server_status() const;
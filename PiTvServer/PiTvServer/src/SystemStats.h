@@ -201,10 +201,13 @@ double system_stats_get_cpu_process()
 #endif
 
 #include <array>
+#include <cerrno>
+#include <cstdlib>
 #include <string>
 #include <iostream>
 #include <memory>
 #include <vector>
+#include <fstream>
 #include <boost/algorithm/string.hpp>
 
 bool system_stats_has_temp_cpu()
@@ -280,4 +283,46 @@ double system_stats_get_temp_cpu()
 
 #endif
     return 0;
+}
+
+bool system_stats_get_udp_sndbuf_errors(uint64_t& sndbuf_errors)
+{
+#if CM_UNIX
+    // /proc/net/snmp has a header line and a value line for every protocol
+    std::ifstream snmp("/proc/net/snmp");
+    if (!snmp.is_open())
+    {
+        return false;
+    }
+
+    std::string header;
+    std::string values;
+    while (std::getline(snmp, header) && std::getline(snmp, values))
+    {
+        if (!header.starts_with("Udp:") || !values.starts_with("Udp:"))
+        {
+            continue;
+        }
+
+        auto names = split(header, ' ');
+        auto numbers = split(values, ' ');
+        for (size_t i = 0; i < names.size() && i < numbers.size(); i++)
+        {
+            if (names[i] == "SndbufErrors")
+            {
+                // Not std::stoull, whatever /proc holds must not throw into the status handler
+                char* end = nullptr;
+                errno = 0;
+                unsigned long long value = strtoull(numbers[i].c_str(), &end, 10);
+                if (end == numbers[i].c_str() || errno == ERANGE)
+                {
+                    return false;
+                }
+                sndbuf_errors = value;
+                return true;
+            }
+        }
+    }
+#endif
+    return false;
 }
\ No newline at end of file
@@ -0,0 +1,491 @@
+#include "AnalyticsHost.h"
+#include <cassert>
+#include <ctime>
+#include <chrono>
+#include <algorithm>
+#include <gst/video/video.h>
+#ifdef CM_UNIX
+#include <dlfcn.h>
+#include <pthread.h>
+#endif
+
+AnalyticsHost::AnalyticsHost(const AnalyticsHostConfig& config)
+{
+	this->config = config;
+}
+
+AnalyticsHost::~AnalyticsHost()
+{
+	stop();
+	unload_plugins();
+}
+
+std::shared_ptr<spdlog::logger> AnalyticsHost::logger() const
+{
+	return config.logger_ptr;
+}
+
+const char* AnalyticsHost::format_to_string(PitvPixelFormat format)
+{
+	switch (format)
+	{
+	case PITV_PIXEL_FORMAT_GRAY8:
+		return "GRAY8";
+	case PITV_PIXEL_FORMAT_RGB:
+		return "RGB";
+	case PITV_PIXEL_FORMAT_I420:
+		return "I420";
+	}
+	return nullptr;
+}
+
+int64_t AnalyticsHost::thread_cpu_usec()
+{
+#ifdef CM_UNIX
+	timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+	{
+		return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+	}
+#endif
+	return g_get_monotonic_time();
+}
+
+bool AnalyticsHost::load_plugins()
+{
+	for (auto& spec : config.plugin_specs)
+	{
+		load_plugin(spec);
+	}
+
+	logger()->info("{} of {} analytics plugins loaded", plugins.size(), config.plugin_specs.size());
+	return !plugins.empty();
+}
+
+bool AnalyticsHost::load_plugin(const std::string& spec)
+{
+#ifdef CM_UNIX
+	auto plugin = std::make_unique<Plugin>();
+	plugin->host = this;
+	plugin->index = plugins.size();
+
+	size_t separator = spec.find_first_of(" \t");
+	plugin->path = spec.substr(0, separator);
+	if (separator != std::string::npos)
+	{
+		size_t args_start = spec.find_first_not_of(" \t", separator);
+		plugin->args = args_start == std::string::npos ? "" : spec.substr(args_start);
+	}
+
+	plugin->library = dlopen(plugin->path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!plugin->library)
+	{
+		logger()->error("Failed to load analytics plugin {}: {}", plugin->path, dlerror());
+		return false;
+	}
+
+	PitvAnalyticsEntry entry = reinterpret_cast<PitvAnalyticsEntry>(dlsym(plugin->library, PITV_ANALYTICS_ENTRY_SYMBOL));
+	plugin->descriptor = entry ? entry() : nullptr;
+	if (!plugin->descriptor)
+	{
+		logger()->error("Analytics plugin {} does not export {}", plugin->path, PITV_ANALYTICS_ENTRY_SYMBOL);
+		dlclose(plugin->library);
+		return false;
+	}
+
+	const PitvAnalyticsPlugin* descriptor = plugin->descriptor;
+	if (descriptor->abi_version != PITV_ANALYTICS_ABI_VERSION)
+	{
+		logger()->error("Analytics plugin {} has ABI version {}, expected {}", plugin->path, descriptor->abi_version, PITV_ANALYTICS_ABI_VERSION);
+		dlclose(plugin->library);
+		return false;
+	}
+
+	if (!descriptor->name || !descriptor->create || !descriptor->process || !descriptor->destroy || !format_to_string(descriptor->format)
+		|| descriptor->width < 0 || descriptor->height < 0 || descriptor->fps_numerator < 0 || descriptor->fps_denominator < 0)
+	{
+		logger()->error("Analytics plugin {} has an invalid descriptor", plugin->path);
+		dlclose(plugin->library);
+		return false;
+	}
+
+	plugin->host_api.host_context = plugin.get();
+	plugin->host_api.publish = &AnalyticsHost::publish_handler;
+	plugin->host_api.log = &AnalyticsHost::log_handler;
+
+	plugin->instance = descriptor->create(plugin->args.c_str(), &plugin->host_api);
+	if (!plugin->instance)
+	{
+		logger()->error("Analytics plugin {} failed to initialize with arguments '{}'", descriptor->name, plugin->args);
+		dlclose(plugin->library);
+		return false;
+	}
+
+	logger()->info("Analytics plugin {} loaded from {}: {} {}x{} at {}/{} fps",
+		descriptor->name, plugin->path, format_to_string(descriptor->format),
+		descriptor->width, descriptor->height, descriptor->fps_numerator, descriptor->fps_denominator);
+
+	plugins.push_back(std::move(plugin));
+	return true;
+#else
+	logger()->error("Analytics plugins are not supported on this platform, {} is not loaded", spec);
+	return false;
+#endif
+}
+
+void AnalyticsHost::unload_plugins()
+{
+	for (auto& plugin : plugins)
+	{
+		if (plugin->instance)
+		{
+			plugin->descriptor->destroy(plugin->instance);
+			plugin->instance = nullptr;
+		}
+		if (plugin->pending_sample)
+		{
+			gst_sample_unref(plugin->pending_sample);
+			plugin->pending_sample = nullptr;
+		}
+#ifdef CM_UNIX
+		if (plugin->library)
+		{
+			dlclose(plugin->library);
+			plugin->library = nullptr;
+		}
+#endif
+	}
+	plugins.clear();
+}
+
+size_t AnalyticsHost::get_plugin_count() const
+{
+	return plugins.size();
+}
+
+GstElement* AnalyticsHost::make_bin(size_t plugin_index)
+{
+	assert(plugin_index < plugins.size());
+	Plugin& plugin = *plugins[plugin_index];
+	const PitvAnalyticsPlugin* descriptor = plugin.descriptor;
+
+	std::string suffix = std::to_string(plugin_index);
+	GstElement* bin = gst_bin_new(("analytics-bin-" + suffix).c_str());
+	assert(bin);
+
+	GstElement* queue = gst_element_factory_make("queue", ("analytics_queue_" + suffix).c_str());
+	GstElement* videorate = gst_element_factory_make("videorate", ("analytics_videorate_" + suffix).c_str());
+	GstElement* videoscale = gst_element_factory_make("videoscale", ("analytics_videoscale_" + suffix).c_str());
+	GstElement* videoconvert = gst_element_factory_make("videoconvert", ("analytics_videoconvert_" + suffix).c_str());
+	GstElement* capsfilter = gst_element_factory_make("capsfilter", ("analytics_capsfilter_" + suffix).c_str());
+	GstElement* appsink = gst_element_factory_make("appsink", ("analytics_appsink_" + suffix).c_str());
+
+	if (!queue || !videorate || !videoscale || !videoconvert || !capsfilter || !appsink)
+	{
+		logger()->error("Failed to create analytics elements for plugin {}!", descriptor->name);
+		gst_object_unref(bin);
+		return nullptr;
+	}
+
+	// Scaling and conversion run on the queue thread, never on the capture thread
+	g_object_set(queue, "leaky", 2, "max-size-buffers", 1, "max-size-bytes", 0, "max-size-time", (guint64)0, NULL);
+	g_object_set(videorate, "drop-only", true, NULL);
+	g_object_set(appsink, "sync", false, "emit-signals", false, "max-buffers", 1, "drop", true, NULL);
+
+	GstCaps* caps = gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, format_to_string(descriptor->format), NULL);
+	if (descriptor->width > 0 && descriptor->height > 0)
+	{
+		gst_caps_set_simple(caps, "width", G_TYPE_INT, descriptor->width, "height", G_TYPE_INT, descriptor->height, NULL);
+	}
+	if (descriptor->fps_numerator > 0 && descriptor->fps_denominator > 0)
+	{
+		gst_caps_set_simple(caps, "framerate", GST_TYPE_FRACTION, descriptor->fps_numerator, descriptor->fps_denominator, NULL);
+	}
+	g_object_set(capsfilter, "caps", caps, NULL);
+	gst_caps_unref(caps);
+
+	GstAppSinkCallbacks callbacks = { 0 };
+	callbacks.new_sample = &AnalyticsHost::appsink_new_sample;
+	gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, &plugin, NULL);
+
+	gst_bin_add_many(GST_BIN(bin), queue, videorate, videoscale, videoconvert, capsfilter, appsink, NULL);
+	if (!gst_element_link_many(queue, videorate, videoscale, videoconvert, capsfilter, appsink, NULL))
+	{
+		logger()->error("Failed to link analytics elements for plugin {}!", descriptor->name);
+		gst_object_unref(bin);
+		return nullptr;
+	}
+
+	GstPad* queue_sink_pad = gst_element_get_static_pad(queue, "sink");
+	GstPad* sink_ghost_pad = gst_ghost_pad_new("sink", queue_sink_pad);
+	gst_element_add_pad(bin, sink_ghost_pad);
+	gst_object_unref(queue_sink_pad);
+
+	return bin;
+}
+
+bool AnalyticsHost::start()
+{
+	if (is_running)
+	{
+		logger()->warn("Analytics host is already running!");
+		return true;
+	}
+
+	if (plugins.empty())
+	{
+		logger()->error("Cannot start analytics host: no plugins loaded!");
+		return false;
+	}
+
+	if (config.cpu_budget_percent <= 0 || config.cpu_budget_percent > 100)
+	{
+		logger()->error("Invalid analytics CPU budget {}%", config.cpu_budget_percent);
+		return false;
+	}
+
+	is_running = true;
+	for (auto& plugin : plugins)
+	{
+		Plugin* plugin_ptr = plugin.get();
+		plugin->started_usec = g_get_monotonic_time();
+		plugin->worker = std::thread([this, plugin_ptr]() { worker_loop(*plugin_ptr); });
+#ifdef CM_UNIX
+		std::string thread_name = "pitv-analytics-" + std::to_string(plugin->index);
+		pthread_setname_np(plugin->worker.native_handle(), thread_name.substr(0, 15).c_str());
+#endif
+	}
+
+	logger()->info("Analytics host started {} plugins with a CPU budget of {}% each", plugins.size(), config.cpu_budget_percent);
+	return true;
+}
+
+void AnalyticsHost::stop()
+{
+	if (!is_running.exchange(false))
+	{
+		return;
+	}
+
+	for (auto& plugin : plugins)
+	{
+		{
+			std::lock_guard<std::mutex> lock(plugin->slot_mutex);
+		}
+		plugin->slot_cv.notify_all();
+	}
+
+	for (auto& plugin : plugins)
+	{
+		if (plugin->worker.joinable())
+		{
+			plugin->worker.join();
+		}
+	}
+
+	logger()->info("Analytics host stopped");
+}
+
+GstFlowReturn AnalyticsHost::appsink_new_sample(GstAppSink* appsink, gpointer udata)
+{
+	assert(udata);
+	Plugin* plugin = static_cast<Plugin*>(udata);
+
+	GstSample* sample = gst_app_sink_pull_sample(appsink);
+	if (!sample)
+	{
+		return GST_FLOW_OK;
+	}
+
+	plugin->frames_received++;
+	{
+		std::lock_guard<std::mutex> lock(plugin->slot_mutex);
+		// The plugin did not pick up the previous frame in time
+		if (plugin->pending_sample)
+		{
+			gst_sample_unref(plugin->pending_sample);
+			plugin->frames_dropped++;
+		}
+		plugin->pending_sample = sample;
+	}
+	plugin->slot_cv.notify_one();
+
+	return GST_FLOW_OK;
+}
+
+void AnalyticsHost::worker_loop(Plugin& plugin)
+{
+	int64_t next_allowed_usec = 0;
+
+	while (is_running)
+	{
+		GstSample* sample = nullptr;
+		uint64_t sequence = 0;
+		{
+			std::unique_lock<std::mutex> lock(plugin.slot_mutex);
+			plugin.slot_cv.wait(lock, [this, &plugin]() { return plugin.pending_sample || !is_running; });
+			if (!is_running)
+			{
+				break;
+			}
+
+			// Over budget: wait for the plugin's turn, newer frames keep replacing the pending one meanwhile
+			int64_t wait_usec = next_allowed_usec - g_get_monotonic_time();
+			if (wait_usec > 0)
+			{
+				plugin.slot_cv.wait_for(lock, std::chrono::microseconds(wait_usec), [this]() { return !is_running; });
+				if (!is_running)
+				{
+					break;
+				}
+			}
+
+			sample = plugin.pending_sample;
+			plugin.pending_sample = nullptr;
+			sequence = plugin.next_sequence++;
+		}
+
+		int64_t cpu_start_usec = thread_cpu_usec();
+		process_sample(plugin, sample, sequence);
+		gst_sample_unref(sample);
+		int64_t cpu_usec = std::max<int64_t>(0, thread_cpu_usec() - cpu_start_usec);
+
+		plugin.last_process_usec = static_cast<uint64_t>(cpu_usec);
+		plugin.cpu_usec_total += static_cast<uint64_t>(cpu_usec);
+
+		// Idle long enough for this run to average out to the budget
+		next_allowed_usec = g_get_monotonic_time() + cpu_usec * (100 - config.cpu_budget_percent) / config.cpu_budget_percent;
+	}
+}
+
+void AnalyticsHost::process_sample(Plugin& plugin, GstSample* sample, uint64_t sequence)
+{
+	GstBuffer* buffer = gst_sample_get_buffer(sample);
+	GstCaps* caps = gst_sample_get_caps(sample);
+	GstVideoInfo video_info;
+	if (!buffer || !caps || !gst_video_info_from_caps(&video_info, caps))
+	{
+		plugin.process_errors++;
+		return;
+	}
+
+	GstVideoFrame video_frame;
+	if (!gst_video_frame_map(&video_frame, &video_info, buffer, GST_MAP_READ))
+	{
+		logger()->error("Failed to map an analytics frame for plugin {}", plugin.descriptor->name);
+		plugin.process_errors++;
+		return;
+	}
+
+	PitvAnalyticsFrame frame = {};
+	frame.sequence = sequence;
+	frame.pts_ns = GST_BUFFER_PTS(buffer);
+	frame.wallclock_usec = g_get_real_time();
+	frame.width = GST_VIDEO_FRAME_WIDTH(&video_frame);
+	frame.height = GST_VIDEO_FRAME_HEIGHT(&video_frame);
+	frame.format = plugin.descriptor->format;
+	frame.plane_count = std::min<int>(GST_VIDEO_FRAME_N_PLANES(&video_frame), 3);
+	for (int i = 0; i < frame.plane_count; i++)
+	{
+		frame.planes[i] = static_cast<const uint8_t*>(GST_VIDEO_FRAME_PLANE_DATA(&video_frame, i));
+		frame.strides[i] = GST_VIDEO_FRAME_PLANE_STRIDE(&video_frame, i);
+	}
+
+	int result = plugin.descriptor->process(plugin.instance, &frame);
+	gst_video_frame_unmap(&video_frame);
+
+	if (result != 0)
+	{
+		plugin.process_errors++;
+		return;
+	}
+	plugin.frames_processed++;
+}
+
+void AnalyticsHost::publish_handler(void* host_context, const PitvAnalyticsFrame* frame, const PitvAnalyticsResult* result)
+{
+	assert(host_context);
+	Plugin* plugin = static_cast<Plugin*>(host_context);
+	AnalyticsHost* host = plugin->host;
+
+	if (!frame || !result)
+	{
+		return;
+	}
+
+	AnalyticsEvent event;
+	event.plugin = plugin->descriptor->name;
+	event.frame_sequence = frame->sequence;
+	event.pts = frame->pts_ns;
+	event.wallclock_usec = frame->wallclock_usec;
+	event.label = result->label ? result->label : "";
+	event.confidence = result->confidence;
+	event.data = result->data ? result->data : "";
+
+	std::lock_guard<std::mutex> lock(host->events_mutex);
+	event.id = host->next_event_id++;
+	host->events.push_back(std::move(event));
+	while (host->events.size() > host->config.max_events)
+	{
+		host->events.pop_front();
+	}
+}
+
+void AnalyticsHost::log_handler(void* host_context, PitvLogLevel level, const char* message)
+{
+	assert(host_context);
+	Plugin* plugin = static_cast<Plugin*>(host_context);
+	auto logger_ptr = plugin->host->logger();
+	const char* name = plugin->descriptor->name;
+
+	switch (level)
+	{
+	case PITV_LOG_DEBUG:
+		logger_ptr->debug("[{}] {}", name, message);
+		break;
+	case PITV_LOG_INFO:
+		logger_ptr->info("[{}] {}", name, message);
+		break;
+	case PITV_LOG_WARN:
+		logger_ptr->warn("[{}] {}", name, message);
+		break;
+	default:
+		logger_ptr->error("[{}] {}", name, message);
+		break;
+	}
+}
+
+void AnalyticsHost::get_events(uint64_t since_id, std::vector<AnalyticsEvent>& result) const
+{
+	std::lock_guard<std::mutex> lock(events_mutex);
+	for (auto& event : events)
+	{
+		if (event.id > since_id)
+		{
+			result.push_back(event);
+		}
+	}
+}
+
+void AnalyticsHost::get_plugin_stats(std::vector<AnalyticsPluginStats>& result) const
+{
+	int64_t now_usec = g_get_monotonic_time();
+	for (auto& plugin : plugins)
+	{
+		AnalyticsPluginStats stats;
+		stats.name = plugin->descriptor->name;
+		stats.width = plugin->descriptor->width;
+		stats.height = plugin->descriptor->height;
+		stats.frames_received = plugin->frames_received;
+		stats.frames_processed = plugin->frames_processed;
+		stats.frames_dropped = plugin->frames_dropped;
+		stats.process_errors = plugin->process_errors;
+		stats.last_process_usec = plugin->last_process_usec;
+		int64_t elapsed_usec = now_usec - plugin->started_usec;
+		if (plugin->started_usec > 0 && elapsed_usec > 0)
+		{
+			stats.cpu_percent = 100.0 * static_cast<double>(plugin->cpu_usec_total) / static_cast<double>(elapsed_usec);
+		}
+		result.push_back(stats);
+	}
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <condition_variable>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <spdlog/spdlog.h>
+#include "PiTvAnalytics.h"
+
+struct AnalyticsHostConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	// "<path to shared object> [plugin arguments]"
+	std::vector<std::string> plugin_specs;
+	// Share of one CPU core a plugin may use on average
+	int cpu_budget_percent = 25;
+	size_t max_events = 512;
+};
+
+struct AnalyticsEvent
+{
+	uint64_t id = 0;
+	std::string plugin;
+	uint64_t frame_sequence = 0;
+	GstClockTime pts = GST_CLOCK_TIME_NONE;
+	int64_t wallclock_usec = 0;
+	std::string label;
+	double confidence = 0;
+	std::string data;
+};
+
+struct AnalyticsPluginStats
+{
+	std::string name;
+	int width = 0;
+	int height = 0;
+	uint64_t frames_received = 0;
+	uint64_t frames_processed = 0;
+	uint64_t frames_dropped = 0;
+	uint64_t process_errors = 0;
+	uint64_t last_process_usec = 0;
+	double cpu_percent = 0;
+};
+
+// Loads analytics plugins and runs each one on its own worker thread.
+// Every plugin gets an appsink branch off the raw tee that scales and converts frames to what it requested.
+// The branch keeps only the newest frame: whatever arrives while the plugin is busy or over its
+// CPU budget replaces the waiting frame and is counted as dropped.
+class AnalyticsHost
+{
+private:
+	struct Plugin
+	{
+		AnalyticsHost* host = nullptr;
+		size_t index = 0;
+		std::string path;
+		std::string args;
+		void* library = nullptr;
+		const PitvAnalyticsPlugin* descriptor = nullptr;
+		void* instance = nullptr;
+		PitvAnalyticsHostApi host_api = {};
+
+		std::mutex slot_mutex;
+		std::condition_variable slot_cv;
+		GstSample* pending_sample = nullptr;
+		uint64_t next_sequence = 0;
+
+		std::thread worker;
+		std::atomic<uint64_t> frames_received = 0;
+		std::atomic<uint64_t> frames_processed = 0;
+		std::atomic<uint64_t> frames_dropped = 0;
+		std::atomic<uint64_t> process_errors = 0;
+		std::atomic<uint64_t> last_process_usec = 0;
+		std::atomic<uint64_t> cpu_usec_total = 0;
+		int64_t started_usec = 0;
+	};
+
+	AnalyticsHostConfig config;
+	std::vector<std::unique_ptr<Plugin>> plugins;
+	std::atomic<bool> is_running = false;
+
+	mutable std::mutex events_mutex;
+	std::deque<AnalyticsEvent> events;
+	uint64_t next_event_id = 1;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	bool load_plugin(const std::string& spec);
+	void unload_plugins();
+	void worker_loop(Plugin& plugin);
+	void process_sample(Plugin& plugin, GstSample* sample, uint64_t sequence);
+
+	static GstFlowReturn appsink_new_sample(GstAppSink* appsink, gpointer udata);
+	static void publish_handler(void* host_context, const PitvAnalyticsFrame* frame, const PitvAnalyticsResult* result);
+	static void log_handler(void* host_context, PitvLogLevel level, const char* message);
+	static const char* format_to_string(PitvPixelFormat format);
+	static int64_t thread_cpu_usec();
+
+public:
+	AnalyticsHost& operator=(const AnalyticsHost&) = delete;
+	AnalyticsHost(const AnalyticsHost& copy) = delete;
+	AnalyticsHost() = delete;
+
+	AnalyticsHost(const AnalyticsHostConfig& config);
+	~AnalyticsHost();
+
+	// Loads all configured plugins, a plugin that fails to load is skipped
+	bool load_plugins();
+	size_t get_plugin_count() const;
+
+	// Returned bin is owned by the caller and has a raw video "sink" ghost pad
+	GstElement* make_bin(size_t plugin_index);
+
+	bool start();
+	void stop();
+
+	// Events with id greater than since_id, oldest first
+	void get_events(uint64_t since_id, std::vector<AnalyticsEvent>& result) const;
+	void get_plugin_stats(std::vector<AnalyticsPluginStats>& result) const;
+};
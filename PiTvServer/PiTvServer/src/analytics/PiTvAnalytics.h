@@ -0,0 +1,86 @@
+#pragma once
+
+// C ABI of PiTV frame analytics plugins.
+// A plugin is a shared object exporting PITV_ANALYTICS_ENTRY_SYMBOL. The host converts raw camera frames
+// to the format, size and rate the plugin asks for and calls process() on a worker thread owned by the plugin.
+// Frames are dropped, never queued, when process() is slower than the frame rate or the CPU budget allows.
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PITV_ANALYTICS_ABI_VERSION 1
+#define PITV_ANALYTICS_ENTRY_SYMBOL "pitv_analytics_plugin"
+
+typedef enum PitvPixelFormat
+{
+	PITV_PIXEL_FORMAT_GRAY8 = 0,
+	PITV_PIXEL_FORMAT_RGB = 1,
+	PITV_PIXEL_FORMAT_I420 = 2
+} PitvPixelFormat;
+
+// Valid only during the process() call
+typedef struct PitvAnalyticsFrame
+{
+	uint64_t sequence;
+	uint64_t pts_ns;
+	int64_t wallclock_usec;
+	int width;
+	int height;
+	PitvPixelFormat format;
+	int plane_count;
+	const uint8_t* planes[3];
+	int strides[3];
+} PitvAnalyticsFrame;
+
+typedef struct PitvAnalyticsResult
+{
+	// Short class of the result, e.g. "person" or "qr"
+	const char* label;
+	double confidence;
+	// Optional free-form payload, served as a string
+	const char* data;
+} PitvAnalyticsResult;
+
+typedef enum PitvLogLevel
+{
+	PITV_LOG_DEBUG = 0,
+	PITV_LOG_INFO = 1,
+	PITV_LOG_WARN = 2,
+	PITV_LOG_ERROR = 3
+} PitvLogLevel;
+
+typedef struct PitvAnalyticsHostApi
+{
+	void* host_context;
+	// May be called from process() any number of times, strings are copied
+	void (*publish)(void* host_context, const PitvAnalyticsFrame* frame, const PitvAnalyticsResult* result);
+	void (*log)(void* host_context, PitvLogLevel level, const char* message);
+} PitvAnalyticsHostApi;
+
+typedef struct PitvAnalyticsPlugin
+{
+	uint32_t abi_version;
+	const char* name;
+
+	// Requested input. Zero width or height keeps the camera size, zero fps delivers every frame
+	int width;
+	int height;
+	int fps_numerator;
+	int fps_denominator;
+	PitvPixelFormat format;
+
+	// args is the text following the plugin path in the configuration. Returns NULL on failure.
+	void* (*create)(const char* args, const PitvAnalyticsHostApi* host);
+	// Returns 0 on success
+	int (*process)(void* instance, const PitvAnalyticsFrame* frame);
+	void (*destroy)(void* instance);
+} PitvAnalyticsPlugin;
+
+typedef const PitvAnalyticsPlugin* (*PitvAnalyticsEntry)(void);
+
+#ifdef __cplusplus
+}
+#endif
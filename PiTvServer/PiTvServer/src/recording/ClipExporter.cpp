@@ -0,0 +1,214 @@
+#include "ClipExporter.h"
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+ClipExporter::ClipExporter(const ClipExporterConfig& config, std::shared_ptr<RecordingCatalog> catalog, int64_t from_usec, int64_t to_usec)
+{
+	this->config = config;
+	this->catalog = catalog;
+	this->from_usec = from_usec;
+	this->to_usec = to_usec;
+}
+
+ClipExporter::~ClipExporter()
+{
+	close_segment();
+}
+
+std::shared_ptr<spdlog::logger> ClipExporter::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool ClipExporter::open()
+{
+	ranges = catalog->query(from_usec, to_usec);
+	for (; range_index < ranges.size(); range_index++)
+	{
+		const RecordingRange& range = ranges[range_index];
+		if (!range.exact)
+		{
+			logger()->warn("Recording {} has no usable index, it is left out of the clip", range.segment.name);
+			continue;
+		}
+
+		if (SegmentIndex::find_mp4_video_config(range.segment.path, avcc, width, height))
+		{
+			return true;
+		}
+		logger()->warn("Recording {} has no readable H.264 track, it is left out of the clip", range.segment.name);
+	}
+
+	return false;
+}
+
+bool ClipExporter::open_segment()
+{
+	for (; range_index < ranges.size(); range_index++)
+	{
+		const RecordingRange& range = ranges[range_index];
+		if (!range.exact)
+		{
+			continue;
+		}
+
+		// A different decoder configuration cannot follow in the same track
+		std::vector<uint8_t> segment_avcc;
+		int segment_width = 0;
+		int segment_height = 0;
+		if (!SegmentIndex::find_mp4_video_config(range.segment.path, segment_avcc, segment_width, segment_height))
+		{
+			logger()->warn("Recording {} has no readable H.264 track, it is left out of the clip", range.segment.name);
+			continue;
+		}
+		if (segment_avcc != avcc || segment_width != width || segment_height != height)
+		{
+			logger()->warn("Stream configuration changes in {}, the clip ends there", range.segment.name);
+			return false;
+		}
+
+		entries.clear();
+		if (!SegmentIndex::read(SegmentIndex::get_index_path(range.segment.path), index_header, entries) || entries.empty())
+		{
+			logger()->warn("Index of {} is gone, it is left out of the clip", range.segment.name);
+			continue;
+		}
+
+		ptrdiff_t first = SegmentIndex::find_keyframe(entries, range.start_wallclock_usec);
+		auto end_iter = std::upper_bound(entries.begin(), entries.end(), to_usec,
+			[](int64_t value, const SegmentIndexEntry& entry) { return value < entry.wallclock_usec; });
+		if (first < 0 || end_iter - entries.begin() <= first)
+		{
+			continue;
+		}
+
+		file = fopen(range.segment.path.c_str(), "rb");
+		if (!file)
+		{
+			logger()->warn("Failed to open {}: {}", range.segment.path, strerror(errno));
+			continue;
+		}
+
+		entry_index = static_cast<size_t>(first);
+		entry_end = static_cast<size_t>(end_iter - entries.begin());
+		return true;
+	}
+
+	return false;
+}
+
+void ClipExporter::close_segment()
+{
+	if (file)
+	{
+		fclose(file);
+		file = nullptr;
+	}
+	entries.clear();
+	entry_index = 0;
+	entry_end = 0;
+}
+
+uint32_t ClipExporter::get_sample_duration(size_t index)
+{
+	// Encoders run without B-frames, so presentation times grow in decode order
+	if (index + 1 < entries.size())
+	{
+		int64_t delta_ns = static_cast<int64_t>(entries[index + 1].pts_ns - entries[index].pts_ns);
+		if (delta_ns > 0 && delta_ns < 10000000000LL)
+		{
+			last_duration = static_cast<uint32_t>(delta_ns * Fmp4Writer::video_timescale / 1000000000);
+		}
+	}
+
+	// Segment tails and gaps between segments get the previous frame duration
+	if (last_duration == 0)
+	{
+		last_duration = Fmp4Writer::video_timescale / 25;
+	}
+	return last_duration;
+}
+
+bool ClipExporter::read_chunk(std::vector<uint8_t>& chunk)
+{
+	chunk.clear();
+	if (finished)
+	{
+		return false;
+	}
+
+	if (!init_sent)
+	{
+		chunk = Fmp4Writer::make_init_segment(avcc, width, height);
+		init_sent = true;
+		return true;
+	}
+
+	uint64_t fragment_target_ticks = static_cast<uint64_t>(config.fragment_duration_msec) * Fmp4Writer::video_timescale / 1000;
+	std::vector<Fmp4Sample> samples;
+	std::vector<uint8_t> payload;
+	uint64_t fragment_ticks = 0;
+
+	while (samples.empty())
+	{
+		if (file && entry_index >= entry_end)
+		{
+			close_segment();
+			range_index++;
+		}
+		if (!file && !open_segment())
+		{
+			finished = true;
+			return false;
+		}
+
+		// Fragments start at keyframes, like the recordings themselves
+		while (entry_index < entry_end)
+		{
+			const SegmentIndexEntry& entry = entries[entry_index];
+			bool keyframe = entry.flags & segment_index_entry_keyframe;
+			if (!samples.empty() && (keyframe || fragment_ticks >= fragment_target_ticks || payload.size() + entry.size > config.max_fragment_bytes))
+			{
+				break;
+			}
+
+			uint64_t offset = 0;
+			size_t payload_size = payload.size();
+			payload.resize(payload_size + entry.size);
+			if (!SegmentIndex::get_file_offset(index_header, entry, offset)
+				|| fseeko(file, static_cast<off_t>(offset), SEEK_SET) != 0
+				|| fread(payload.data() + payload_size, 1, entry.size, file) != entry.size)
+			{
+				logger()->warn("Recording {} is truncated, the clip continues with the next one", ranges[range_index].segment.name);
+				payload.resize(payload_size);
+				entry_index = entry_end;
+				break;
+			}
+
+			Fmp4Sample sample;
+			sample.duration = get_sample_duration(entry_index);
+			sample.size = entry.size;
+			sample.keyframe = keyframe;
+			samples.push_back(sample);
+			fragment_ticks += sample.duration;
+			entry_index++;
+		}
+	}
+
+	chunk = Fmp4Writer::make_fragment_header(fragment_sequence++, decode_time, samples);
+	chunk.insert(chunk.end(), payload.begin(), payload.end());
+	decode_time += fragment_ticks;
+	samples_exported += samples.size();
+	return true;
+}
+
+std::string ClipExporter::get_codecs() const
+{
+	return Fmp4Writer::make_codecs_string(avcc);
+}
+
+uint64_t ClipExporter::get_samples_exported() const
+{
+	return samples_exported;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
+#include <spdlog/spdlog.h>
+#include "RecordingCatalog.h"
+#include "SegmentIndex.h"
+#include "../video/Fmp4Writer.h"
+
+struct ClipExporterConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	int fragment_duration_msec = 1000;
+	size_t max_fragment_bytes = 4 * 1024 * 1024;
+};
+
+// Streams recorded footage of a time range as one fragmented MP4. Samples are copied from the
+// recordings as they are, located through the segment sidecar indexes; nothing is decoded,
+// encoded or staged on disk. The clip starts at the keyframe preceding the range start.
+class ClipExporter
+{
+private:
+	ClipExporterConfig config;
+	std::shared_ptr<RecordingCatalog> catalog;
+	std::vector<RecordingRange> ranges;
+	int64_t from_usec = 0;
+	int64_t to_usec = 0;
+
+	std::vector<uint8_t> avcc;
+	int width = 0;
+	int height = 0;
+	bool init_sent = false;
+	bool finished = false;
+
+	size_t range_index = 0;
+	FILE* file = nullptr;
+	SegmentIndexHeader index_header = {};
+	std::vector<SegmentIndexEntry> entries;
+	size_t entry_index = 0;
+	size_t entry_end = 0;
+
+	uint64_t decode_time = 0;
+	uint32_t last_duration = 0;
+	uint32_t fragment_sequence = 1;
+	uint64_t samples_exported = 0;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	bool open_segment();
+	void close_segment();
+	uint32_t get_sample_duration(size_t index);
+
+public:
+	ClipExporter& operator=(const ClipExporter&) = delete;
+	ClipExporter(const ClipExporter& copy) = delete;
+	ClipExporter() = delete;
+
+	ClipExporter(const ClipExporterConfig& config, std::shared_ptr<RecordingCatalog> catalog, int64_t from_usec, int64_t to_usec);
+	~ClipExporter();
+
+	// Looks up the range in the catalog and prepares the init segment from the first usable segment,
+	// false when there is nothing to export. Reads the sidecars and the moov, keep it off the poll loop.
+	bool open();
+
+	// Next piece of the clip (the init segment, then one fragment per call), false at the end.
+	// Reads from the recordings like open().
+	bool read_chunk(std::vector<uint8_t>& chunk);
+
+	std::string get_codecs() const;
+	uint64_t get_samples_exported() const;
+};
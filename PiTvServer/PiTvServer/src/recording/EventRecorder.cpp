@@ -0,0 +1,494 @@
+#include "EventRecorder.h"
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#ifdef CM_UNIX
+#include <pthread.h>
+#endif
+
+EventRecorder::EventRecorder(const EventRecorderConfig& config, std::shared_ptr<EncodedTap> encoded_tap)
+{
+	this->config = config;
+	this->encoded_tap = encoded_tap;
+}
+
+EventRecorder::~EventRecorder()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> EventRecorder::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool EventRecorder::start()
+{
+	if (is_running)
+	{
+		logger()->warn("Event recorder is already running!");
+		return true;
+	}
+
+	if (!encoded_tap)
+	{
+		logger()->error("Cannot start event recorder: encoded tap is not available!");
+		return false;
+	}
+
+	if (!config.location_handler)
+	{
+		logger()->error("Cannot start event recorder: no location handler!");
+		return false;
+	}
+
+	if (config.preroll_msec < 0 || config.postroll_msec <= 0 || config.fragment_duration_msec <= 0)
+	{
+		logger()->error("Invalid event recorder configuration: pre-roll {} msec, post-roll {} msec, fragment {} msec",
+			config.preroll_msec, config.postroll_msec, config.fragment_duration_msec);
+		return false;
+	}
+
+	is_running = true;
+	writer_thread = std::thread([this]() { writer_loop(); });
+#ifdef CM_UNIX
+	pthread_setname_np(writer_thread.native_handle(), "pitv-evrec");
+#endif
+
+	tap_listener_id = encoded_tap->add_listener([this](const EncodedFramePtr& frame)
+		{
+			on_encoded_frame(frame);
+		}
+	);
+
+	logger()->info("Event recorder started: pre-roll {} msec, post-roll {} msec", config.preroll_msec, config.postroll_msec);
+	return true;
+}
+
+void EventRecorder::stop()
+{
+	if (!is_running)
+	{
+		return;
+	}
+
+	encoded_tap->remove_listener(tap_listener_id);
+	tap_listener_id = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		if (recording)
+		{
+			Job job;
+			job.type = JobType::Close;
+			job.event_id = current_event_id;
+			enqueue(std::move(job));
+			recording = false;
+		}
+		preroll.clear();
+	}
+
+	// The writer drains what is queued, so a running event is closed cleanly
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		is_running = false;
+	}
+	queue_cv.notify_all();
+	if (writer_thread.joinable())
+	{
+		writer_thread.join();
+	}
+
+	logger()->info("Event recorder stopped");
+}
+
+void EventRecorder::trim_preroll()
+{
+	// Decoding has to start with a keyframe
+	while (!preroll.empty() && !preroll.front()->keyframe)
+	{
+		preroll.pop_front();
+	}
+
+	if (preroll.empty())
+	{
+		return;
+	}
+
+	// Drop whole GOPs as long as the next GOP alone still covers the pre-roll
+	int64_t newest_usec = preroll.back()->wallclock_usec;
+	int64_t preroll_usec = static_cast<int64_t>(config.preroll_msec) * 1000;
+	size_t drop_count = 0;
+	for (size_t i = 1; i < preroll.size(); i++)
+	{
+		if (!preroll[i]->keyframe)
+		{
+			continue;
+		}
+		if (newest_usec - preroll[i]->wallclock_usec < preroll_usec)
+		{
+			break;
+		}
+		drop_count = i;
+	}
+
+	preroll.erase(preroll.begin(), preroll.begin() + drop_count);
+}
+
+void EventRecorder::on_encoded_frame(const EncodedFramePtr& frame)
+{
+	if (!frame->stream_info || frame->stream_info->codec_data.empty())
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(state_mutex);
+
+	if (!recording)
+	{
+		preroll.push_back(frame);
+		trim_preroll();
+
+		if (!start_requested || preroll.empty())
+		{
+			return;
+		}
+
+		start_requested = false;
+		recording = true;
+		current_event_id = next_event_id++;
+		events_recorded++;
+
+		logger()->info("Event {} started, flushing {} pre-roll frames", current_event_id, preroll.size());
+
+		Job open_job;
+		open_job.type = JobType::Open;
+		open_job.event_id = current_event_id;
+		enqueue(std::move(open_job));
+
+		for (auto& preroll_frame : preroll)
+		{
+			Job job;
+			job.event_id = current_event_id;
+			job.frame = preroll_frame;
+			enqueue(std::move(job));
+		}
+		preroll.clear();
+		return;
+	}
+
+	Job job;
+	job.event_id = current_event_id;
+	job.frame = frame;
+	enqueue(std::move(job));
+
+	if (hold_count == 0 && frame->wallclock_usec >= record_until_usec)
+	{
+		logger()->info("Event {} post-roll expired", current_event_id);
+
+		Job close_job;
+		close_job.type = JobType::Close;
+		close_job.event_id = current_event_id;
+		enqueue(std::move(close_job));
+		recording = false;
+	}
+}
+
+void EventRecorder::enqueue(Job&& job)
+{
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		if (job.frame)
+		{
+			size_t size = gst_buffer_get_size(job.frame->buffer);
+
+			// The disk fell behind: drop frames up to the next keyframe that fits
+			if (queue_waiting_keyframe && !job.frame->keyframe)
+			{
+				frames_dropped++;
+				return;
+			}
+			if (queued_bytes + size > config.max_queued_bytes)
+			{
+				if (!queue_waiting_keyframe)
+				{
+					logger()->warn("Event recorder queue is full ({} bytes), dropping frames until the next keyframe", queued_bytes);
+				}
+				queue_waiting_keyframe = true;
+				frames_dropped++;
+				return;
+			}
+
+			queue_waiting_keyframe = false;
+			queued_bytes += size;
+		}
+		queue.push_back(std::move(job));
+	}
+	queue_cv.notify_one();
+}
+
+void EventRecorder::trigger(const std::string& reason)
+{
+	std::lock_guard<std::mutex> lock(state_mutex);
+
+	record_until_usec = std::max(record_until_usec, g_get_real_time() + static_cast<int64_t>(config.postroll_msec) * 1000);
+	if (!recording)
+	{
+		start_requested = true;
+	}
+
+	logger()->debug("Event recording triggered by {}", reason);
+}
+
+void EventRecorder::set_hold(bool hold, const std::string& reason)
+{
+	std::lock_guard<std::mutex> lock(state_mutex);
+
+	if (hold)
+	{
+		hold_count++;
+		if (!recording)
+		{
+			start_requested = true;
+		}
+	}
+	else if (hold_count > 0)
+	{
+		hold_count--;
+	}
+
+	record_until_usec = std::max(record_until_usec, g_get_real_time() + static_cast<int64_t>(config.postroll_msec) * 1000);
+	logger()->debug("Event recording hold {} by {}", hold ? "set" : "released", reason);
+}
+
+EventRecorderStats EventRecorder::get_stats() const
+{
+	EventRecorderStats stats;
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		stats.recording = recording;
+		stats.current_event_id = recording ? current_event_id : 0;
+		stats.record_until_usec = record_until_usec;
+		stats.events_recorded = events_recorded;
+	}
+	stats.bytes_written = bytes_written;
+	stats.frames_dropped = frames_dropped;
+	return stats;
+}
+
+void EventRecorder::writer_loop()
+{
+	while (true)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			queue_cv.wait(lock, [this]() { return !queue.empty() || !is_running; });
+			if (queue.empty())
+			{
+				break;
+			}
+
+			job = std::move(queue.front());
+			queue.pop_front();
+			if (job.frame)
+			{
+				queued_bytes -= gst_buffer_get_size(job.frame->buffer);
+			}
+		}
+
+		switch (job.type)
+		{
+		case JobType::Open:
+			close_file();
+			file_event_id = job.event_id;
+			break;
+		case JobType::Frame:
+			if (job.event_id == file_event_id)
+			{
+				write_frame(job.frame);
+			}
+			break;
+		case JobType::Close:
+			close_file();
+			file_event_id = 0;
+			break;
+		}
+	}
+
+	close_file();
+}
+
+bool EventRecorder::open_file(uint64_t event_id, const std::shared_ptr<const EncodedStreamInfo>& info)
+{
+	file_path = config.location_handler(event_id);
+	file = fopen(file_path.c_str(), "wb");
+	if (!file)
+	{
+		logger()->error("Event recorder failed to open {}: {}", file_path, strerror(errno));
+		return false;
+	}
+
+	file_offset = 0;
+	file_index = std::make_unique<SegmentIndexWriter>(logger());
+	// Fragmented files have one mdat per fragment, the sidecar stores absolute offsets
+	if (!file_index->open(SegmentIndex::get_index_path(file_path), true))
+	{
+		file_index.reset();
+	}
+
+	file_stream_info = info;
+	timeline.reset();
+	fragment_frames.clear();
+	fragment_samples.clear();
+	fragment_ticks = 0;
+	fragment_sequence = 1;
+
+	std::vector<uint8_t> init_segment = Fmp4Writer::make_init_segment(info->codec_data, info->width, info->height);
+	if (!write_bytes(init_segment.data(), init_segment.size()))
+	{
+		close_file();
+		return false;
+	}
+
+	logger()->info("Event {} is recorded to {}", event_id, file_path);
+	return true;
+}
+
+void EventRecorder::write_frame(const EncodedFramePtr& frame)
+{
+	// A caps change needs a new init segment, the event continues in a new file
+	if (file && frame->stream_info != file_stream_info)
+	{
+		close_file();
+	}
+
+	if (!file)
+	{
+		// Files start at a keyframe, frames up to it are lost after a caps change or an open failure
+		if (!frame->keyframe || !open_file(file_event_id, frame->stream_info))
+		{
+			return;
+		}
+	}
+
+	Fmp4TimedSample timed_sample;
+	if (!timeline.push(frame, timed_sample))
+	{
+		return;
+	}
+
+	if (fragment_frames.empty())
+	{
+		fragment_base_decode_time = timed_sample.decode_time;
+	}
+	fragment_frames.push_back(timed_sample.frame);
+	fragment_samples.push_back(timed_sample.sample);
+	fragment_ticks += timed_sample.sample.duration;
+
+	// Fragments end in front of a keyframe or once they are long enough
+	uint64_t fragment_target_ticks = static_cast<uint64_t>(config.fragment_duration_msec) * Fmp4Writer::video_timescale / 1000;
+	if (frame->keyframe || fragment_ticks >= fragment_target_ticks)
+	{
+		flush_fragment();
+	}
+}
+
+void EventRecorder::flush_fragment()
+{
+	if (!file || fragment_frames.empty())
+	{
+		return;
+	}
+
+	std::vector<uint8_t> header = Fmp4Writer::make_fragment_header(fragment_sequence++, fragment_base_decode_time, fragment_samples);
+	bool ok = write_bytes(header.data(), header.size());
+	for (size_t i = 0; ok && i < fragment_frames.size(); i++)
+	{
+		GstBuffer* buffer = fragment_frames[i]->buffer;
+		GstMapInfo map_info;
+		if (!gst_buffer_map(buffer, &map_info, GST_MAP_READ))
+		{
+			logger()->error("Event recorder failed to map a buffer, {} is truncated", file_path);
+			ok = false;
+			break;
+		}
+		uint64_t sample_offset = file_offset;
+		ok = write_bytes(map_info.data, map_info.size);
+		gst_buffer_unmap(buffer, &map_info);
+
+		const EncodedFramePtr& frame = fragment_frames[i];
+		if (ok && file_index)
+		{
+			file_index->append(frame->pts, frame->wallclock_usec, sample_offset, static_cast<uint32_t>(map_info.size), frame->keyframe);
+		}
+	}
+
+	fragment_frames.clear();
+	fragment_samples.clear();
+	fragment_ticks = 0;
+
+	if (!ok || fflush(file) != 0)
+	{
+		logger()->error("Event recorder failed to write {}, closing it", file_path);
+		close_file();
+	}
+}
+
+void EventRecorder::close_file()
+{
+	if (!file)
+	{
+		return;
+	}
+
+	Fmp4TimedSample timed_sample;
+	if (timeline.flush(timed_sample))
+	{
+		if (fragment_frames.empty())
+		{
+			fragment_base_decode_time = timed_sample.decode_time;
+		}
+		fragment_frames.push_back(timed_sample.frame);
+		fragment_samples.push_back(timed_sample.sample);
+	}
+
+	FILE* closing_file = file;
+	flush_fragment();
+	// flush_fragment() closes the file itself on a write error
+	if (file == closing_file)
+	{
+		fclose(file);
+		file = nullptr;
+		logger()->info("Event recording {} closed", file_path);
+	}
+
+	if (file_index)
+	{
+		if (file_index->close(false, 0) && config.file_closed_handler)
+		{
+			config.file_closed_handler(file_path, file_index->get_header());
+		}
+		file_index.reset();
+	}
+
+	file_stream_info.reset();
+	timeline.reset();
+	fragment_frames.clear();
+	fragment_samples.clear();
+	fragment_ticks = 0;
+}
+
+bool EventRecorder::write_bytes(const uint8_t* data, size_t size)
+{
+	if (fwrite(data, 1, size, file) != size)
+	{
+		logger()->error("Event recorder failed to write {}: {}", file_path, strerror(errno));
+		return false;
+	}
+
+	file_offset += size;
+	bytes_written += size;
+	return true;
+}
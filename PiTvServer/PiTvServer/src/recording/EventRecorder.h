@@ -0,0 +1,136 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+#include <spdlog/spdlog.h>
+#include "../video/EncodedTap.h"
+#include "../video/Fmp4Writer.h"
+#include "../video/Fmp4Timeline.h"
+#include "SegmentIndex.h"
+
+struct EventRecorderConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	int preroll_msec = 5000;
+	int postroll_msec = 10000;
+	int fragment_duration_msec = 1000;
+	size_t max_queued_bytes = 32 * 1024 * 1024;
+
+	// Called on the writer thread when an event needs a new file, returns its full path
+	std::function<std::string(uint64_t event_id)> location_handler;
+	// Called on the writer thread once a file and its sidecar index are finished
+	std::function<void(const std::string& path, const SegmentIndexHeader& index_header)> file_closed_handler;
+};
+
+struct EventRecorderStats
+{
+	bool recording = false;
+	uint64_t current_event_id = 0;
+	int64_t record_until_usec = 0;
+	uint64_t events_recorded = 0;
+	uint64_t bytes_written = 0;
+	uint64_t frames_dropped = 0;
+};
+
+// Event-gated recorder fed from the encoded tap. The last preroll_msec of access units are kept in RAM,
+// starting at a keyframe. A trigger flushes them into a new fragmented MP4 file and recording goes on
+// until postroll_msec after the last trigger (or the end of a hold). Files are written on a dedicated
+// thread so a slow SD card never stalls the tap.
+class EventRecorder
+{
+private:
+	enum class JobType
+	{
+		Open,
+		Frame,
+		Close
+	};
+
+	struct Job
+	{
+		JobType type = JobType::Frame;
+		uint64_t event_id = 0;
+		EncodedFramePtr frame;
+	};
+
+	EventRecorderConfig config;
+	std::shared_ptr<EncodedTap> encoded_tap;
+	int tap_listener_id = 0;
+
+	// Trigger state, shared between the streaming thread and trigger()/set_hold() callers
+	mutable std::mutex state_mutex;
+	std::deque<EncodedFramePtr> preroll;
+	bool recording = false;
+	bool start_requested = false;
+	int hold_count = 0;
+	int64_t record_until_usec = 0;
+	uint64_t current_event_id = 0;
+	uint64_t next_event_id = 1;
+	uint64_t events_recorded = 0;
+
+	mutable std::mutex queue_mutex;
+	std::condition_variable queue_cv;
+	std::deque<Job> queue;
+	size_t queued_bytes = 0;
+	bool queue_waiting_keyframe = false;
+	std::atomic<uint64_t> frames_dropped = 0;
+
+	std::thread writer_thread;
+	std::atomic<bool> is_running = false;
+
+	// File state, touched only by the writer thread
+	FILE* file = nullptr;
+	std::string file_path;
+	uint64_t file_event_id = 0;
+	std::shared_ptr<const EncodedStreamInfo> file_stream_info;
+	Fmp4Timeline timeline;
+	std::vector<EncodedFramePtr> fragment_frames;
+	std::vector<Fmp4Sample> fragment_samples;
+	uint64_t fragment_base_decode_time = 0;
+	uint64_t fragment_ticks = 0;
+	uint32_t fragment_sequence = 1;
+	uint64_t file_offset = 0;
+	std::unique_ptr<SegmentIndexWriter> file_index;
+	std::atomic<uint64_t> bytes_written = 0;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	void on_encoded_frame(const EncodedFramePtr& frame);
+	void trim_preroll();
+	void enqueue(Job&& job);
+
+	void writer_loop();
+	bool open_file(uint64_t event_id, const std::shared_ptr<const EncodedStreamInfo>& info);
+	void write_frame(const EncodedFramePtr& frame);
+	void flush_fragment();
+	void close_file();
+	bool write_bytes(const uint8_t* data, size_t size);
+
+public:
+	EventRecorder& operator=(const EventRecorder&) = delete;
+	EventRecorder(const EventRecorder& copy) = delete;
+	EventRecorder() = delete;
+
+	EventRecorder(const EventRecorderConfig& config, std::shared_ptr<EncodedTap> encoded_tap);
+	~EventRecorder();
+
+	bool start();
+	void stop();
+
+	// Starts an event (with the pre-roll) or extends the current one by postroll_msec
+	void trigger(const std::string& reason);
+
+	// While any hold is active the event does not end, post-roll counts from the last release
+	void set_hold(bool hold, const std::string& reason);
+
+	EventRecorderStats get_stats() const;
+};
@@ -0,0 +1,584 @@
+#include "RecordingCatalog.h"
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+
+const std::string RecordingCatalog::catalog_file_name = "catalog.bin";
+const char RecordingCatalog::magic[4] = { 'P', 'T', 'V', 'C' };
+const uint16_t RecordingCatalog::version = 1;
+
+RecordingCatalog::RecordingCatalog(const RecordingCatalogConfig& config)
+{
+	this->config = config;
+}
+
+RecordingCatalog::~RecordingCatalog()
+{
+	close();
+}
+
+std::shared_ptr<spdlog::logger> RecordingCatalog::logger() const
+{
+	return config.logger_ptr;
+}
+
+std::string RecordingCatalog::get_catalog_path() const
+{
+	return (std::filesystem::path(config.recording_path) / catalog_file_name).string();
+}
+
+std::string RecordingCatalog::get_tier_path(uint32_t flags) const
+{
+	return (flags & recording_segment_secondary) && !config.secondary_path.empty() ? config.secondary_path : config.recording_path;
+}
+
+uint32_t RecordingCatalog::get_checksum(const RecordingCatalogRecord& record)
+{
+	RecordingCatalogRecord copy = record;
+	copy.checksum = 0;
+
+	// FNV-1a, only meant to catch a record torn by a power loss
+	const uint8_t* data = reinterpret_cast<const uint8_t*>(&copy);
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < sizeof(copy); i++)
+	{
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	return hash;
+}
+
+bool RecordingCatalog::make_record(const std::string& name, const SegmentIndexHeader& index_header, uint64_t size, uint32_t flags, RecordingCatalogRecord& record)
+{
+	if (name.empty() || name.size() >= sizeof(record.name))
+	{
+		return false;
+	}
+
+	record = {};
+	record.start_wallclock_usec = index_header.start_wallclock_usec;
+	record.end_wallclock_usec = index_header.end_wallclock_usec;
+	record.start_pts_ns = index_header.start_pts_ns;
+	record.end_pts_ns = index_header.end_pts_ns;
+	record.size = size;
+	record.flags = flags;
+	memcpy(record.name, name.c_str(), name.size());
+	record.checksum = get_checksum(record);
+	return true;
+}
+
+bool RecordingCatalog::open()
+{
+	std::lock_guard<std::mutex> lock(catalog_mutex);
+	if (file)
+	{
+		return true;
+	}
+
+	std::vector<RecordingCatalogRecord> records;
+	bool changed = false;
+	if (!load(records, changed))
+	{
+		logger()->warn("Recording catalog {} is not readable, it is rebuilt from the segment indexes", get_catalog_path());
+		records.clear();
+		changed = true;
+	}
+
+	size_t backfilled = backfill(records);
+	if (backfilled > 0)
+	{
+		logger()->info("Recording catalog picked up {} segments from their indexes", backfilled);
+		changed = true;
+	}
+
+	if (changed)
+	{
+		if (!rewrite(records))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		file = fopen(get_catalog_path().c_str(), "ab");
+		if (!file)
+		{
+			logger()->error("Failed to open recording catalog {}: {}", get_catalog_path(), strerror(errno));
+			return false;
+		}
+	}
+
+	// Sorted once, inserting one by one would move the vector for every segment
+	segments.clear();
+	segment_starts.clear();
+	max_segment_duration_usec = 0;
+	segments.reserve(records.size());
+	for (const auto& record : records)
+	{
+		segments.push_back(make_segment(record));
+	}
+	std::stable_sort(segments.begin(), segments.end(),
+		[](const RecordingSegment& a, const RecordingSegment& b) { return a.start_wallclock_usec < b.start_wallclock_usec; });
+	for (const auto& segment : segments)
+	{
+		segment_starts[segment.name] = segment.start_wallclock_usec;
+		max_segment_duration_usec = std::max(max_segment_duration_usec, segment.end_wallclock_usec - segment.start_wallclock_usec);
+	}
+
+	logger()->info("Recording catalog {} opened with {} segments", get_catalog_path(), segments.size());
+	return true;
+}
+
+void RecordingCatalog::close()
+{
+	std::lock_guard<std::mutex> lock(catalog_mutex);
+	if (file)
+	{
+		fclose(file);
+		file = nullptr;
+	}
+}
+
+bool RecordingCatalog::load(std::vector<RecordingCatalogRecord>& records, bool& changed)
+{
+	FILE* catalog_file = fopen(get_catalog_path().c_str(), "rb");
+	if (!catalog_file)
+	{
+		changed = true;
+		return true;
+	}
+
+	RecordingCatalogFileHeader header;
+	bool ok = fread(&header, sizeof(header), 1, catalog_file) == 1
+		&& memcmp(header.magic, magic, sizeof(magic)) == 0
+		&& header.version == version
+		&& header.record_size == sizeof(RecordingCatalogRecord);
+	if (!ok)
+	{
+		fclose(catalog_file);
+		return false;
+	}
+
+	// Replays the log: the last record of a name wins, removals drop it
+	std::vector<RecordingCatalogRecord> live_records;
+	std::unordered_map<std::string, size_t> record_positions;
+	RecordingCatalogRecord record;
+	size_t read_size = 0;
+	while ((read_size = fread(&record, 1, sizeof(record), catalog_file)) == sizeof(record))
+	{
+		if (record.checksum != get_checksum(record) || record.name[sizeof(record.name) - 1] != 0)
+		{
+			logger()->warn("Recording catalog has a damaged record, the rest of it is dropped");
+			changed = true;
+			break;
+		}
+
+		// A removal stays in its slot until the loop below skips it, a later record of the name reuses the slot
+		auto position = record_positions.find(record.name);
+		if (position != record_positions.end())
+		{
+			live_records[position->second] = record;
+			changed = true;
+		}
+		else
+		{
+			record_positions.emplace(record.name, live_records.size());
+			live_records.push_back(record);
+		}
+
+		if (record.flags & recording_segment_removed)
+		{
+			changed = true;
+		}
+	}
+	if (read_size != 0 && read_size != sizeof(record))
+	{
+		changed = true;
+	}
+	fclose(catalog_file);
+
+	// Recordings removed while the server was down. A move between tiers may have been cut
+	// short before it was recorded, the file is then looked for in the other tier.
+	for (auto live_record : live_records)
+	{
+		if (live_record.flags & recording_segment_removed)
+		{
+			continue;
+		}
+
+		std::error_code exists_error;
+		if (!std::filesystem::exists(std::filesystem::path(get_tier_path(live_record.flags)) / live_record.name, exists_error))
+		{
+			changed = true;
+			uint32_t other_flags = live_record.flags ^ recording_segment_secondary;
+			if (config.secondary_path.empty() || !std::filesystem::exists(std::filesystem::path(get_tier_path(other_flags)) / live_record.name, exists_error))
+			{
+				continue;
+			}
+			live_record.flags = other_flags;
+			live_record.checksum = get_checksum(live_record);
+		}
+		records.push_back(live_record);
+	}
+
+	return true;
+}
+
+size_t RecordingCatalog::backfill(std::vector<RecordingCatalogRecord>& records)
+{
+	std::set<std::string> known_names;
+	for (const auto& record : records)
+	{
+		known_names.insert(record.name);
+	}
+
+	size_t backfilled = backfill_tier(records, known_names, 0);
+	if (!config.secondary_path.empty())
+	{
+		backfilled += backfill_tier(records, known_names, recording_segment_secondary);
+	}
+	return backfilled;
+}
+
+size_t RecordingCatalog::backfill_tier(std::vector<RecordingCatalogRecord>& records, std::set<std::string>& known_names, uint32_t tier_flags)
+{
+	size_t backfilled = 0;
+	std::error_code iterate_error;
+	for (auto const& dir_entry : std::filesystem::directory_iterator{ get_tier_path(tier_flags), iterate_error })
+	{
+		std::string extension = dir_entry.path().extension().string();
+		if (!dir_entry.is_regular_file() || extension.empty()
+			|| std::find(config.recording_extensions.begin(), config.recording_extensions.end(), extension.substr(1)) == config.recording_extensions.end())
+		{
+			continue;
+		}
+
+		std::string name = dir_entry.path().filename().string();
+		if (known_names.count(name))
+		{
+			continue;
+		}
+
+		SegmentIndexHeader index_header;
+		std::vector<SegmentIndexEntry> entries;
+		if (!SegmentIndex::read(SegmentIndex::get_index_path(dir_entry.path().string()), index_header, entries) || entries.empty())
+		{
+			logger()->debug("Recording {} has no usable index, it is not cataloged", name);
+			continue;
+		}
+
+		uint32_t flags = recording_segment_indexed | tier_flags;
+		if (!(index_header.flags & segment_index_complete))
+		{
+			// The header of an interrupted index still has the times of its first entry only
+			index_header.start_wallclock_usec = entries.front().wallclock_usec;
+			index_header.end_wallclock_usec = entries.back().wallclock_usec;
+			index_header.start_pts_ns = entries.front().pts_ns;
+			index_header.end_pts_ns = entries.back().pts_ns;
+			flags |= recording_segment_incomplete;
+		}
+		if (name.find("[event-") != std::string::npos)
+		{
+			flags |= recording_segment_event;
+		}
+
+		RecordingCatalogRecord record;
+		if (make_record(name, index_header, dir_entry.file_size(), flags, record))
+		{
+			records.push_back(record);
+			known_names.insert(name);
+			backfilled++;
+		}
+	}
+
+	return backfilled;
+}
+
+bool RecordingCatalog::rewrite(const std::vector<RecordingCatalogRecord>& records)
+{
+	if (file)
+	{
+		fclose(file);
+		file = nullptr;
+	}
+
+	std::string catalog_path = get_catalog_path();
+	std::string temp_path = catalog_path + ".tmp";
+	FILE* temp_file = fopen(temp_path.c_str(), "wb");
+	if (!temp_file)
+	{
+		logger()->error("Failed to create recording catalog {}: {}", temp_path, strerror(errno));
+		return false;
+	}
+
+	RecordingCatalogFileHeader header = {};
+	memcpy(header.magic, magic, sizeof(header.magic));
+	header.version = version;
+	header.record_size = sizeof(RecordingCatalogRecord);
+
+	bool ok = fwrite(&header, sizeof(header), 1, temp_file) == 1;
+	for (size_t i = 0; ok && i < records.size(); i++)
+	{
+		ok = fwrite(&records[i], sizeof(records[i]), 1, temp_file) == 1;
+	}
+	ok = fclose(temp_file) == 0 && ok;
+
+	std::error_code rename_error;
+	if (ok)
+	{
+		std::filesystem::rename(temp_path, catalog_path, rename_error);
+	}
+	if (!ok || rename_error)
+	{
+		logger()->error("Failed to write recording catalog {}", catalog_path);
+		std::filesystem::remove(temp_path, rename_error);
+		return false;
+	}
+
+	file = fopen(catalog_path.c_str(), "ab");
+	if (!file)
+	{
+		logger()->error("Failed to open recording catalog {}: {}", catalog_path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool RecordingCatalog::append(RecordingCatalogRecord& record)
+{
+	if (!file)
+	{
+		return false;
+	}
+
+	if (fwrite(&record, sizeof(record), 1, file) != 1 || fflush(file) != 0)
+	{
+		logger()->error("Failed to append to recording catalog {}: {}", get_catalog_path(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+RecordingSegment RecordingCatalog::make_segment(const RecordingCatalogRecord& record) const
+{
+	RecordingSegment segment;
+	segment.name = record.name;
+	segment.path = (std::filesystem::path(get_tier_path(record.flags)) / segment.name).string();
+	segment.start_wallclock_usec = record.start_wallclock_usec;
+	segment.end_wallclock_usec = record.end_wallclock_usec;
+	segment.start_pts_ns = record.start_pts_ns;
+	segment.end_pts_ns = record.end_pts_ns;
+	segment.size = record.size;
+	segment.flags = record.flags;
+	return segment;
+}
+
+void RecordingCatalog::insert_segment(const RecordingCatalogRecord& record)
+{
+	auto same_name = find_segment_position(record.name);
+	if (same_name != segments.end())
+	{
+		segments.erase(same_name);
+	}
+
+	RecordingSegment segment = make_segment(record);
+	auto position = std::upper_bound(segments.begin(), segments.end(), segment.start_wallclock_usec,
+		[](int64_t value, const RecordingSegment& other) { return value < other.start_wallclock_usec; });
+	segments.insert(position, segment);
+	segment_starts[segment.name] = segment.start_wallclock_usec;
+
+	max_segment_duration_usec = std::max(max_segment_duration_usec, segment.end_wallclock_usec - segment.start_wallclock_usec);
+}
+
+std::vector<RecordingSegment>::const_iterator RecordingCatalog::find_segment_position(const std::string& name) const
+{
+	auto start = segment_starts.find(name);
+	if (start == segment_starts.end())
+	{
+		return segments.end();
+	}
+
+	// Only segments starting at the same microsecond are compared by name
+	auto iter = std::lower_bound(segments.begin(), segments.end(), start->second,
+		[](const RecordingSegment& segment, int64_t value) { return segment.start_wallclock_usec < value; });
+	for (; iter != segments.end() && iter->start_wallclock_usec == start->second; ++iter)
+	{
+		if (iter->name == name)
+		{
+			return iter;
+		}
+	}
+	return segments.end();
+}
+
+std::vector<RecordingSegment>::iterator RecordingCatalog::find_segment_position(const std::string& name)
+{
+	auto iter = static_cast<const RecordingCatalog*>(this)->find_segment_position(name);
+	return segments.begin() + (iter - segments.cbegin());
+}
+
+bool RecordingCatalog::add_segment(const std::string& path, const SegmentIndexHeader& index_header, uint32_t flags)
+{
+	if (index_header.start_wallclock_usec == 0)
+	{
+		logger()->warn("Recording {} has no indexed frames, it is not cataloged", path);
+		return false;
+	}
+
+	flags |= recording_segment_indexed;
+	if (!(index_header.flags & segment_index_complete))
+	{
+		flags |= recording_segment_incomplete;
+	}
+
+	std::error_code size_error;
+	uint64_t size = std::filesystem::file_size(path, size_error);
+	std::string name = std::filesystem::path(path).filename().string();
+
+	RecordingCatalogRecord record;
+	if (!make_record(name, index_header, size_error ? 0 : size, flags, record))
+	{
+		logger()->error("Recording name {} does not fit the catalog", name);
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(catalog_mutex);
+	bool ok = append(record);
+	insert_segment(record);
+	return ok;
+}
+
+bool RecordingCatalog::remove_segment(const std::string& path)
+{
+	std::string name = std::filesystem::path(path).filename().string();
+
+	std::lock_guard<std::mutex> lock(catalog_mutex);
+	auto iter = find_segment_position(name);
+	if (iter == segments.end())
+	{
+		return false;
+	}
+	segments.erase(iter);
+	segment_starts.erase(name);
+
+	RecordingCatalogRecord record;
+	if (!make_record(name, SegmentIndexHeader{}, 0, recording_segment_removed, record))
+	{
+		return false;
+	}
+	return append(record);
+}
+
+bool RecordingCatalog::move_segment(const std::string& path, bool secondary)
+{
+	std::string name = std::filesystem::path(path).filename().string();
+
+	std::lock_guard<std::mutex> lock(catalog_mutex);
+	auto iter = find_segment_position(name);
+	if (iter == segments.end())
+	{
+		return false;
+	}
+
+	SegmentIndexHeader index_header = {};
+	index_header.start_wallclock_usec = iter->start_wallclock_usec;
+	index_header.end_wallclock_usec = iter->end_wallclock_usec;
+	index_header.start_pts_ns = iter->start_pts_ns;
+	index_header.end_pts_ns = iter->end_pts_ns;
+	uint32_t flags = secondary ? iter->flags | recording_segment_secondary : iter->flags & ~recording_segment_secondary;
+
+	RecordingCatalogRecord record;
+	if (!make_record(name, index_header, iter->size, flags, record))
+	{
+		return false;
+	}
+	bool ok = append(record);
+	iter->flags = flags;
+	iter->path = path;
+	return ok;
+}
+
+std::vector<RecordingSegment> RecordingCatalog::find_segments(int64_t from_usec, int64_t to_usec) const
+{
+	std::vector<RecordingSegment> result;
+
+	std::lock_guard<std::mutex> lock(catalog_mutex);
+
+	// No segment starting earlier than this can reach from_usec
+	int64_t earliest_start_usec = from_usec - max_segment_duration_usec;
+	auto iter = std::lower_bound(segments.begin(), segments.end(), earliest_start_usec,
+		[](const RecordingSegment& segment, int64_t value) { return segment.start_wallclock_usec < value; });
+
+	for (; iter != segments.end() && iter->start_wallclock_usec <= to_usec; ++iter)
+	{
+		if (iter->end_wallclock_usec >= from_usec)
+		{
+			result.push_back(*iter);
+		}
+	}
+
+	return result;
+}
+
+std::vector<RecordingRange> RecordingCatalog::query(int64_t from_usec, int64_t to_usec) const
+{
+	std::vector<RecordingRange> result;
+
+	// Sidecars are read without the lock, a removal in between only makes a range unusable
+	for (const auto& segment : find_segments(from_usec, to_usec))
+	{
+		RecordingRange range;
+		range.segment = segment;
+		range.length = segment.size;
+		range.start_wallclock_usec = segment.start_wallclock_usec;
+		range.end_wallclock_usec = segment.end_wallclock_usec;
+
+		SegmentIndexHeader index_header;
+		std::vector<SegmentIndexEntry> entries;
+		if ((segment.flags & recording_segment_indexed)
+			&& SegmentIndex::read(SegmentIndex::get_index_path(segment.path), index_header, entries)
+			&& !entries.empty())
+		{
+			ptrdiff_t first = SegmentIndex::find_keyframe(entries, from_usec);
+			auto last_iter = std::upper_bound(entries.begin(), entries.end(), to_usec,
+				[](int64_t value, const SegmentIndexEntry& entry) { return value < entry.wallclock_usec; });
+			ptrdiff_t last = std::max<ptrdiff_t>(first, (last_iter - entries.begin()) - 1);
+
+			uint64_t first_offset = 0;
+			uint64_t last_offset = 0;
+			if (first >= 0
+				&& SegmentIndex::get_file_offset(index_header, entries[first], first_offset)
+				&& SegmentIndex::get_file_offset(index_header, entries[last], last_offset))
+			{
+				range.offset = first_offset;
+				range.length = last_offset + entries[last].size - first_offset;
+				range.start_wallclock_usec = entries[first].wallclock_usec;
+				range.end_wallclock_usec = entries[last].wallclock_usec;
+				range.exact = true;
+			}
+		}
+
+		result.push_back(range);
+	}
+
+	return result;
+}
+
+bool RecordingCatalog::find_segment(const std::string& name, RecordingSegment& segment) const
+{
+	std::lock_guard<std::mutex> lock(catalog_mutex);
+	auto iter = find_segment_position(name);
+	if (iter == segments.end())
+	{
+		return false;
+	}
+
+	segment = *iter;
+	return true;
+}
+
+size_t RecordingCatalog::get_segment_count() const
+{
+	std::lock_guard<std::mutex> lock(catalog_mutex);
+	return segments.size();
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <set>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstdio>
+#include <cstdint>
+#include <spdlog/spdlog.h>
+#include "SegmentIndex.h"
+
+// Catalog of finished recordings, stored as "catalog.bin" in the recording directory.
+// Layout (native byte order):
+//   RecordingCatalogFileHeader
+//   RecordingCatalogRecord for every finished segment or removal, appended in the order they happen
+// A torn record at the end of the file is detected by its checksum and dropped.
+
+static const uint32_t recording_segment_event = 0x1;
+static const uint32_t recording_segment_indexed = 0x2;
+static const uint32_t recording_segment_incomplete = 0x4;
+static const uint32_t recording_segment_removed = 0x8;
+// The file was moved to the secondary storage tier
+static const uint32_t recording_segment_secondary = 0x10;
+
+struct RecordingCatalogFileHeader
+{
+	char magic[4];
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t record_size;
+	uint32_t reserved2;
+};
+
+struct RecordingCatalogRecord
+{
+	int64_t start_wallclock_usec;
+	int64_t end_wallclock_usec;
+	uint64_t start_pts_ns;
+	uint64_t end_pts_ns;
+	uint64_t size;
+	uint32_t flags;
+	uint32_t checksum;
+	// File name inside the directory of its tier, zero terminated
+	char name[80];
+};
+
+static_assert(sizeof(RecordingCatalogFileHeader) == 16, "RecordingCatalogFileHeader layout changed");
+static_assert(sizeof(RecordingCatalogRecord) == 128, "RecordingCatalogRecord layout changed");
+
+struct RecordingCatalogConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	std::string recording_path;
+	// Directory of the secondary tier, empty without tiering
+	std::string secondary_path;
+	std::vector<std::string> recording_extensions = { "mp4" };
+};
+
+struct RecordingSegment
+{
+	std::string name;
+	std::string path;
+	int64_t start_wallclock_usec = 0;
+	int64_t end_wallclock_usec = 0;
+	uint64_t start_pts_ns = 0;
+	uint64_t end_pts_ns = 0;
+	uint64_t size = 0;
+	uint32_t flags = 0;
+};
+
+struct RecordingRange
+{
+	RecordingSegment segment;
+	// Bytes of the file that hold the requested time, starting at a keyframe
+	uint64_t offset = 0;
+	uint64_t length = 0;
+	int64_t start_wallclock_usec = 0;
+	int64_t end_wallclock_usec = 0;
+	// False when the sidecar was unusable and the range is the whole file
+	bool exact = false;
+};
+
+// Wall-clock index of the recording directory. Segments are kept sorted by start time,
+// so a time range is found with a binary search no matter how many segments there are.
+class RecordingCatalog
+{
+public:
+	static const std::string catalog_file_name;
+	static const char magic[4];
+	static const uint16_t version;
+
+private:
+	RecordingCatalogConfig config;
+
+	mutable std::mutex catalog_mutex;
+	FILE* file = nullptr;
+	std::vector<RecordingSegment> segments;
+	// Start time of every segment by name, updates by name find it with a binary search
+	std::unordered_map<std::string, int64_t> segment_starts;
+	int64_t max_segment_duration_usec = 0;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	std::string get_catalog_path() const;
+	std::string get_tier_path(uint32_t flags) const;
+	bool load(std::vector<RecordingCatalogRecord>& records, bool& changed);
+	size_t backfill(std::vector<RecordingCatalogRecord>& records);
+	size_t backfill_tier(std::vector<RecordingCatalogRecord>& records, std::set<std::string>& known_names, uint32_t tier_flags);
+	bool rewrite(const std::vector<RecordingCatalogRecord>& records);
+	bool append(RecordingCatalogRecord& record);
+	RecordingSegment make_segment(const RecordingCatalogRecord& record) const;
+	void insert_segment(const RecordingCatalogRecord& record);
+	std::vector<RecordingSegment>::const_iterator find_segment_position(const std::string& name) const;
+	std::vector<RecordingSegment>::iterator find_segment_position(const std::string& name);
+
+	static uint32_t get_checksum(const RecordingCatalogRecord& record);
+	static bool make_record(const std::string& name, const SegmentIndexHeader& index_header, uint64_t size, uint32_t flags, RecordingCatalogRecord& record);
+
+public:
+	RecordingCatalog& operator=(const RecordingCatalog&) = delete;
+	RecordingCatalog(const RecordingCatalog& copy) = delete;
+	RecordingCatalog() = delete;
+
+	RecordingCatalog(const RecordingCatalogConfig& config);
+	~RecordingCatalog();
+
+	// Loads the catalog, forgets deleted files and picks up indexed recordings it does not know yet
+	bool open();
+	void close();
+
+	bool add_segment(const std::string& path, const SegmentIndexHeader& index_header, uint32_t flags);
+	bool remove_segment(const std::string& path);
+	// Records that the file of a segment now lives in the other tier, path is its new location
+	bool move_segment(const std::string& path, bool secondary);
+
+	// Segments overlapping [from_usec, to_usec], ordered by start time
+	std::vector<RecordingSegment> find_segments(int64_t from_usec, int64_t to_usec) const;
+
+	// Same as find_segments, narrowed down to byte ranges with the segment sidecars
+	std::vector<RecordingRange> query(int64_t from_usec, int64_t to_usec) const;
+
+	// Only cataloged names resolve, which keeps request parameters inside the recording directory
+	bool find_segment(const std::string& name, RecordingSegment& segment) const;
+
+	size_t get_segment_count() const;
+};
@@ -0,0 +1,147 @@
+#include "RecordingReader.h"
+#include <algorithm>
+#ifdef CM_UNIX
+#include <pthread.h>
+#endif
+
+RecordingReader::RecordingReader(const RecordingReaderConfig& config)
+{
+	this->config = config;
+}
+
+RecordingReader::~RecordingReader()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> RecordingReader::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool RecordingReader::start()
+{
+	if (is_running)
+	{
+		logger()->warn("Recording reader is already running!");
+		return true;
+	}
+
+	is_running = true;
+	worker = std::thread([this]() { worker_loop(); });
+#ifdef CM_UNIX
+	pthread_setname_np(worker.native_handle(), "pitv-reader");
+#endif
+	return true;
+}
+
+void RecordingReader::stop()
+{
+	if (!is_running && !worker.joinable())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(job_mutex);
+		is_running = false;
+		queue.clear();
+		jobs.clear();
+	}
+	job_cv.notify_all();
+	if (worker.joinable())
+	{
+		worker.join();
+	}
+}
+
+void RecordingReader::worker_loop()
+{
+	while (true)
+	{
+		QueuedJob queued_job;
+		{
+			std::unique_lock<std::mutex> lock(job_mutex);
+			job_cv.wait(lock, [this]() { return !is_running || !queue.empty(); });
+			if (!is_running)
+			{
+				return;
+			}
+			queued_job = std::move(queue.front());
+			queue.pop_front();
+		}
+
+		auto data = std::make_shared<std::vector<uint8_t>>();
+		bool ok = queued_job.job(*data);
+		// Whatever the job holds (an exporter, the catalog) is released outside the lock
+		queued_job.job = nullptr;
+
+		std::lock_guard<std::mutex> lock(job_mutex);
+		auto iter = jobs.find(queued_job.id);
+		if (iter != jobs.end() && iter->second.sequence == queued_job.sequence)
+		{
+			iter->second.done = true;
+			iter->second.ok = ok;
+			iter->second.data = data;
+		}
+	}
+}
+
+bool RecordingReader::submit(unsigned long id, Job job)
+{
+	{
+		std::lock_guard<std::mutex> lock(job_mutex);
+		if (!is_running || jobs.count(id) || queue.size() >= config.max_queued_jobs)
+		{
+			return false;
+		}
+
+		JobState& state = jobs[id];
+		state.sequence = next_sequence++;
+
+		QueuedJob queued_job;
+		queued_job.id = id;
+		queued_job.sequence = state.sequence;
+		queued_job.job = std::move(job);
+		queue.push_back(std::move(queued_job));
+	}
+	job_cv.notify_one();
+	return true;
+}
+
+bool RecordingReader::take_result(unsigned long id, bool& ok, std::shared_ptr<std::vector<uint8_t>>& data)
+{
+	std::lock_guard<std::mutex> lock(job_mutex);
+	auto iter = jobs.find(id);
+	if (iter == jobs.end() || !iter->second.done)
+	{
+		return false;
+	}
+
+	ok = iter->second.ok;
+	data = iter->second.data;
+	jobs.erase(iter);
+	return true;
+}
+
+bool RecordingReader::is_pending(unsigned long id) const
+{
+	std::lock_guard<std::mutex> lock(job_mutex);
+	auto iter = jobs.find(id);
+	return iter != jobs.end() && !iter->second.done;
+}
+
+void RecordingReader::cancel(unsigned long id)
+{
+	Job dropped_job;
+	{
+		std::lock_guard<std::mutex> lock(job_mutex);
+		jobs.erase(id);
+		auto iter = std::find_if(queue.begin(), queue.end(), [id](const QueuedJob& queued_job) { return queued_job.id == id; });
+		if (iter != queue.end())
+		{
+			dropped_job = std::move(iter->job);
+			queue.erase(iter);
+		}
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+#include <spdlog/spdlog.h>
+
+struct RecordingReaderConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	// Jobs waiting for the worker, more are refused
+	size_t max_queued_jobs = 16;
+};
+
+// Runs the disk reads of recording requests (clip exports, VOD playlists and segments) on a worker
+// thread, so a slow card delays only the request that waits for it and not the HTTP poll loop.
+// Jobs are keyed by connection id, one at a time per connection; the poll loop collects the result
+// once the job ran.
+class RecordingReader
+{
+public:
+	// Fills data, the result is false on failure or at the end of a stream
+	typedef std::function<bool(std::vector<uint8_t>& data)> Job;
+
+private:
+	struct JobState
+	{
+		uint64_t sequence = 0;
+		bool done = false;
+		bool ok = false;
+		std::shared_ptr<std::vector<uint8_t>> data;
+	};
+
+	struct QueuedJob
+	{
+		unsigned long id = 0;
+		uint64_t sequence = 0;
+		Job job;
+	};
+
+	RecordingReaderConfig config;
+
+	std::thread worker;
+	std::atomic<bool> is_running = false;
+	mutable std::mutex job_mutex;
+	std::condition_variable job_cv;
+	std::deque<QueuedJob> queue;
+	std::map<unsigned long, JobState> jobs;
+	uint64_t next_sequence = 1;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	void worker_loop();
+
+public:
+	RecordingReader& operator=(const RecordingReader&) = delete;
+	RecordingReader(const RecordingReader& copy) = delete;
+	RecordingReader() = delete;
+
+	RecordingReader(const RecordingReaderConfig& config);
+	~RecordingReader();
+
+	bool start();
+	void stop();
+
+	// Queues job for connection id, false when the connection has a job already or the queue is full
+	bool submit(unsigned long id, Job job);
+
+	// True once the job of connection id ran, with its result
+	bool take_result(unsigned long id, bool& ok, std::shared_ptr<std::vector<uint8_t>>& data);
+
+	// True while the job of connection id waits or runs
+	bool is_pending(unsigned long id) const;
+
+	// Forgets the job of connection id, a running one finishes and its result is dropped
+	void cancel(unsigned long id);
+};
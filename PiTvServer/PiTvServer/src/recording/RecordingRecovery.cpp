@@ -0,0 +1,608 @@
+#include "RecordingRecovery.h"
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../video/Fmp4Writer.h"
+#include "SegmentStaging.h"
+#ifdef CM_UNIX
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+// NAL units larger than this are taken for garbage left by a torn write
+static const uint32_t max_nal_size = 16 * 1024 * 1024;
+static const uint64_t mpeg_ts_packet_size = 188;
+
+struct Mp4Layout
+{
+	bool has_moov = false;
+	bool has_moof = false;
+	bool has_mdat = false;
+	uint64_t media_offset = 0;
+	uint64_t media_header_size = 0;
+};
+
+static uint64_t read_be(const uint8_t* data, int size)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < size; i++)
+	{
+		value = (value << 8) | data[i];
+	}
+	return value;
+}
+
+static void write_be(uint8_t* data, uint64_t value, int size)
+{
+	for (int i = size - 1; i >= 0; i--)
+	{
+		data[i] = static_cast<uint8_t>(value & 0xFF);
+		value >>= 8;
+	}
+}
+
+static void scan_top_level_boxes(FILE* file, uint64_t file_size, Mp4Layout& layout)
+{
+	uint64_t box_start = 0;
+	uint8_t box_header[16];
+	while (box_start + 8 <= file_size && fseeko(file, static_cast<off_t>(box_start), SEEK_SET) == 0 && fread(box_header, 1, 8, file) == 8)
+	{
+		uint64_t box_size = read_be(box_header, 4);
+		uint64_t header_size = 8;
+		if (box_size == 1)
+		{
+			if (fread(box_header + 8, 1, 8, file) != 8)
+			{
+				break;
+			}
+			box_size = read_be(box_header + 8, 8);
+			header_size = 16;
+		}
+
+		if (memcmp(box_header + 4, "moov", 4) == 0)
+		{
+			layout.has_moov = true;
+		}
+		else if (memcmp(box_header + 4, "moof", 4) == 0)
+		{
+			layout.has_moof = true;
+		}
+		else if (memcmp(box_header + 4, "mdat", 4) == 0 && !layout.has_mdat)
+		{
+			layout.has_mdat = true;
+			layout.media_offset = box_start + header_size;
+			layout.media_header_size = header_size;
+		}
+
+		// An interrupted mdat keeps the size placeholder written when it was opened
+		if (box_size < header_size)
+		{
+			break;
+		}
+		box_start += box_size;
+	}
+}
+
+RecordingRecovery::RecordingRecovery(const RecordingRecoveryConfig& config, std::shared_ptr<RecordingCatalog> catalog)
+{
+	this->config = config;
+	this->catalog = catalog;
+}
+
+RecordingRecovery::~RecordingRecovery()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> RecordingRecovery::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool RecordingRecovery::start()
+{
+	if (is_running)
+	{
+		logger()->warn("Recording recovery is already running!");
+		return true;
+	}
+
+	if (config.video_fps_numerator <= 0 || config.video_fps_denominator <= 0)
+	{
+		logger()->error("Cannot start recording recovery: invalid framerate {}/{}", config.video_fps_numerator, config.video_fps_denominator);
+		return false;
+	}
+
+	started_at = std::filesystem::file_time_type::clock::now();
+	is_running = true;
+	worker = std::thread([this]()
+		{
+			worker_loop();
+			is_finished = true;
+		});
+#ifdef CM_UNIX
+	pthread_setname_np(worker.native_handle(), "pitv-recovery");
+#endif
+	return true;
+}
+
+void RecordingRecovery::stop()
+{
+	if (!is_running && !worker.joinable())
+	{
+		return;
+	}
+
+	is_running = false;
+	if (worker.joinable())
+	{
+		worker.join();
+	}
+}
+
+bool RecordingRecovery::is_done() const
+{
+	return is_finished;
+}
+
+void RecordingRecovery::worker_loop()
+{
+#ifdef __linux__
+	// Recovery must not take CPU or disk bandwidth from the live pipeline.
+	// Both calls act on the calling thread only: IOPRIO_WHO_PROCESS with id 0, IOPRIO_CLASS_IDLE.
+	setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+	syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+
+	std::vector<std::filesystem::path> candidates;
+	std::error_code iterate_error;
+	for (const auto& dir_entry : std::filesystem::directory_iterator(config.recording_path, iterate_error))
+	{
+		const std::filesystem::path& path = dir_entry.path();
+		bool is_recording = std::any_of(config.recording_extensions.begin(), config.recording_extensions.end(),
+			[&path](const std::string& extension) { return path.extension() == "." + extension; });
+
+		std::error_code time_error;
+		if (!is_recording || !dir_entry.is_regular_file() || dir_entry.last_write_time(time_error) >= started_at || time_error)
+		{
+			continue;
+		}
+		candidates.push_back(path);
+	}
+	if (iterate_error)
+	{
+		logger()->error("Recording recovery failed to list {}: {}", config.recording_path, iterate_error.message());
+		return;
+	}
+
+	if (!config.staging_path.empty())
+	{
+		// What a crashed run left in RAM goes back into its segments before they are repaired
+		SegmentStaging::salvage(config.logger_ptr, config.staging_path, config.recording_path, config.recording_extensions, started_at);
+	}
+
+	size_t repaired = 0;
+	size_t removed = 0;
+	size_t failed = 0;
+	for (const auto& path : candidates)
+	{
+		if (!is_running)
+		{
+			logger()->info("Recording recovery interrupted");
+			return;
+		}
+
+		switch (recover_file(path))
+		{
+		case RecordingRecoveryResult::Repaired:
+			repaired++;
+			break;
+		case RecordingRecoveryResult::Removed:
+			removed++;
+			break;
+		case RecordingRecoveryResult::Failed:
+			failed++;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (repaired + removed + failed > 0)
+	{
+		logger()->info("Recording recovery checked {} files: {} repaired, {} removed, {} failed", candidates.size(), repaired, removed, failed);
+	}
+}
+
+void RecordingRecovery::remove_recording(const std::filesystem::path& path)
+{
+	std::error_code remove_error;
+	std::filesystem::remove(path, remove_error);
+	std::filesystem::remove(SegmentIndex::get_index_path(path.string()), remove_error);
+	if (catalog)
+	{
+		catalog->remove_segment(path.string());
+	}
+}
+
+bool RecordingRecovery::release_reserved_space(const std::filesystem::path& path)
+{
+	int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		logger()->error("Recording recovery failed to open {}: {}", path.string(), strerror(errno));
+		return false;
+	}
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0)
+	{
+		logger()->error("Recording recovery failed to stat {}: {}", path.string(), strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	// The sink reserves blocks past the end of a segment and gives them back only when it closes it.
+	// The file size still tells what was written, for MPEG-TS a packet cut short is dropped as well.
+	uint64_t size = static_cast<uint64_t>(file_stat.st_size);
+	uint64_t end = path.extension() == ".ts" ? size - size % mpeg_ts_packet_size : size;
+	uint64_t block_size = file_stat.st_blksize > 0 ? static_cast<uint64_t>(file_stat.st_blksize) : 4096;
+	uint64_t allocated = static_cast<uint64_t>(file_stat.st_blocks) * 512;
+	bool ok = true;
+	if (end < size || allocated > (size + block_size - 1) / block_size * block_size)
+	{
+		ok = ftruncate(fd, static_cast<off_t>(end)) == 0;
+		if (ok)
+		{
+			logger()->info("Released {} reserved bytes of interrupted recording {}", allocated > end ? allocated - end : 0, path.string());
+		}
+		else
+		{
+			logger()->error("Recording recovery failed to truncate {}: {}", path.string(), strerror(errno));
+		}
+	}
+	close(fd);
+	return ok;
+}
+
+RecordingRecoveryResult RecordingRecovery::recover_file(const std::filesystem::path& path)
+{
+	// Intact or not, a segment left open by a crash still holds its preallocation
+	release_reserved_space(path);
+
+	std::string index_path = SegmentIndex::get_index_path(path.string());
+	SegmentIndexHeader index_header = {};
+	std::vector<SegmentIndexEntry> entries;
+	bool has_index = SegmentIndex::read(index_path, index_header, entries);
+	if (has_index && (index_header.flags & segment_index_complete))
+	{
+		return RecordingRecoveryResult::Intact;
+	}
+
+	// MPEG-TS stays playable when cut short and keeps no byte offsets to fix
+	if (path.extension() != ".mp4")
+	{
+		return RecordingRecoveryResult::Intact;
+	}
+
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+	{
+		logger()->error("Recording recovery failed to open {}: {}", path.string(), strerror(errno));
+		return RecordingRecoveryResult::Failed;
+	}
+	fseeko(file, 0, SEEK_END);
+	uint64_t file_size = static_cast<uint64_t>(ftello(file));
+	Mp4Layout layout;
+	scan_top_level_boxes(file, file_size, layout);
+	fclose(file);
+
+	if (layout.has_moof)
+	{
+		entries.clear();
+		if (!has_index || !SegmentIndex::resolve_fragmented_offsets(path.string())
+			|| !SegmentIndex::read(index_path, index_header, entries))
+		{
+			// Fragmented files play as they are, they only stay out of time range queries
+			logger()->warn("Index of interrupted recording {} is unusable", path.string());
+			return RecordingRecoveryResult::Failed;
+		}
+
+		if (catalog)
+		{
+			catalog->add_segment(path.string(), index_header, recording_segment_incomplete);
+		}
+		logger()->info("Recovered fragmented recording {}: {} frames", path.string(), entries.size());
+		return RecordingRecoveryResult::Repaired;
+	}
+
+	if (layout.has_moov)
+	{
+		return RecordingRecoveryResult::Intact;
+	}
+
+	if (!layout.has_mdat)
+	{
+		logger()->info("Interrupted recording {} holds no media, removing it", path.string());
+		remove_recording(path);
+		return RecordingRecoveryResult::Removed;
+	}
+
+	return recover_progressive(path, layout.media_offset, layout.media_header_size, entries);
+}
+
+RecordingRecoveryResult RecordingRecovery::recover_progressive(const std::filesystem::path& path, uint64_t media_offset, uint64_t media_header_size, std::vector<SegmentIndexEntry>& entries)
+{
+	FILE* file = fopen(path.c_str(), "r+b");
+	if (!file)
+	{
+		logger()->error("Recording recovery failed to open {}: {}", path.string(), strerror(errno));
+		return RecordingRecoveryResult::Failed;
+	}
+	fseeko(file, 0, SEEK_END);
+	uint64_t file_size = static_cast<uint64_t>(ftello(file));
+
+	// The sidecar covers everything up to the last keyframe it flushed, as long as it agrees with the file
+	uint64_t media_size = 0;
+	size_t indexed_count = 0;
+	for (; indexed_count < entries.size(); indexed_count++)
+	{
+		const SegmentIndexEntry& entry = entries[indexed_count];
+		if (entry.offset != media_size || media_offset + media_size + entry.size > file_size)
+		{
+			break;
+		}
+		media_size += entry.size;
+	}
+	entries.resize(indexed_count);
+
+	std::vector<SegmentIndexEntry> units;
+	if (!scan_access_units(file, media_offset + media_size, file_size, media_size, units))
+	{
+		fclose(file);
+		return RecordingRecoveryResult::Failed;
+	}
+	size_t scanned_count = units.size();
+
+	// Frames found by the scan get timestamps at the frame rate of the indexed ones
+	uint64_t frame_ns = 1000000000ULL * static_cast<uint64_t>(config.video_fps_denominator) / static_cast<uint64_t>(config.video_fps_numerator);
+	if (entries.size() >= 2)
+	{
+		int64_t delta_ns = static_cast<int64_t>(entries.back().pts_ns - entries[entries.size() - 2].pts_ns);
+		if (delta_ns > 0 && delta_ns < 10000000000LL)
+		{
+			frame_ns = static_cast<uint64_t>(delta_ns);
+		}
+	}
+
+	if (entries.empty() && !units.empty())
+	{
+		// Nothing was indexed, the last write to the file dates the last frame
+		struct stat file_stat;
+		int64_t end_usec = 0;
+		if (fstat(fileno(file), &file_stat) == 0)
+		{
+			end_usec = static_cast<int64_t>(file_stat.st_mtim.tv_sec) * 1000000 + file_stat.st_mtim.tv_nsec / 1000;
+		}
+		units.front().pts_ns = 0;
+		units.front().wallclock_usec = end_usec - static_cast<int64_t>((units.size() - 1) * frame_ns / 1000);
+		entries.push_back(units.front());
+		units.erase(units.begin());
+	}
+	for (auto& unit : units)
+	{
+		unit.pts_ns = entries.back().pts_ns + frame_ns;
+		unit.wallclock_usec = entries.back().wallclock_usec + static_cast<int64_t>(frame_ns / 1000);
+		entries.push_back(unit);
+	}
+
+	if (std::none_of(entries.begin(), entries.end(), [](const SegmentIndexEntry& entry) { return entry.flags & segment_index_entry_keyframe; }))
+	{
+		fclose(file);
+		logger()->info("Interrupted recording {} holds no decodable frames, removing it", path.string());
+		remove_recording(path);
+		return RecordingRecoveryResult::Removed;
+	}
+
+	std::vector<uint8_t> avcc;
+	int width = config.video_width;
+	int height = config.video_height;
+	if (!find_video_config(file, media_offset, entries, avcc, width, height))
+	{
+		fclose(file);
+		logger()->error("Cannot recover {}: no H.264 parameter sets found", path.string());
+		return RecordingRecoveryResult::Failed;
+	}
+
+	media_size = entries.back().offset + entries.back().size;
+	uint64_t media_end = media_offset + media_size;
+	uint8_t size_field[8];
+	bool ok = fflush(file) == 0 && ftruncate(fileno(file), static_cast<off_t>(media_end)) == 0;
+	if (ok && media_header_size == 16)
+	{
+		write_be(size_field, media_size + 16, 8);
+		ok = fseeko(file, static_cast<off_t>(media_offset - 8), SEEK_SET) == 0 && fwrite(size_field, 1, 8, file) == 8;
+	}
+	else if (ok && media_size + 8 <= UINT32_MAX)
+	{
+		write_be(size_field, media_size + 8, 4);
+		ok = fseeko(file, static_cast<off_t>(media_offset - 8), SEEK_SET) == 0 && fwrite(size_field, 1, 4, file) == 4;
+	}
+	else
+	{
+		ok = false;
+	}
+
+	std::vector<Fmp4Sample> samples(entries.size());
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		uint64_t duration_ns = i + 1 < entries.size() && entries[i + 1].pts_ns > entries[i].pts_ns ? entries[i + 1].pts_ns - entries[i].pts_ns : frame_ns;
+		samples[i].duration = static_cast<uint32_t>(duration_ns * Fmp4Writer::video_timescale / 1000000000);
+		samples[i].size = entries[i].size;
+		samples[i].keyframe = entries[i].flags & segment_index_entry_keyframe;
+	}
+
+	std::vector<uint8_t> moov = Fmp4Writer::make_progressive_movie(avcc, width, height, samples, media_offset);
+	ok = ok && fseeko(file, static_cast<off_t>(media_end), SEEK_SET) == 0
+		&& fwrite(moov.data(), 1, moov.size(), file) == moov.size()
+		&& fflush(file) == 0 && fsync(fileno(file)) == 0;
+	ok = fclose(file) == 0 && ok;
+	if (!ok)
+	{
+		logger()->error("Failed to rewrite interrupted recording {}: {}", path.string(), strerror(errno));
+		return RecordingRecoveryResult::Failed;
+	}
+
+	SegmentIndexWriter index_writer(config.logger_ptr);
+	if (index_writer.open(SegmentIndex::get_index_path(path.string()), false))
+	{
+		for (const auto& entry : entries)
+		{
+			index_writer.append(entry.pts_ns, entry.wallclock_usec, entry.offset, entry.size, entry.flags & segment_index_entry_keyframe);
+		}
+		if (index_writer.close(true, media_offset) && catalog)
+		{
+			catalog->add_segment(path.string(), index_writer.get_header(), recording_segment_incomplete);
+		}
+	}
+
+	logger()->info("Recovered recording {}: {} frames ({} found past the index), {} bytes cut off",
+		path.string(), entries.size(), scanned_count, file_size - media_end);
+	return RecordingRecoveryResult::Repaired;
+}
+
+bool RecordingRecovery::scan_access_units(FILE* file, uint64_t begin, uint64_t end, uint64_t relative_base, std::vector<SegmentIndexEntry>& units)
+{
+	// mp4mux stores access units as 4-byte length prefixed NAL units. A new access unit starts with an
+	// AUD, SEI or parameter set after a slice, or with a slice whose first_mb_in_slice is 0 (ue(v) "1").
+	SegmentIndexEntry unit = {};
+	bool unit_open = false;
+	bool unit_has_slice = false;
+	uint64_t nal_count = 0;
+	uint64_t position = begin;
+	uint8_t nal_header[6];
+	while (position + 5 <= end)
+	{
+		if ((++nal_count & 0x3FF) == 0 && !is_running)
+		{
+			return false;
+		}
+
+		if (fseeko(file, static_cast<off_t>(position), SEEK_SET) != 0 || fread(nal_header, 1, 6, file) < 5)
+		{
+			break;
+		}
+		uint32_t nal_size = static_cast<uint32_t>(read_be(nal_header, 4));
+		if (nal_size == 0 || nal_size > max_nal_size || position + 4 + nal_size > end || (nal_header[4] & 0x80))
+		{
+			break;
+		}
+
+		int nal_type = nal_header[4] & 0x1F;
+		bool slice = nal_type == 1 || nal_type == 5;
+		bool first_slice = slice && nal_size >= 2 && (nal_header[5] & 0x80);
+		bool starts_unit = nal_type == 6 || nal_type == 7 || nal_type == 8 || nal_type == 9 || first_slice;
+		if (unit_open && unit_has_slice && starts_unit)
+		{
+			units.push_back(unit);
+			unit_open = false;
+		}
+
+		if (!unit_open)
+		{
+			unit = {};
+			unit.offset = position - begin + relative_base;
+			unit_open = true;
+			unit_has_slice = false;
+		}
+		unit.size += 4 + nal_size;
+		unit_has_slice = unit_has_slice || slice;
+		if (nal_type == 5)
+		{
+			unit.flags |= segment_index_entry_keyframe;
+		}
+		position += 4 + nal_size;
+	}
+
+	if (unit_open && unit_has_slice)
+	{
+		units.push_back(unit);
+	}
+	return true;
+}
+
+bool RecordingRecovery::find_video_config(FILE* file, uint64_t media_offset, const std::vector<SegmentIndexEntry>& entries, std::vector<uint8_t>& avcc, int& width, int& height)
+{
+	// h264parse repeats SPS and PPS in front of keyframes
+	std::vector<uint8_t> data;
+	for (const auto& entry : entries)
+	{
+		if (!(entry.flags & segment_index_entry_keyframe))
+		{
+			continue;
+		}
+
+		data.resize(entry.size);
+		if (fseeko(file, static_cast<off_t>(media_offset + entry.offset), SEEK_SET) != 0 || fread(data.data(), 1, data.size(), file) != data.size())
+		{
+			continue;
+		}
+
+		std::vector<uint8_t> sps;
+		std::vector<uint8_t> pps;
+		for (size_t position = 0; position + 4 < data.size();)
+		{
+			size_t nal_size = static_cast<size_t>(read_be(data.data() + position, 4));
+			if (nal_size == 0 || nal_size > data.size() - position - 4)
+			{
+				break;
+			}
+
+			const uint8_t* nal = data.data() + position + 4;
+			int nal_type = nal[0] & 0x1F;
+			if (nal_type == 7 && sps.empty() && nal_size >= 4)
+			{
+				sps.assign(nal, nal + nal_size);
+			}
+			else if (nal_type == 8 && pps.empty())
+			{
+				pps.assign(nal, nal + nal_size);
+			}
+			position += 4 + nal_size;
+		}
+
+		if (sps.empty() || pps.empty() || sps.size() > 0xFFFF || pps.size() > 0xFFFF)
+		{
+			continue;
+		}
+
+		avcc = { 1, sps[1], sps[2], sps[3], 0xFF, 0xE1 };
+		avcc.push_back(static_cast<uint8_t>(sps.size() >> 8));
+		avcc.push_back(static_cast<uint8_t>(sps.size() & 0xFF));
+		avcc.insert(avcc.end(), sps.begin(), sps.end());
+		avcc.push_back(1);
+		avcc.push_back(static_cast<uint8_t>(pps.size() >> 8));
+		avcc.push_back(static_cast<uint8_t>(pps.size() & 0xFF));
+		avcc.insert(avcc.end(), pps.begin(), pps.end());
+		return true;
+	}
+
+	// Segments recorded before parameter sets were repeated: borrow them from an intact neighbour
+	std::error_code iterate_error;
+	for (const auto& dir_entry : std::filesystem::directory_iterator(config.recording_path, iterate_error))
+	{
+		if (dir_entry.path().extension() == ".mp4"
+			&& SegmentIndex::find_mp4_video_config(dir_entry.path().string(), avcc, width, height))
+		{
+			logger()->warn("Recovery borrows the stream configuration of {}", dir_entry.path().string());
+			return true;
+		}
+	}
+	return false;
+}
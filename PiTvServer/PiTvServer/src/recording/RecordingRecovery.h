@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <filesystem>
+#include <spdlog/spdlog.h>
+#include "RecordingCatalog.h"
+#include "SegmentIndex.h"
+
+struct RecordingRecoveryConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	std::string recording_path;
+	std::vector<std::string> recording_extensions = { "mp4" };
+	// Staging directory whose leftovers go back into their segments before they are repaired, may be empty
+	std::string staging_path;
+	// Nominal values for frames that only the elementary stream knows about
+	int video_width = 640;
+	int video_height = 640;
+	int video_fps_numerator = 20;
+	int video_fps_denominator = 1;
+};
+
+enum class RecordingRecoveryResult
+{
+	Intact,
+	Repaired,
+	Removed,
+	Failed
+};
+
+// Repairs recordings left behind by an unclean shutdown, on an idle-priority thread so the
+// pipeline starts right away. Plain MP4 segments without moov get their tail scanned as an
+// H.264 elementary stream, the torn end cut off and a moov appended; fragmented segments get
+// their index mapped onto the fragments that made it to disk. Results go to the catalog.
+class RecordingRecovery
+{
+private:
+	RecordingRecoveryConfig config;
+	std::shared_ptr<RecordingCatalog> catalog;
+
+	std::thread worker;
+	std::atomic<bool> is_running = false;
+	std::atomic<bool> is_finished = false;
+	std::filesystem::file_time_type started_at;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	void worker_loop();
+	RecordingRecoveryResult recover_file(const std::filesystem::path& path);
+	bool release_reserved_space(const std::filesystem::path& path);
+	RecordingRecoveryResult recover_progressive(const std::filesystem::path& path, uint64_t media_offset, uint64_t media_header_size, std::vector<SegmentIndexEntry>& entries);
+	bool scan_access_units(FILE* file, uint64_t begin, uint64_t end, uint64_t relative_base, std::vector<SegmentIndexEntry>& units);
+	bool find_video_config(FILE* file, uint64_t media_offset, const std::vector<SegmentIndexEntry>& entries, std::vector<uint8_t>& avcc, int& width, int& height);
+	void remove_recording(const std::filesystem::path& path);
+
+public:
+	RecordingRecovery& operator=(const RecordingRecovery&) = delete;
+	RecordingRecovery(const RecordingRecovery& copy) = delete;
+	RecordingRecovery() = delete;
+
+	RecordingRecovery(const RecordingRecoveryConfig& config, std::shared_ptr<RecordingCatalog> catalog);
+	~RecordingRecovery();
+
+	// Only files last written before start() are looked at, new segments are never touched
+	bool start();
+	void stop();
+
+	// True once every file of the previous run was looked at, or recovery was stopped
+	bool is_done() const;
+};
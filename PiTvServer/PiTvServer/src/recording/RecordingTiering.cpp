@@ -0,0 +1,460 @@
+#include "RecordingTiering.h"
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "SegmentIndex.h"
+#ifdef CM_UNIX
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+const std::string RecordingTiering::temp_extension = "tiering";
+
+static const size_t copy_chunk_size = 1024 * 1024;
+
+RecordingTiering::RecordingTiering(const RecordingTieringConfig& config, std::shared_ptr<RecordingCatalog> catalog)
+{
+	this->config = config;
+	this->catalog = catalog;
+}
+
+RecordingTiering::~RecordingTiering()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> RecordingTiering::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool RecordingTiering::start()
+{
+	if (is_running)
+	{
+		logger()->warn("Recording tiering is already running!");
+		return true;
+	}
+
+	std::error_code error;
+	if (std::filesystem::equivalent(config.recording_path, config.secondary_path, error))
+	{
+		logger()->error("Cannot start recording tiering: {} is the recording directory itself", config.secondary_path);
+		return false;
+	}
+
+	is_running = true;
+	worker = std::thread([this]() { worker_loop(); });
+#ifdef CM_UNIX
+	pthread_setname_np(worker.native_handle(), "pitv-tiering");
+#endif
+	logger()->info("Recordings older than {} h move to {}", config.min_age_hours, config.secondary_path);
+	return true;
+}
+
+void RecordingTiering::stop()
+{
+	if (!is_running && !worker.joinable())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(wait_mutex);
+		is_running = false;
+	}
+	wait_cv.notify_all();
+	if (worker.joinable())
+	{
+		worker.join();
+	}
+}
+
+bool RecordingTiering::wait(std::chrono::milliseconds duration)
+{
+	std::unique_lock<std::mutex> lock(wait_mutex);
+	wait_cv.wait_for(lock, duration, [this]() { return !is_running; });
+	return is_running;
+}
+
+bool RecordingTiering::is_recording_file(const std::filesystem::path& path) const
+{
+	return std::any_of(config.recording_extensions.begin(), config.recording_extensions.end(),
+		[&path](const std::string& extension) { return path.extension() == "." + extension; });
+}
+
+bool RecordingTiering::is_secondary_mounted() const
+{
+	// An unmounted mount point is a directory on the card, filling it would defeat the purpose
+	struct stat recording_stat;
+	struct stat secondary_stat;
+	if (stat(config.recording_path.c_str(), &recording_stat) != 0 || stat(config.secondary_path.c_str(), &secondary_stat) != 0)
+	{
+		return false;
+	}
+	return recording_stat.st_dev != secondary_stat.st_dev;
+}
+
+void RecordingTiering::worker_loop()
+{
+#ifdef __linux__
+	// Tiering must not take CPU or disk bandwidth from the live pipeline.
+	// Both calls act on the calling thread only: IOPRIO_WHO_PROCESS with id 0, IOPRIO_CLASS_IDLE.
+	setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+	syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+
+	bool was_mounted = true;
+	while (is_running)
+	{
+		if (config.ready_handler && !config.ready_handler())
+		{
+			wait(std::chrono::seconds(10));
+			continue;
+		}
+
+		bool is_mounted = is_secondary_mounted();
+		if (is_mounted != was_mounted)
+		{
+			if (is_mounted)
+			{
+				logger()->info("Secondary recording tier {} is available", config.secondary_path);
+			}
+			else
+			{
+				logger()->warn("Secondary recording tier {} is missing or on the same device as the recordings, tiering waits", config.secondary_path);
+			}
+			was_mounted = is_mounted;
+		}
+
+		if (is_mounted)
+		{
+			move_aged_segments();
+			enforce_secondary_retention();
+		}
+		wait(std::chrono::seconds(config.scan_interval_sec));
+	}
+}
+
+void RecordingTiering::move_aged_segments()
+{
+	// Copies cut short by a stop or a crash, only this thread writes them
+	std::error_code temp_error;
+	for (const auto& dir_entry : std::filesystem::directory_iterator(config.secondary_path, temp_error))
+	{
+		if (dir_entry.path().extension() == "." + temp_extension)
+		{
+			std::error_code remove_error;
+			std::filesystem::remove(dir_entry.path(), remove_error);
+		}
+	}
+
+	auto threshold = std::filesystem::file_time_type::clock::now() - std::chrono::hours(config.min_age_hours);
+
+	std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> candidates;
+	std::error_code iterate_error;
+	for (const auto& dir_entry : std::filesystem::directory_iterator(config.recording_path, iterate_error))
+	{
+		std::error_code time_error;
+		auto last_write_time = dir_entry.last_write_time(time_error);
+		if (!is_recording_file(dir_entry.path()) || !dir_entry.is_regular_file() || time_error || last_write_time >= threshold)
+		{
+			continue;
+		}
+		candidates.emplace_back(last_write_time, dir_entry.path());
+	}
+	if (iterate_error)
+	{
+		logger()->error("Recording tiering failed to list {}: {}", config.recording_path, iterate_error.message());
+		return;
+	}
+
+	// Oldest first, the card loses them first when it runs full
+	std::sort(candidates.begin(), candidates.end());
+
+	throttle_started = std::chrono::steady_clock::now();
+	throttle_bytes = 0;
+	for (const auto& candidate : candidates)
+	{
+		if (!is_running)
+		{
+			return;
+		}
+		if (!move_segment(candidate.second) && !is_secondary_mounted())
+		{
+			return;
+		}
+	}
+}
+
+bool RecordingTiering::move_segment(const std::filesystem::path& path)
+{
+	std::filesystem::path target_path = std::filesystem::path(config.secondary_path) / path.filename();
+	std::filesystem::path index_path = SegmentIndex::get_index_path(path.string());
+	std::filesystem::path target_index_path = SegmentIndex::get_index_path(target_path.string());
+
+	// The sidecar goes first, a segment in the secondary tier is never without it
+	uint64_t index_size = 0;
+	uint64_t size = 0;
+	std::error_code error;
+	if (std::filesystem::exists(index_path, error) && !copy_file(index_path, target_index_path, index_size))
+	{
+		return false;
+	}
+	if (!copy_file(path, target_path, size))
+	{
+		std::filesystem::remove(target_index_path, error);
+		return false;
+	}
+
+	if (catalog && !catalog->move_segment(target_path.string(), true))
+	{
+		logger()->debug("Recording {} is not cataloged, it is picked up from its index at the next start", path.filename().string());
+	}
+
+	std::filesystem::remove(path, error);
+	if (error)
+	{
+		logger()->warn("Recording {} was copied to {} but could not be removed: {}", path.string(), config.secondary_path, error.message());
+	}
+	std::filesystem::remove(index_path, error);
+
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		stats.segments_moved++;
+		stats.bytes_moved += size + index_size;
+	}
+	logger()->info("Recording {} moved to {}", path.filename().string(), config.secondary_path);
+	return true;
+}
+
+bool RecordingTiering::throttle(size_t size)
+{
+	if (config.bandwidth_kib <= 0)
+	{
+		return is_running;
+	}
+
+	throttle_bytes += size;
+	auto due = std::chrono::milliseconds(throttle_bytes * 1000 / (static_cast<uint64_t>(config.bandwidth_kib) * 1024));
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - throttle_started);
+	if (due > elapsed)
+	{
+		return wait(due - elapsed);
+	}
+	return is_running;
+}
+
+bool RecordingTiering::hash_file(int fd, uint64_t& size, uint64_t& hash)
+{
+	std::vector<uint8_t> buffer(copy_chunk_size);
+	size = 0;
+	hash = 14695981039346656037ull;
+	while (true)
+	{
+		ssize_t ret = pread(fd, buffer.data(), buffer.size(), static_cast<off_t>(size));
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ret < 0)
+		{
+			return false;
+		}
+		if (ret == 0)
+		{
+			return true;
+		}
+
+		// FNV-1a, only meant to catch a copy the secondary storage did not keep
+		for (ssize_t i = 0; i < ret; i++)
+		{
+			hash = (hash ^ buffer[i]) * 1099511628211ull;
+		}
+		size += static_cast<uint64_t>(ret);
+	}
+}
+
+bool RecordingTiering::copy_file(const std::filesystem::path& source_path, const std::filesystem::path& target_path, uint64_t& size)
+{
+	std::filesystem::path temp_path = target_path;
+	temp_path += "." + temp_extension;
+
+	int source_fd = ::open(source_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (source_fd < 0)
+	{
+		logger()->error("Recording tiering failed to open {}: {}", source_path.string(), strerror(errno));
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		stats.copy_failures++;
+		return false;
+	}
+	int target_fd = ::open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (target_fd < 0)
+	{
+		logger()->error("Recording tiering failed to create {}: {}", temp_path.string(), strerror(errno));
+		::close(source_fd);
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		stats.copy_failures++;
+		return false;
+	}
+
+	std::vector<uint8_t> buffer(copy_chunk_size);
+	uint64_t hash = 14695981039346656037ull;
+	size = 0;
+	bool ok = true;
+	while (ok)
+	{
+		ssize_t read = ::read(source_fd, buffer.data(), buffer.size());
+		if (read < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (read <= 0)
+		{
+			ok = read == 0;
+			break;
+		}
+
+		for (ssize_t i = 0; i < read; i++)
+		{
+			hash = (hash ^ buffer[i]) * 1099511628211ull;
+		}
+		ok = write(target_fd, buffer.data(), static_cast<size_t>(read)) == read;
+#ifdef __linux__
+		// The source is removed once copied, it has no business in the page cache
+		posix_fadvise(source_fd, static_cast<off_t>(size), read, POSIX_FADV_DONTNEED);
+#endif
+		size += static_cast<uint64_t>(read);
+		ok = ok && throttle(static_cast<size_t>(read));
+	}
+	ok = ok && fdatasync(target_fd) == 0;
+	if (!ok && is_running)
+	{
+		logger()->error("Recording tiering failed to copy {} to {}: {}", source_path.string(), temp_path.string(), strerror(errno));
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		stats.copy_failures++;
+	}
+
+	// Keeps the recording time, retention of the secondary tier goes by it
+	struct stat source_stat;
+	if (ok && fstat(source_fd, &source_stat) == 0)
+	{
+		struct timespec times[2] = { source_stat.st_atim, source_stat.st_mtim };
+		futimens(target_fd, times);
+	}
+	::close(source_fd);
+
+	if (ok)
+	{
+#ifdef __linux__
+		// Read back from the device, not from what the page cache still holds
+		posix_fadvise(target_fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+		uint64_t copied_size = 0;
+		uint64_t copied_hash = 0;
+		if (!hash_file(target_fd, copied_size, copied_hash) || copied_size != size || copied_hash != hash)
+		{
+			logger()->error("Copy of {} in {} does not match the recording, it is kept on the card", source_path.filename().string(), config.secondary_path);
+			std::lock_guard<std::mutex> lock(stats_mutex);
+			stats.verify_failures++;
+			ok = false;
+		}
+	}
+	if (::close(target_fd) != 0)
+	{
+		ok = false;
+	}
+
+	std::error_code error;
+	if (ok)
+	{
+		std::filesystem::rename(temp_path, target_path, error);
+		if (error)
+		{
+			logger()->error("Recording tiering failed to rename {}: {}", temp_path.string(), error.message());
+			ok = false;
+		}
+	}
+	if (!ok)
+	{
+		std::filesystem::remove(temp_path, error);
+	}
+	return ok;
+}
+
+// A segment and its sidecar index, which is moved and removed together with it
+static uintmax_t get_segment_size(const std::filesystem::path& path, std::error_code& error)
+{
+	uintmax_t size = std::filesystem::file_size(path, error);
+	std::error_code index_error;
+	uintmax_t index_size = std::filesystem::file_size(SegmentIndex::get_index_path(path.string()), index_error);
+	return error ? 0 : size + (index_error ? 0 : index_size);
+}
+
+void RecordingTiering::enforce_secondary_retention()
+{
+	if (config.secondary_max_size_mib <= 0)
+	{
+		return;
+	}
+
+	std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> files;
+	uintmax_t total_size = 0;
+	std::error_code iterate_error;
+	for (const auto& dir_entry : std::filesystem::directory_iterator(config.secondary_path, iterate_error))
+	{
+		std::error_code entry_error;
+		if (!is_recording_file(dir_entry.path()) || !dir_entry.is_regular_file())
+		{
+			continue;
+		}
+		auto last_write_time = dir_entry.last_write_time(entry_error);
+		uintmax_t size = get_segment_size(dir_entry.path(), entry_error);
+		if (entry_error)
+		{
+			continue;
+		}
+		files.emplace_back(last_write_time, dir_entry.path());
+		total_size += size;
+	}
+	std::sort(files.begin(), files.end());
+
+	uintmax_t max_size = static_cast<uintmax_t>(config.secondary_max_size_mib) * 1024 * 1024;
+	for (const auto& file : files)
+	{
+		if (total_size <= max_size)
+		{
+			break;
+		}
+
+		std::error_code error;
+		uintmax_t size = get_segment_size(file.second, error);
+		logger()->info("Secondary recording tier is full, removing the oldest file: {}", file.second.string());
+		if (!std::filesystem::remove(file.second, error))
+		{
+			logger()->error("Failed to remove {}: {}", file.second.string(), error.message());
+			return;
+		}
+		std::filesystem::remove(SegmentIndex::get_index_path(file.second.string()), error);
+		if (catalog)
+		{
+			catalog->remove_segment(file.second.string());
+		}
+		total_size -= std::min(total_size, size);
+
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		stats.segments_expired++;
+	}
+}
+
+RecordingTieringStats RecordingTiering::get_stats() const
+{
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	return stats;
+}
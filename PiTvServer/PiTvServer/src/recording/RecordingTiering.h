@@ -0,0 +1,95 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <filesystem>
+#include <condition_variable>
+#include <spdlog/spdlog.h>
+#include "RecordingCatalog.h"
+
+struct RecordingTieringConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	std::string recording_path;
+	// Secondary tier, a USB disk or a network mount
+	std::string secondary_path;
+	std::vector<std::string> recording_extensions = { "mp4" };
+	// Segments last written this long ago move to the secondary tier
+	int min_age_hours = 24;
+	// KiB/s copied off the card, 0 does not limit it
+	int bandwidth_kib = 4096;
+	// Retention of the secondary tier in MiB, 0 keeps everything
+	int secondary_max_size_mib = 0;
+	int scan_interval_sec = 300;
+	// Nothing moves while this returns false, e.g. while recovery still works on the card
+	std::function<bool()> ready_handler;
+};
+
+struct RecordingTieringStats
+{
+	uint64_t segments_moved = 0;
+	uint64_t bytes_moved = 0;
+	uint64_t copy_failures = 0;
+	uint64_t verify_failures = 0;
+	uint64_t segments_expired = 0;
+};
+
+// Moves aged segments from the card to a secondary directory on an idle-priority thread with a
+// bandwidth limit. A segment is copied with its sidecar under a temporary name, synced, read back
+// and compared against the checksum taken while copying, and only then renamed into place, moved
+// in the catalog and removed from the card. Each tier has its own retention: the card keeps the
+// recording-max-size of the pipeline, the secondary tier drops its oldest segments above its limit.
+class RecordingTiering
+{
+public:
+	static const std::string temp_extension;
+
+private:
+	RecordingTieringConfig config;
+	std::shared_ptr<RecordingCatalog> catalog;
+
+	std::thread worker;
+	std::atomic<bool> is_running = false;
+	std::mutex wait_mutex;
+	std::condition_variable wait_cv;
+
+	mutable std::mutex stats_mutex;
+	RecordingTieringStats stats;
+
+	// Start of the current copy, for the bandwidth limit
+	std::chrono::steady_clock::time_point throttle_started;
+	uint64_t throttle_bytes = 0;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	void worker_loop();
+	bool wait(std::chrono::milliseconds duration);
+	bool is_recording_file(const std::filesystem::path& path) const;
+	bool is_secondary_mounted() const;
+	void move_aged_segments();
+	bool move_segment(const std::filesystem::path& path);
+	bool copy_file(const std::filesystem::path& source_path, const std::filesystem::path& target_path, uint64_t& size);
+	bool hash_file(int fd, uint64_t& size, uint64_t& hash);
+	bool throttle(size_t size);
+	void enforce_secondary_retention();
+
+public:
+	RecordingTiering& operator=(const RecordingTiering&) = delete;
+	RecordingTiering(const RecordingTiering& copy) = delete;
+	RecordingTiering() = delete;
+
+	RecordingTiering(const RecordingTieringConfig& config, std::shared_ptr<RecordingCatalog> catalog);
+	~RecordingTiering();
+
+	bool start();
+	void stop();
+
+	RecordingTieringStats get_stats() const;
+};
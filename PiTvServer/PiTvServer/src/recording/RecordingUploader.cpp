@@ -0,0 +1,617 @@
+#include "RecordingUploader.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "SegmentIndex.h"
+#ifdef CM_UNIX
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+const std::string RecordingUploader::journal_file_name = "upload-queue.txt";
+
+static const int part_attempts = 3;
+// Failed attempts after which a multipart upload is given up and started over
+static const int restart_after_failures = 3;
+
+static void set_idle_priority()
+{
+#ifdef __linux__
+	// Uploads must not take CPU or disk bandwidth from the live pipeline.
+	// Both calls act on the calling thread only: IOPRIO_WHO_PROCESS with id 0, IOPRIO_CLASS_IDLE.
+	setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+	syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+}
+
+static bool read_fully(int fd, uint8_t* data, size_t size, uint64_t offset)
+{
+	while (size > 0)
+	{
+		ssize_t ret = pread(fd, data, size, static_cast<off_t>(offset));
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ret <= 0)
+		{
+			return false;
+		}
+		data += ret;
+		size -= static_cast<size_t>(ret);
+		offset += static_cast<uint64_t>(ret);
+	}
+	return true;
+}
+
+// Splits the first space separated field off a journal line
+static std::string take_field(std::string& rest)
+{
+	size_t space = rest.find(' ');
+	std::string field = rest.substr(0, space);
+	rest = space == std::string::npos ? "" : rest.substr(space + 1);
+	return field;
+}
+
+RecordingUploader::RecordingUploader(const RecordingUploaderConfig& config, std::shared_ptr<RecordingCatalog> catalog)
+{
+	this->config = config;
+	this->catalog = catalog;
+}
+
+RecordingUploader::~RecordingUploader()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> RecordingUploader::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool RecordingUploader::start()
+{
+	if (is_running)
+	{
+		logger()->warn("Recording uploader is already running!");
+		return true;
+	}
+
+	S3ClientConfig client_config = config.s3;
+	client_config.logger_ptr = config.logger_ptr;
+	client_config.throttle_handler = [this](size_t size) { return throttle(size); };
+	client = std::make_shared<S3Client>(client_config);
+	if (!client->start())
+	{
+		client.reset();
+		return false;
+	}
+
+	size_t queued = 0;
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		if (!load_journal())
+		{
+			return false;
+		}
+		queued = queue.size();
+		is_running = true;
+	}
+
+	worker = std::thread([this]() { worker_loop(); });
+#ifdef CM_UNIX
+	pthread_setname_np(worker.native_handle(), "pitv-upload");
+#endif
+	logger()->info("Recordings upload to bucket {} at {}, {} queued", config.s3.bucket, config.s3.endpoint, queued);
+	return true;
+}
+
+void RecordingUploader::stop()
+{
+	if (!is_running && !worker.joinable())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		is_running = false;
+	}
+	queue_cv.notify_all();
+	if (worker.joinable())
+	{
+		worker.join();
+	}
+
+	std::lock_guard<std::mutex> lock(queue_mutex);
+	if (journal)
+	{
+		fclose(journal);
+		journal = nullptr;
+	}
+}
+
+std::string RecordingUploader::get_journal_path() const
+{
+	return (std::filesystem::path(config.recording_path) / journal_file_name).string();
+}
+
+bool RecordingUploader::load_journal()
+{
+	std::ifstream journal_stream(get_journal_path());
+	std::string line;
+	while (std::getline(journal_stream, line))
+	{
+		std::string rest = line;
+		std::string type = take_field(rest);
+		if (type == "Q")
+		{
+			if (!rest.empty() && std::find(queue.begin(), queue.end(), rest) == queue.end())
+			{
+				queue.push_back(rest);
+			}
+		}
+		else if (type == "U")
+		{
+			std::string upload_id = take_field(rest);
+			// Journals of older builds have no part size before the name
+			uint64_t part_size = 0;
+			size_t space = rest.find(' ');
+			if (space != std::string::npos && space > 0 && rest.find_first_not_of("0123456789") == space)
+			{
+				part_size = std::strtoull(take_field(rest).c_str(), nullptr, 10);
+			}
+			uploads[rest] = UploadState{ upload_id, part_size, {} };
+		}
+		else if (type == "P")
+		{
+			int part_number = std::atoi(take_field(rest).c_str());
+			std::string etag = take_field(rest);
+			auto upload = uploads.find(rest);
+			if (upload != uploads.end() && part_number > 0)
+			{
+				upload->second.etags[part_number] = etag;
+			}
+		}
+		else if (type == "R")
+		{
+			uploads.erase(rest);
+		}
+		else if (type == "D")
+		{
+			queue.erase(std::remove(queue.begin(), queue.end(), rest), queue.end());
+			uploads.erase(rest);
+		}
+	}
+
+	// Compacts what the previous run appended
+	return rewrite_journal();
+}
+
+bool RecordingUploader::rewrite_journal()
+{
+	if (journal)
+	{
+		fclose(journal);
+		journal = nullptr;
+	}
+
+	std::string journal_path = get_journal_path();
+	std::string temp_path = journal_path + ".tmp";
+	FILE* temp_file = fopen(temp_path.c_str(), "w");
+	if (!temp_file)
+	{
+		logger()->error("Failed to create upload queue {}: {}", temp_path, strerror(errno));
+		return false;
+	}
+
+	bool ok = true;
+	for (const std::string& name : queue)
+	{
+		ok = ok && fprintf(temp_file, "Q %s\n", name.c_str()) >= 0;
+		auto upload = uploads.find(name);
+		if (upload == uploads.end())
+		{
+			continue;
+		}
+		ok = ok && fprintf(temp_file, "U %s %llu %s\n", upload->second.upload_id.c_str(), static_cast<unsigned long long>(upload->second.part_size), name.c_str()) >= 0;
+		for (const auto& [part_number, etag] : upload->second.etags)
+		{
+			ok = ok && fprintf(temp_file, "P %d %s %s\n", part_number, etag.c_str(), name.c_str()) >= 0;
+		}
+	}
+	ok = ok && fflush(temp_file) == 0 && fdatasync(fileno(temp_file)) == 0;
+	ok = fclose(temp_file) == 0 && ok;
+
+	std::error_code rename_error;
+	if (ok)
+	{
+		std::filesystem::rename(temp_path, journal_path, rename_error);
+	}
+	if (!ok || rename_error)
+	{
+		logger()->error("Failed to write upload queue {}", journal_path);
+		std::filesystem::remove(temp_path, rename_error);
+		return false;
+	}
+
+	journal = fopen(journal_path.c_str(), "a");
+	if (!journal)
+	{
+		logger()->error("Failed to open upload queue {}: {}", journal_path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+void RecordingUploader::append_journal(const std::string& line, bool sync)
+{
+	if (!journal)
+	{
+		return;
+	}
+
+	// Queued and finished files are synced, a lost part line only costs sending the part again
+	if (fprintf(journal, "%s\n", line.c_str()) < 0 || fflush(journal) != 0 || (sync && fdatasync(fileno(journal)) != 0))
+	{
+		logger()->error("Failed to append to upload queue {}: {}", get_journal_path(), strerror(errno));
+	}
+}
+
+void RecordingUploader::enqueue(const std::string& path)
+{
+	std::string name = std::filesystem::path(path).filename().string();
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		if (std::find(queue.begin(), queue.end(), name) != queue.end())
+		{
+			return;
+		}
+		queue.push_back(name);
+		append_journal("Q " + name, true);
+	}
+	queue_cv.notify_all();
+}
+
+void RecordingUploader::set_throttled(bool throttled)
+{
+	if (is_throttled.exchange(throttled) != throttled)
+	{
+		logger()->debug("Recording upload bandwidth is now {} KiB/s", throttled ? config.leased_bandwidth_kib : config.bandwidth_kib);
+	}
+}
+
+bool RecordingUploader::wait(std::chrono::milliseconds duration)
+{
+	std::unique_lock<std::mutex> lock(queue_mutex);
+	queue_cv.wait_for(lock, duration, [this]() { return !is_running; });
+	return is_running;
+}
+
+bool RecordingUploader::throttle(size_t size)
+{
+	int bandwidth_kib = is_throttled ? config.leased_bandwidth_kib : config.bandwidth_kib;
+	if (bandwidth_kib <= 0)
+	{
+		return is_running;
+	}
+
+	// Chunks of all part threads are lined up one after another at the current rate
+	auto now = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point due;
+	{
+		std::lock_guard<std::mutex> lock(throttle_mutex);
+		throttle_next = std::max(throttle_next, now);
+		due = throttle_next;
+		throttle_next += std::chrono::microseconds(size * 1000000 / (static_cast<uint64_t>(bandwidth_kib) * 1024));
+	}
+	if (due > now)
+	{
+		return wait(std::chrono::duration_cast<std::chrono::milliseconds>(due - now));
+	}
+	return is_running;
+}
+
+void RecordingUploader::worker_loop()
+{
+	set_idle_priority();
+
+	while (is_running)
+	{
+		if (config.ready_handler && !config.ready_handler())
+		{
+			wait(std::chrono::seconds(10));
+			continue;
+		}
+
+		std::string name;
+		{
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			queue_cv.wait(lock, [this]() { return !is_running || !queue.empty(); });
+			if (!is_running)
+			{
+				break;
+			}
+			name = queue.front();
+		}
+
+		if (upload_segment(name) == UploadResult::Failed && is_running)
+		{
+			{
+				std::lock_guard<std::mutex> lock(stats_mutex);
+				stats.upload_failures++;
+			}
+			requeue_failed(name);
+			logger()->warn("Upload of recording {} failed, retrying in {} s", name, config.retry_interval_sec);
+			wait(std::chrono::seconds(config.retry_interval_sec));
+		}
+	}
+}
+
+void RecordingUploader::requeue_failed(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(queue_mutex);
+
+	// A file the store keeps refusing must not hold up the ones queued after it
+	auto queued = std::find(queue.begin(), queue.end(), name);
+	if (queued != queue.end())
+	{
+		queue.erase(queued);
+		queue.push_back(name);
+	}
+
+	// The parts sent so far may be what the store refuses, e.g. with InvalidPart
+	int attempts = ++failures[name];
+	if (attempts % restart_after_failures == 0 && uploads.erase(name) > 0)
+	{
+		logger()->warn("Upload of recording {} failed {} times, starting it over", name, attempts);
+		append_journal("R " + name, false);
+	}
+}
+
+RecordingUploader::UploadResult RecordingUploader::upload_segment(const std::string& name)
+{
+	// Tiering may move the file between resolving and opening it, the second lookup finds it
+	std::string path;
+	int fd = -1;
+	for (int attempt = 0; attempt < 2 && fd < 0; attempt++)
+	{
+		RecordingSegment segment;
+		path = catalog && catalog->find_segment(name, segment) ? segment.path : (std::filesystem::path(config.recording_path) / name).string();
+		fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0 && errno != ENOENT)
+		{
+			logger()->error("Failed to open recording {} for upload: {}", path, strerror(errno));
+			return UploadResult::Failed;
+		}
+	}
+	if (fd < 0)
+	{
+		logger()->warn("Recording {} was removed before it was uploaded", name);
+		finish_segment(name, path, 0, UploadResult::Missing);
+		return UploadResult::Missing;
+	}
+
+	struct stat file_stat;
+	bool ok = fstat(fd, &file_stat) == 0;
+	uint64_t size = ok ? static_cast<uint64_t>(file_stat.st_size) : 0;
+	if (ok && size <= config.part_size)
+	{
+		ok = upload_object(fd, name, static_cast<size_t>(size));
+	}
+	else if (ok)
+	{
+		ok = upload_multipart(fd, name, size);
+	}
+	::close(fd);
+
+	UploadResult result = ok ? UploadResult::Uploaded : UploadResult::Failed;
+	if (ok)
+	{
+		finish_segment(name, path, size, result);
+	}
+	return result;
+}
+
+bool RecordingUploader::upload_object(int fd, const std::string& name, size_t size)
+{
+	std::vector<uint8_t> buffer(size);
+	if (!read_fully(fd, buffer.data(), size, 0))
+	{
+		logger()->error("Failed to read recording {} for upload: {}", name, strerror(errno));
+		return false;
+	}
+	return client->put_object(config.key_prefix + name, buffer.data(), size);
+}
+
+bool RecordingUploader::upload_multipart(int fd, const std::string& name, uint64_t size)
+{
+	std::string key = config.key_prefix + name;
+
+	UploadState state;
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		auto upload = uploads.find(name);
+		if (upload != uploads.end() && upload->second.part_size != config.part_size)
+		{
+			// Parts already sent were cut at other offsets, completing them would fail
+			logger()->info("Part size of recording {} changed since its upload started, starting over", name);
+			uploads.erase(upload);
+			append_journal("R " + name, false);
+		}
+		else if (upload != uploads.end())
+		{
+			state = upload->second;
+		}
+	}
+	if (state.upload_id.empty())
+	{
+		if (!client->create_multipart_upload(key, state.upload_id))
+		{
+			return false;
+		}
+		state.part_size = config.part_size;
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		uploads[name] = state;
+		append_journal("U " + state.upload_id + " " + std::to_string(state.part_size) + " " + name, false);
+	}
+	else
+	{
+		logger()->info("Resuming upload of recording {}, {} parts already sent", name, state.etags.size());
+	}
+
+	int part_count = static_cast<int>((size + config.part_size - 1) / config.part_size);
+	std::vector<std::string> etags(part_count);
+	int remaining_parts = part_count;
+	for (const auto& [part_number, etag] : state.etags)
+	{
+		if (part_number >= 1 && part_number <= part_count)
+		{
+			etags[part_number - 1] = etag;
+			remaining_parts--;
+		}
+	}
+
+	std::atomic<int> next_part = 0;
+	std::atomic<bool> failed = false;
+	std::atomic<bool> upload_missing = false;
+	auto part_loop = [&]()
+		{
+			set_idle_priority();
+			std::vector<uint8_t> buffer;
+			while (is_running && !failed)
+			{
+				int index = next_part++;
+				if (index >= part_count)
+				{
+					break;
+				}
+				if (!etags[index].empty())
+				{
+					continue;
+				}
+
+				uint64_t offset = static_cast<uint64_t>(index) * config.part_size;
+				size_t length = static_cast<size_t>(std::min<uint64_t>(config.part_size, size - offset));
+				buffer.resize(length);
+				if (!read_fully(fd, buffer.data(), length, offset))
+				{
+					logger()->error("Failed to read recording {} for upload: {}", name, strerror(errno));
+					failed = true;
+					break;
+				}
+
+				bool part_ok = false;
+				bool part_missing = false;
+				for (int attempt = 0; attempt < part_attempts && is_running && !part_ok && !part_missing; attempt++)
+				{
+					part_ok = client->upload_part(key, state.upload_id, index + 1, buffer.data(), length, etags[index], part_missing);
+				}
+				if (!part_ok)
+				{
+					if (part_missing)
+					{
+						upload_missing = true;
+					}
+					failed = true;
+					break;
+				}
+
+				std::lock_guard<std::mutex> lock(queue_mutex);
+				uploads[name].etags[index + 1] = etags[index];
+				append_journal("P " + std::to_string(index + 1) + " " + etags[index] + " " + name, false);
+			}
+		};
+
+	std::vector<std::thread> part_threads;
+	int thread_count = std::min(std::max(config.parallel_parts, 1), remaining_parts);
+	for (int i = 0; i < thread_count; i++)
+	{
+		part_threads.emplace_back(part_loop);
+#ifdef CM_UNIX
+		pthread_setname_np(part_threads.back().native_handle(), "pitv-upload-part");
+#endif
+	}
+	for (std::thread& part_thread : part_threads)
+	{
+		part_thread.join();
+	}
+
+	bool missing = upload_missing;
+	bool ok = !failed && is_running && client->complete_multipart_upload(key, state.upload_id, etags, missing);
+	if (!ok && missing)
+	{
+		// The store dropped the upload, e.g. by a lifecycle rule, the next attempt starts over
+		logger()->warn("Upload of recording {} is no longer known to the store, starting over", name);
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		uploads.erase(name);
+		append_journal("R " + name, false);
+	}
+	return ok;
+}
+
+void RecordingUploader::finish_segment(const std::string& name, const std::string& path, uint64_t size, UploadResult result)
+{
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		queue.erase(std::remove(queue.begin(), queue.end(), name), queue.end());
+		uploads.erase(name);
+		failures.erase(name);
+		append_journal("D " + name, true);
+		if (queue.empty())
+		{
+			rewrite_journal();
+		}
+	}
+
+	if (result == UploadResult::Uploaded && config.delete_uploaded)
+	{
+		std::error_code error;
+		std::filesystem::remove(path, error);
+		if (error)
+		{
+			logger()->warn("Recording {} was uploaded but could not be removed: {}", path, error.message());
+		}
+		std::filesystem::remove(SegmentIndex::get_index_path(path), error);
+		if (catalog)
+		{
+			catalog->remove_segment(path);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	if (result == UploadResult::Uploaded)
+	{
+		stats.segments_uploaded++;
+		stats.bytes_uploaded += size;
+		logger()->info("Recording {} uploaded, {} bytes", name, size);
+	}
+	else
+	{
+		stats.segments_missing++;
+	}
+}
+
+RecordingUploaderStats RecordingUploader::get_stats() const
+{
+	RecordingUploaderStats result;
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		result = stats;
+	}
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		result.queue_length = queue.size();
+	}
+	result.throttled = is_throttled;
+	return result;
+}
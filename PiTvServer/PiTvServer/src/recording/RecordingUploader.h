@@ -0,0 +1,137 @@
+#pragma once
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+#include <spdlog/spdlog.h>
+#include "RecordingCatalog.h"
+#include "S3Client.h"
+
+struct RecordingUploaderConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	std::string recording_path;
+	S3ClientConfig s3;
+	// Prepended to the file name to make the object key
+	std::string key_prefix;
+	// Files up to this size go up in a single request, larger ones in parts of this size
+	size_t part_size = 8 * 1024 * 1024;
+	// Parts of one file uploaded at the same time
+	int parallel_parts = 2;
+	// KiB/s, 0 does not limit it
+	int bandwidth_kib = 0;
+	// KiB/s while someone watches the stream
+	int leased_bandwidth_kib = 256;
+	// Removes the file from the card once it is uploaded
+	bool delete_uploaded = false;
+	int retry_interval_sec = 60;
+	// Nothing is uploaded while this returns false, e.g. while recovery still works on the card
+	std::function<bool()> ready_handler;
+};
+
+struct RecordingUploaderStats
+{
+	uint64_t segments_uploaded = 0;
+	uint64_t bytes_uploaded = 0;
+	uint64_t upload_failures = 0;
+	uint64_t segments_missing = 0;
+	uint64_t queue_length = 0;
+	bool throttled = false;
+};
+
+// Uploads closed segments to an S3-compatible store on a background thread. The queue is journaled
+// in the recording directory: queued files, started multipart uploads and their finished parts are
+// appended as text lines, so a restart resumes where the previous run stopped instead of sending
+// whole segments again. Parts of a file go up on a bounded number of idle-priority threads that
+// share one bandwidth limit, lowered while leases are active.
+class RecordingUploader
+{
+public:
+	static const std::string journal_file_name;
+
+private:
+	// Multipart upload of one queued file
+	struct UploadState
+	{
+		std::string upload_id;
+		// Part size the upload was started with, 0 when the journal did not record it
+		uint64_t part_size = 0;
+		// ETags of finished parts by part number
+		std::map<int, std::string> etags;
+	};
+
+	enum class UploadResult
+	{
+		Uploaded,
+		Missing,
+		Failed
+	};
+
+	RecordingUploaderConfig config;
+	std::shared_ptr<RecordingCatalog> catalog;
+	std::shared_ptr<S3Client> client;
+
+	std::thread worker;
+	std::atomic<bool> is_running = false;
+	std::atomic<bool> is_throttled = false;
+
+	// Guards the queue, the upload states, the journal and waiting
+	mutable std::mutex queue_mutex;
+	std::condition_variable queue_cv;
+	std::deque<std::string> queue;
+	std::map<std::string, UploadState> uploads;
+	// Failed attempts of queued files since they were queued or the service started
+	std::map<std::string, int> failures;
+	FILE* journal = nullptr;
+
+	mutable std::mutex stats_mutex;
+	RecordingUploaderStats stats;
+
+	std::mutex throttle_mutex;
+	std::chrono::steady_clock::time_point throttle_next;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	std::string get_journal_path() const;
+	bool load_journal();
+	bool rewrite_journal();
+	void append_journal(const std::string& line, bool sync);
+
+	void worker_loop();
+	void requeue_failed(const std::string& name);
+	bool wait(std::chrono::milliseconds duration);
+	bool throttle(size_t size);
+	UploadResult upload_segment(const std::string& name);
+	bool upload_object(int fd, const std::string& name, size_t size);
+	bool upload_multipart(int fd, const std::string& name, uint64_t size);
+	void finish_segment(const std::string& name, const std::string& path, uint64_t size, UploadResult result);
+
+public:
+	RecordingUploader& operator=(const RecordingUploader&) = delete;
+	RecordingUploader(const RecordingUploader& copy) = delete;
+	RecordingUploader() = delete;
+
+	RecordingUploader(const RecordingUploaderConfig& config, std::shared_ptr<RecordingCatalog> catalog);
+	~RecordingUploader();
+
+	bool start();
+	void stop();
+
+	// Queues a closed segment, path is its location in the recording directory
+	void enqueue(const std::string& path);
+
+	// Switches to the leased bandwidth limit
+	void set_throttled(bool throttled);
+
+	RecordingUploaderStats get_stats() const;
+};
@@ -0,0 +1,545 @@
+#include "S3Client.h"
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/x509v3.h>
+
+// Request bodies go out in chunks of this size, each one passes the throttle
+static const size_t send_chunk_size = 64 * 1024;
+// Responses of the calls made here are small, anything larger is cut
+static const size_t max_response_size = 1024 * 1024;
+
+// One request on a plain or TLS connection
+struct S3Connection
+{
+	int fd = -1;
+	SSL* ssl = nullptr;
+
+	~S3Connection()
+	{
+		if (ssl)
+		{
+			SSL_shutdown(ssl);
+			SSL_free(ssl);
+		}
+		if (fd >= 0)
+		{
+			::close(fd);
+		}
+	}
+
+	bool send_all(const char* data, size_t size)
+	{
+		while (size > 0)
+		{
+			ssize_t sent = 0;
+			if (ssl)
+			{
+				int ret = SSL_write(ssl, data, static_cast<int>(std::min<size_t>(size, INT32_MAX)));
+				sent = ret > 0 ? ret : -1;
+			}
+			else
+			{
+				sent = ::send(fd, data, size, MSG_NOSIGNAL);
+				if (sent < 0 && errno == EINTR)
+				{
+					continue;
+				}
+			}
+			if (sent <= 0)
+			{
+				return false;
+			}
+			data += sent;
+			size -= static_cast<size_t>(sent);
+		}
+		return true;
+	}
+
+	ssize_t receive(char* data, size_t size)
+	{
+		if (ssl)
+		{
+			errno = 0;
+			int ret = SSL_read(ssl, data, static_cast<int>(size));
+			if (ret <= 0)
+			{
+				// SSL_ERROR_SYSCALL also stands for a receive timeout or a reset, only a bare EOF ends the
+				// response. Whether it arrived whole is checked against its framing afterwards.
+				int error = SSL_get_error(ssl, ret);
+				return error == SSL_ERROR_ZERO_RETURN || (error == SSL_ERROR_SYSCALL && errno == 0) ? 0 : -1;
+			}
+			return ret;
+		}
+
+		while (true)
+		{
+			ssize_t ret = ::recv(fd, data, size, 0);
+			if (ret < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			return ret;
+		}
+	}
+};
+
+S3Client::S3Client(const S3ClientConfig& config)
+{
+	this->config = config;
+}
+
+S3Client::~S3Client()
+{
+	if (ssl_ctx)
+	{
+		SSL_CTX_free(ssl_ctx);
+		ssl_ctx = nullptr;
+	}
+}
+
+std::shared_ptr<spdlog::logger> S3Client::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool S3Client::start()
+{
+	std::string address = config.endpoint;
+	if (address.starts_with("https://"))
+	{
+		use_tls = true;
+		address = address.substr(strlen("https://"));
+	}
+	else if (address.starts_with("http://"))
+	{
+		address = address.substr(strlen("http://"));
+	}
+	else
+	{
+		logger()->error("S3 endpoint {} must start with http:// or https://", config.endpoint);
+		return false;
+	}
+
+	address = address.substr(0, address.find('/'));
+	size_t colon = address.rfind(':');
+	if (colon != std::string::npos && address.find(']', colon) == std::string::npos)
+	{
+		host = address.substr(0, colon);
+		port = address.substr(colon + 1);
+	}
+	else
+	{
+		host = address;
+		port = use_tls ? "443" : "80";
+	}
+	if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+	{
+		host = host.substr(1, host.size() - 2);
+	}
+	if (host.empty() || config.bucket.empty())
+	{
+		logger()->error("S3 endpoint {} or bucket {} is not usable", config.endpoint, config.bucket);
+		return false;
+	}
+
+	if (use_tls)
+	{
+		ssl_ctx = SSL_CTX_new(TLS_client_method());
+		if (!ssl_ctx)
+		{
+			logger()->error("Failed to set up TLS for {}", config.endpoint);
+			return false;
+		}
+		SSL_CTX_set_default_verify_paths(ssl_ctx);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+		// Stores commonly close without close_notify, OpenSSL 3 would report that as a protocol error
+		SSL_CTX_set_options(ssl_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+		SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, nullptr);
+	}
+	return true;
+}
+
+std::string S3Client::to_hex(const uint8_t* data, size_t size)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string result;
+	result.reserve(size * 2);
+	for (size_t i = 0; i < size; i++)
+	{
+		result += digits[data[i] >> 4];
+		result += digits[data[i] & 0xf];
+	}
+	return result;
+}
+
+std::string S3Client::sha256_hex(const uint8_t* data, size_t size)
+{
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_size = 0;
+	EVP_Digest(data, size, digest, &digest_size, EVP_sha256(), nullptr);
+	return to_hex(digest, digest_size);
+}
+
+std::string S3Client::hmac_sha256(const std::string& key, const std::string& data)
+{
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_size = 0;
+	HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()), reinterpret_cast<const uint8_t*>(data.data()), data.size(), digest, &digest_size);
+	return std::string(reinterpret_cast<const char*>(digest), digest_size);
+}
+
+std::string S3Client::uri_encode(const std::string& value, bool keep_slash)
+{
+	// RFC 3986 unreserved characters stay, everything else is percent-encoded as SigV4 expects
+	static const char digits[] = "0123456789ABCDEF";
+	std::string result;
+	for (unsigned char ch : value)
+	{
+		if (std::isalnum(ch) || ch == '-' || ch == '_' || ch == '.' || ch == '~' || (keep_slash && ch == '/'))
+		{
+			result += static_cast<char>(ch);
+		}
+		else
+		{
+			result += '%';
+			result += digits[ch >> 4];
+			result += digits[ch & 0xf];
+		}
+	}
+	return result;
+}
+
+std::string S3Client::get_xml_value(const std::string& xml, const std::string& element)
+{
+	std::string open_tag = "<" + element + ">";
+	size_t begin = xml.find(open_tag);
+	if (begin == std::string::npos)
+	{
+		return "";
+	}
+	begin += open_tag.size();
+	size_t end = xml.find("</" + element + ">", begin);
+	return end == std::string::npos ? "" : xml.substr(begin, end - begin);
+}
+
+std::string S3Client::make_authorization(const std::string& method, const std::string& canonical_uri, const std::string& canonical_query,
+	const std::string& host_header, const std::string& payload_hash, const std::string& amz_date) const
+{
+	std::string date = amz_date.substr(0, 8);
+	std::string scope = date + "/" + config.region + "/s3/aws4_request";
+	std::string signed_headers = "host;x-amz-content-sha256;x-amz-date";
+
+	std::string canonical_request = method + "\n"
+		+ canonical_uri + "\n"
+		+ canonical_query + "\n"
+		+ "host:" + host_header + "\n"
+		+ "x-amz-content-sha256:" + payload_hash + "\n"
+		+ "x-amz-date:" + amz_date + "\n"
+		+ "\n"
+		+ signed_headers + "\n"
+		+ payload_hash;
+
+	std::string string_to_sign = "AWS4-HMAC-SHA256\n" + amz_date + "\n" + scope + "\n"
+		+ sha256_hex(reinterpret_cast<const uint8_t*>(canonical_request.data()), canonical_request.size());
+
+	std::string signing_key = hmac_sha256("AWS4" + config.secret_key, date);
+	signing_key = hmac_sha256(signing_key, config.region);
+	signing_key = hmac_sha256(signing_key, "s3");
+	signing_key = hmac_sha256(signing_key, "aws4_request");
+	std::string signature = hmac_sha256(signing_key, string_to_sign);
+
+	return "AWS4-HMAC-SHA256 Credential=" + config.access_key + "/" + scope
+		+ ", SignedHeaders=" + signed_headers
+		+ ", Signature=" + to_hex(reinterpret_cast<const uint8_t*>(signature.data()), signature.size());
+}
+
+bool S3Client::request(const std::string& method, const std::string& key, const std::vector<std::pair<std::string, std::string>>& query,
+	const uint8_t* body, size_t body_size, S3Response& response)
+{
+	response = S3Response();
+
+	std::string canonical_uri = "/" + uri_encode(config.bucket, false) + "/" + uri_encode(key, true);
+	std::vector<std::pair<std::string, std::string>> sorted_query = query;
+	std::sort(sorted_query.begin(), sorted_query.end());
+	std::string canonical_query;
+	for (const auto& [name, value] : sorted_query)
+	{
+		canonical_query += (canonical_query.empty() ? "" : "&") + uri_encode(name, false) + "=" + uri_encode(value, false);
+	}
+
+	bool default_port = port == (use_tls ? "443" : "80");
+	std::string host_header = (host.find(':') != std::string::npos ? "[" + host + "]" : host) + (default_port ? "" : ":" + port);
+
+	time_t now = time(nullptr);
+	struct tm now_tm;
+	gmtime_r(&now, &now_tm);
+	char amz_date[32];
+	strftime(amz_date, sizeof(amz_date), "%Y%m%dT%H%M%SZ", &now_tm);
+
+	std::string payload_hash = sha256_hex(body, body ? body_size : 0);
+	std::string head = method + " " + canonical_uri + (canonical_query.empty() ? "" : "?" + canonical_query) + " HTTP/1.1\r\n"
+		+ "Host: " + host_header + "\r\n"
+		+ "x-amz-date: " + amz_date + "\r\n"
+		+ "x-amz-content-sha256: " + payload_hash + "\r\n"
+		+ "Authorization: " + make_authorization(method, canonical_uri, canonical_query, host_header, payload_hash, amz_date) + "\r\n"
+		+ "Content-Length: " + std::to_string(body ? body_size : 0) + "\r\n"
+		+ "Connection: close\r\n\r\n";
+
+	struct addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* addresses = nullptr;
+	int gai_ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+	if (gai_ret != 0 || !addresses)
+	{
+		logger()->error("Failed to resolve S3 endpoint {}: {}", host, gai_strerror(gai_ret));
+		return false;
+	}
+
+	S3Connection connection;
+	struct timeval timeout = {};
+	timeout.tv_sec = config.timeout_sec;
+	for (struct addrinfo* address = addresses; address; address = address->ai_next)
+	{
+		connection.fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+		if (connection.fd < 0)
+		{
+			continue;
+		}
+		// Also bounds connect() on Linux
+		setsockopt(connection.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(connection.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		if (connect(connection.fd, address->ai_addr, address->ai_addrlen) == 0)
+		{
+			break;
+		}
+		::close(connection.fd);
+		connection.fd = -1;
+	}
+	freeaddrinfo(addresses);
+	if (connection.fd < 0)
+	{
+		logger()->error("Failed to connect to S3 endpoint {}:{}: {}", host, port, strerror(errno));
+		return false;
+	}
+
+	if (use_tls)
+	{
+		connection.ssl = SSL_new(ssl_ctx);
+		if (!connection.ssl)
+		{
+			return false;
+		}
+		SSL_set_fd(connection.ssl, connection.fd);
+		SSL_set_tlsext_host_name(connection.ssl, host.c_str());
+		SSL_set1_host(connection.ssl, host.c_str());
+		if (SSL_connect(connection.ssl) != 1)
+		{
+			logger()->error("TLS handshake with S3 endpoint {} failed: {}", host, X509_verify_cert_error_string(SSL_get_verify_result(connection.ssl)));
+			return false;
+		}
+	}
+
+	if (!connection.send_all(head.data(), head.size()))
+	{
+		logger()->error("Failed to send a request to S3 endpoint {}", host);
+		return false;
+	}
+	for (size_t sent = 0; body && sent < body_size;)
+	{
+		size_t chunk = std::min(send_chunk_size, body_size - sent);
+		if (config.throttle_handler && !config.throttle_handler(chunk))
+		{
+			return false;
+		}
+		if (!connection.send_all(reinterpret_cast<const char*>(body + sent), chunk))
+		{
+			logger()->error("Failed to send {} bytes to S3 endpoint {}", body_size, host);
+			return false;
+		}
+		sent += chunk;
+	}
+
+	std::string raw;
+	char buffer[16 * 1024];
+	while (raw.size() < max_response_size)
+	{
+		ssize_t received = connection.receive(buffer, sizeof(buffer));
+		if (received < 0)
+		{
+			logger()->error("Failed to read the response of S3 endpoint {}", host);
+			return false;
+		}
+		if (received == 0)
+		{
+			break;
+		}
+		raw.append(buffer, static_cast<size_t>(received));
+	}
+
+	size_t head_end = raw.find("\r\n\r\n");
+	if (head_end == std::string::npos || !raw.starts_with("HTTP/1.") || raw.size() < 12)
+	{
+		logger()->error("S3 endpoint {} sent a malformed response", host);
+		return false;
+	}
+	response.status = std::atoi(raw.c_str() + 9);
+
+	size_t line_start = raw.find("\r\n") + 2;
+	while (line_start < head_end)
+	{
+		size_t line_end = raw.find("\r\n", line_start);
+		std::string line = raw.substr(line_start, line_end - line_start);
+		size_t colon = line.find(':');
+		if (colon != std::string::npos)
+		{
+			std::string name = line.substr(0, colon);
+			std::transform(name.begin(), name.end(), name.begin(), [](unsigned char ch) { return static_cast<char>(std::tolower(ch)); });
+			size_t value_start = line.find_first_not_of(' ', colon + 1);
+			response.headers[name] = value_start == std::string::npos ? "" : line.substr(value_start);
+		}
+		line_start = line_end + 2;
+	}
+
+	// The connection may have ended early, the response counts only when its framing is complete
+	bool complete = true;
+	std::string raw_body = raw.substr(head_end + 4);
+	auto transfer_encoding = response.headers.find("transfer-encoding");
+	auto content_length = response.headers.find("content-length");
+	if (transfer_encoding != response.headers.end() && transfer_encoding->second.find("chunked") != std::string::npos)
+	{
+		complete = false;
+		size_t position = 0;
+		while (position < raw_body.size())
+		{
+			size_t size_end = raw_body.find("\r\n", position);
+			if (size_end == std::string::npos)
+			{
+				break;
+			}
+			size_t chunk_size = std::strtoul(raw_body.c_str() + position, nullptr, 16);
+			if (chunk_size == 0)
+			{
+				complete = true;
+				break;
+			}
+			if (size_end + 2 + chunk_size > raw_body.size())
+			{
+				break;
+			}
+			response.body.append(raw_body, size_end + 2, chunk_size);
+			position = size_end + 2 + chunk_size + 2;
+		}
+	}
+	else
+	{
+		response.body = raw_body;
+		if (content_length != response.headers.end())
+		{
+			complete = raw_body.size() >= std::strtoull(content_length->second.c_str(), nullptr, 10);
+		}
+	}
+
+	if (!complete)
+	{
+		logger()->error("S3 endpoint {} closed the connection before the response was complete", host);
+		return false;
+	}
+	return true;
+}
+
+void S3Client::log_error(const std::string& action, const std::string& key, const S3Response& response) const
+{
+	std::string code = get_xml_value(response.body, "Code");
+	std::string message = get_xml_value(response.body, "Message");
+	logger()->error("S3 {} of {} failed with HTTP {}: {} {}", action, key, response.status, code, message);
+}
+
+bool S3Client::put_object(const std::string& key, const uint8_t* data, size_t size)
+{
+	S3Response response;
+	if (!request("PUT", key, {}, data, size, response))
+	{
+		return false;
+	}
+	if (response.status != 200)
+	{
+		log_error("upload", key, response);
+		return false;
+	}
+	return true;
+}
+
+bool S3Client::create_multipart_upload(const std::string& key, std::string& upload_id)
+{
+	S3Response response;
+	if (!request("POST", key, { { "uploads", "" } }, nullptr, 0, response))
+	{
+		return false;
+	}
+	upload_id = get_xml_value(response.body, "UploadId");
+	if (response.status != 200 || upload_id.empty())
+	{
+		log_error("multipart upload start", key, response);
+		return false;
+	}
+	return true;
+}
+
+bool S3Client::upload_part(const std::string& key, const std::string& upload_id, int part_number, const uint8_t* data, size_t size,
+	std::string& etag, bool& upload_missing)
+{
+	upload_missing = false;
+
+	S3Response response;
+	if (!request("PUT", key, { { "partNumber", std::to_string(part_number) }, { "uploadId", upload_id } }, data, size, response))
+	{
+		return false;
+	}
+	auto etag_header = response.headers.find("etag");
+	if (response.status != 200 || etag_header == response.headers.end())
+	{
+		upload_missing = response.status == 404;
+		log_error("part " + std::to_string(part_number) + " upload", key, response);
+		return false;
+	}
+	etag = etag_header->second;
+	return true;
+}
+
+bool S3Client::complete_multipart_upload(const std::string& key, const std::string& upload_id, const std::vector<std::string>& etags,
+	bool& upload_missing)
+{
+	upload_missing = false;
+
+	std::string body = "<CompleteMultipartUpload>";
+	for (size_t i = 0; i < etags.size(); i++)
+	{
+		body += "<Part><PartNumber>" + std::to_string(i + 1) + "</PartNumber><ETag>" + etags[i] + "</ETag></Part>";
+	}
+	body += "</CompleteMultipartUpload>";
+
+	S3Response response;
+	if (!request("POST", key, { { "uploadId", upload_id } }, reinterpret_cast<const uint8_t*>(body.data()), body.size(), response))
+	{
+		return false;
+	}
+	// A failure may also come as an error document in a 200 response
+	if (response.status != 200 || response.body.find("<Error>") != std::string::npos)
+	{
+		upload_missing = response.status == 404;
+		log_error("multipart upload completion", key, response);
+		return false;
+	}
+	return true;
+}
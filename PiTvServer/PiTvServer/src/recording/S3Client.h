@@ -0,0 +1,82 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <spdlog/spdlog.h>
+
+typedef struct ssl_ctx_st SSL_CTX;
+
+struct S3ClientConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	// http://host:port or https://host, objects are addressed path-style: /bucket/key
+	std::string endpoint;
+	std::string region = "us-east-1";
+	std::string bucket;
+	std::string access_key;
+	std::string secret_key;
+	int timeout_sec = 30;
+	// Called before every chunk of a request body is sent, false aborts the request
+	std::function<bool(size_t size)> throttle_handler;
+};
+
+struct S3Response
+{
+	int status = 0;
+	// Header names in lower case
+	std::map<std::string, std::string> headers;
+	std::string body;
+};
+
+// Minimal S3 client for uploads: requests are signed with AWS Signature Version 4 and sent over
+// HTTP/1.1, one connection per request, TLS through OpenSSL for https endpoints. Calls block and
+// may be made from several threads at once.
+class S3Client
+{
+private:
+	S3ClientConfig config;
+	bool use_tls = false;
+	std::string host;
+	std::string port;
+	SSL_CTX* ssl_ctx = nullptr;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	bool request(const std::string& method, const std::string& key, const std::vector<std::pair<std::string, std::string>>& query,
+		const uint8_t* body, size_t body_size, S3Response& response);
+	void log_error(const std::string& action, const std::string& key, const S3Response& response) const;
+
+	static std::string uri_encode(const std::string& value, bool keep_slash);
+	static std::string sha256_hex(const uint8_t* data, size_t size);
+	static std::string hmac_sha256(const std::string& key, const std::string& data);
+	static std::string to_hex(const uint8_t* data, size_t size);
+	static std::string get_xml_value(const std::string& xml, const std::string& element);
+
+public:
+	S3Client& operator=(const S3Client&) = delete;
+	S3Client(const S3Client& copy) = delete;
+	S3Client() = delete;
+
+	S3Client(const S3ClientConfig& config);
+	~S3Client();
+
+	// Parses the endpoint and sets up TLS
+	bool start();
+
+	// Authorization header of a request signed with AWS Signature Version 4, amz_date is YYYYMMDD'T'HHMMSS'Z'
+	std::string make_authorization(const std::string& method, const std::string& canonical_uri, const std::string& canonical_query,
+		const std::string& host_header, const std::string& payload_hash, const std::string& amz_date) const;
+
+	bool put_object(const std::string& key, const uint8_t* data, size_t size);
+
+	// upload_missing is set when the store no longer knows the upload, it has to start over
+	bool create_multipart_upload(const std::string& key, std::string& upload_id);
+	bool upload_part(const std::string& key, const std::string& upload_id, int part_number, const uint8_t* data, size_t size,
+		std::string& etag, bool& upload_missing);
+	bool complete_multipart_upload(const std::string& key, const std::string& upload_id, const std::vector<std::string>& etags,
+		bool& upload_missing);
+};
@@ -0,0 +1,520 @@
+#include "SegmentIndex.h"
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+
+const char SegmentIndex::magic[4] = { 'P', 'T', 'V', 'I' };
+const uint16_t SegmentIndex::version = 1;
+const std::string SegmentIndex::index_extension = "idx";
+
+std::string SegmentIndex::get_index_path(const std::string& segment_path)
+{
+	std::filesystem::path path(segment_path);
+	path.replace_extension("." + index_extension);
+	return path.string();
+}
+
+static uint64_t read_be(const uint8_t* data, int size)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < size; i++)
+	{
+		value = (value << 8) | data[i];
+	}
+	return value;
+}
+
+bool SegmentIndex::find_mp4_media_offset(const std::string& mp4_path, uint64_t& media_offset)
+{
+	FILE* file = fopen(mp4_path.c_str(), "rb");
+	if (!file)
+	{
+		return false;
+	}
+
+	bool found = false;
+	uint64_t box_start = 0;
+	uint8_t box_header[16];
+	while (fseeko(file, static_cast<off_t>(box_start), SEEK_SET) == 0 && fread(box_header, 1, 8, file) == 8)
+	{
+		uint64_t box_size = read_be(box_header, 4);
+		uint64_t header_size = 8;
+		if (box_size == 1)
+		{
+			if (fread(box_header + 8, 1, 8, file) != 8)
+			{
+				break;
+			}
+			box_size = read_be(box_header + 8, 8);
+			header_size = 16;
+		}
+
+		if (memcmp(box_header + 4, "mdat", 4) == 0)
+		{
+			media_offset = box_start + header_size;
+			found = true;
+			break;
+		}
+
+		// size 0 extends to the end of the file
+		if (box_size < header_size)
+		{
+			break;
+		}
+		box_start += box_size;
+	}
+
+	fclose(file);
+	return found;
+}
+
+bool SegmentIndex::resolve_fragmented_offsets(const std::string& mp4_path)
+{
+	FILE* file = fopen(mp4_path.c_str(), "rb");
+	if (!file)
+	{
+		return false;
+	}
+
+	// Payload start and size of every top-level mdat
+	std::vector<std::pair<uint64_t, uint64_t>> extents;
+	uint64_t box_start = 0;
+	uint8_t box_header[16];
+	while (fseeko(file, static_cast<off_t>(box_start), SEEK_SET) == 0 && fread(box_header, 1, 8, file) == 8)
+	{
+		uint64_t box_size = read_be(box_header, 4);
+		uint64_t header_size = 8;
+		if (box_size == 1)
+		{
+			if (fread(box_header + 8, 1, 8, file) != 8)
+			{
+				break;
+			}
+			box_size = read_be(box_header + 8, 8);
+			header_size = 16;
+		}
+		else if (box_size == 0 && fseeko(file, 0, SEEK_END) == 0)
+		{
+			box_size = static_cast<uint64_t>(ftello(file)) - box_start;
+		}
+
+		if (box_size < header_size)
+		{
+			break;
+		}
+		if (memcmp(box_header + 4, "mdat", 4) == 0)
+		{
+			extents.emplace_back(box_start + header_size, box_size - header_size);
+		}
+		box_start += box_size;
+	}
+	fseeko(file, 0, SEEK_END);
+	uint64_t file_size = static_cast<uint64_t>(ftello(file));
+	fclose(file);
+
+	std::string index_path = get_index_path(mp4_path);
+	SegmentIndexHeader header;
+	std::vector<SegmentIndexEntry> entries;
+	if (!read(index_path, header, entries))
+	{
+		return false;
+	}
+	// Absolute offsets were known while writing, an interrupted file only loses the entries past its end
+	bool absolute = header.flags & segment_index_absolute_offsets;
+	if (absolute && (header.flags & segment_index_complete))
+	{
+		return true;
+	}
+
+	size_t extent = 0;
+	uint64_t extent_base = 0;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		SegmentIndexEntry& entry = entries[i];
+		if (absolute)
+		{
+			if (entry.offset + entry.size > file_size)
+			{
+				entries.resize(i);
+				break;
+			}
+			continue;
+		}
+
+		while (extent < extents.size() && entry.offset >= extent_base + extents[extent].second)
+		{
+			extent_base += extents[extent].second;
+			extent++;
+		}
+
+		// The last mdat of an interrupted file may claim more than was written
+		uint64_t absolute_offset = extent < extents.size() ? extents[extent].first + (entry.offset - extent_base) : 0;
+		if (extent >= extents.size() || entry.offset + entry.size > extent_base + extents[extent].second
+			|| absolute_offset + entry.size > file_size)
+		{
+			entries.resize(i);
+			break;
+		}
+		entry.offset = absolute_offset;
+	}
+
+	if (entries.empty())
+	{
+		return false;
+	}
+
+	header.flags |= segment_index_absolute_offsets | segment_index_complete;
+	header.start_wallclock_usec = entries.front().wallclock_usec;
+	header.start_pts_ns = entries.front().pts_ns;
+	header.end_wallclock_usec = entries.back().wallclock_usec;
+	header.end_pts_ns = entries.back().pts_ns;
+
+	std::string temp_path = index_path + ".tmp";
+	FILE* index_file = fopen(temp_path.c_str(), "wb");
+	if (!index_file)
+	{
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, index_file) == 1
+		&& fwrite(entries.data(), sizeof(SegmentIndexEntry), entries.size(), index_file) == entries.size();
+	ok = fclose(index_file) == 0 && ok;
+
+	std::error_code rename_error;
+	if (ok)
+	{
+		std::filesystem::rename(temp_path, index_path, rename_error);
+	}
+	if (!ok || rename_error)
+	{
+		std::filesystem::remove(temp_path, rename_error);
+		return false;
+	}
+	return true;
+}
+
+static bool find_child_box(const std::vector<uint8_t>& data, size_t begin, size_t end, const char* type, size_t& payload_begin, size_t& payload_end)
+{
+	size_t box_start = begin;
+	while (box_start + 8 <= end)
+	{
+		uint64_t box_size = read_be(data.data() + box_start, 4);
+		size_t header_size = 8;
+		if (box_size == 1)
+		{
+			if (box_start + 16 > end)
+			{
+				return false;
+			}
+			box_size = read_be(data.data() + box_start + 8, 8);
+			header_size = 16;
+		}
+		else if (box_size == 0)
+		{
+			box_size = end - box_start;
+		}
+
+		if (box_size < header_size || box_size > end - box_start)
+		{
+			return false;
+		}
+
+		if (memcmp(data.data() + box_start + 4, type, 4) == 0)
+		{
+			payload_begin = box_start + header_size;
+			payload_end = box_start + box_size;
+			return true;
+		}
+		box_start += box_size;
+	}
+	return false;
+}
+
+bool SegmentIndex::find_mp4_video_config(const std::string& mp4_path, std::vector<uint8_t>& avcc, int& width, int& height)
+{
+	FILE* mp4_file = fopen(mp4_path.c_str(), "rb");
+	if (!mp4_file)
+	{
+		return false;
+	}
+
+	// moov trails the media in segments written by mp4mux, the top-level boxes are walked to find it
+	std::vector<uint8_t> moov;
+	uint64_t box_start = 0;
+	uint8_t box_header[16];
+	while (fseeko(mp4_file, static_cast<off_t>(box_start), SEEK_SET) == 0 && fread(box_header, 1, 8, mp4_file) == 8)
+	{
+		uint64_t box_size = read_be(box_header, 4);
+		uint64_t header_size = 8;
+		if (box_size == 1)
+		{
+			if (fread(box_header + 8, 1, 8, mp4_file) != 8)
+			{
+				break;
+			}
+			box_size = read_be(box_header + 8, 8);
+			header_size = 16;
+		}
+		if (box_size < header_size)
+		{
+			break;
+		}
+
+		if (memcmp(box_header + 4, "moov", 4) == 0)
+		{
+			if (box_size > 16 * 1024 * 1024)
+			{
+				break;
+			}
+			moov.resize(box_size - header_size);
+			if (fread(moov.data(), 1, moov.size(), mp4_file) != moov.size())
+			{
+				moov.clear();
+			}
+			break;
+		}
+		box_start += box_size;
+	}
+	fclose(mp4_file);
+
+	size_t begin = 0;
+	size_t end = moov.size();
+	for (const char* type : { "trak", "mdia", "minf", "stbl", "stsd" })
+	{
+		if (!find_child_box(moov, begin, end, type, begin, end))
+		{
+			return false;
+		}
+	}
+
+	// stsd: version, flags and entry count precede the sample entries
+	if (!find_child_box(moov, begin + 8, end, "avc1", begin, end) || end - begin < 78)
+	{
+		return false;
+	}
+	width = static_cast<int>(read_be(moov.data() + begin + 24, 2));
+	height = static_cast<int>(read_be(moov.data() + begin + 26, 2));
+
+	if (!find_child_box(moov, begin + 78, end, "avcC", begin, end))
+	{
+		return false;
+	}
+	avcc.assign(moov.begin() + begin, moov.begin() + end);
+	return true;
+}
+
+// Wall-clock time of an access unit dated from the first one of its segment by running time.
+// A clock step inside a segment cannot make it look longer or its entries run backwards.
+static int64_t get_anchored_wallclock(const SegmentIndexEntry& anchor, uint64_t pts_ns, int64_t previous_usec)
+{
+	int64_t wallclock_usec = pts_ns > anchor.pts_ns ? anchor.wallclock_usec + static_cast<int64_t>((pts_ns - anchor.pts_ns) / 1000) : anchor.wallclock_usec;
+	// Reordered frames carry a smaller running time than the one before them
+	return std::max(wallclock_usec, previous_usec);
+}
+
+bool SegmentIndex::read(const std::string& index_path, SegmentIndexHeader& header, std::vector<SegmentIndexEntry>& entries)
+{
+	FILE* file = fopen(index_path.c_str(), "rb");
+	if (!file)
+	{
+		return false;
+	}
+
+	bool ok = fread(&header, sizeof(header), 1, file) == 1
+		&& memcmp(header.magic, magic, sizeof(magic)) == 0
+		&& header.version == version
+		&& header.header_size == sizeof(SegmentIndexHeader)
+		&& header.entry_size == sizeof(SegmentIndexEntry);
+
+	if (ok)
+	{
+		SegmentIndexEntry entry;
+		while (fread(&entry, sizeof(entry), 1, file) == 1)
+		{
+			entries.push_back(entry);
+		}
+	}
+
+	fclose(file);
+	return ok;
+}
+
+ptrdiff_t SegmentIndex::find_keyframe(const std::vector<SegmentIndexEntry>& entries, int64_t wallclock_usec)
+{
+	// Entries are in decode order and their anchored wall-clock time never decreases
+	auto upper = std::upper_bound(entries.begin(), entries.end(), wallclock_usec,
+		[](int64_t value, const SegmentIndexEntry& entry) { return value < entry.wallclock_usec; });
+
+	for (auto iter = upper; iter != entries.begin();)
+	{
+		--iter;
+		if (iter->flags & segment_index_entry_keyframe)
+		{
+			return iter - entries.begin();
+		}
+	}
+
+	for (auto iter = upper; iter != entries.end(); ++iter)
+	{
+		if (iter->flags & segment_index_entry_keyframe)
+		{
+			return iter - entries.begin();
+		}
+	}
+
+	return -1;
+}
+
+bool SegmentIndex::get_file_offset(const SegmentIndexHeader& header, const SegmentIndexEntry& entry, uint64_t& file_offset)
+{
+	if (header.flags & segment_index_absolute_offsets)
+	{
+		file_offset = entry.offset;
+		return true;
+	}
+	if (header.flags & segment_index_media_offset_known)
+	{
+		file_offset = header.media_offset + entry.offset;
+		return true;
+	}
+	return false;
+}
+
+SegmentIndexWriter::SegmentIndexWriter(std::shared_ptr<spdlog::logger> logger_ptr)
+{
+	this->logger_ptr = logger_ptr;
+}
+
+SegmentIndexWriter::~SegmentIndexWriter()
+{
+	if (file)
+	{
+		fclose(file);
+	}
+}
+
+bool SegmentIndexWriter::open(const std::string& index_path, bool absolute_offsets)
+{
+	assert(!file);
+
+	path = index_path;
+	file = fopen(path.c_str(), "wb");
+	if (!file)
+	{
+		logger_ptr->error("Failed to create segment index {}: {}", path, strerror(errno));
+		return false;
+	}
+
+	header = {};
+	memcpy(header.magic, SegmentIndex::magic, sizeof(header.magic));
+	header.version = SegmentIndex::version;
+	header.header_size = sizeof(SegmentIndexHeader);
+	header.entry_size = sizeof(SegmentIndexEntry);
+	header.flags = absolute_offsets ? segment_index_absolute_offsets : 0;
+	entry_count = 0;
+
+	if (!write_header())
+	{
+		fclose(file);
+		file = nullptr;
+		return false;
+	}
+	return true;
+}
+
+bool SegmentIndexWriter::is_open() const
+{
+	return file != nullptr;
+}
+
+const std::string& SegmentIndexWriter::get_path() const
+{
+	return path;
+}
+
+uint64_t SegmentIndexWriter::get_entry_count() const
+{
+	return entry_count;
+}
+
+const SegmentIndexHeader& SegmentIndexWriter::get_header() const
+{
+	return header;
+}
+
+bool SegmentIndexWriter::write_header()
+{
+	return fseeko(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 && fseeko(file, 0, SEEK_END) == 0;
+}
+
+void SegmentIndexWriter::append(uint64_t pts_ns, int64_t wallclock_usec, uint64_t offset, uint32_t size, bool keyframe)
+{
+	if (!file)
+	{
+		return;
+	}
+
+	if (entry_count == 0)
+	{
+		header.start_wallclock_usec = wallclock_usec;
+		header.start_pts_ns = pts_ns;
+		write_header();
+	}
+	else
+	{
+		SegmentIndexEntry anchor = {};
+		anchor.pts_ns = header.start_pts_ns;
+		anchor.wallclock_usec = header.start_wallclock_usec;
+		wallclock_usec = get_anchored_wallclock(anchor, pts_ns, header.end_wallclock_usec);
+	}
+	header.end_wallclock_usec = wallclock_usec;
+	header.end_pts_ns = pts_ns;
+
+	SegmentIndexEntry entry;
+	entry.pts_ns = pts_ns;
+	entry.wallclock_usec = wallclock_usec;
+	entry.offset = offset;
+	entry.size = size;
+	entry.flags = keyframe ? segment_index_entry_keyframe : 0;
+
+	if (fwrite(&entry, sizeof(entry), 1, file) != 1)
+	{
+		logger_ptr->error("Failed to write segment index {}: {}, index is abandoned", path, strerror(errno));
+		fclose(file);
+		file = nullptr;
+		return;
+	}
+	entry_count++;
+
+	// A keyframe entry is what seeking needs, make sure it survives a crash
+	if (keyframe)
+	{
+		fflush(file);
+	}
+}
+
+bool SegmentIndexWriter::close(bool media_offset_known, uint64_t media_offset)
+{
+	if (!file)
+	{
+		return false;
+	}
+
+	header.flags |= segment_index_complete;
+	if (media_offset_known)
+	{
+		header.flags |= segment_index_media_offset_known;
+		header.media_offset = media_offset;
+	}
+
+	bool ok = write_header();
+	ok = fclose(file) == 0 && ok;
+	file = nullptr;
+
+	if (!ok)
+	{
+		logger_ptr->error("Failed to finalize segment index {}", path);
+	}
+	return ok;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <spdlog/spdlog.h>
+
+// Sidecar index of a recording segment, stored next to it with the extension replaced by ".idx" (foo.mp4 -> foo.idx).
+// Layout (native byte order, little-endian on every supported target):
+//   SegmentIndexHeader
+//   SegmentIndexEntry for every access unit, appended while the segment is recorded
+// The entry count follows from the file size, so a sidecar cut short by a power loss stays usable.
+
+static const uint32_t segment_index_media_offset_known = 0x1;
+static const uint32_t segment_index_absolute_offsets = 0x2;
+static const uint32_t segment_index_complete = 0x4;
+
+static const uint32_t segment_index_entry_keyframe = 0x1;
+
+struct SegmentIndexHeader
+{
+	char magic[4];
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t entry_size;
+	uint32_t flags;
+	// File offset of the first media byte, entry offsets are relative to it unless segment_index_absolute_offsets
+	uint64_t media_offset;
+	int64_t start_wallclock_usec;
+	int64_t end_wallclock_usec;
+	uint64_t start_pts_ns;
+	uint64_t end_pts_ns;
+	uint64_t reserved;
+};
+
+struct SegmentIndexEntry
+{
+	// Pipeline running time of the access unit, monotonic across segments of one run
+	uint64_t pts_ns;
+	// Clock of the first entry of the segment plus the running time since it
+	int64_t wallclock_usec;
+	uint64_t offset;
+	uint32_t size;
+	uint32_t flags;
+};
+
+static_assert(sizeof(SegmentIndexHeader) == 64, "SegmentIndexHeader layout changed");
+static_assert(sizeof(SegmentIndexEntry) == 32, "SegmentIndexEntry layout changed");
+
+class SegmentIndex
+{
+public:
+	static const char magic[4];
+	static const uint16_t version;
+	static const std::string index_extension;
+
+	static std::string get_index_path(const std::string& segment_path);
+
+	// Offset of the payload of the single top-level mdat box written by mp4mux
+	static bool find_mp4_media_offset(const std::string& mp4_path, uint64_t& media_offset);
+
+	// For fragmented MP4: maps the media byte counts recorded in arrival order onto the payloads of the
+	// successive mdat boxes and rewrites the index with absolute offsets. Entries past the end of a
+	// truncated file are dropped. Indexes of interrupted files that had absolute offsets from the start
+	// only get the lost entries dropped. The index is marked complete afterwards.
+	static bool resolve_fragmented_offsets(const std::string& mp4_path);
+
+	// avcC and coded size from the stsd of the first track, moov may be anywhere among the top-level boxes
+	static bool find_mp4_video_config(const std::string& mp4_path, std::vector<uint8_t>& avcc, int& width, int& height);
+
+	static bool read(const std::string& index_path, SegmentIndexHeader& header, std::vector<SegmentIndexEntry>& entries);
+
+	// Last keyframe at or before wallclock_usec, the first keyframe if there is none before it, -1 without keyframes
+	static ptrdiff_t find_keyframe(const std::vector<SegmentIndexEntry>& entries, int64_t wallclock_usec);
+
+	// Returns false when the entry cannot be placed in the file (media offset unknown)
+	static bool get_file_offset(const SegmentIndexHeader& header, const SegmentIndexEntry& entry, uint64_t& file_offset);
+};
+
+// Appends entries while a segment is recorded. Entries reach the disk at every keyframe,
+// the header gets the end time and the media offset when the segment is finished.
+class SegmentIndexWriter
+{
+private:
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	std::string path;
+	FILE* file = nullptr;
+	SegmentIndexHeader header = {};
+	uint64_t entry_count = 0;
+
+	bool write_header();
+
+public:
+	SegmentIndexWriter& operator=(const SegmentIndexWriter&) = delete;
+	SegmentIndexWriter(const SegmentIndexWriter& copy) = delete;
+	SegmentIndexWriter() = delete;
+
+	SegmentIndexWriter(std::shared_ptr<spdlog::logger> logger_ptr);
+	~SegmentIndexWriter();
+
+	bool open(const std::string& index_path, bool absolute_offsets);
+	bool is_open() const;
+	const std::string& get_path() const;
+	uint64_t get_entry_count() const;
+	const SegmentIndexHeader& get_header() const;
+
+	// wallclock_usec of the first entry anchors the segment, later ones are dated from it by pts_ns
+	void append(uint64_t pts_ns, int64_t wallclock_usec, uint64_t offset, uint32_t size, bool keyframe);
+
+	// media_offset_known is false when the container could not be parsed, entries keep relative offsets
+	bool close(bool media_offset_known, uint64_t media_offset);
+};
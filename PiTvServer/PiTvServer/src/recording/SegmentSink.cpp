@@ -0,0 +1,697 @@
+#include "SegmentSink.h"
+#include <bit>
+#include <cmath>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <gst/base/gstbasesink.h>
+
+struct SegmentSinkElement
+{
+	GstBaseSink parent;
+	std::shared_ptr<SegmentSink>* segment_sink;
+	gchar* location;
+};
+
+struct SegmentSinkElementClass
+{
+	GstBaseSinkClass parent_class;
+};
+
+enum
+{
+	PROP_0,
+	PROP_LOCATION
+};
+
+G_DEFINE_TYPE(SegmentSinkElement, segment_sink_element, GST_TYPE_BASE_SINK)
+
+static GstStaticPadTemplate segment_sink_template = GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS_ANY);
+
+static SegmentSinkElement* get_element(gpointer object)
+{
+	return reinterpret_cast<SegmentSinkElement*>(object);
+}
+
+static void segment_sink_element_set_property(GObject* object, guint prop_id, const GValue* value, GParamSpec* pspec)
+{
+	SegmentSinkElement* element = get_element(object);
+	switch (prop_id)
+	{
+	case PROP_LOCATION:
+		g_free(element->location);
+		element->location = g_value_dup_string(value);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+}
+
+static void segment_sink_element_get_property(GObject* object, guint prop_id, GValue* value, GParamSpec* pspec)
+{
+	SegmentSinkElement* element = get_element(object);
+	switch (prop_id)
+	{
+	case PROP_LOCATION:
+		g_value_set_string(value, element->location);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+}
+
+static void segment_sink_element_finalize(GObject* object)
+{
+	SegmentSinkElement* element = get_element(object);
+	g_free(element->location);
+	element->location = nullptr;
+	delete element->segment_sink;
+	element->segment_sink = nullptr;
+
+	G_OBJECT_CLASS(segment_sink_element_parent_class)->finalize(object);
+}
+
+static gboolean segment_sink_element_start(GstBaseSink* base_sink)
+{
+	SegmentSinkElement* element = get_element(base_sink);
+	if (!element->location)
+	{
+		GST_ELEMENT_ERROR(base_sink, RESOURCE, NOT_FOUND, ("No file name specified for writing"), (NULL));
+		return FALSE;
+	}
+
+	if (!(*element->segment_sink)->open(element->location))
+	{
+		GST_ELEMENT_ERROR(base_sink, RESOURCE, OPEN_WRITE, ("Could not open file \"%s\" for writing", element->location), (NULL));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean segment_sink_element_stop(GstBaseSink* base_sink)
+{
+	SegmentSinkElement* element = get_element(base_sink);
+	if (!(*element->segment_sink)->close())
+	{
+		GST_ELEMENT_ERROR(base_sink, RESOURCE, CLOSE, ("Error closing file \"%s\"", element->location), (NULL));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static GstFlowReturn segment_sink_element_render(GstBaseSink* base_sink, GstBuffer* buffer)
+{
+	SegmentSinkElement* element = get_element(base_sink);
+
+	GstMapInfo map;
+	if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+	{
+		return GST_FLOW_ERROR;
+	}
+	bool ok = (*element->segment_sink)->write(map.data, map.size);
+	gst_buffer_unmap(buffer, &map);
+
+	if (!ok)
+	{
+		GST_ELEMENT_ERROR(base_sink, RESOURCE, WRITE, ("Error while writing to file \"%s\"", element->location), (NULL));
+		return GST_FLOW_ERROR;
+	}
+	return GST_FLOW_OK;
+}
+
+static gboolean segment_sink_element_event(GstBaseSink* base_sink, GstEvent* event)
+{
+	SegmentSinkElement* element = get_element(base_sink);
+	SegmentSink* segment_sink = element->segment_sink->get();
+
+	bool ok = true;
+	switch (GST_EVENT_TYPE(event))
+	{
+	case GST_EVENT_SEGMENT:
+	{
+		// Muxers rewrite headers through byte segments
+		const GstSegment* segment = nullptr;
+		gst_event_parse_segment(event, &segment);
+		if (segment->format == GST_FORMAT_BYTES)
+		{
+			ok = segment_sink->seek(segment->start);
+		}
+		break;
+	}
+	case GST_EVENT_EOS:
+	case GST_EVENT_FLUSH_STOP:
+		// Everything is on disk before splitmuxsink reports the fragment closed
+		ok = segment_sink->flush();
+		break;
+	default:
+		break;
+	}
+
+	if (!ok)
+	{
+		GST_ELEMENT_ERROR(base_sink, RESOURCE, WRITE, ("Error while writing to file \"%s\"", element->location), (NULL));
+		gst_event_unref(event);
+		return FALSE;
+	}
+	return GST_BASE_SINK_CLASS(segment_sink_element_parent_class)->event(base_sink, event);
+}
+
+static gboolean segment_sink_element_query(GstBaseSink* base_sink, GstQuery* query)
+{
+	SegmentSinkElement* element = get_element(base_sink);
+
+	switch (GST_QUERY_TYPE(query))
+	{
+	case GST_QUERY_SEEKING:
+	{
+		// mp4mux only writes a playable file when it can go back to the headers
+		GstFormat format;
+		gst_query_parse_seeking(query, &format, NULL, NULL, NULL);
+		gst_query_set_seeking(query, format, format == GST_FORMAT_BYTES || format == GST_FORMAT_DEFAULT, 0, -1);
+		return TRUE;
+	}
+	case GST_QUERY_POSITION:
+	{
+		GstFormat format;
+		gst_query_parse_position(query, &format, NULL);
+		if (format != GST_FORMAT_BYTES && format != GST_FORMAT_DEFAULT)
+		{
+			return FALSE;
+		}
+		gst_query_set_position(query, GST_FORMAT_BYTES, static_cast<gint64>((*element->segment_sink)->get_position()));
+		return TRUE;
+	}
+	case GST_QUERY_FORMATS:
+		gst_query_set_formats(query, 2, GST_FORMAT_DEFAULT, GST_FORMAT_BYTES);
+		return TRUE;
+	default:
+		return GST_BASE_SINK_CLASS(segment_sink_element_parent_class)->query(base_sink, query);
+	}
+}
+
+static void segment_sink_element_class_init(SegmentSinkElementClass* klass)
+{
+	GObjectClass* gobject_class = G_OBJECT_CLASS(klass);
+	GstElementClass* element_class = GST_ELEMENT_CLASS(klass);
+	GstBaseSinkClass* base_sink_class = GST_BASE_SINK_CLASS(klass);
+
+	gobject_class->set_property = segment_sink_element_set_property;
+	gobject_class->get_property = segment_sink_element_get_property;
+	gobject_class->finalize = segment_sink_element_finalize;
+
+	g_object_class_install_property(gobject_class, PROP_LOCATION,
+		g_param_spec_string("location", "File Location", "Location of the file to write", NULL,
+			static_cast<GParamFlags>(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+	gst_element_class_set_static_metadata(element_class, "PiTV segment sink", "Sink/File",
+		"Writes recording segments into preallocated files", "PiTV");
+	gst_element_class_add_static_pad_template(element_class, &segment_sink_template);
+
+	base_sink_class->start = segment_sink_element_start;
+	base_sink_class->stop = segment_sink_element_stop;
+	base_sink_class->render = segment_sink_element_render;
+	base_sink_class->event = segment_sink_element_event;
+	base_sink_class->query = segment_sink_element_query;
+}
+
+static void segment_sink_element_init(SegmentSinkElement* element)
+{
+	element->segment_sink = nullptr;
+	element->location = nullptr;
+	gst_base_sink_set_sync(GST_BASE_SINK(element), FALSE);
+}
+
+const size_t SegmentSink::direct_io_alignment = 4096;
+
+SegmentSink::SegmentSink(const SegmentSinkConfig& config)
+{
+	this->config = config;
+	this->config.write_block_size = std::max<size_t>(this->config.write_block_size, direct_io_alignment);
+}
+
+SegmentSink::~SegmentSink()
+{
+	close();
+
+	if (staging)
+	{
+		staging->stop();
+		staging.reset();
+	}
+#ifdef CM_IO_URING
+	if (uring)
+	{
+		uring->release_block(block);
+		block = nullptr;
+		uring->stop();
+		uring.reset();
+	}
+#endif
+	free(block);
+}
+
+std::shared_ptr<spdlog::logger> SegmentSink::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool SegmentSink::is_async() const
+{
+#ifdef CM_IO_URING
+	return uring != nullptr;
+#else
+	return false;
+#endif
+}
+
+bool SegmentSink::start()
+{
+	if (!config.staging_path.empty())
+	{
+		SegmentStagingConfig staging_config;
+		staging_config.logger_ptr = config.logger_ptr;
+		staging_config.staging_path = config.staging_path;
+		staging_config.max_bytes = config.staging_max_bytes;
+		staging_config.max_loss_sec = config.staging_max_loss_sec;
+		staging_config.chunk_size = config.write_block_size;
+		staging_config.chunk_alignment = direct_io_alignment;
+		staging_config.write_done_handler = [this](SegmentFile& segment_file, uint64_t latency_usec, size_t size)
+			{
+				on_write_done(segment_file, latency_usec, size);
+			};
+
+		staging = std::make_unique<SegmentStaging>(staging_config);
+		if (!staging->start())
+		{
+			logger()->warn("Recording staging is not available, segments are written to the card directly");
+			staging.reset();
+		}
+		else if (config.writer == "io_uring")
+		{
+			// Writes to RAM do not block, the card only sees the flush thread
+			logger()->info("Recording segments are staged, the io_uring writer is not used");
+			config.writer = "sync";
+		}
+	}
+
+	if (config.writer == "io_uring")
+	{
+#ifdef CM_IO_URING
+		SegmentUringConfig uring_config;
+		uring_config.logger_ptr = config.logger_ptr;
+		uring_config.block_count = std::max(config.writes_in_flight, 1) + 1;
+		uring_config.block_size = config.write_block_size;
+		uring_config.block_alignment = direct_io_alignment;
+		uring_config.write_done_handler = [this](SegmentFile& segment_file, uint64_t latency_usec, size_t size)
+			{
+				on_write_done(segment_file, latency_usec, size);
+			};
+		uring_config.file_done_handler = [this](SegmentFile& segment_file)
+			{
+				finish_file(segment_file);
+			};
+
+		uring = std::make_unique<SegmentUring>(uring_config);
+		if (uring->start())
+		{
+			block = uring->acquire_block();
+		}
+		else
+		{
+			uring.reset();
+		}
+#endif
+		if (!is_async())
+		{
+			logger()->warn("io_uring is not available, recordings are written synchronously");
+		}
+	}
+
+	if (!is_async())
+	{
+		void* memory = nullptr;
+		if (posix_memalign(&memory, direct_io_alignment, config.write_block_size) != 0)
+		{
+			logger()->error("Failed to allocate {} bytes for the segment write block", config.write_block_size);
+			return false;
+		}
+		block = static_cast<uint8_t*>(memory);
+	}
+
+	logger()->info("Recording writer: {}, {} KiB blocks{}, flush policy {}",
+		is_async() ? "io_uring" : "sync", config.write_block_size / 1024, config.direct_io ? " with direct I/O" : "", config.flush_policy);
+	return true;
+}
+
+GstElement* SegmentSink::make_element(std::shared_ptr<SegmentSink> segment_sink)
+{
+	SegmentSinkElement* element = get_element(g_object_new(segment_sink_element_get_type(), NULL));
+	element->segment_sink = new std::shared_ptr<SegmentSink>(segment_sink);
+	return GST_ELEMENT(element);
+}
+
+bool SegmentSink::open(const std::string& path)
+{
+	close();
+	if (!block)
+	{
+		logger()->error("Segment writer is not started, cannot open {}", path);
+		return false;
+	}
+
+	auto segment_file = std::make_shared<SegmentFile>();
+	segment_file->path = path;
+	// Readable for the staging, which refills punched pages from the card
+	segment_file->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (segment_file->fd < 0)
+	{
+		logger()->error("Failed to open segment {}: {}", path, strerror(errno));
+		return false;
+	}
+
+#ifdef O_DIRECT
+	if (config.direct_io)
+	{
+		// Not every filesystem takes O_DIRECT, tmpfs for one
+		segment_file->direct_fd = ::open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+		if (segment_file->direct_fd < 0)
+		{
+			logger()->warn("Direct I/O is not available for {}: {}", path, strerror(errno));
+		}
+	}
+#endif
+
+#ifdef __linux__
+	if (config.preallocate_bytes > 0)
+	{
+		// Blocks are reserved past the end of the file, its size still tells what was written
+		if (fallocate(segment_file->fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(config.preallocate_bytes)) == 0)
+		{
+			segment_file->preallocated = true;
+		}
+		else
+		{
+			logger()->warn("Failed to preallocate {} bytes for {}: {}", config.preallocate_bytes, path, strerror(errno));
+			std::lock_guard<std::mutex> lock(stats_mutex);
+			stats.preallocation_failures++;
+		}
+	}
+#endif
+
+	if (staging && !staging->open(segment_file))
+	{
+		logger()->warn("Segment {} is written to the card directly", path);
+	}
+
+	file = segment_file;
+	block_fill = 0;
+	block_offset = 0;
+	return true;
+}
+
+bool SegmentSink::write(const uint8_t* data, size_t size)
+{
+	if (!file)
+	{
+		return false;
+	}
+
+	if (file->staged_fd >= 0)
+	{
+		// The staging gathers the chunks written to the card
+		if (!staging->write(*file, data, size, block_offset))
+		{
+			return false;
+		}
+		block_offset += size;
+		file->file_end = std::max(file->file_end, block_offset);
+		return true;
+	}
+
+	while (size > 0)
+	{
+		// Blocks end at multiples of the block size, also after a seek
+		size_t capacity = config.write_block_size - static_cast<size_t>(block_offset % config.write_block_size);
+		size_t chunk = std::min(size, capacity - block_fill);
+		memcpy(block + block_fill, data, chunk);
+		block_fill += chunk;
+		data += chunk;
+		size -= chunk;
+
+		if (block_fill == capacity && !flush_block())
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool SegmentSink::seek(uint64_t offset)
+{
+	if (offset == block_offset + block_fill)
+	{
+		return true;
+	}
+
+	// Writes in flight may cover the range the muxer goes back to
+	if (!flush_block() || !drain())
+	{
+		return false;
+	}
+	block_offset = offset;
+	return true;
+}
+
+bool SegmentSink::flush()
+{
+	if (file && file->staged_fd >= 0)
+	{
+		return staging->flush(*file);
+	}
+	return flush_block() && drain();
+}
+
+uint64_t SegmentSink::get_position() const
+{
+	return block_offset + block_fill;
+}
+
+bool SegmentSink::flush_block()
+{
+	if (block_fill == 0)
+	{
+		return true;
+	}
+	if (!file || file->failed)
+	{
+		return false;
+	}
+
+	bool aligned = block_offset % direct_io_alignment == 0 && block_fill % direct_io_alignment == 0;
+	int fd = file->direct_fd >= 0 && aligned ? file->direct_fd : file->fd;
+	bool sync_block = config.flush_policy == "block";
+	file->file_end = std::max(file->file_end, block_offset + block_fill);
+
+#ifdef CM_IO_URING
+	if (uring)
+	{
+		if (!uring->submit_write(file, fd, block, block_fill, block_offset, sync_block))
+		{
+			return false;
+		}
+		block_offset += block_fill;
+		block_fill = 0;
+
+		// Waits only when every block is in flight
+		block = uring->acquire_block();
+		return block != nullptr;
+	}
+#endif
+
+	auto started = std::chrono::steady_clock::now();
+	size_t written = 0;
+	while (written < block_fill)
+	{
+		ssize_t ret = pwrite(fd, block + written, block_fill - written, static_cast<off_t>(block_offset + written));
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ret <= 0)
+		{
+			logger()->error("Failed to write segment {}: {}", file->path, strerror(errno));
+			file->failed = true;
+			return false;
+		}
+		written += static_cast<size_t>(ret);
+	}
+	if (sync_block && fdatasync(file->fd) != 0)
+	{
+		logger()->error("Failed to sync segment {}: {}", file->path, strerror(errno));
+		file->failed = true;
+		return false;
+	}
+	uint64_t latency_usec = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+	on_write_done(*file, latency_usec, block_fill);
+
+	block_offset += block_fill;
+	block_fill = 0;
+	return true;
+}
+
+bool SegmentSink::drain()
+{
+#ifdef CM_IO_URING
+	if (uring && file)
+	{
+		return uring->drain(*file);
+	}
+#endif
+	return !file || !file->failed;
+}
+
+void SegmentSink::on_write_done(SegmentFile& segment_file, uint64_t latency_usec, size_t size)
+{
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	segment_file.max_latency_usec = std::max(segment_file.max_latency_usec, latency_usec);
+	stats.writes++;
+	stats.bytes_written += size;
+	stats.write_latency_max_usec = std::max(stats.write_latency_max_usec, latency_usec);
+	latency_buckets[get_latency_bucket(latency_usec)]++;
+}
+
+bool SegmentSink::finish_file(SegmentFile& segment_file)
+{
+	bool ok = !segment_file.failed;
+
+	// Gives back what the segment did not use
+	if (segment_file.preallocated && ftruncate(segment_file.fd, static_cast<off_t>(segment_file.file_end)) != 0)
+	{
+		logger()->warn("Failed to release preallocated space of {}: {}", segment_file.path, strerror(errno));
+	}
+
+	if (config.flush_policy != "none" && fdatasync(segment_file.fd) != 0)
+	{
+		logger()->error("Failed to sync segment {}: {}", segment_file.path, strerror(errno));
+		ok = false;
+	}
+
+	if (segment_file.direct_fd >= 0)
+	{
+		::close(segment_file.direct_fd);
+		segment_file.direct_fd = -1;
+	}
+	if (::close(segment_file.fd) != 0)
+	{
+		logger()->error("Failed to close segment {}: {}", segment_file.path, strerror(errno));
+		ok = false;
+	}
+	segment_file.fd = -1;
+
+	uint64_t max_latency_usec = 0;
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		stats.files_written++;
+		max_latency_usec = segment_file.max_latency_usec;
+	}
+	logger()->info("Segment {} closed at {} bytes, slowest write took {} usec", segment_file.path, segment_file.file_end, max_latency_usec);
+	return ok;
+}
+
+bool SegmentSink::close()
+{
+	if (!file)
+	{
+		return true;
+	}
+
+	bool ok = flush_block();
+	std::shared_ptr<SegmentFile> closed_file = file;
+	file.reset();
+	block_fill = 0;
+	block_offset = 0;
+
+	if (closed_file->staged_fd >= 0 && !staging->finish(*closed_file))
+	{
+		ok = false;
+	}
+
+#ifdef CM_IO_URING
+	if (uring)
+	{
+		// Trimming, syncing and closing happen on the completion thread
+		if (uring->submit_close(closed_file))
+		{
+			return ok;
+		}
+		logger()->warn("Failed to hand {} to the io_uring writer, closing it here", closed_file->path);
+		uring->drain(*closed_file);
+	}
+#endif
+
+	return finish_file(*closed_file) && ok;
+}
+
+size_t SegmentSink::get_latency_bucket(uint64_t latency_usec)
+{
+	if (latency_usec < 4)
+	{
+		return static_cast<size_t>(latency_usec);
+	}
+
+	int width = std::bit_width(latency_usec);
+	size_t bucket = static_cast<size_t>(width - 2) * 4 + static_cast<size_t>((latency_usec >> (width - 3)) & 0x3);
+	return std::min(bucket, latency_bucket_count - 1);
+}
+
+uint64_t SegmentSink::get_latency_bucket_bound(size_t bucket)
+{
+	// Lower bound of the next bucket, minus one
+	size_t next = bucket + 1;
+	if (next < 4)
+	{
+		return next - 1;
+	}
+	return ((4 + static_cast<uint64_t>(next % 4)) << (next / 4 - 1)) - 1;
+}
+
+uint64_t SegmentSink::get_latency_percentile(double percentile) const
+{
+	if (stats.writes == 0)
+	{
+		return 0;
+	}
+
+	uint64_t target = static_cast<uint64_t>(std::ceil(static_cast<double>(stats.writes) * percentile));
+	uint64_t count = 0;
+	for (size_t i = 0; i < latency_bucket_count; i++)
+	{
+		count += latency_buckets[i];
+		if (count >= target)
+		{
+			return std::min(get_latency_bucket_bound(i), stats.write_latency_max_usec);
+		}
+	}
+	return stats.write_latency_max_usec;
+}
+
+SegmentSinkStats SegmentSink::get_stats() const
+{
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	SegmentSinkStats result = stats;
+	result.write_latency_p50_usec = get_latency_percentile(0.50);
+	result.write_latency_p90_usec = get_latency_percentile(0.90);
+	result.write_latency_p99_usec = get_latency_percentile(0.99);
+	if (staging)
+	{
+		result.staged_bytes = staging->get_staged_bytes();
+		result.staging_stalls = staging->get_stalls();
+	}
+	return result;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <map>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <gst/gst.h>
+#include <spdlog/spdlog.h>
+#include "SegmentUring.h"
+#include "SegmentStaging.h"
+
+struct SegmentSinkConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	// Reserved on disk when a segment is opened, 0 disables preallocation
+	uint64_t preallocate_bytes = 0;
+	// Writes reach the disk in blocks of this size, aligned to it in the file
+	size_t write_block_size = 512 * 1024;
+	// "sync" writes on the streaming thread, "io_uring" hands blocks to the kernel and returns
+	std::string writer = "sync";
+	int writes_in_flight = 4;
+	// Whole aligned blocks bypass the page cache
+	bool direct_io = false;
+	// "none" leaves it to the kernel, "segment" syncs every segment when it is closed, "block" every block
+	std::string flush_policy = "none";
+	// Stages the active segment in this directory, empty writes to the card directly
+	std::string staging_path;
+	uint64_t staging_max_bytes = 64 * 1024 * 1024;
+	int staging_max_loss_sec = 10;
+};
+
+// An open segment. With io_uring it is finished on the completion thread after the streaming thread let go of it.
+struct SegmentFile
+{
+	std::string path;
+	int fd = -1;
+	// O_DIRECT descriptor for whole aligned blocks, -1 without direct I/O
+	int direct_fd = -1;
+	bool preallocated = false;
+	uint64_t file_end = 0;
+	uint64_t max_latency_usec = 0;
+	std::atomic<bool> failed = false;
+	// Guarded by the io_uring writer
+	int writes_in_flight = 0;
+	bool closing = false;
+	// Staging file in RAM, -1 when the segment is written to the card directly
+	std::string staged_path;
+	int staged_fd = -1;
+	// Written to the staging file but not to the card yet, guarded by the staging
+	std::map<uint64_t, uint64_t> staged_ranges;
+	// Whole pages punched out of the staging file after they reached the card, guarded by the staging
+	std::map<uint64_t, uint64_t> punched_ranges;
+};
+
+struct SegmentSinkStats
+{
+	uint64_t files_written = 0;
+	uint64_t bytes_written = 0;
+	uint64_t writes = 0;
+	uint64_t preallocation_failures = 0;
+	uint64_t write_latency_p50_usec = 0;
+	uint64_t write_latency_p90_usec = 0;
+	uint64_t write_latency_p99_usec = 0;
+	uint64_t write_latency_max_usec = 0;
+	uint64_t staged_bytes = 0;
+	uint64_t staging_stalls = 0;
+};
+
+// File sink for splitmuxsink. Every segment is preallocated with fallocate (keeping the file size,
+// so readers see only what was written) and trimmed back to its size when closed, so an hour of
+// recording ends up in a few large extents instead of thousands of small appends. Muxer output is
+// gathered into blocks aligned in the file, seeks of the muxer flush the current block first.
+// Blocks are written synchronously or through SegmentUring when the build has io_uring. With a
+// staging directory the segment goes to RAM first and SegmentStaging writes it to the card.
+class SegmentSink
+{
+private:
+	// Four buckets per power of two, percentiles are reported as the upper bound of their bucket
+	static const size_t latency_bucket_count = 160;
+
+	SegmentSinkConfig config;
+
+	static const size_t direct_io_alignment;
+
+	std::shared_ptr<SegmentFile> file;
+	uint8_t* block = nullptr;
+	size_t block_fill = 0;
+	uint64_t block_offset = 0;
+#ifdef CM_IO_URING
+	std::unique_ptr<SegmentUring> uring;
+#endif
+	std::unique_ptr<SegmentStaging> staging;
+
+	mutable std::mutex stats_mutex;
+	SegmentSinkStats stats;
+	std::array<uint64_t, latency_bucket_count> latency_buckets = {};
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	static size_t get_latency_bucket(uint64_t latency_usec);
+	static uint64_t get_latency_bucket_bound(size_t bucket);
+	uint64_t get_latency_percentile(double percentile) const;
+
+	bool is_async() const;
+	bool flush_block();
+	bool drain();
+	void on_write_done(SegmentFile& segment_file, uint64_t latency_usec, size_t size);
+	bool finish_file(SegmentFile& segment_file);
+
+public:
+	SegmentSink& operator=(const SegmentSink&) = delete;
+	SegmentSink(const SegmentSink& copy) = delete;
+	SegmentSink() = delete;
+
+	SegmentSink(const SegmentSinkConfig& config);
+	~SegmentSink();
+
+	// Sets up the writer, falls back to synchronous writes when io_uring is not available
+	bool start();
+
+	// Floating element with a "location" property, it keeps the SegmentSink alive
+	static GstElement* make_element(std::shared_ptr<SegmentSink> segment_sink);
+
+	bool open(const std::string& path);
+	bool write(const uint8_t* data, size_t size);
+	bool seek(uint64_t offset);
+	bool flush();
+	uint64_t get_position() const;
+	bool close();
+
+	SegmentSinkStats get_stats() const;
+};
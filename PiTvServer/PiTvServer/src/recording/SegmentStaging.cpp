@@ -0,0 +1,574 @@
+#include "SegmentStaging.h"
+#include <chrono>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include "SegmentSink.h"
+#ifdef CM_UNIX
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#endif
+
+SegmentStaging::SegmentStaging(const SegmentStagingConfig& config)
+{
+	this->config = config;
+	this->config.chunk_size = std::max(this->config.chunk_size, this->config.chunk_alignment);
+}
+
+SegmentStaging::~SegmentStaging()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> SegmentStaging::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool SegmentStaging::start()
+{
+	if (flush_thread.joinable())
+	{
+		return true;
+	}
+
+	std::error_code error;
+	std::filesystem::create_directories(config.staging_path, error);
+	if (error)
+	{
+		logger()->error("Failed to create the staging directory {}: {}", config.staging_path, error.message());
+		return false;
+	}
+
+#ifdef __linux__
+	struct statfs fs_stat;
+	if (statfs(config.staging_path.c_str(), &fs_stat) == 0 && fs_stat.f_type != TMPFS_MAGIC)
+	{
+		logger()->warn("Staging directory {} is not on tmpfs, staged segments wear the same storage", config.staging_path);
+	}
+#endif
+
+	long system_page_size = sysconf(_SC_PAGESIZE);
+	if (system_page_size > 0)
+	{
+		page_size = static_cast<size_t>(system_page_size);
+	}
+
+	void* memory = nullptr;
+	if (posix_memalign(&memory, config.chunk_alignment, config.chunk_size) != 0)
+	{
+		logger()->error("Failed to allocate {} bytes for the staging flush chunk", config.chunk_size);
+		return false;
+	}
+	chunk = static_cast<uint8_t*>(memory);
+
+	stopping = false;
+	flush_thread = std::thread([this]() { flush_loop(); });
+#ifdef CM_UNIX
+	pthread_setname_np(flush_thread.native_handle(), "pitv-staging");
+#endif
+
+	logger()->info("Recording segments are staged in {}, up to {} MiB, flushed at least every {} s",
+		config.staging_path, config.max_bytes / 1024 / 1024, config.max_loss_sec);
+	return true;
+}
+
+void SegmentStaging::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		stopping = true;
+	}
+	state_cv.notify_all();
+
+	if (flush_thread.joinable())
+	{
+		flush_thread.join();
+	}
+	free(chunk);
+	chunk = nullptr;
+}
+
+void SegmentStaging::flush_loop()
+{
+	std::unique_lock<std::mutex> lock(state_mutex);
+	auto next_flush = std::chrono::steady_clock::now() + std::chrono::seconds(config.max_loss_sec);
+	while (!stopping)
+	{
+		state_cv.wait_until(lock, next_flush, [this]()
+			{
+				return stopping || flush_requested || (staged_bytes >= config.max_bytes / 2 && file && !file->failed);
+			});
+		if (stopping)
+		{
+			break;
+		}
+
+		flush_requested = false;
+		std::shared_ptr<SegmentFile> staged_file = file;
+		lock.unlock();
+		if (staged_file)
+		{
+			flush(*staged_file);
+		}
+		lock.lock();
+		next_flush = std::chrono::steady_clock::now() + std::chrono::seconds(config.max_loss_sec);
+	}
+}
+
+bool SegmentStaging::open(std::shared_ptr<SegmentFile> segment_file)
+{
+	std::filesystem::path staged_path = std::filesystem::path(config.staging_path) / std::filesystem::path(segment_file->path).filename();
+	segment_file->staged_path = staged_path.string();
+	segment_file->staged_fd = ::open(segment_file->staged_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (segment_file->staged_fd < 0)
+	{
+		logger()->error("Failed to open staging file {}: {}", segment_file->staged_path, strerror(errno));
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(state_mutex);
+	file = segment_file;
+	return true;
+}
+
+uint64_t SegmentStaging::add_range(std::map<uint64_t, uint64_t>& ranges, uint64_t start, uint64_t end)
+{
+	uint64_t merged_start = start;
+	uint64_t merged_end = end;
+	uint64_t overlap = 0;
+
+	auto it = ranges.upper_bound(start);
+	if (it != ranges.begin() && std::prev(it)->second >= start)
+	{
+		it = std::prev(it);
+	}
+	while (it != ranges.end() && it->first <= end)
+	{
+		uint64_t overlap_start = std::max(start, it->first);
+		uint64_t overlap_end = std::min(end, it->second);
+		if (overlap_end > overlap_start)
+		{
+			overlap += overlap_end - overlap_start;
+		}
+		merged_start = std::min(merged_start, it->first);
+		merged_end = std::max(merged_end, it->second);
+		it = ranges.erase(it);
+	}
+	ranges[merged_start] = merged_end;
+
+	// Bytes the ranges did not cover yet
+	return end - start - overlap;
+}
+
+bool SegmentStaging::write(SegmentFile& segment_file, const uint8_t* data, size_t size, uint64_t offset)
+{
+	std::unique_lock<std::mutex> lock(state_mutex);
+	if (staged_bytes > 0 && staged_bytes + size > config.max_bytes)
+	{
+		// The card fell behind by the whole RAM limit, the muxer waits for the flush
+		if (stalls == 0)
+		{
+			logger()->warn("Staging of {} is full at {} bytes, recording waits for the card", segment_file.path, staged_bytes);
+		}
+		stalls++;
+		flush_requested = true;
+		state_cv.notify_all();
+		state_cv.wait(lock, [this, &segment_file, size]()
+			{
+				return stopping || segment_file.failed || staged_bytes == 0 || staged_bytes + size <= config.max_bytes;
+			});
+	}
+	if (segment_file.failed)
+	{
+		return false;
+	}
+
+	// Pages cut by the write at either end
+	uint64_t page = static_cast<uint64_t>(page_size);
+	uint64_t first_page = offset / page * page;
+	uint64_t last_page = (offset + size - 1) / page * page;
+	if (size > 0 && !segment_file.punched_ranges.empty()
+		&& ((offset != first_page && !refill_page(segment_file, first_page))
+			|| ((offset + size) % page != 0 && !refill_page(segment_file, last_page))))
+	{
+		segment_file.failed = true;
+		return false;
+	}
+	if (size > 0)
+	{
+		remove_range(segment_file.punched_ranges, offset, offset + size);
+	}
+
+	// Written under the lock, a flush never punches out data it did not copy
+	size_t written = 0;
+	while (written < size)
+	{
+		ssize_t ret = pwrite(segment_file.staged_fd, data + written, size - written, static_cast<off_t>(offset + written));
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ret <= 0)
+		{
+			logger()->error("Failed to write staging file {}: {}", segment_file.staged_path, strerror(errno));
+			segment_file.failed = true;
+			return false;
+		}
+		written += static_cast<size_t>(ret);
+	}
+
+	staged_bytes += add_range(segment_file.staged_ranges, offset, offset + size);
+	if (staged_bytes >= config.max_bytes / 2)
+	{
+		state_cv.notify_all();
+	}
+	return true;
+}
+
+bool SegmentStaging::copy_range(SegmentFile& segment_file, uint64_t start, uint64_t end)
+{
+	uint64_t offset = start;
+	while (offset < end)
+	{
+		// Chunks end at multiples of the chunk size, the card sees aligned sequential writes
+		size_t size = static_cast<size_t>(std::min<uint64_t>(end - offset, config.chunk_size - offset % config.chunk_size));
+
+		size_t read = 0;
+		while (read < size)
+		{
+			ssize_t ret = pread(segment_file.staged_fd, chunk + read, size - read, static_cast<off_t>(offset + read));
+			if (ret < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (ret <= 0)
+			{
+				logger()->error("Failed to read staging file {}: {}", segment_file.staged_path, ret < 0 ? strerror(errno) : "unexpected end of file");
+				segment_file.failed = true;
+				return false;
+			}
+			read += static_cast<size_t>(ret);
+		}
+
+		bool aligned = offset % config.chunk_alignment == 0 && size % config.chunk_alignment == 0;
+		int fd = segment_file.direct_fd >= 0 && aligned ? segment_file.direct_fd : segment_file.fd;
+		auto started = std::chrono::steady_clock::now();
+		size_t written = 0;
+		while (written < size)
+		{
+			ssize_t ret = pwrite(fd, chunk + written, size - written, static_cast<off_t>(offset + written));
+			if (ret < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (ret <= 0)
+			{
+				logger()->error("Failed to write segment {}: {}", segment_file.path, strerror(errno));
+				segment_file.failed = true;
+				return false;
+			}
+			written += static_cast<size_t>(ret);
+		}
+		uint64_t latency_usec = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+		config.write_done_handler(segment_file, latency_usec, size);
+
+		offset += size;
+	}
+	return true;
+}
+
+void SegmentStaging::punch_range(SegmentFile& segment_file, uint64_t start, uint64_t end)
+{
+#ifdef __linux__
+	// Only pages that lie entirely inside the copied range and hold nothing staged since. A page
+	// punched only in part would be read back as data by salvage(), zeros included.
+	uint64_t page = static_cast<uint64_t>(page_size);
+	uint64_t position = (start + page - 1) / page * page;
+	uint64_t limit = end / page * page;
+
+	auto it = segment_file.staged_ranges.upper_bound(position);
+	if (it != segment_file.staged_ranges.begin())
+	{
+		it = std::prev(it);
+	}
+	while (position < limit)
+	{
+		while (it != segment_file.staged_ranges.end() && it->second <= position)
+		{
+			it++;
+		}
+		uint64_t gap_end = it != segment_file.staged_ranges.end() ? std::min(limit, std::max(position, it->first)) : limit;
+
+		uint64_t punch_start = (position + page - 1) / page * page;
+		uint64_t punch_end = gap_end / page * page;
+		if (punch_end > punch_start)
+		{
+			if (fallocate(segment_file.staged_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				static_cast<off_t>(punch_start), static_cast<off_t>(punch_end - punch_start)) != 0)
+			{
+				logger()->debug("Failed to release staged range of {}: {}", segment_file.staged_path, strerror(errno));
+				return;
+			}
+			add_range(segment_file.punched_ranges, punch_start, punch_end);
+		}
+
+		if (it == segment_file.staged_ranges.end())
+		{
+			break;
+		}
+		position = std::max(position, it->second);
+	}
+#endif
+}
+
+void SegmentStaging::remove_range(std::map<uint64_t, uint64_t>& ranges, uint64_t start, uint64_t end)
+{
+	auto it = ranges.upper_bound(start);
+	if (it != ranges.begin() && std::prev(it)->second > start)
+	{
+		it = std::prev(it);
+	}
+	while (it != ranges.end() && it->first < end)
+	{
+		uint64_t range_start = it->first;
+		uint64_t range_end = it->second;
+		it = ranges.erase(it);
+		if (range_start < start)
+		{
+			ranges[range_start] = start;
+		}
+		if (range_end > end)
+		{
+			ranges[end] = range_end;
+		}
+	}
+}
+
+bool SegmentStaging::refill_page(SegmentFile& segment_file, uint64_t page_start)
+{
+	uint64_t page = static_cast<uint64_t>(page_size);
+	auto it = segment_file.punched_ranges.upper_bound(page_start);
+	if (it == segment_file.punched_ranges.begin() || std::prev(it)->second <= page_start)
+	{
+		return true;
+	}
+
+	// A write into part of a punched page would turn the rest of it into zeros the card does not
+	// have, so the page is staged again with its content from the card first
+	std::vector<uint8_t> buffer(page_size);
+	size_t read = 0;
+	while (read < page_size)
+	{
+		ssize_t ret = pread(segment_file.fd, buffer.data() + read, page_size - read, static_cast<off_t>(page_start + read));
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ret <= 0)
+		{
+			logger()->error("Failed to read back segment {}: {}", segment_file.path, ret < 0 ? strerror(errno) : "unexpected end of file");
+			return false;
+		}
+		read += static_cast<size_t>(ret);
+	}
+	if (pwrite(segment_file.staged_fd, buffer.data(), page_size, static_cast<off_t>(page_start)) != static_cast<ssize_t>(page_size))
+	{
+		logger()->error("Failed to write staging file {}: {}", segment_file.staged_path, strerror(errno));
+		return false;
+	}
+
+	remove_range(segment_file.punched_ranges, page_start, page_start + page);
+	staged_bytes += add_range(segment_file.staged_ranges, page_start, page_start + page);
+	return true;
+}
+
+bool SegmentStaging::flush(SegmentFile& segment_file)
+{
+	std::lock_guard<std::mutex> flush_lock(flush_mutex);
+
+	std::map<uint64_t, uint64_t> ranges;
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		ranges.swap(segment_file.staged_ranges);
+	}
+	if (ranges.empty())
+	{
+		return !segment_file.failed;
+	}
+
+	// Copied without the lock, the muxer goes on writing into the staging file meanwhile
+	bool ok = !segment_file.failed;
+	uint64_t copied = 0;
+	for (const auto& [start, end] : ranges)
+	{
+		if (!ok || !copy_range(segment_file, start, end))
+		{
+			ok = false;
+			break;
+		}
+		copied += end - start;
+	}
+	if (ok && fdatasync(segment_file.fd) != 0)
+	{
+		logger()->error("Failed to sync segment {}: {}", segment_file.path, strerror(errno));
+		segment_file.failed = true;
+		ok = false;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		uint64_t taken = 0;
+		for (const auto& [start, end] : ranges)
+		{
+			taken += end - start;
+		}
+		staged_bytes -= std::min(staged_bytes, taken);
+
+		// Ranges written again during the copy are staged once more and stay
+		if (ok)
+		{
+			for (const auto& [start, end] : ranges)
+			{
+				punch_range(segment_file, start, end);
+			}
+		}
+	}
+	state_cv.notify_all();
+
+	if (ok)
+	{
+		logger()->debug("Flushed {} staged bytes to {}", copied, segment_file.path);
+	}
+	return ok;
+}
+
+bool SegmentStaging::finish(SegmentFile& segment_file)
+{
+	bool ok = flush(segment_file);
+
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		if (file.get() == &segment_file)
+		{
+			file.reset();
+		}
+	}
+
+	if (segment_file.staged_fd >= 0)
+	{
+		::close(segment_file.staged_fd);
+		segment_file.staged_fd = -1;
+	}
+	// A failed segment keeps its staging file, the next start puts it back
+	if (ok && unlink(segment_file.staged_path.c_str()) != 0)
+	{
+		logger()->warn("Failed to remove staging file {}: {}", segment_file.staged_path, strerror(errno));
+	}
+	return ok;
+}
+
+uint64_t SegmentStaging::get_staged_bytes()
+{
+	std::lock_guard<std::mutex> lock(state_mutex);
+	return staged_bytes;
+}
+
+uint64_t SegmentStaging::get_stalls()
+{
+	std::lock_guard<std::mutex> lock(state_mutex);
+	return stalls;
+}
+
+void SegmentStaging::salvage(std::shared_ptr<spdlog::logger> logger_ptr, const std::string& staging_path, const std::string& recording_path,
+	const std::vector<std::string>& recording_extensions, std::filesystem::file_time_type written_before)
+{
+	std::error_code error;
+	if (!std::filesystem::is_directory(staging_path, error))
+	{
+		return;
+	}
+
+	for (const auto& dir_entry : std::filesystem::directory_iterator(staging_path, error))
+	{
+		const std::filesystem::path& staged_path = dir_entry.path();
+		bool is_recording = std::any_of(recording_extensions.begin(), recording_extensions.end(),
+			[&staged_path](const std::string& extension) { return staged_path.extension() == "." + extension; });
+		// The staging of the running pipeline is newer and stays alone
+		std::error_code time_error;
+		if (!is_recording || !dir_entry.is_regular_file() || dir_entry.last_write_time(time_error) >= written_before || time_error)
+		{
+			continue;
+		}
+
+#ifdef SEEK_DATA
+		std::filesystem::path target_path = std::filesystem::path(recording_path) / staged_path.filename();
+		int staged_fd = ::open(staged_path.c_str(), O_RDONLY | O_CLOEXEC);
+		int target_fd = ::open(target_path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		if (staged_fd < 0 || target_fd < 0)
+		{
+			logger_ptr->error("Failed to salvage staging file {}: {}", staged_path.string(), strerror(errno));
+			if (staged_fd >= 0)
+			{
+				::close(staged_fd);
+			}
+			if (target_fd >= 0)
+			{
+				::close(target_fd);
+			}
+			continue;
+		}
+
+		// Flushed ranges were punched out, the data left is what the card never got
+		std::vector<uint8_t> buffer(1024 * 1024);
+		uint64_t salvaged = 0;
+		bool ok = true;
+		off_t data_start = lseek(staged_fd, 0, SEEK_DATA);
+		while (ok && data_start >= 0)
+		{
+			off_t data_end = lseek(staged_fd, data_start, SEEK_HOLE);
+			if (data_end < 0)
+			{
+				ok = false;
+				break;
+			}
+			for (off_t offset = data_start; ok && offset < data_end;)
+			{
+				size_t size = static_cast<size_t>(std::min<off_t>(data_end - offset, static_cast<off_t>(buffer.size())));
+				ssize_t read = pread(staged_fd, buffer.data(), size, offset);
+				ok = read > 0 && pwrite(target_fd, buffer.data(), static_cast<size_t>(read), offset) == read;
+				if (ok)
+				{
+					offset += read;
+					salvaged += static_cast<uint64_t>(read);
+				}
+			}
+			data_start = lseek(staged_fd, data_end, SEEK_DATA);
+		}
+		ok = ok && fdatasync(target_fd) == 0;
+
+		::close(staged_fd);
+		if (::close(target_fd) != 0)
+		{
+			ok = false;
+		}
+		if (!ok)
+		{
+			logger_ptr->error("Failed to salvage staging file {}: {}", staged_path.string(), strerror(errno));
+			continue;
+		}
+
+		logger_ptr->info("Salvaged {} staged bytes of {}", salvaged, target_path.string());
+		std::filesystem::remove(staged_path, error);
+#else
+		logger_ptr->warn("Staging file {} of the previous run cannot be salvaged on this system", staged_path.string());
+#endif
+	}
+}
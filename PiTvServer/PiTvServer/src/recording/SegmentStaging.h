@@ -0,0 +1,95 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <filesystem>
+#include <condition_variable>
+#include <spdlog/spdlog.h>
+
+struct SegmentFile;
+
+struct SegmentStagingConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	// Directory on tmpfs, used only by the staging
+	std::string staging_path;
+	// RAM taken by footage not yet on the card, the muxer waits above it
+	uint64_t max_bytes = 64 * 1024 * 1024;
+	// Staged footage is written to the card and synced at least this often
+	int max_loss_sec = 10;
+	// Size and alignment of the writes to the card
+	size_t chunk_size = 512 * 1024;
+	size_t chunk_alignment = 4096;
+	// Called for every write to the card
+	std::function<void(SegmentFile& file, uint64_t latency_usec, size_t size)> write_done_handler;
+};
+
+// Stages the active segment in RAM. Muxer output goes into a file of the same name in a tmpfs
+// directory, a flush thread copies what changed to the segment on the card in large chunks every
+// max_loss_sec (or when half of the RAM limit is used) and syncs it, so a power loss costs at most
+// that much footage. Copied ranges are punched out of the staging file, it only holds what the card
+// does not have yet. Staging files left behind by a crashed process are put back by salvage().
+class SegmentStaging
+{
+private:
+	SegmentStagingConfig config;
+	size_t page_size = 4096;
+
+	std::mutex state_mutex;
+	std::condition_variable state_cv;
+	std::shared_ptr<SegmentFile> file;
+	uint64_t staged_bytes = 0;
+	uint64_t stalls = 0;
+	bool flush_requested = false;
+	bool stopping = false;
+
+	// One copy to the card at a time, the flush thread and the streaming thread share the chunk
+	std::mutex flush_mutex;
+	uint8_t* chunk = nullptr;
+	std::thread flush_thread;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	void flush_loop();
+	bool copy_range(SegmentFile& segment_file, uint64_t start, uint64_t end);
+	void punch_range(SegmentFile& segment_file, uint64_t start, uint64_t end);
+	bool refill_page(SegmentFile& segment_file, uint64_t page_start);
+
+public:
+	SegmentStaging& operator=(const SegmentStaging&) = delete;
+	SegmentStaging(const SegmentStaging& copy) = delete;
+	SegmentStaging() = delete;
+
+	SegmentStaging(const SegmentStagingConfig& config);
+	~SegmentStaging();
+
+	bool start();
+	void stop();
+
+	// Creates the staging file of a segment whose card file is already open
+	bool open(std::shared_ptr<SegmentFile> segment_file);
+	// Waits while the RAM limit is reached
+	bool write(SegmentFile& segment_file, const uint8_t* data, size_t size, uint64_t offset);
+	// Copies everything staged to the card and syncs it
+	bool flush(SegmentFile& segment_file);
+	// Flushes and removes the staging file
+	bool finish(SegmentFile& segment_file);
+
+	uint64_t get_staged_bytes();
+	uint64_t get_stalls();
+
+	// Merges [start, end) into the ranges, returns the bytes they did not cover yet
+	static uint64_t add_range(std::map<uint64_t, uint64_t>& ranges, uint64_t start, uint64_t end);
+	static void remove_range(std::map<uint64_t, uint64_t>& ranges, uint64_t start, uint64_t end);
+
+	// Copies what staging files of the previous run, last written before written_before, still hold
+	// into the recordings of the same name
+	static void salvage(std::shared_ptr<spdlog::logger> logger_ptr, const std::string& staging_path, const std::string& recording_path,
+		const std::vector<std::string>& recording_extensions, std::filesystem::file_time_type written_before);
+};
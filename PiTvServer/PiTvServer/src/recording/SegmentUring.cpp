@@ -0,0 +1,329 @@
+#include "SegmentUring.h"
+
+#ifdef CM_IO_URING
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include "SegmentSink.h"
+#ifdef CM_UNIX
+#include <pthread.h>
+#endif
+
+SegmentUring::SegmentUring(const SegmentUringConfig& config)
+{
+	this->config = config;
+}
+
+SegmentUring::~SegmentUring()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> SegmentUring::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool SegmentUring::start()
+{
+	if (ring_ready)
+	{
+		return true;
+	}
+
+	// Every block may carry a write and a linked sync, plus the close of a file or two
+	unsigned int entries = static_cast<unsigned int>(config.block_count) * 2 + 4;
+	int ret = io_uring_queue_init(entries, &ring, 0);
+	if (ret < 0)
+	{
+		logger()->error("Failed to set up io_uring: {}", strerror(-ret));
+		return false;
+	}
+	ring_ready = true;
+
+	for (int i = 0; i < config.block_count; i++)
+	{
+		void* block = nullptr;
+		if (posix_memalign(&block, config.block_alignment, config.block_size) != 0)
+		{
+			logger()->error("Failed to allocate {} bytes for a segment write block", config.block_size);
+			stop();
+			return false;
+		}
+		blocks.push_back(static_cast<uint8_t*>(block));
+	}
+	free_blocks = blocks;
+
+	completion_stopped = false;
+	completion_thread = std::thread([this]() { completion_loop(); });
+#ifdef CM_UNIX
+	pthread_setname_np(completion_thread.native_handle(), "pitv-uring");
+#endif
+	return true;
+}
+
+void SegmentUring::stop()
+{
+	if (!ring_ready)
+	{
+		return;
+	}
+
+	if (completion_thread.joinable())
+	{
+		// Drained: the stop request completes after everything submitted before it
+		bool submitted = false;
+		{
+			std::lock_guard<std::mutex> lock(submit_mutex);
+			io_uring_sqe* sqe = get_sqe();
+			if (sqe)
+			{
+				Request* request = new Request();
+				request->type = RequestType::Stop;
+				io_uring_prep_nop(sqe);
+				io_uring_sqe_set_data(sqe, request);
+				sqe->flags |= IOSQE_IO_DRAIN;
+				submitted = io_uring_submit(&ring) >= 0;
+			}
+		}
+		if (!submitted)
+		{
+			logger()->error("Failed to stop the io_uring completion thread, it is left behind");
+			completion_thread.detach();
+			return;
+		}
+		completion_thread.join();
+	}
+
+	io_uring_queue_exit(&ring);
+	ring_ready = false;
+
+	for (uint8_t* block : blocks)
+	{
+		free(block);
+	}
+	blocks.clear();
+	free_blocks.clear();
+}
+
+io_uring_sqe* SegmentUring::get_sqe()
+{
+	io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+	if (!sqe && io_uring_submit(&ring) >= 0)
+	{
+		sqe = io_uring_get_sqe(&ring);
+	}
+	return sqe;
+}
+
+uint8_t* SegmentUring::acquire_block()
+{
+	std::unique_lock<std::mutex> lock(state_mutex);
+	state_cv.wait(lock, [this]() { return !free_blocks.empty() || completion_stopped; });
+	if (free_blocks.empty())
+	{
+		return nullptr;
+	}
+
+	uint8_t* block = free_blocks.back();
+	free_blocks.pop_back();
+	return block;
+}
+
+void SegmentUring::release_block(uint8_t* block)
+{
+	if (!block)
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		free_blocks.push_back(block);
+	}
+	state_cv.notify_all();
+}
+
+bool SegmentUring::submit_write(std::shared_ptr<SegmentFile> file, int fd, uint8_t* block, size_t size, uint64_t offset, bool sync_after)
+{
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		file->writes_in_flight += sync_after ? 2 : 1;
+	}
+
+	Request* request = new Request();
+	request->type = RequestType::Write;
+	request->file = file;
+	request->block = block;
+	request->size = size;
+	request->submitted = std::chrono::steady_clock::now();
+
+	std::lock_guard<std::mutex> lock(submit_mutex);
+	io_uring_sqe* sqe = get_sqe();
+	io_uring_sqe* sync_sqe = nullptr;
+	if (sqe)
+	{
+		io_uring_prep_write(sqe, fd, block, static_cast<unsigned int>(size), offset);
+		io_uring_sqe_set_data(sqe, request);
+		if (sync_after)
+		{
+			sqe->flags |= IOSQE_IO_LINK;
+			sync_sqe = io_uring_get_sqe(&ring);
+		}
+	}
+
+	if (!sqe || (sync_after && !sync_sqe))
+	{
+		// The ring has room for everything the pool allows, this is not expected
+		logger()->error("io_uring submission queue of {} is full", file->path);
+		if (sqe)
+		{
+			io_uring_prep_nop(sqe);
+			io_uring_sqe_set_data(sqe, nullptr);
+			sqe->flags = 0;
+			io_uring_submit(&ring);
+		}
+		{
+			std::lock_guard<std::mutex> state_lock(state_mutex);
+			file->writes_in_flight -= sync_after ? 2 : 1;
+		}
+		delete request;
+		return false;
+	}
+
+	if (sync_sqe)
+	{
+		Request* sync_request = new Request();
+		sync_request->type = RequestType::Sync;
+		sync_request->file = file;
+		sync_request->submitted = request->submitted;
+		io_uring_prep_fsync(sync_sqe, file->fd, IORING_FSYNC_DATASYNC);
+		io_uring_sqe_set_data(sync_sqe, sync_request);
+	}
+
+	int ret = io_uring_submit(&ring);
+	if (ret < 0)
+	{
+		// Prepared entries stay in the queue and go out with the next submission
+		logger()->warn("io_uring submission for {} deferred: {}", file->path, strerror(-ret));
+	}
+	return true;
+}
+
+bool SegmentUring::drain(SegmentFile& file)
+{
+	std::unique_lock<std::mutex> lock(state_mutex);
+	state_cv.wait(lock, [this, &file]() { return file.writes_in_flight == 0 || completion_stopped; });
+	return file.writes_in_flight == 0 && !file.failed;
+}
+
+bool SegmentUring::submit_close(std::shared_ptr<SegmentFile> file)
+{
+	Request* request = new Request();
+	request->type = RequestType::Close;
+	request->file = file;
+
+	std::lock_guard<std::mutex> lock(submit_mutex);
+	io_uring_sqe* sqe = get_sqe();
+	if (!sqe)
+	{
+		delete request;
+		return false;
+	}
+	io_uring_prep_nop(sqe);
+	io_uring_sqe_set_data(sqe, request);
+	return io_uring_submit(&ring) >= 0;
+}
+
+void SegmentUring::completion_loop()
+{
+	while (true)
+	{
+		io_uring_cqe* cqe = nullptr;
+		int ret = io_uring_wait_cqe(&ring, &cqe);
+		if (ret == -EINTR)
+		{
+			continue;
+		}
+		if (ret < 0)
+		{
+			logger()->error("io_uring completion failed: {}, segment writes stop", strerror(-ret));
+			break;
+		}
+
+		Request* request = static_cast<Request*>(io_uring_cqe_get_data(cqe));
+		int result = cqe->res;
+		io_uring_cqe_seen(&ring, cqe);
+		if (!request)
+		{
+			continue;
+		}
+		if (request->type == RequestType::Stop)
+		{
+			delete request;
+			break;
+		}
+		complete(request, result);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		completion_stopped = true;
+	}
+	state_cv.notify_all();
+}
+
+void SegmentUring::complete(Request* request, int result)
+{
+	SegmentFile& file = *request->file;
+	bool file_done = false;
+
+	if (request->type == RequestType::Write)
+	{
+		if (result != static_cast<int>(request->size))
+		{
+			logger()->error("Failed to write segment {}: {}", file.path, result < 0 ? strerror(-result) : "short write");
+			file.failed = true;
+		}
+		else
+		{
+			uint64_t latency_usec = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - request->submitted).count());
+			config.write_done_handler(file, latency_usec, request->size);
+		}
+	}
+	else if (request->type == RequestType::Sync && result < 0)
+	{
+		// A failed write cancels the sync linked behind it
+		if (result != -ECANCELED)
+		{
+			logger()->error("Failed to sync segment {}: {}", file.path, strerror(-result));
+		}
+		file.failed = true;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		if (request->type == RequestType::Write)
+		{
+			free_blocks.push_back(request->block);
+		}
+		if (request->type == RequestType::Close)
+		{
+			file.closing = true;
+		}
+		else
+		{
+			file.writes_in_flight--;
+		}
+		file_done = file.closing && file.writes_in_flight == 0;
+	}
+	state_cv.notify_all();
+
+	if (file_done)
+	{
+		config.file_done_handler(file);
+	}
+	delete request;
+}
+#endif
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+#include <spdlog/spdlog.h>
+#ifdef CM_IO_URING
+#include <liburing.h>
+#endif
+
+struct SegmentFile;
+
+struct SegmentUringConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	// Blocks in the pool, one is being filled while the others may be in flight
+	int block_count = 5;
+	size_t block_size = 512 * 1024;
+	size_t block_alignment = 4096;
+	// Called on the completion thread
+	std::function<void(SegmentFile& file, uint64_t latency_usec, size_t size)> write_done_handler;
+	std::function<void(SegmentFile& file)> file_done_handler;
+};
+
+#ifdef CM_IO_URING
+// Segment writes through io_uring. The streaming thread only fills blocks and submits them, a
+// completion thread returns blocks to the pool and finishes closed files (trim, sync, close), so
+// neither write() nor fdatasync() run on the streaming thread. The pool bounds the writes in
+// flight: when the card falls behind, acquire_block() waits for the oldest write to complete.
+class SegmentUring
+{
+private:
+	enum class RequestType
+	{
+		Write,
+		Sync,
+		Close,
+		Stop
+	};
+
+	struct Request
+	{
+		RequestType type = RequestType::Write;
+		std::shared_ptr<SegmentFile> file;
+		uint8_t* block = nullptr;
+		size_t size = 0;
+		std::chrono::steady_clock::time_point submitted;
+	};
+
+	SegmentUringConfig config;
+
+	io_uring ring = {};
+	bool ring_ready = false;
+	std::thread completion_thread;
+	bool completion_stopped = false;
+
+	std::mutex submit_mutex;
+	std::mutex state_mutex;
+	std::condition_variable state_cv;
+	std::vector<uint8_t*> blocks;
+	std::vector<uint8_t*> free_blocks;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	void completion_loop();
+	void complete(Request* request, int result);
+	io_uring_sqe* get_sqe();
+
+public:
+	SegmentUring& operator=(const SegmentUring&) = delete;
+	SegmentUring(const SegmentUring& copy) = delete;
+	SegmentUring() = delete;
+
+	SegmentUring(const SegmentUringConfig& config);
+	~SegmentUring();
+
+	bool start();
+	// Waits for every submitted request, files closed before are finished
+	void stop();
+
+	// nullptr when the completion thread is gone
+	uint8_t* acquire_block();
+	void release_block(uint8_t* block);
+
+	// The block goes back to the pool once written. With sync_after a datasync is linked behind the write.
+	bool submit_write(std::shared_ptr<SegmentFile> file, int fd, uint8_t* block, size_t size, uint64_t offset, bool sync_after);
+
+	// Waits until the writes of the file are complete, false if one of them failed
+	bool drain(SegmentFile& file);
+
+	// file_done_handler runs once the writes of the file are complete
+	bool submit_close(std::shared_ptr<SegmentFile> file);
+};
+#endif
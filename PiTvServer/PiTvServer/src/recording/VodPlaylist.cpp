@@ -0,0 +1,222 @@
+#include "VodPlaylist.h"
+#include <ctime>
+#include <cstdio>
+#include <cmath>
+#include <cctype>
+#include <sstream>
+#include <algorithm>
+#include "../video/Fmp4Writer.h"
+
+const int VodPlaylist::target_segment_msec = 6000;
+
+uint32_t VodPlaylist::get_sample_duration(const std::vector<SegmentIndexEntry>& entries, size_t index)
+{
+	// Stateless, so segments generated independently agree on the timeline.
+	// Encoders run without B-frames, presentation times grow in decode order.
+	for (size_t next : { index + 1, index })
+	{
+		if (next == 0 || next >= entries.size())
+		{
+			continue;
+		}
+
+		int64_t delta_ns = static_cast<int64_t>(entries[next].pts_ns - entries[next - 1].pts_ns);
+		if (delta_ns > 0 && delta_ns < 10000000000LL)
+		{
+			return static_cast<uint32_t>(delta_ns * Fmp4Writer::video_timescale / 1000000000);
+		}
+	}
+	return Fmp4Writer::video_timescale / 25;
+}
+
+uint64_t VodPlaylist::get_decode_time(const std::vector<SegmentIndexEntry>& entries, size_t index)
+{
+	if (index == 0 || entries[index].pts_ns <= entries[0].pts_ns)
+	{
+		return 0;
+	}
+	return (entries[index].pts_ns - entries[0].pts_ns) * Fmp4Writer::video_timescale / 1000000000;
+}
+
+std::string VodPlaylist::url_encode(const std::string& str)
+{
+	static const char hex_digits[] = "0123456789ABCDEF";
+
+	std::string encoded;
+	for (unsigned char ch : str)
+	{
+		if (isalnum(ch) || ch == '-' || ch == '_' || ch == '.' || ch == '~')
+		{
+			encoded += static_cast<char>(ch);
+		}
+		else
+		{
+			encoded += '%';
+			encoded += hex_digits[ch >> 4];
+			encoded += hex_digits[ch & 0xF];
+		}
+	}
+	return encoded;
+}
+
+std::string VodPlaylist::format_date_time(int64_t wallclock_usec)
+{
+	time_t seconds = static_cast<time_t>(wallclock_usec / 1000000);
+	struct tm tstruct;
+	gmtime_r(&seconds, &tstruct);
+
+	char buf[64];
+	size_t length = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tstruct);
+	snprintf(buf + length, sizeof(buf) - length, ".%03dZ", static_cast<int>((wallclock_usec / 1000) % 1000));
+	return buf;
+}
+
+std::string VodPlaylist::make_playlist(const std::vector<RecordingRange>& ranges)
+{
+	std::stringstream body;
+	double max_duration = 0;
+	bool first_file = true;
+
+	for (const auto& range : ranges)
+	{
+		SegmentIndexHeader index_header;
+		std::vector<SegmentIndexEntry> entries;
+		if (!range.exact || !SegmentIndex::read(SegmentIndex::get_index_path(range.segment.path), index_header, entries))
+		{
+			continue;
+		}
+
+		ptrdiff_t first = SegmentIndex::find_keyframe(entries, range.start_wallclock_usec);
+		auto end_iter = std::upper_bound(entries.begin(), entries.end(), range.end_wallclock_usec,
+			[](int64_t value, const SegmentIndexEntry& entry) { return value < entry.wallclock_usec; });
+		size_t end = static_cast<size_t>(end_iter - entries.begin());
+		if (first < 0 || end <= static_cast<size_t>(first))
+		{
+			continue;
+		}
+
+		std::string name = url_encode(range.segment.name);
+		if (!first_file)
+		{
+			body << "#EXT-X-DISCONTINUITY\n";
+		}
+		first_file = false;
+		body << "#EXT-X-MAP:URI=\"init.mp4?name=" << name << "\"\n";
+		body << "#EXT-X-PROGRAM-DATE-TIME:" << format_date_time(entries[first].wallclock_usec) << "\n";
+
+		// Whole GOPs are gathered until the target duration, the range end may cut the last one
+		uint64_t target_ticks = static_cast<uint64_t>(target_segment_msec) * Fmp4Writer::video_timescale / 1000;
+		size_t segment_start = static_cast<size_t>(first);
+		uint64_t segment_ticks = 0;
+		for (size_t i = segment_start; i < end; i++)
+		{
+			segment_ticks += get_sample_duration(entries, i);
+
+			bool last = i + 1 == end;
+			bool next_keyframe = !last && (entries[i + 1].flags & segment_index_entry_keyframe);
+			if (!last && !(next_keyframe && segment_ticks >= target_ticks))
+			{
+				continue;
+			}
+
+			double duration = static_cast<double>(segment_ticks) / Fmp4Writer::video_timescale;
+			max_duration = std::max(max_duration, duration);
+			char extinf[32];
+			snprintf(extinf, sizeof(extinf), "%.3f", duration);
+			body << "#EXTINF:" << extinf << ",\n"
+				<< "segment.m4s?name=" << name << "&first=" << segment_start << "&count=" << (i + 1 - segment_start) << "\n";
+
+			segment_start = i + 1;
+			segment_ticks = 0;
+		}
+	}
+
+	std::stringstream playlist;
+	playlist << "#EXTM3U\n"
+		<< "#EXT-X-VERSION:7\n"
+		<< "#EXT-X-TARGETDURATION:" << std::max(1, static_cast<int>(std::lround(std::ceil(max_duration)))) << "\n"
+		<< "#EXT-X-PLAYLIST-TYPE:VOD\n"
+		<< "#EXT-X-INDEPENDENT-SEGMENTS\n"
+		<< body.str()
+		<< "#EXT-X-ENDLIST\n";
+	return playlist.str();
+}
+
+bool VodPlaylist::make_init_segment(const std::string& mp4_path, std::vector<uint8_t>& init)
+{
+	std::vector<uint8_t> avcc;
+	int width = 0;
+	int height = 0;
+	if (!SegmentIndex::find_mp4_video_config(mp4_path, avcc, width, height))
+	{
+		return false;
+	}
+
+	init = Fmp4Writer::make_init_segment(avcc, width, height);
+	return true;
+}
+
+bool VodPlaylist::make_media_segment(const std::string& mp4_path, size_t first_entry, size_t entry_count, std::vector<uint8_t>& segment)
+{
+	SegmentIndexHeader index_header;
+	std::vector<SegmentIndexEntry> entries;
+	if (!SegmentIndex::read(SegmentIndex::get_index_path(mp4_path), index_header, entries)
+		|| entry_count == 0 || first_entry >= entries.size() || entry_count > entries.size() - first_entry
+		|| !(entries[first_entry].flags & segment_index_entry_keyframe))
+	{
+		return false;
+	}
+
+	FILE* file = fopen(mp4_path.c_str(), "rb");
+	if (!file)
+	{
+		return false;
+	}
+
+	std::vector<Fmp4Sample> samples;
+	std::vector<uint8_t> payload;
+	bool ok = true;
+	size_t i = first_entry;
+	size_t end = first_entry + entry_count;
+	while (ok && i < end)
+	{
+		// Samples of a GOP are contiguous in the file unless a fragment header sits between them
+		uint64_t run_offset = 0;
+		ok = SegmentIndex::get_file_offset(index_header, entries[i], run_offset);
+		uint64_t run_size = 0;
+		size_t run_end = i;
+		while (ok && run_end < end)
+		{
+			uint64_t offset = 0;
+			if (!SegmentIndex::get_file_offset(index_header, entries[run_end], offset) || offset != run_offset + run_size)
+			{
+				break;
+			}
+
+			Fmp4Sample sample;
+			sample.duration = get_sample_duration(entries, run_end);
+			sample.size = entries[run_end].size;
+			sample.keyframe = entries[run_end].flags & segment_index_entry_keyframe;
+			samples.push_back(sample);
+			run_size += entries[run_end].size;
+			run_end++;
+		}
+
+		size_t payload_size = payload.size();
+		payload.resize(payload_size + run_size);
+		ok = ok && run_end > i
+			&& fseeko(file, static_cast<off_t>(run_offset), SEEK_SET) == 0
+			&& fread(payload.data() + payload_size, 1, run_size, file) == run_size;
+		i = run_end;
+	}
+	fclose(file);
+
+	if (!ok)
+	{
+		return false;
+	}
+
+	segment = Fmp4Writer::make_fragment_header(static_cast<uint32_t>(first_entry + 1), get_decode_time(entries, first_entry), samples);
+	segment.insert(segment.end(), payload.begin(), payload.end());
+	return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "RecordingCatalog.h"
+#include "SegmentIndex.h"
+
+// HLS VOD over the recordings. A media segment is a run of whole GOPs of one recording file:
+// the samples are one byte range of the file (a few ranges for fragmented files), read at the
+// sidecar offsets and prefixed with a generated moof. Nothing is transcoded or copied to disk.
+class VodPlaylist
+{
+public:
+	static const int target_segment_msec;
+
+	// Every recording file starts a discontinuity with its own init segment and program date-time
+	static std::string make_playlist(const std::vector<RecordingRange>& ranges);
+
+	static bool make_init_segment(const std::string& mp4_path, std::vector<uint8_t>& init);
+
+	// entry_count samples starting at the keyframe first_entry of the recording's sidecar
+	static bool make_media_segment(const std::string& mp4_path, size_t first_entry, size_t entry_count, std::vector<uint8_t>& segment);
+
+private:
+	static uint32_t get_sample_duration(const std::vector<SegmentIndexEntry>& entries, size_t index);
+	static uint64_t get_decode_time(const std::vector<SegmentIndexEntry>& entries, size_t index);
+	static std::string url_encode(const std::string& str);
+	static std::string format_date_time(int64_t wallclock_usec);
+};
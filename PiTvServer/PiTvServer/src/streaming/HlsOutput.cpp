@@ -0,0 +1,397 @@
+#include "HlsOutput.h"
+#include <cassert>
+#include <cmath>
+#include <ctime>
+#include <sstream>
+#include <iomanip>
+
+HlsOutput::HlsOutput(const HlsOutputConfig& config, std::shared_ptr<EncodedTap> encoded_tap)
+{
+	this->config = config;
+	this->encoded_tap = encoded_tap;
+	target_duration_sec = std::max(1, static_cast<int>(std::ceil(config.segment_duration_msec / 1000.0)));
+}
+
+HlsOutput::~HlsOutput()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> HlsOutput::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool HlsOutput::start()
+{
+	if (tap_listener_id)
+	{
+		logger()->warn("HLS output is already running!");
+		return true;
+	}
+
+	if (!encoded_tap)
+	{
+		logger()->error("Cannot start HLS output: encoded tap is not available!");
+		return false;
+	}
+
+	if (config.part_duration_msec <= 0 || config.segment_duration_msec < config.part_duration_msec || config.segment_count < 2)
+	{
+		logger()->error("Invalid HLS configuration: part duration {} msec, segment duration {} msec, {} segments",
+			config.part_duration_msec, config.segment_duration_msec, config.segment_count);
+		return false;
+	}
+
+	tap_listener_id = encoded_tap->add_listener([this](const EncodedFramePtr& frame)
+		{
+			on_encoded_frame(frame);
+		}
+	);
+
+	logger()->info("LL-HLS output started: part target {} msec, segment target {} msec, {} segments kept",
+		config.part_duration_msec, config.segment_duration_msec, config.segment_count);
+	return true;
+}
+
+void HlsOutput::stop()
+{
+	if (!tap_listener_id)
+	{
+		return;
+	}
+
+	encoded_tap->remove_listener(tap_listener_id);
+	tap_listener_id = 0;
+	logger()->info("LL-HLS output stopped");
+}
+
+void HlsOutput::reset_stream(std::shared_ptr<const EncodedStreamInfo> info)
+{
+	bool restarted = stream_info != nullptr;
+	if (restarted)
+	{
+		// What the previous configuration produced is closed as a segment of its own
+		Fmp4TimedSample timed_sample;
+		if (timeline.flush(timed_sample))
+		{
+			append_sample(timed_sample);
+		}
+		flush_part(true);
+	}
+
+	stream_info = info;
+	timeline.reset();
+	part_frames.clear();
+	part_samples.clear();
+	part_ticks = 0;
+	segment_ticks = 0;
+
+	auto init = std::make_shared<std::vector<uint8_t>>(Fmp4Writer::make_init_segment(info->codec_data, info->width, info->height));
+
+	std::lock_guard<std::mutex> lock(segments_mutex);
+	init_segment = init;
+	init_id++;
+	if (!segments.empty())
+	{
+		// Old segments stay listed with their own EXT-X-MAP, the decode time starts over after a discontinuity
+		segments.back().complete = true;
+		pending_discontinuity = true;
+	}
+
+	logger()->info("HLS stream {} for {}x{}", restarted ? "reinitialized" : "initialized", info->width, info->height);
+}
+
+void HlsOutput::on_encoded_frame(const EncodedFramePtr& frame)
+{
+	if (!frame->stream_info || frame->stream_info->codec_data.empty())
+	{
+		return;
+	}
+
+	if (frame->stream_info != stream_info)
+	{
+		reset_stream(frame->stream_info);
+	}
+
+	Fmp4TimedSample timed_sample;
+	if (!timeline.push(frame, timed_sample))
+	{
+		return;
+	}
+	append_sample(timed_sample);
+
+	uint64_t part_target_ticks = static_cast<uint64_t>(config.part_duration_msec) * Fmp4Writer::video_timescale / 1000;
+	uint64_t segment_target_ticks = static_cast<uint64_t>(config.segment_duration_msec) * Fmp4Writer::video_timescale / 1000;
+	// EXTINF rounded to the nearest second must not exceed EXT-X-TARGETDURATION
+	uint64_t segment_max_ticks = static_cast<uint64_t>(target_duration_sec) * Fmp4Writer::video_timescale + Fmp4Writer::video_timescale / 2;
+
+	// The new frame starts the next part: a segment boundary waits for an IDR unless the segment would
+	// outgrow EXT-X-TARGETDURATION, a part must not exceed PART-TARGET
+	if ((frame->keyframe && segment_ticks + part_ticks >= segment_target_ticks)
+		|| segment_ticks + part_ticks + last_sample_duration >= segment_max_ticks)
+	{
+		flush_part(true);
+	}
+	else if (part_ticks + last_sample_duration > part_target_ticks)
+	{
+		flush_part(false);
+	}
+}
+
+void HlsOutput::append_sample(const Fmp4TimedSample& timed_sample)
+{
+	if (part_frames.empty())
+	{
+		part_base_decode_time = timed_sample.decode_time;
+	}
+
+	part_samples.push_back(timed_sample.sample);
+	part_frames.push_back(timed_sample.frame);
+	part_ticks += timed_sample.sample.duration;
+	last_sample_duration = timed_sample.sample.duration;
+}
+
+void HlsOutput::flush_part(bool end_segment)
+{
+	if (part_frames.empty())
+	{
+		return;
+	}
+
+	auto data = std::make_shared<std::vector<uint8_t>>(Fmp4Writer::make_fragment_header(fragment_sequence++, part_base_decode_time, part_samples));
+	for (auto& frame : part_frames)
+	{
+		GstMapInfo map_info;
+		if (gst_buffer_map(frame->buffer, &map_info, GST_MAP_READ))
+		{
+			data->insert(data->end(), map_info.data, map_info.data + map_info.size);
+			gst_buffer_unmap(frame->buffer, &map_info);
+		}
+	}
+
+	Part part;
+	part.data = data;
+	part.duration = static_cast<double>(part_ticks) / Fmp4Writer::video_timescale;
+	part.independent = part_samples.front().keyframe;
+	int64_t part_wallclock_usec = part_frames.front()->wallclock_usec;
+
+	segment_ticks += part_ticks;
+	part_ticks = 0;
+	part_frames.clear();
+	part_samples.clear();
+
+	std::lock_guard<std::mutex> lock(segments_mutex);
+	if (segments.empty() || segments.back().complete)
+	{
+		Segment segment;
+		segment.msn = next_msn++;
+		segment.start_wallclock_usec = part_wallclock_usec;
+		segment.discontinuity = pending_discontinuity;
+		segment.init_id = init_id;
+		segment.init = init_segment;
+		pending_discontinuity = false;
+		segments.push_back(segment);
+	}
+
+	Segment& segment = segments.back();
+	segment.parts.push_back(part);
+	segment.duration += part.duration;
+
+	if (end_segment)
+	{
+		segment.complete = true;
+		segment_ticks = 0;
+
+		while (segments.size() > static_cast<size_t>(config.segment_count) + 1)
+		{
+			if (segments.front().discontinuity)
+			{
+				discontinuity_sequence++;
+			}
+			segments.pop_front();
+		}
+	}
+}
+
+const HlsOutput::Segment* HlsOutput::find_segment(uint64_t msn) const
+{
+	if (segments.empty() || msn < segments.front().msn || msn > segments.back().msn)
+	{
+		return nullptr;
+	}
+
+	return &segments[msn - segments.front().msn];
+}
+
+HlsMediaState HlsOutput::get_media_state(uint64_t msn, int part) const
+{
+	std::lock_guard<std::mutex> lock(segments_mutex);
+
+	uint64_t last_msn = segments.empty() ? next_msn : segments.back().msn;
+	if (msn > last_msn + 2)
+	{
+		return HlsMediaState::TooFar;
+	}
+
+	if (!segments.empty() && msn < segments.front().msn)
+	{
+		return HlsMediaState::Gone;
+	}
+
+	const Segment* segment = find_segment(msn);
+	if (!segment)
+	{
+		return HlsMediaState::Pending;
+	}
+
+	if (part < 0)
+	{
+		return segment->complete ? HlsMediaState::Available : HlsMediaState::Pending;
+	}
+
+	if (static_cast<size_t>(part) < segment->parts.size() || segment->complete)
+	{
+		return HlsMediaState::Available;
+	}
+
+	return HlsMediaState::Pending;
+}
+
+bool HlsOutput::get_playlist(std::string& playlist) const
+{
+	std::lock_guard<std::mutex> lock(segments_mutex);
+
+	if (segments.empty() || !init_segment)
+	{
+		return false;
+	}
+
+	double part_target = config.part_duration_msec / 1000.0;
+
+	std::stringstream playlist_builder;
+	playlist_builder << std::fixed << std::setprecision(5);
+	playlist_builder << "#EXTM3U\n"
+		<< "#EXT-X-VERSION:6\n"
+		<< "#EXT-X-TARGETDURATION:" << target_duration_sec << "\n"
+		<< "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=" << part_target * 3 << "\n"
+		<< "#EXT-X-PART-INF:PART-TARGET=" << part_target << "\n"
+		<< "#EXT-X-MEDIA-SEQUENCE:" << segments.front().msn << "\n"
+		<< "#EXT-X-DISCONTINUITY-SEQUENCE:" << discontinuity_sequence << "\n"
+		<< "#EXT-X-MAP:URI=\"init" << segments.front().init_id << ".mp4\"\n";
+
+	for (size_t i = 0; i < segments.size(); i++)
+	{
+		const Segment& segment = segments[i];
+
+		if (segment.discontinuity)
+		{
+			playlist_builder << "#EXT-X-DISCONTINUITY\n";
+		}
+		if (i > 0 && segment.init_id != segments[i - 1].init_id)
+		{
+			playlist_builder << "#EXT-X-MAP:URI=\"init" << segment.init_id << ".mp4\"\n";
+		}
+
+		time_t start_sec = static_cast<time_t>(segment.start_wallclock_usec / 1000000);
+		tm start_tm;
+		gmtime_r(&start_sec, &start_tm);
+		playlist_builder << "#EXT-X-PROGRAM-DATE-TIME:" << std::put_time(&start_tm, "%Y-%m-%dT%H:%M:%S")
+			<< "." << std::setw(3) << std::setfill('0') << (segment.start_wallclock_usec / 1000) % 1000 << std::setfill(' ') << "Z\n";
+
+		// Parts are only advertised for the live edge, older segments are listed whole
+		if (i + 3 >= segments.size())
+		{
+			for (size_t part_index = 0; part_index < segment.parts.size(); part_index++)
+			{
+				const Part& part = segment.parts[part_index];
+				playlist_builder << "#EXT-X-PART:DURATION=" << part.duration
+					<< ",URI=\"part" << segment.msn << "." << part_index << ".m4s\""
+					<< (part.independent ? ",INDEPENDENT=YES" : "") << "\n";
+			}
+		}
+
+		if (segment.complete)
+		{
+			playlist_builder << "#EXTINF:" << segment.duration << ",\n"
+				<< "seg" << segment.msn << ".m4s\n";
+		}
+	}
+
+	const Segment& last_segment = segments.back();
+	if (last_segment.complete)
+	{
+		playlist_builder << "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"part" << last_segment.msn + 1 << ".0.m4s\"\n";
+	}
+	else
+	{
+		playlist_builder << "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"part" << last_segment.msn << "." << last_segment.parts.size() << ".m4s\"\n";
+	}
+
+	playlist = playlist_builder.str();
+	return true;
+}
+
+bool HlsOutput::get_init_segment(HlsData& data) const
+{
+	std::lock_guard<std::mutex> lock(segments_mutex);
+	data = init_segment;
+	return data != nullptr;
+}
+
+bool HlsOutput::get_init_segment(uint32_t id, HlsData& data) const
+{
+	std::lock_guard<std::mutex> lock(segments_mutex);
+
+	if (id == init_id)
+	{
+		data = init_segment;
+		return data != nullptr;
+	}
+	for (const Segment& segment : segments)
+	{
+		if (segment.init_id == id)
+		{
+			data = segment.init;
+			return data != nullptr;
+		}
+	}
+	return false;
+}
+
+bool HlsOutput::get_part(uint64_t msn, int part, HlsData& data) const
+{
+	std::lock_guard<std::mutex> lock(segments_mutex);
+
+	const Segment* segment = find_segment(msn);
+	if (!segment || part < 0 || static_cast<size_t>(part) >= segment->parts.size())
+	{
+		return false;
+	}
+
+	data = segment->parts[part].data;
+	return true;
+}
+
+bool HlsOutput::get_segment(uint64_t msn, std::vector<HlsData>& data) const
+{
+	std::lock_guard<std::mutex> lock(segments_mutex);
+
+	const Segment* segment = find_segment(msn);
+	if (!segment || !segment->complete)
+	{
+		return false;
+	}
+
+	for (auto& part : segment->parts)
+	{
+		data.push_back(part.data);
+	}
+	return true;
+}
+
+int HlsOutput::get_target_duration_sec() const
+{
+	std::lock_guard<std::mutex> lock(segments_mutex);
+	return target_duration_sec;
+}
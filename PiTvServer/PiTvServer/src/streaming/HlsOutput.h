@@ -0,0 +1,115 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <gst/gst.h>
+#include <spdlog/spdlog.h>
+#include "../video/EncodedTap.h"
+#include "../video/Fmp4Writer.h"
+#include "../video/Fmp4Timeline.h"
+
+struct HlsOutputConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	int part_duration_msec = 500;
+	int segment_duration_msec = 2000;
+	int segment_count = 6;
+};
+
+typedef Fmp4Data HlsData;
+
+enum class HlsMediaState
+{
+	Available,
+	Pending,
+	TooFar,
+	Gone
+};
+
+// LL-HLS packager. Access units from the encoded tap are cut into fMP4 parts once,
+// kept in a bounded in-memory ring and shared by all viewers.
+class HlsOutput
+{
+private:
+	struct Part
+	{
+		HlsData data;
+		double duration = 0;
+		bool independent = false;
+	};
+
+	struct Segment
+	{
+		uint64_t msn = 0;
+		std::vector<Part> parts;
+		double duration = 0;
+		bool complete = false;
+		int64_t start_wallclock_usec = 0;
+		// First segment after the stream was reinitialized, it gets EXT-X-DISCONTINUITY and its own EXT-X-MAP
+		bool discontinuity = false;
+		uint32_t init_id = 0;
+		HlsData init;
+	};
+
+	HlsOutputConfig config;
+	std::shared_ptr<EncodedTap> encoded_tap;
+	int tap_listener_id = 0;
+
+	mutable std::mutex segments_mutex;
+	HlsData init_segment;
+	uint32_t init_id = 0;
+	std::deque<Segment> segments;
+	uint64_t next_msn = 0;
+	// Discontinuities that went out of the playlist with their segments
+	uint64_t discontinuity_sequence = 0;
+	bool pending_discontinuity = false;
+	// Fixed for the life of the playlist, segments are cut before they outgrow it
+	int target_duration_sec = 1;
+
+	// Assembly state, touched only by the streaming thread
+	std::shared_ptr<const EncodedStreamInfo> stream_info;
+	Fmp4Timeline timeline;
+	std::vector<EncodedFramePtr> part_frames;
+	std::vector<Fmp4Sample> part_samples;
+	uint64_t part_base_decode_time = 0;
+	uint64_t part_ticks = 0;
+	uint64_t segment_ticks = 0;
+	uint32_t last_sample_duration = 0;
+	uint32_t fragment_sequence = 1;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	void on_encoded_frame(const EncodedFramePtr& frame);
+	void append_sample(const Fmp4TimedSample& timed_sample);
+	void flush_part(bool end_segment);
+	void reset_stream(std::shared_ptr<const EncodedStreamInfo> info);
+
+	const Segment* find_segment(uint64_t msn) const;
+
+public:
+	HlsOutput& operator=(const HlsOutput&) = delete;
+	HlsOutput(const HlsOutput& copy) = delete;
+	HlsOutput() = delete;
+
+	HlsOutput(const HlsOutputConfig& config, std::shared_ptr<EncodedTap> encoded_tap);
+	~HlsOutput();
+
+	bool start();
+	void stop();
+
+	// part < 0 refers to the whole segment
+	HlsMediaState get_media_state(uint64_t msn, int part) const;
+
+	bool get_playlist(std::string& playlist) const;
+	// Initialization segment of the current stream configuration
+	bool get_init_segment(HlsData& data) const;
+	// Initialization segment by the id in its EXT-X-MAP URI "init<id>.mp4", kept while segments refer to it
+	bool get_init_segment(uint32_t id, HlsData& data) const;
+	bool get_part(uint64_t msn, int part, HlsData& data) const;
+	bool get_segment(uint64_t msn, std::vector<HlsData>& data) const;
+
+	int get_target_duration_sec() const;
+};
@@ -0,0 +1,192 @@
+#include "LiveFmp4Output.h"
+#include <cassert>
+
+LiveFmp4Output::LiveFmp4Output(const LiveFmp4OutputConfig& config, std::shared_ptr<EncodedTap> encoded_tap)
+{
+	this->config = config;
+	this->encoded_tap = encoded_tap;
+}
+
+LiveFmp4Output::~LiveFmp4Output()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> LiveFmp4Output::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool LiveFmp4Output::start()
+{
+	if (tap_listener_id)
+	{
+		logger()->warn("Live fMP4 output is already running!");
+		return true;
+	}
+
+	if (!encoded_tap)
+	{
+		logger()->error("Cannot start live fMP4 output: encoded tap is not available!");
+		return false;
+	}
+
+	tap_listener_id = encoded_tap->add_listener([this](const EncodedFramePtr& frame)
+		{
+			on_encoded_frame(frame);
+		}
+	);
+
+	logger()->info("Live fMP4 output started, {} bytes buffered at most", config.max_buffered_bytes);
+	return true;
+}
+
+void LiveFmp4Output::stop()
+{
+	if (!tap_listener_id)
+	{
+		return;
+	}
+
+	encoded_tap->remove_listener(tap_listener_id);
+	tap_listener_id = 0;
+	logger()->info("Live fMP4 output stopped");
+}
+
+void LiveFmp4Output::reset_stream(std::shared_ptr<const EncodedStreamInfo> info)
+{
+	stream_info = info;
+	timeline.reset();
+
+	auto init = std::make_shared<std::vector<uint8_t>>(Fmp4Writer::make_init_segment(info->codec_data, info->width, info->height));
+
+	std::lock_guard<std::mutex> lock(fragments_mutex);
+	init_segment = init;
+	codecs = Fmp4Writer::make_codecs_string(info->codec_data);
+	stream_generation++;
+	fragments.clear();
+	buffered_bytes = 0;
+}
+
+void LiveFmp4Output::on_encoded_frame(const EncodedFramePtr& frame)
+{
+	if (!frame->stream_info || frame->stream_info->codec_data.empty())
+	{
+		return;
+	}
+
+	if (frame->stream_info != stream_info)
+	{
+		reset_stream(frame->stream_info);
+	}
+
+	Fmp4TimedSample timed_sample;
+	if (!timeline.push(frame, timed_sample))
+	{
+		return;
+	}
+
+	std::vector<Fmp4Sample> samples = { timed_sample.sample };
+	auto data = std::make_shared<std::vector<uint8_t>>(Fmp4Writer::make_fragment_header(fragment_sequence++, timed_sample.decode_time, samples));
+
+	GstMapInfo map_info;
+	if (!gst_buffer_map(timed_sample.frame->buffer, &map_info, GST_MAP_READ))
+	{
+		logger()->error("Live fMP4 output failed to map access unit!");
+		return;
+	}
+	data->insert(data->end(), map_info.data, map_info.data + map_info.size);
+	gst_buffer_unmap(timed_sample.frame->buffer, &map_info);
+
+	std::lock_guard<std::mutex> lock(fragments_mutex);
+
+	LiveFmp4Fragment fragment;
+	fragment.sequence = next_sequence++;
+	fragment.decode_time = timed_sample.decode_time;
+	fragment.keyframe = timed_sample.sample.keyframe;
+	fragment.data = data;
+
+	buffered_bytes += data->size();
+	fragments.push_back(fragment);
+
+	while (fragments.size() > 1 && buffered_bytes > config.max_buffered_bytes)
+	{
+		buffered_bytes -= fragments.front().data->size();
+		fragments.pop_front();
+	}
+}
+
+bool LiveFmp4Output::get_init_segment(Fmp4Data& data, std::string& codecs, uint64_t& generation) const
+{
+	std::lock_guard<std::mutex> lock(fragments_mutex);
+	data = init_segment;
+	codecs = this->codecs;
+	generation = stream_generation;
+	return data != nullptr;
+}
+
+uint64_t LiveFmp4Output::get_stream_generation() const
+{
+	std::lock_guard<std::mutex> lock(fragments_mutex);
+	return stream_generation;
+}
+
+const LiveFmp4Fragment* LiveFmp4Output::find_newest_keyframe() const
+{
+	for (auto iter = fragments.rbegin(); iter != fragments.rend(); iter++)
+	{
+		if (iter->keyframe)
+		{
+			return &(*iter);
+		}
+	}
+	return nullptr;
+}
+
+uint64_t LiveFmp4Output::get_start_sequence() const
+{
+	std::lock_guard<std::mutex> lock(fragments_mutex);
+
+	const LiveFmp4Fragment* keyframe = find_newest_keyframe();
+	return keyframe ? keyframe->sequence : next_sequence;
+}
+
+LiveFmp4ReadResult LiveFmp4Output::read_fragment(uint64_t sequence, LiveFmp4Fragment& fragment) const
+{
+	std::lock_guard<std::mutex> lock(fragments_mutex);
+
+	if (fragments.empty() || sequence >= next_sequence)
+	{
+		return LiveFmp4ReadResult::NotReady;
+	}
+
+	const LiveFmp4Fragment* requested = nullptr;
+	if (sequence >= fragments.front().sequence)
+	{
+		requested = &fragments[sequence - fragments.front().sequence];
+	}
+
+	uint64_t max_lag_ticks = static_cast<uint64_t>(config.max_subscriber_lag_msec) * Fmp4Writer::video_timescale / 1000;
+	bool is_lagging = requested && fragments.back().decode_time > requested->decode_time + max_lag_ticks;
+
+	if (requested && !is_lagging)
+	{
+		fragment = *requested;
+		return LiveFmp4ReadResult::Ok;
+	}
+
+	// Jump over the backlog instead of buffering it for a slow subscriber
+	const LiveFmp4Fragment* keyframe = find_newest_keyframe();
+	if (!keyframe || keyframe->sequence <= sequence)
+	{
+		if (requested)
+		{
+			fragment = *requested;
+			return LiveFmp4ReadResult::Ok;
+		}
+		return LiveFmp4ReadResult::NotReady;
+	}
+
+	fragment = *keyframe;
+	return LiveFmp4ReadResult::Skipped;
+}
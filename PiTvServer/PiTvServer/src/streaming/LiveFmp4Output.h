@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <gst/gst.h>
+#include <spdlog/spdlog.h>
+#include "../video/EncodedTap.h"
+#include "../video/Fmp4Writer.h"
+#include "../video/Fmp4Timeline.h"
+
+struct LiveFmp4OutputConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	size_t max_buffered_bytes = 8 * 1024 * 1024;
+	int max_subscriber_lag_msec = 2000;
+};
+
+struct LiveFmp4Fragment
+{
+	uint64_t sequence = 0;
+	uint64_t decode_time = 0;
+	bool keyframe = false;
+	Fmp4Data data;
+};
+
+enum class LiveFmp4ReadResult
+{
+	Ok,
+	Skipped,
+	NotReady
+};
+
+// Progressive fMP4 muxer: every access unit becomes one moof+mdat fragment, produced once
+// and kept in a bounded ring from which all HTTP subscribers read at their own pace.
+class LiveFmp4Output
+{
+private:
+	LiveFmp4OutputConfig config;
+	std::shared_ptr<EncodedTap> encoded_tap;
+	int tap_listener_id = 0;
+
+	mutable std::mutex fragments_mutex;
+	Fmp4Data init_segment;
+	std::string codecs;
+	uint64_t stream_generation = 0;
+	std::deque<LiveFmp4Fragment> fragments;
+	size_t buffered_bytes = 0;
+	uint64_t next_sequence = 0;
+
+	// Muxer state, touched only by the streaming thread
+	std::shared_ptr<const EncodedStreamInfo> stream_info;
+	Fmp4Timeline timeline;
+	uint32_t fragment_sequence = 1;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	void on_encoded_frame(const EncodedFramePtr& frame);
+	void reset_stream(std::shared_ptr<const EncodedStreamInfo> info);
+	const LiveFmp4Fragment* find_newest_keyframe() const;
+
+public:
+	LiveFmp4Output& operator=(const LiveFmp4Output&) = delete;
+	LiveFmp4Output(const LiveFmp4Output& copy) = delete;
+	LiveFmp4Output() = delete;
+
+	LiveFmp4Output(const LiveFmp4OutputConfig& config, std::shared_ptr<EncodedTap> encoded_tap);
+	~LiveFmp4Output();
+
+	bool start();
+	void stop();
+
+	// Init segment, RFC 6381 codecs string and generation of the current stream configuration
+	bool get_init_segment(Fmp4Data& data, std::string& codecs, uint64_t& generation) const;
+	uint64_t get_stream_generation() const;
+
+	// Fragment a new subscriber starts with: the newest keyframe
+	uint64_t get_start_sequence() const;
+
+	// Reads the fragment with the given sequence. A subscriber that lags too far behind or
+	// whose fragment was already evicted is moved to the newest keyframe (Skipped).
+	LiveFmp4ReadResult read_fragment(uint64_t sequence, LiveFmp4Fragment& fragment) const;
+};
@@ -0,0 +1,372 @@
+#include "RtpTcpOutput.h"
+#include <cassert>
+
+RtpTcpOutput::RtpTcpOutput(const RtpTcpOutputConfig& config, std::shared_ptr<EncodedTap> encoded_tap)
+{
+	this->config = config;
+	this->encoded_tap = encoded_tap;
+}
+
+RtpTcpOutput::~RtpTcpOutput()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> RtpTcpOutput::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool RtpTcpOutput::start()
+{
+	if (pipeline)
+	{
+		logger()->warn("RTP over TCP output is already running!");
+		return true;
+	}
+
+	if (!encoded_tap)
+	{
+		logger()->error("Cannot start RTP over TCP output: encoded tap is not available!");
+		return false;
+	}
+
+	GError* error = nullptr;
+	GstElement* pipeline_tmp = gst_parse_launch(
+		"appsrc name=rtp_tcp_appsrc is-live=true format=time do-timestamp=true max-bytes=4194304 ! "
+		"rtph264pay config-interval=-1 pt=96 mtu=1400 ! "
+		"appsink name=rtp_tcp_appsink sync=false async=false max-buffers=64 drop=true",
+		&error);
+	if (!pipeline_tmp || error)
+	{
+		logger()->error("Failed to create RTP over TCP pipeline: {}", error ? error->message : "unknown error");
+		g_clear_error(&error);
+		if (pipeline_tmp)
+		{
+			gst_object_unref(pipeline_tmp);
+		}
+		return false;
+	}
+
+	appsrc = gst_bin_get_by_name(GST_BIN(pipeline_tmp), "rtp_tcp_appsrc");
+	appsink = gst_bin_get_by_name(GST_BIN(pipeline_tmp), "rtp_tcp_appsink");
+	assert(appsrc && appsink);
+
+	GstAppSinkCallbacks callbacks = { 0 };
+	callbacks.new_sample = &RtpTcpOutput::appsink_new_sample;
+	gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, this, NULL);
+
+	pipeline = pipeline_tmp;
+	bus = gst_element_get_bus(pipeline);
+
+	if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+	{
+		logger()->error("Failed to set RTP over TCP pipeline to PLAYING state!");
+		stop();
+		return false;
+	}
+
+	tap_listener_id = encoded_tap->add_listener([this](const EncodedFramePtr& frame)
+		{
+			on_encoded_frame(frame);
+		}
+	);
+
+	logger()->info("RTP over TCP output started, {} bytes queued per client at most", config.max_queued_bytes);
+	return true;
+}
+
+void RtpTcpOutput::stop()
+{
+	if (tap_listener_id)
+	{
+		encoded_tap->remove_listener(tap_listener_id);
+		tap_listener_id = 0;
+	}
+
+	if (!pipeline)
+	{
+		return;
+	}
+
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+
+	gst_object_unref(appsrc);
+	appsrc = nullptr;
+	gst_object_unref(appsink);
+	appsink = nullptr;
+	gst_object_unref(bus);
+	bus = nullptr;
+	gst_object_unref(pipeline);
+	pipeline = nullptr;
+
+	if (appsrc_caps)
+	{
+		gst_caps_unref(appsrc_caps);
+		appsrc_caps = nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(clients_mutex);
+	clients.clear();
+
+	logger()->info("RTP over TCP output stopped");
+}
+
+void RtpTcpOutput::on_encoded_frame(const EncodedFramePtr& frame)
+{
+	if (waiting_keyframe)
+	{
+		if (!frame->keyframe)
+		{
+			return;
+		}
+		waiting_keyframe = false;
+	}
+
+	if (frame->stream_info && frame->stream_info->caps != appsrc_caps)
+	{
+		gst_app_src_set_caps(GST_APP_SRC(appsrc), frame->stream_info->caps);
+		if (appsrc_caps)
+		{
+			gst_caps_unref(appsrc_caps);
+		}
+		appsrc_caps = gst_caps_ref(frame->stream_info->caps);
+	}
+
+	GstBuffer* buffer = gst_buffer_copy(frame->buffer);
+	GST_BUFFER_PTS(buffer) = GST_CLOCK_TIME_NONE;
+	GST_BUFFER_DTS(buffer) = GST_CLOCK_TIME_NONE;
+	gst_app_src_push_buffer(GST_APP_SRC(appsrc), buffer);
+}
+
+GstFlowReturn RtpTcpOutput::appsink_new_sample(GstAppSink* appsink, gpointer udata)
+{
+	assert(udata);
+	RtpTcpOutput* output = static_cast<RtpTcpOutput*>(udata);
+
+	GstSample* sample = gst_app_sink_pull_sample(appsink);
+	if (!sample)
+	{
+		return GST_FLOW_EOS;
+	}
+
+	GstBufferList* list = gst_sample_get_buffer_list(sample);
+	if (list)
+	{
+		for (guint i = 0; i < gst_buffer_list_length(list); i++)
+		{
+			output->on_rtp_packet(gst_buffer_list_get(list, i));
+		}
+	}
+	else
+	{
+		GstBuffer* buffer = gst_sample_get_buffer(sample);
+		if (buffer)
+		{
+			output->on_rtp_packet(buffer);
+		}
+	}
+
+	gst_sample_unref(sample);
+	return GST_FLOW_OK;
+}
+
+bool RtpTcpOutput::is_gop_start(const uint8_t* packet, size_t size)
+{
+	if (size < 12 || (packet[0] >> 6) != 2)
+	{
+		return false;
+	}
+
+	size_t header_size = 12 + 4 * static_cast<size_t>(packet[0] & 0x0F);
+	if ((packet[0] & 0x10) && size >= header_size + 4)
+	{
+		header_size += 4 + 4 * ((static_cast<size_t>(packet[header_size + 2]) << 8) | packet[header_size + 3]);
+	}
+	if (size < header_size + 2)
+	{
+		return false;
+	}
+
+	const uint8_t* payload = packet + header_size;
+	size_t payload_size = size - header_size;
+	uint8_t nal_type = payload[0] & 0x1F;
+
+	bool keyframe_nal = false;
+	if (nal_type == 5 || nal_type == 7)
+	{
+		keyframe_nal = true;
+	}
+	else if (nal_type == 24 && payload_size >= 4)
+	{
+		// STAP-A, config-interval=-1 aggregates SPS and PPS in front of every IDR
+		uint8_t first_type = payload[3] & 0x1F;
+		keyframe_nal = first_type == 5 || first_type == 7;
+	}
+	else if (nal_type == 28)
+	{
+		// FU-A start fragment of an IDR slice
+		keyframe_nal = (payload[1] & 0x80) && (payload[1] & 0x1F) == 5;
+	}
+
+	if (!keyframe_nal)
+	{
+		return false;
+	}
+
+	// All packets of an access unit share the RTP timestamp, only the first one starts the GOP
+	uint32_t timestamp = (static_cast<uint32_t>(packet[4]) << 24) | (static_cast<uint32_t>(packet[5]) << 16) |
+		(static_cast<uint32_t>(packet[6]) << 8) | packet[7];
+	if (gop_timestamp_valid && timestamp == gop_timestamp)
+	{
+		return false;
+	}
+
+	gop_timestamp = timestamp;
+	gop_timestamp_valid = true;
+	return true;
+}
+
+void RtpTcpOutput::on_rtp_packet(GstBuffer* buffer)
+{
+	GstMapInfo map_info;
+	if (!gst_buffer_map(buffer, &map_info, GST_MAP_READ))
+	{
+		return;
+	}
+
+	RtpTcpPacket packet;
+	packet.data = std::make_shared<std::vector<uint8_t>>(map_info.data, map_info.data + map_info.size);
+	packet.gop_start = is_gop_start(map_info.data, map_info.size);
+	gst_buffer_unmap(buffer, &map_info);
+
+	std::lock_guard<std::mutex> lock(clients_mutex);
+	for (auto& client : clients)
+	{
+		enqueue_packet(client.second, packet);
+	}
+}
+
+void RtpTcpOutput::drop_front(Client& client, size_t count)
+{
+	for (size_t i = 0; i < count && !client.queue.empty(); i++)
+	{
+		client.queued_bytes -= client.queue.front().data->size();
+		client.queue.pop_front();
+		client.stats.packets_dropped++;
+	}
+}
+
+void RtpTcpOutput::enqueue_packet(Client& client, const RtpTcpPacket& packet)
+{
+	if (client.queued_bytes + packet.data->size() > config.max_queued_bytes)
+	{
+		// Keep the newest queued GOP if there is one behind the head, drop everything older
+		size_t newest_gop = client.queue.size();
+		for (size_t i = client.queue.size(); i-- > 1;)
+		{
+			if (client.queue[i].gop_start)
+			{
+				newest_gop = i;
+				break;
+			}
+		}
+		drop_front(client, newest_gop);
+
+		if (client.queued_bytes + packet.data->size() > config.max_queued_bytes)
+		{
+			drop_front(client, client.queue.size());
+		}
+		// Without a GOP start left in the queue the client has to wait for the next one
+		if (client.queue.empty())
+		{
+			client.waiting_gop_start = true;
+		}
+		client.stats.gops_dropped++;
+	}
+
+	// A decoder cannot join mid-GOP, so after a leak everything up to the next keyframe is useless
+	if (client.waiting_gop_start)
+	{
+		if (!packet.gop_start)
+		{
+			client.stats.packets_dropped++;
+			return;
+		}
+		client.waiting_gop_start = false;
+	}
+
+	client.queued_bytes += packet.data->size();
+	client.queue.push_back(packet);
+}
+
+void RtpTcpOutput::add_client(unsigned long client_id)
+{
+	std::lock_guard<std::mutex> lock(clients_mutex);
+	clients[client_id] = Client();
+}
+
+void RtpTcpOutput::remove_client(unsigned long client_id)
+{
+	std::lock_guard<std::mutex> lock(clients_mutex);
+	clients.erase(client_id);
+}
+
+bool RtpTcpOutput::pop_packets(unsigned long client_id, size_t max_bytes, std::vector<RtpTcpPacket>& packets)
+{
+	std::lock_guard<std::mutex> lock(clients_mutex);
+
+	auto iter = clients.find(client_id);
+	if (iter == clients.end())
+	{
+		return false;
+	}
+
+	Client& client = iter->second;
+	size_t popped_bytes = 0;
+	while (!client.queue.empty() && popped_bytes < max_bytes)
+	{
+		size_t packet_size = client.queue.front().data->size();
+		popped_bytes += packet_size;
+		client.queued_bytes -= packet_size;
+		packets.push_back(client.queue.front());
+		client.queue.pop_front();
+		client.stats.packets_sent++;
+	}
+
+	return true;
+}
+
+bool RtpTcpOutput::get_client_stats(unsigned long client_id, RtpTcpClientStats& stats) const
+{
+	std::lock_guard<std::mutex> lock(clients_mutex);
+
+	auto iter = clients.find(client_id);
+	if (iter == clients.end())
+	{
+		return false;
+	}
+
+	stats = iter->second.stats;
+	return true;
+}
+
+void RtpTcpOutput::poll_bus()
+{
+	if (!bus)
+	{
+		return;
+	}
+
+	GstMessage* msg = nullptr;
+	while ((msg = gst_bus_pop_filtered(bus, static_cast<GstMessageType>(GST_MESSAGE_ERROR))) != nullptr)
+	{
+		GError* err = nullptr;
+		gchar* debug_info = nullptr;
+		gst_message_parse_error(msg, &err, &debug_info);
+		logger()->error("RTP over TCP pipeline: error received from element {}: {}", GST_OBJECT_NAME(msg->src), err->message);
+		g_clear_error(&err);
+		g_free(debug_info);
+		gst_message_unref(msg);
+	}
+}
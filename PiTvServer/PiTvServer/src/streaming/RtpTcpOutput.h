@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <spdlog/spdlog.h>
+#include "../video/EncodedTap.h"
+
+struct RtpTcpOutputConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	size_t max_queued_bytes = 1024 * 1024;
+};
+
+typedef std::shared_ptr<const std::vector<uint8_t>> RtpPacketData;
+
+struct RtpTcpPacket
+{
+	RtpPacketData data;
+	bool gop_start = false;
+};
+
+struct RtpTcpClientStats
+{
+	uint64_t packets_sent = 0;
+	uint64_t packets_dropped = 0;
+	uint64_t gops_dropped = 0;
+};
+
+// RTP for viewers that cannot receive UDP. The encoded stream is payloaded once in a private
+// pipeline and every packet is queued for each stream connection. Queues are bounded: on overflow
+// whole GOPs are leaked, so a congested TCP link adds bounded latency instead of growing buffers.
+class RtpTcpOutput
+{
+private:
+	struct Client
+	{
+		std::deque<RtpTcpPacket> queue;
+		size_t queued_bytes = 0;
+		bool waiting_gop_start = true;
+		RtpTcpClientStats stats;
+	};
+
+	RtpTcpOutputConfig config;
+	std::shared_ptr<EncodedTap> encoded_tap;
+	int tap_listener_id = 0;
+
+	GstElement* pipeline = nullptr;
+	GstElement* appsrc = nullptr;
+	GstElement* appsink = nullptr;
+	GstBus* bus = nullptr;
+	GstCaps* appsrc_caps = nullptr;
+	bool waiting_keyframe = true;
+
+	// Touched only by the appsink streaming thread
+	bool gop_timestamp_valid = false;
+	uint32_t gop_timestamp = 0;
+
+	mutable std::mutex clients_mutex;
+	std::map<unsigned long, Client> clients;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	void on_encoded_frame(const EncodedFramePtr& frame);
+	static GstFlowReturn appsink_new_sample(GstAppSink* appsink, gpointer udata);
+	void on_rtp_packet(GstBuffer* buffer);
+	bool is_gop_start(const uint8_t* packet, size_t size);
+	void enqueue_packet(Client& client, const RtpTcpPacket& packet);
+	static void drop_front(Client& client, size_t count);
+
+public:
+	RtpTcpOutput& operator=(const RtpTcpOutput&) = delete;
+	RtpTcpOutput(const RtpTcpOutput& copy) = delete;
+	RtpTcpOutput() = delete;
+
+	RtpTcpOutput(const RtpTcpOutputConfig& config, std::shared_ptr<EncodedTap> encoded_tap);
+	~RtpTcpOutput();
+
+	bool start();
+	void stop();
+
+	// Clients are identified by the HTTP connection id and start at the next keyframe
+	void add_client(unsigned long client_id);
+	void remove_client(unsigned long client_id);
+
+	// Moves queued packets up to max_bytes to the caller, returns false for unknown clients
+	bool pop_packets(unsigned long client_id, size_t max_bytes, std::vector<RtpTcpPacket>& packets);
+	bool get_client_stats(unsigned long client_id, RtpTcpClientStats& stats) const;
+
+	// Logs errors posted on the private pipeline bus
+	void poll_bus();
+};
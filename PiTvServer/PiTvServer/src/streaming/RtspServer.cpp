@@ -0,0 +1,355 @@
+#include "RtspServer.h"
+#include <cassert>
+
+const std::string RtspServer::appsrc_name = "pitv_appsrc";
+const std::string RtspServer::viewer_role = "viewer";
+
+// GstRTSPAuth subclass that validates Basic credentials against the UserDb instead of a static table
+struct PiTvRtspAuth
+{
+	GstRTSPAuth parent;
+	RtspServer* rtsp_server;
+};
+
+struct PiTvRtspAuthClass
+{
+	GstRTSPAuthClass parent_class;
+};
+
+G_DEFINE_TYPE(PiTvRtspAuth, pitv_rtsp_auth, GST_TYPE_RTSP_AUTH)
+
+static gboolean pitv_rtsp_auth_authenticate(GstRTSPAuth* auth, GstRTSPContext* ctx)
+{
+	PiTvRtspAuth* pitv_auth = reinterpret_cast<PiTvRtspAuth*>(auth);
+
+	gchar* authorization = nullptr;
+	if (!pitv_auth->rtsp_server || !ctx->request ||
+		gst_rtsp_message_get_header(ctx->request, GST_RTSP_HDR_AUTHORIZATION, &authorization, 0) != GST_RTSP_OK)
+	{
+		// No token in the context makes GstRTSPAuth reply 401 with a Basic challenge
+		return TRUE;
+	}
+
+	if (g_ascii_strncasecmp(authorization, "basic ", 6) != 0)
+	{
+		return TRUE;
+	}
+
+	gsize decoded_len = 0;
+	guchar* decoded = g_base64_decode(authorization + 6, &decoded_len);
+	std::string credentials(reinterpret_cast<char*>(decoded), decoded_len);
+	g_free(decoded);
+
+	size_t separator = credentials.find(':');
+	if (separator == std::string::npos)
+	{
+		return TRUE;
+	}
+
+	ctx->token = pitv_auth->rtsp_server->authenticate(credentials.substr(0, separator), credentials.substr(separator + 1));
+	return TRUE;
+}
+
+static void pitv_rtsp_auth_class_init(PiTvRtspAuthClass* klass)
+{
+	GST_RTSP_AUTH_CLASS(klass)->authenticate = pitv_rtsp_auth_authenticate;
+}
+
+static void pitv_rtsp_auth_init(PiTvRtspAuth* auth)
+{
+	auth->rtsp_server = nullptr;
+}
+
+RtspServer::RtspServer(const RtspServerConfig& config, std::shared_ptr<UserDb> user_db, std::shared_ptr<EncodedTap> encoded_tap)
+{
+	this->config = config;
+	this->user_db = user_db;
+	this->encoded_tap = encoded_tap;
+}
+
+RtspServer::~RtspServer()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> RtspServer::logger() const
+{
+	return config.logger_ptr;
+}
+
+GstRTSPToken* RtspServer::authenticate(const std::string& username, const std::string& password) const
+{
+	if (!user_db)
+	{
+		logger()->error("RTSP authentication failed: user_db not constructed!");
+		return nullptr;
+	}
+
+	auto user_entry = user_db->get_userdata(username);
+	if (!user_entry)
+	{
+		logger()->error("RTSP authentication failed: user {} not found!", username);
+		return nullptr;
+	}
+
+	if (user_entry->password != password)
+	{
+		logger()->error("RTSP authentication failed: wrong password.");
+		return nullptr;
+	}
+
+	return viewer_token;
+}
+
+void RtspServer::client_connected_handler(GstRTSPServer* server, GstRTSPClient* client, gpointer udata)
+{
+	assert(udata);
+	RtspServer* rtsp_server = static_cast<RtspServer*>(udata);
+
+	GstRTSPConnection* connection = gst_rtsp_client_get_connection(client);
+	rtsp_server->logger()->info("RTSP client connected from {}", connection ? gst_rtsp_connection_get_ip(connection) : "unknown");
+}
+
+void RtspServer::media_configure_handler(GstRTSPMediaFactory* factory, GstRTSPMedia* media, gpointer udata)
+{
+	assert(udata);
+	RtspServer* rtsp_server = static_cast<RtspServer*>(udata);
+
+	GstElement* media_element = gst_rtsp_media_get_element(media);
+	GstElement* media_appsrc = gst_bin_get_by_name_recurse_up(GST_BIN(media_element), appsrc_name.c_str());
+	gst_object_unref(media_element);
+
+	if (!media_appsrc)
+	{
+		rtsp_server->logger()->error("RTSP media has no {} element!", appsrc_name);
+		return;
+	}
+
+	g_object_set(media_appsrc,
+		"is-live", true,
+		"format", GST_FORMAT_TIME,
+		"do-timestamp", true,
+		"max-bytes", (guint64)(4 * 1024 * 1024),
+		NULL);
+	if (g_object_class_find_property(G_OBJECT_GET_CLASS(media_appsrc), "leaky-type"))
+	{
+		// Drop old access units rather than grow unbounded when the RTSP side stalls
+		g_object_set(media_appsrc, "leaky-type", 2, NULL);
+	}
+
+	g_signal_connect(media, "unprepared", G_CALLBACK(&RtspServer::media_unprepared_handler), rtsp_server);
+
+	std::lock_guard<std::mutex> lock(rtsp_server->appsrc_mutex);
+	if (rtsp_server->appsrc)
+	{
+		gst_object_unref(rtsp_server->appsrc);
+	}
+	if (rtsp_server->appsrc_caps)
+	{
+		gst_caps_unref(rtsp_server->appsrc_caps);
+		rtsp_server->appsrc_caps = nullptr;
+	}
+	rtsp_server->appsrc = media_appsrc;
+	rtsp_server->waiting_keyframe = true;
+
+	auto stream_info = rtsp_server->encoded_tap->get_stream_info();
+	if (stream_info && stream_info->caps)
+	{
+		gst_app_src_set_caps(GST_APP_SRC(media_appsrc), stream_info->caps);
+		rtsp_server->appsrc_caps = gst_caps_ref(stream_info->caps);
+	}
+
+	rtsp_server->logger()->info("RTSP shared media configured");
+}
+
+void RtspServer::media_unprepared_handler(GstRTSPMedia* media, gpointer udata)
+{
+	assert(udata);
+	RtspServer* rtsp_server = static_cast<RtspServer*>(udata);
+
+	GstElement* media_element = gst_rtsp_media_get_element(media);
+	GstElement* media_appsrc = gst_bin_get_by_name_recurse_up(GST_BIN(media_element), appsrc_name.c_str());
+	gst_object_unref(media_element);
+
+	// A newer media may already be configured, only release the appsrc owned by this one
+	bool is_current = false;
+	{
+		std::lock_guard<std::mutex> lock(rtsp_server->appsrc_mutex);
+		is_current = media_appsrc && media_appsrc == rtsp_server->appsrc;
+	}
+	if (media_appsrc)
+	{
+		gst_object_unref(media_appsrc);
+	}
+
+	if (is_current)
+	{
+		rtsp_server->release_appsrc();
+		rtsp_server->logger()->info("RTSP shared media unprepared, no more clients");
+	}
+}
+
+void RtspServer::release_appsrc()
+{
+	std::lock_guard<std::mutex> lock(appsrc_mutex);
+	if (appsrc)
+	{
+		gst_object_unref(appsrc);
+		appsrc = nullptr;
+	}
+	if (appsrc_caps)
+	{
+		gst_caps_unref(appsrc_caps);
+		appsrc_caps = nullptr;
+	}
+}
+
+void RtspServer::on_encoded_frame(const EncodedFramePtr& frame)
+{
+	std::lock_guard<std::mutex> lock(appsrc_mutex);
+	if (!appsrc)
+	{
+		return;
+	}
+
+	// Payloader must start decoding from an IDR, otherwise clients show garbage until the next one
+	if (waiting_keyframe)
+	{
+		if (!frame->keyframe)
+		{
+			return;
+		}
+		waiting_keyframe = false;
+	}
+
+	if (frame->stream_info && frame->stream_info->caps != appsrc_caps)
+	{
+		gst_app_src_set_caps(GST_APP_SRC(appsrc), frame->stream_info->caps);
+		if (appsrc_caps)
+		{
+			gst_caps_unref(appsrc_caps);
+		}
+		appsrc_caps = gst_caps_ref(frame->stream_info->caps);
+	}
+
+	// Shallow copy shares the memory with the tap, only timestamps are rewritten by appsrc do-timestamp
+	GstBuffer* buffer = gst_buffer_copy(frame->buffer);
+	GST_BUFFER_PTS(buffer) = GST_CLOCK_TIME_NONE;
+	GST_BUFFER_DTS(buffer) = GST_CLOCK_TIME_NONE;
+
+	GstFlowReturn ret = gst_app_src_push_buffer(GST_APP_SRC(appsrc), buffer);
+	if (ret != GST_FLOW_OK && ret != GST_FLOW_FLUSHING)
+	{
+		logger()->warn("RTSP appsrc push failed with code {}", static_cast<int>(ret));
+	}
+}
+
+bool RtspServer::start()
+{
+	if (server)
+	{
+		logger()->warn("RTSP server is already running!");
+		return true;
+	}
+
+	if (!encoded_tap)
+	{
+		logger()->error("Cannot start RTSP server: encoded tap is not available!");
+		return false;
+	}
+
+	context = g_main_context_new();
+	loop = g_main_loop_new(context, false);
+	server = gst_rtsp_server_new();
+
+	std::string service = std::to_string(config.port);
+	gst_rtsp_server_set_service(server, service.c_str());
+
+	viewer_token = gst_rtsp_token_new(GST_RTSP_TOKEN_MEDIA_FACTORY_ROLE, G_TYPE_STRING, viewer_role.c_str(), NULL);
+
+	PiTvRtspAuth* auth = static_cast<PiTvRtspAuth*>(g_object_new(pitv_rtsp_auth_get_type(), NULL));
+	auth->rtsp_server = this;
+	gst_rtsp_server_set_auth(server, GST_RTSP_AUTH(auth));
+	g_object_unref(auth);
+
+	GstRTSPMediaFactory* factory = gst_rtsp_media_factory_new();
+	std::string launch = "( appsrc name=" + appsrc_name + " ! rtph264pay name=pay0 pt=96 config-interval=-1 )";
+	gst_rtsp_media_factory_set_launch(factory, launch.c_str());
+	gst_rtsp_media_factory_set_shared(factory, true);
+	gst_rtsp_media_factory_set_latency(factory, 0);
+	gst_rtsp_media_factory_add_role(factory, viewer_role.c_str(),
+		GST_RTSP_PERM_MEDIA_FACTORY_ACCESS, G_TYPE_BOOLEAN, true,
+		GST_RTSP_PERM_MEDIA_FACTORY_CONSTRUCT, G_TYPE_BOOLEAN, true,
+		NULL);
+	g_signal_connect(factory, "media-configure", G_CALLBACK(&RtspServer::media_configure_handler), this);
+
+	GstRTSPMountPoints* mounts = gst_rtsp_server_get_mount_points(server);
+	gst_rtsp_mount_points_add_factory(mounts, config.mount_point.c_str(), factory);
+	g_object_unref(mounts);
+
+	g_signal_connect(server, "client-connected", G_CALLBACK(&RtspServer::client_connected_handler), this);
+
+	if (gst_rtsp_server_attach(server, context) == 0)
+	{
+		logger()->error("Failed to attach RTSP server to port {}!", config.port);
+		g_object_unref(server);
+		server = nullptr;
+		g_main_loop_unref(loop);
+		loop = nullptr;
+		g_main_context_unref(context);
+		context = nullptr;
+		gst_rtsp_token_unref(viewer_token);
+		viewer_token = nullptr;
+		return false;
+	}
+
+	tap_listener_id = encoded_tap->add_listener([this](const EncodedFramePtr& frame)
+		{
+			on_encoded_frame(frame);
+		}
+	);
+
+	server_thread = std::thread([this]()
+		{
+			g_main_context_push_thread_default(context);
+			g_main_loop_run(loop);
+			g_main_context_pop_thread_default(context);
+		}
+	);
+
+	logger()->info("RTSP server listening on rtsp://0.0.0.0:{}{}", config.port, config.mount_point);
+	return true;
+}
+
+void RtspServer::stop()
+{
+	if (!server)
+	{
+		return;
+	}
+
+	if (tap_listener_id)
+	{
+		encoded_tap->remove_listener(tap_listener_id);
+		tap_listener_id = 0;
+	}
+
+	g_main_loop_quit(loop);
+	if (server_thread.joinable())
+	{
+		server_thread.join();
+	}
+
+	release_appsrc();
+
+	g_object_unref(server);
+	server = nullptr;
+	g_main_loop_unref(loop);
+	loop = nullptr;
+	g_main_context_unref(context);
+	context = nullptr;
+	gst_rtsp_token_unref(viewer_token);
+	viewer_token = nullptr;
+
+	logger()->info("RTSP server stopped");
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/rtsp-server/rtsp-server.h>
+#include <spdlog/spdlog.h>
+#include "../video/EncodedTap.h"
+#include "../accounts/UserDb.h"
+
+struct RtspServerConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	int port = 0;
+	std::string mount_point = "/live";
+};
+
+// Embedded RTSP server. One shared media is fed with access units from the encoded tap,
+// so every RTSP client reuses the same payloader and no extra encoding is done.
+class RtspServer
+{
+private:
+	static const std::string appsrc_name;
+	static const std::string viewer_role;
+
+	RtspServerConfig config;
+	std::shared_ptr<UserDb> user_db;
+	std::shared_ptr<EncodedTap> encoded_tap;
+	int tap_listener_id = 0;
+
+	GMainContext* context = nullptr;
+	GMainLoop* loop = nullptr;
+	GstRTSPServer* server = nullptr;
+	GstRTSPToken* viewer_token = nullptr;
+	std::thread server_thread;
+
+	std::mutex appsrc_mutex;
+	GstElement* appsrc = nullptr;
+	GstCaps* appsrc_caps = nullptr;
+	bool waiting_keyframe = true;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	static void media_configure_handler(GstRTSPMediaFactory* factory, GstRTSPMedia* media, gpointer udata);
+	static void media_unprepared_handler(GstRTSPMedia* media, gpointer udata);
+	static void client_connected_handler(GstRTSPServer* server, GstRTSPClient* client, gpointer udata);
+
+	void on_encoded_frame(const EncodedFramePtr& frame);
+	void release_appsrc();
+
+public:
+	RtspServer& operator=(const RtspServer&) = delete;
+	RtspServer(const RtspServer& copy) = delete;
+	RtspServer() = delete;
+
+	RtspServer(const RtspServerConfig& config, std::shared_ptr<UserDb> user_db, std::shared_ptr<EncodedTap> encoded_tap);
+	~RtspServer();
+
+	bool start();
+	void stop();
+
+	// Called by the RTSP authenticator with credentials from the Basic Authorization header
+	GstRTSPToken* authenticate(const std::string& username, const std::string& password) const;
+};
@@ -0,0 +1,268 @@
+#include "ShmEgress.h"
+#include <cassert>
+#include <gst/video/video.h>
+
+ShmEgress::ShmEgress(const ShmEgressConfig& config, std::shared_ptr<EncodedTap> encoded_tap, std::shared_ptr<RawTap> raw_tap)
+{
+	this->config = config;
+	this->encoded_tap = encoded_tap;
+	this->raw_tap = raw_tap;
+}
+
+ShmEgress::~ShmEgress()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> ShmEgress::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool ShmEgress::start()
+{
+	if (encoded_listener_id)
+	{
+		logger()->warn("Shared memory egress is already running!");
+		return true;
+	}
+
+	if (!encoded_tap)
+	{
+		logger()->error("Cannot start shared memory egress: encoded tap is not available!");
+		return false;
+	}
+
+	encoded_listener_id = encoded_tap->add_listener([this](const EncodedFramePtr& frame)
+		{
+			on_encoded_frame(frame);
+		}
+	);
+
+	if (raw_tap)
+	{
+		raw_listener_id = raw_tap->add_listener([this](const RawFramePtr& frame)
+			{
+				on_raw_frame(frame);
+			}
+		);
+	}
+
+	logger()->info("Shared memory egress started, raw frames {}", raw_tap ? "available" : "not available");
+	return true;
+}
+
+void ShmEgress::stop()
+{
+	if (encoded_listener_id)
+	{
+		encoded_tap->remove_listener(encoded_listener_id);
+		encoded_listener_id = 0;
+	}
+
+	if (raw_listener_id)
+	{
+		raw_tap->remove_listener(raw_listener_id);
+		raw_listener_id = 0;
+	}
+
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	rings.clear();
+}
+
+bool ShmEgress::has_raw_frames() const
+{
+	return raw_tap != nullptr;
+}
+
+std::string ShmEgress::caps_to_string(GstCaps* caps)
+{
+	gchar* caps_str = gst_caps_to_string(caps);
+	std::string result(caps_str ? caps_str : "");
+	g_free(caps_str);
+	return result;
+}
+
+uint64_t ShmEgress::to_ns(GstClockTime time)
+{
+	return GST_CLOCK_TIME_IS_VALID(time) ? static_cast<uint64_t>(time) : UINT64_MAX;
+}
+
+bool ShmEgress::open_ring(const std::string& lease_guid, ShmRingKind kind, ShmRingInfo& info)
+{
+	uint32_t slot_count = config.encoded_slot_count;
+	uint32_t payload_capacity = config.encoded_slot_capacity;
+
+	if (kind == ShmRingRaw)
+	{
+		auto stream_info = raw_tap ? raw_tap->get_stream_info() : nullptr;
+		if (!stream_info)
+		{
+			logger()->error("Raw shared memory ring requested, but no raw frames were received yet");
+			return false;
+		}
+
+		// Strided buffers from the camera may be larger than the packed frame size
+		slot_count = config.raw_slot_count;
+		payload_capacity = static_cast<uint32_t>(GST_VIDEO_INFO_SIZE(&stream_info->video_info) * 5 / 4);
+	}
+
+	Ring ring;
+	ring.kind = kind;
+	ring.ring = std::make_unique<ShmRing>(config.logger_ptr);
+	if (!ring.ring->create("/pitv-" + lease_guid, kind, slot_count, payload_capacity))
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	info.name = ring.ring->get_name();
+	info.kind = kind;
+	info.slot_count = ring.ring->get_slot_count();
+	info.payload_capacity = ring.ring->get_payload_capacity();
+	rings[lease_guid] = std::move(ring);
+	return true;
+}
+
+void ShmEgress::close_ring(const std::string& lease_guid)
+{
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	rings.erase(lease_guid);
+}
+
+bool ShmEgress::get_ring_info(const std::string& lease_guid, ShmRingInfo& info) const
+{
+	std::lock_guard<std::mutex> lock(rings_mutex);
+
+	auto iter = rings.find(lease_guid);
+	if (iter == rings.end())
+	{
+		return false;
+	}
+
+	const ShmRing& ring = *iter->second.ring;
+	info.name = ring.get_name();
+	info.kind = iter->second.kind;
+	info.slot_count = ring.get_slot_count();
+	info.payload_capacity = ring.get_payload_capacity();
+	info.frames_written = ring.get_frames_written();
+	info.frames_dropped = ring.get_frames_dropped();
+	return true;
+}
+
+void ShmEgress::on_encoded_frame(const EncodedFramePtr& frame)
+{
+	if (!frame->stream_info)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	if (rings.empty())
+	{
+		return;
+	}
+
+	GstMapInfo map_info;
+	if (!gst_buffer_map(frame->buffer, &map_info, GST_MAP_READ))
+	{
+		logger()->error("Shared memory egress failed to map access unit!");
+		return;
+	}
+
+	ShmRingFrameInfo frame_info;
+	frame_info.pts_ns = to_ns(frame->pts);
+	frame_info.dts_ns = to_ns(frame->dts);
+	frame_info.duration_ns = to_ns(frame->duration);
+	frame_info.wallclock_usec = frame->wallclock_usec;
+	frame_info.flags = frame->keyframe ? ShmRingFlagKeyframe : 0;
+
+	for (auto& entry : rings)
+	{
+		Ring& ring = entry.second;
+		if (ring.kind != ShmRingEncoded)
+		{
+			continue;
+		}
+
+		// Consumers can start decoding at the first slot of the ring
+		if (ring.waiting_keyframe)
+		{
+			if (!frame->keyframe)
+			{
+				continue;
+			}
+			ring.waiting_keyframe = false;
+		}
+
+		if (ring.stream_info != frame->stream_info)
+		{
+			ring.ring->set_caps(caps_to_string(frame->stream_info->caps));
+			ring.stream_info = frame->stream_info;
+		}
+
+		ring.ring->write(map_info.data, map_info.size, frame_info);
+	}
+
+	gst_buffer_unmap(frame->buffer, &map_info);
+}
+
+void ShmEgress::on_raw_frame(const RawFramePtr& frame)
+{
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	if (rings.empty())
+	{
+		return;
+	}
+
+	GstMapInfo map_info;
+	if (!gst_buffer_map(frame->buffer, &map_info, GST_MAP_READ))
+	{
+		logger()->error("Shared memory egress failed to map raw frame!");
+		return;
+	}
+
+	const GstVideoInfo& video_info = frame->stream_info->video_info;
+
+	ShmRingFrameInfo frame_info;
+	frame_info.pts_ns = to_ns(frame->pts);
+	frame_info.dts_ns = UINT64_MAX;
+	frame_info.duration_ns = to_ns(GST_BUFFER_DURATION(frame->buffer));
+	frame_info.wallclock_usec = frame->wallclock_usec;
+	frame_info.flags = ShmRingFlagKeyframe;
+
+	// The video meta describes the real plane layout of padded camera buffers
+	GstVideoMeta* video_meta = gst_buffer_get_video_meta(frame->buffer);
+	for (int plane = 0; plane < 4; plane++)
+	{
+		if (video_meta && static_cast<guint>(plane) < video_meta->n_planes)
+		{
+			frame_info.plane_offset[plane] = static_cast<uint32_t>(video_meta->offset[plane]);
+			frame_info.plane_stride[plane] = video_meta->stride[plane];
+		}
+		else if (!video_meta && plane < static_cast<int>(GST_VIDEO_INFO_N_PLANES(&video_info)))
+		{
+			frame_info.plane_offset[plane] = static_cast<uint32_t>(GST_VIDEO_INFO_PLANE_OFFSET(&video_info, plane));
+			frame_info.plane_stride[plane] = GST_VIDEO_INFO_PLANE_STRIDE(&video_info, plane);
+		}
+	}
+
+	for (auto& entry : rings)
+	{
+		Ring& ring = entry.second;
+		if (ring.kind != ShmRingRaw)
+		{
+			continue;
+		}
+
+		if (ring.stream_info != frame->stream_info)
+		{
+			ring.ring->set_caps(caps_to_string(frame->stream_info->caps));
+			ring.stream_info = frame->stream_info;
+		}
+
+		ring.ring->write(map_info.data, map_info.size, frame_info);
+	}
+
+	gst_buffer_unmap(frame->buffer, &map_info);
+}
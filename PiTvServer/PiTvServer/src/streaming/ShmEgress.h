@@ -0,0 +1,77 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <gst/gst.h>
+#include <spdlog/spdlog.h>
+#include "ShmRing.h"
+#include "../video/EncodedTap.h"
+#include "../video/RawTap.h"
+
+struct ShmEgressConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	uint32_t encoded_slot_count = 64;
+	uint32_t encoded_slot_capacity = 512 * 1024;
+	uint32_t raw_slot_count = 4;
+};
+
+struct ShmRingInfo
+{
+	std::string name;
+	ShmRingKind kind = ShmRingEncoded;
+	uint32_t slot_count = 0;
+	uint32_t payload_capacity = 0;
+	uint64_t frames_written = 0;
+	uint64_t frames_dropped = 0;
+};
+
+// Local egress for co-located consumers: one shared memory ring per lease, named after the lease GUID.
+// Encoded access units and raw frames are written straight from the taps, without payloading.
+class ShmEgress
+{
+private:
+	struct Ring
+	{
+		std::unique_ptr<ShmRing> ring;
+		ShmRingKind kind = ShmRingEncoded;
+		std::shared_ptr<const void> stream_info;
+		bool waiting_keyframe = true;
+	};
+
+	ShmEgressConfig config;
+	std::shared_ptr<EncodedTap> encoded_tap;
+	std::shared_ptr<RawTap> raw_tap;
+	int encoded_listener_id = 0;
+	int raw_listener_id = 0;
+
+	mutable std::mutex rings_mutex;
+	std::map<std::string, Ring> rings;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	void on_encoded_frame(const EncodedFramePtr& frame);
+	void on_raw_frame(const RawFramePtr& frame);
+	static std::string caps_to_string(GstCaps* caps);
+	static uint64_t to_ns(GstClockTime time);
+
+public:
+	ShmEgress& operator=(const ShmEgress&) = delete;
+	ShmEgress(const ShmEgress& copy) = delete;
+	ShmEgress() = delete;
+
+	// raw_tap may be null, raw rings are unavailable then
+	ShmEgress(const ShmEgressConfig& config, std::shared_ptr<EncodedTap> encoded_tap, std::shared_ptr<RawTap> raw_tap);
+	~ShmEgress();
+
+	bool start();
+	void stop();
+
+	bool has_raw_frames() const;
+
+	bool open_ring(const std::string& lease_guid, ShmRingKind kind, ShmRingInfo& info);
+	void close_ring(const std::string& lease_guid);
+	bool get_ring_info(const std::string& lease_guid, ShmRingInfo& info) const;
+};
@@ -0,0 +1,220 @@
+#include "ShmRing.h"
+#include <cassert>
+#include <cstring>
+#include <new>
+
+#ifdef CM_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+const uint32_t ShmRing::magic = 0x52565450; // "PTVR"
+const uint32_t ShmRing::version = 1;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory ring requires lock-free 64-bit atomics");
+
+static uint32_t align_up(size_t value, size_t alignment)
+{
+	return static_cast<uint32_t>((value + alignment - 1) / alignment * alignment);
+}
+
+ShmRing::ShmRing(std::shared_ptr<spdlog::logger> logger_ptr)
+{
+	this->logger_ptr = logger_ptr;
+}
+
+ShmRing::~ShmRing()
+{
+	destroy();
+}
+
+ShmRingSlot* ShmRing::get_slot(uint64_t index) const
+{
+	size_t offset = header->header_size + static_cast<size_t>(index % header->slot_count) * header->slot_stride;
+	return reinterpret_cast<ShmRingSlot*>(base + offset);
+}
+
+bool ShmRing::create(const std::string& name, ShmRingKind kind, uint32_t slot_count, uint32_t payload_capacity)
+{
+#ifdef CM_UNIX
+	if (base)
+	{
+		logger_ptr->warn("Shared memory ring {} is already created!", this->name);
+		return true;
+	}
+
+	if (slot_count == 0 || payload_capacity == 0)
+	{
+		logger_ptr->error("Shared memory ring {}: invalid geometry {} x {}", name, slot_count, payload_capacity);
+		return false;
+	}
+
+	uint32_t header_size = align_up(sizeof(ShmRingHeader), 64);
+	uint32_t slot_stride = align_up(sizeof(ShmRingSlot) + payload_capacity, 64);
+	size_t size = header_size + static_cast<size_t>(slot_count) * slot_stride;
+
+	// Readable by the owner group, consumers are expected to map it read-only
+	fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0640);
+	if (fd < 0)
+	{
+		logger_ptr->error("Shared memory ring {}: shm_open failed: {}", name, strerror(errno));
+		return false;
+	}
+
+	if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+	{
+		logger_ptr->error("Shared memory ring {}: ftruncate to {} bytes failed: {}", name, size, strerror(errno));
+		close(fd);
+		fd = -1;
+		shm_unlink(name.c_str());
+		return false;
+	}
+
+	void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED)
+	{
+		logger_ptr->error("Shared memory ring {}: mmap failed: {}", name, strerror(errno));
+		close(fd);
+		fd = -1;
+		shm_unlink(name.c_str());
+		return false;
+	}
+
+	this->name = name;
+	base = static_cast<uint8_t*>(mapping);
+	mapping_size = size;
+	write_count = 0;
+	frames_dropped = 0;
+
+	// ftruncate zero-fills, so all slots start with sequence 0 (never published)
+	header = new (base) ShmRingHeader();
+	header->header_size = header_size;
+	header->kind = kind;
+	header->slot_count = slot_count;
+	header->slot_stride = slot_stride;
+	header->payload_capacity = payload_capacity;
+	header->write_count.store(0, std::memory_order_relaxed);
+	header->caps_sequence.store(0, std::memory_order_relaxed);
+	header->version = version;
+	std::atomic_thread_fence(std::memory_order_release);
+	header->magic = magic;
+
+	logger_ptr->info("Shared memory ring {} created: {} slots of {} bytes, {} bytes total", name, slot_count, payload_capacity, size);
+	return true;
+#else
+	logger_ptr->error("Shared memory rings are not supported on this platform");
+	return false;
+#endif
+}
+
+void ShmRing::destroy()
+{
+#ifdef CM_UNIX
+	if (!base)
+	{
+		return;
+	}
+
+	// Consumers that still have the segment mapped keep it alive until they unmap it
+	munmap(base, mapping_size);
+	close(fd);
+	shm_unlink(name.c_str());
+
+	logger_ptr->info("Shared memory ring {} destroyed after {} frames, {} dropped", name, write_count.load(), frames_dropped.load());
+
+	base = nullptr;
+	header = nullptr;
+	fd = -1;
+	mapping_size = 0;
+#endif
+}
+
+void ShmRing::set_caps(const std::string& caps)
+{
+	if (!header)
+	{
+		return;
+	}
+
+	if (caps.size() >= sizeof(header->caps))
+	{
+		logger_ptr->error("Shared memory ring {}: caps of {} bytes do not fit the header", name, caps.size());
+		return;
+	}
+
+	uint64_t sequence = header->caps_sequence.load(std::memory_order_relaxed);
+	header->caps_sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	memcpy(header->caps, caps.c_str(), caps.size() + 1);
+	header->caps_size = static_cast<uint32_t>(caps.size());
+
+	header->caps_sequence.store(sequence + 2, std::memory_order_release);
+}
+
+bool ShmRing::write(const uint8_t* data, size_t size, const ShmRingFrameInfo& frame_info)
+{
+	if (!header)
+	{
+		return false;
+	}
+
+	if (size > header->payload_capacity)
+	{
+		if (frames_dropped++ == 0)
+		{
+			logger_ptr->warn("Shared memory ring {}: frame of {} bytes exceeds slot capacity {}, dropping", name, size, header->payload_capacity);
+		}
+		return false;
+	}
+
+	uint64_t index = write_count;
+	ShmRingSlot* slot = get_slot(index);
+
+	slot->sequence.store(2 * index + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot->pts_ns = frame_info.pts_ns;
+	slot->dts_ns = frame_info.dts_ns;
+	slot->duration_ns = frame_info.duration_ns;
+	slot->wallclock_usec = frame_info.wallclock_usec;
+	slot->caps_generation = header->caps_sequence.load(std::memory_order_relaxed) / 2;
+	slot->size = static_cast<uint32_t>(size);
+	slot->flags = frame_info.flags;
+	memcpy(slot->plane_offset, frame_info.plane_offset, sizeof(slot->plane_offset));
+	memcpy(slot->plane_stride, frame_info.plane_stride, sizeof(slot->plane_stride));
+	memcpy(reinterpret_cast<uint8_t*>(slot) + sizeof(ShmRingSlot), data, size);
+
+	slot->sequence.store(2 * index + 2, std::memory_order_release);
+
+	write_count = index + 1;
+	header->write_count.store(write_count, std::memory_order_release);
+	return true;
+}
+
+std::string ShmRing::get_name() const
+{
+	return name;
+}
+
+uint32_t ShmRing::get_slot_count() const
+{
+	return header ? header->slot_count : 0;
+}
+
+uint32_t ShmRing::get_payload_capacity() const
+{
+	return header ? header->payload_capacity : 0;
+}
+
+uint64_t ShmRing::get_frames_written() const
+{
+	return write_count;
+}
+
+uint64_t ShmRing::get_frames_dropped() const
+{
+	return frames_dropped;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <spdlog/spdlog.h>
+
+// Shared memory layout, version 1. All integers are in host byte order, the segment is
+// created with shm_open() under the name returned in the lease reply and is read-only for consumers.
+//
+//   offset 0                     ShmRingHeader
+//   header_size + i*slot_stride  ShmRingSlot i, followed by payload_capacity bytes of payload
+//
+// Frame n (counting from 0) is written to slot n % slot_count. Every slot is guarded by a
+// seqlock: sequence is 2n+1 while frame n is being written and 2n+2 once it is published.
+// Readers use the payload in place:
+//
+//   n = header.write_count - 1                 (newest published frame, acquire load)
+//   s1 = slot.sequence                         (acquire load), must equal 2n+2
+//   read slot fields and payload
+//   acquire fence, s2 = slot.sequence          must equal s1, otherwise the slot was reused meanwhile
+//
+// Caps of the stream are published the same way with caps_sequence, and each slot records the
+// caps_generation (caps_sequence / 2) that describes its payload. Raw frames are stored as they
+// left the camera, so plane offsets and strides are given per slot rather than derived from caps.
+// Timestamps are GstClockTime values in nanoseconds, UINT64_MAX when unknown.
+struct ShmRingHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t kind;
+	uint32_t slot_count;
+	uint32_t slot_stride;
+	uint32_t payload_capacity;
+	uint32_t reserved;
+	std::atomic<uint64_t> write_count;
+	std::atomic<uint64_t> caps_sequence;
+	uint32_t caps_size;
+	char caps[1024];
+};
+
+struct ShmRingSlot
+{
+	std::atomic<uint64_t> sequence;
+	uint64_t pts_ns;
+	uint64_t dts_ns;
+	uint64_t duration_ns;
+	int64_t wallclock_usec;
+	uint64_t caps_generation;
+	uint32_t size;
+	uint32_t flags;
+	uint32_t plane_offset[4];
+	int32_t plane_stride[4];
+};
+
+enum ShmRingKind : uint32_t
+{
+	ShmRingEncoded = 0,  // H.264 access units, stream-format=avc (length-prefixed NAL units)
+	ShmRingRaw = 1       // raw video frames in the layout described by the caps
+};
+
+enum ShmRingFlags : uint32_t
+{
+	ShmRingFlagKeyframe = 1
+};
+
+// Metadata stored next to a frame; planes are only filled for raw frames
+struct ShmRingFrameInfo
+{
+	uint64_t pts_ns = 0;
+	uint64_t dts_ns = 0;
+	uint64_t duration_ns = 0;
+	int64_t wallclock_usec = 0;
+	uint32_t flags = 0;
+	uint32_t plane_offset[4] = { 0, 0, 0, 0 };
+	int32_t plane_stride[4] = { 0, 0, 0, 0 };
+};
+
+// Single producer side of a shared memory ring. Frames larger than the slot capacity are dropped.
+class ShmRing
+{
+private:
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	std::string name;
+	int fd = -1;
+	uint8_t* base = nullptr;
+	size_t mapping_size = 0;
+	ShmRingHeader* header = nullptr;
+	std::atomic<uint64_t> write_count = 0;
+	std::atomic<uint64_t> frames_dropped = 0;
+
+	ShmRingSlot* get_slot(uint64_t index) const;
+
+public:
+	static const uint32_t magic;
+	static const uint32_t version;
+
+	ShmRing& operator=(const ShmRing&) = delete;
+	ShmRing(const ShmRing& copy) = delete;
+	ShmRing() = delete;
+
+	ShmRing(std::shared_ptr<spdlog::logger> logger_ptr);
+	~ShmRing();
+
+	// name must start with '/', e.g. /pitv-<lease guid>
+	bool create(const std::string& name, ShmRingKind kind, uint32_t slot_count, uint32_t payload_capacity);
+	void destroy();
+
+	void set_caps(const std::string& caps);
+	bool write(const uint8_t* data, size_t size, const ShmRingFrameInfo& frame_info);
+
+	std::string get_name() const;
+	uint32_t get_slot_count() const;
+	uint32_t get_payload_capacity() const;
+	uint64_t get_frames_written() const;
+	uint64_t get_frames_dropped() const;
+};
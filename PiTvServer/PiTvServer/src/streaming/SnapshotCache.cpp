@@ -0,0 +1,244 @@
+#include "SnapshotCache.h"
+#include <cassert>
+#ifdef CM_UNIX
+#include <pthread.h>
+#endif
+
+SnapshotCache::SnapshotCache(const SnapshotCacheConfig& config, std::shared_ptr<EncodedTap> encoded_tap)
+{
+	this->config = config;
+	this->encoded_tap = encoded_tap;
+}
+
+SnapshotCache::~SnapshotCache()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> SnapshotCache::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool SnapshotCache::start()
+{
+	if (is_running)
+	{
+		logger()->warn("Snapshot cache is already running!");
+		return true;
+	}
+
+	if (!encoded_tap)
+	{
+		logger()->error("Cannot start snapshot cache: encoded tap is not available!");
+		return false;
+	}
+
+	if (config.jpeg_quality < 1 || config.jpeg_quality > 100)
+	{
+		logger()->error("Invalid snapshot JPEG quality {}", config.jpeg_quality);
+		return false;
+	}
+
+	is_running = true;
+	worker = std::thread([this]() { worker_loop(); });
+#ifdef CM_UNIX
+	pthread_setname_np(worker.native_handle(), "pitv-snapshot");
+#endif
+
+	tap_listener_id = encoded_tap->add_listener([this](const EncodedFramePtr& frame)
+		{
+			on_encoded_frame(frame);
+		}
+	);
+
+	logger()->info("Snapshot cache started, JPEG quality {}", config.jpeg_quality);
+	return true;
+}
+
+void SnapshotCache::stop()
+{
+	if (!is_running)
+	{
+		return;
+	}
+
+	encoded_tap->remove_listener(tap_listener_id);
+	tap_listener_id = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		is_running = false;
+		latest_keyframe.reset();
+	}
+	decode_cv.notify_all();
+	if (worker.joinable())
+	{
+		worker.join();
+	}
+
+	logger()->info("Snapshot cache stopped");
+}
+
+void SnapshotCache::on_encoded_frame(const EncodedFramePtr& frame)
+{
+	if (!frame->keyframe || !frame->stream_info || !frame->stream_info->caps)
+	{
+		return;
+	}
+
+	// Only a reference: nothing is decoded until somebody asks
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	latest_keyframe = frame;
+	keyframe_generation++;
+}
+
+SnapshotState SnapshotCache::get_snapshot(bool allow_stale, SnapshotData& jpeg, int64_t& wallclock_usec)
+{
+	std::unique_lock<std::mutex> lock(cache_mutex);
+	stats.requests++;
+
+	if (cached_jpeg && cached_generation == keyframe_generation)
+	{
+		jpeg = cached_jpeg;
+		wallclock_usec = cached_wallclock_usec;
+		return SnapshotState::Ready;
+	}
+
+	// A keyframe that failed to decode is not retried, the next one will be
+	bool decode_failed = failed_generation == keyframe_generation;
+	if (!latest_keyframe || (decode_failed && !(allow_stale && cached_jpeg)))
+	{
+		return SnapshotState::Unavailable;
+	}
+
+	if (!decode_requested && !decode_failed)
+	{
+		decode_requested = true;
+		lock.unlock();
+		decode_cv.notify_one();
+		lock.lock();
+	}
+
+	if (allow_stale && cached_jpeg)
+	{
+		jpeg = cached_jpeg;
+		wallclock_usec = cached_wallclock_usec;
+		return SnapshotState::Ready;
+	}
+
+	return SnapshotState::Pending;
+}
+
+SnapshotStats SnapshotCache::get_stats() const
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	return stats;
+}
+
+void SnapshotCache::worker_loop()
+{
+	while (true)
+	{
+		EncodedFramePtr keyframe;
+		uint64_t generation = 0;
+		{
+			std::unique_lock<std::mutex> lock(cache_mutex);
+			decode_cv.wait(lock, [this]() { return decode_requested || !is_running; });
+			if (!is_running)
+			{
+				break;
+			}
+
+			keyframe = latest_keyframe;
+			generation = keyframe_generation;
+		}
+
+		int64_t decode_start_usec = g_get_monotonic_time();
+		auto jpeg = std::make_shared<std::vector<uint8_t>>();
+		bool ok = keyframe && decode_keyframe(keyframe, *jpeg);
+		int64_t decode_usec = g_get_monotonic_time() - decode_start_usec;
+
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		decode_requested = false;
+		stats.decodes++;
+		stats.last_decode_usec = static_cast<uint64_t>(decode_usec);
+		if (!ok)
+		{
+			stats.decode_errors++;
+			failed_generation = generation;
+			continue;
+		}
+
+		cached_jpeg = jpeg;
+		cached_generation = generation;
+		cached_wallclock_usec = keyframe->wallclock_usec;
+		logger()->debug("Snapshot of keyframe {} encoded in {} usec, {} bytes", generation, decode_usec, jpeg->size());
+	}
+}
+
+bool SnapshotCache::decode_keyframe(const EncodedFramePtr& keyframe, std::vector<uint8_t>& jpeg)
+{
+	// A throwaway pipeline per decode: one IDR in, EOS flushes the decoder, one JPEG out
+	std::string description = "appsrc name=snapshot_appsrc format=time ! decodebin ! videoconvert ! "
+		"jpegenc quality=" + std::to_string(config.jpeg_quality) + " ! "
+		"appsink name=snapshot_appsink sync=false max-buffers=1";
+
+	GError* error = nullptr;
+	GstElement* pipeline = gst_parse_launch(description.c_str(), &error);
+	if (!pipeline || error)
+	{
+		logger()->error("Failed to create snapshot pipeline: {}", error ? error->message : "unknown error");
+		g_clear_error(&error);
+		if (pipeline)
+		{
+			gst_object_unref(pipeline);
+		}
+		return false;
+	}
+
+	GstElement* appsrc = gst_bin_get_by_name(GST_BIN(pipeline), "snapshot_appsrc");
+	GstElement* appsink = gst_bin_get_by_name(GST_BIN(pipeline), "snapshot_appsink");
+	assert(appsrc && appsink);
+
+	gst_app_src_set_caps(GST_APP_SRC(appsrc), keyframe->stream_info->caps);
+
+	bool ok = false;
+	if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+	{
+		logger()->error("Failed to set snapshot pipeline to PLAYING state!");
+	}
+	else
+	{
+		GstBuffer* buffer = gst_buffer_copy(keyframe->buffer);
+		GST_BUFFER_PTS(buffer) = 0;
+		GST_BUFFER_DTS(buffer) = 0;
+		gst_app_src_push_buffer(GST_APP_SRC(appsrc), buffer);
+		gst_app_src_end_of_stream(GST_APP_SRC(appsrc));
+
+		GstSample* sample = gst_app_sink_try_pull_sample(GST_APP_SINK(appsink), static_cast<GstClockTime>(config.decode_timeout_msec) * GST_MSECOND);
+		GstBuffer* jpeg_buffer = sample ? gst_sample_get_buffer(sample) : nullptr;
+		GstMapInfo map_info;
+		if (jpeg_buffer && gst_buffer_map(jpeg_buffer, &map_info, GST_MAP_READ))
+		{
+			jpeg.assign(map_info.data, map_info.data + map_info.size);
+			gst_buffer_unmap(jpeg_buffer, &map_info);
+			ok = !jpeg.empty();
+		}
+		else
+		{
+			logger()->error("Snapshot pipeline produced no JPEG within {} msec", config.decode_timeout_msec);
+		}
+
+		if (sample)
+		{
+			gst_sample_unref(sample);
+		}
+	}
+
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+	gst_object_unref(appsrc);
+	gst_object_unref(appsink);
+	gst_object_unref(pipeline);
+	return ok;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <condition_variable>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <spdlog/spdlog.h>
+#include "../video/EncodedTap.h"
+
+struct SnapshotCacheConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	int jpeg_quality = 85;
+	int decode_timeout_msec = 2000;
+};
+
+typedef std::shared_ptr<const std::vector<uint8_t>> SnapshotData;
+
+enum class SnapshotState
+{
+	Ready,
+	Pending,
+	Unavailable
+};
+
+struct SnapshotStats
+{
+	uint64_t requests = 0;
+	uint64_t decodes = 0;
+	uint64_t decode_errors = 0;
+	uint64_t last_decode_usec = 0;
+};
+
+// JPEG stills of the camera. Only a reference to the newest IDR access unit is kept; it is decoded
+// and encoded on a worker thread when a snapshot is asked for and the cached JPEG belongs to an older
+// keyframe. Any number of pollers therefore cost at most one decode per GOP.
+class SnapshotCache
+{
+private:
+	SnapshotCacheConfig config;
+	std::shared_ptr<EncodedTap> encoded_tap;
+	int tap_listener_id = 0;
+
+	mutable std::mutex cache_mutex;
+	std::condition_variable decode_cv;
+	EncodedFramePtr latest_keyframe;
+	uint64_t keyframe_generation = 0;
+	SnapshotData cached_jpeg;
+	uint64_t cached_generation = 0;
+	int64_t cached_wallclock_usec = 0;
+	bool decode_requested = false;
+	uint64_t failed_generation = 0;
+	SnapshotStats stats;
+
+	std::thread worker;
+	std::atomic<bool> is_running = false;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	void on_encoded_frame(const EncodedFramePtr& frame);
+	void worker_loop();
+	bool decode_keyframe(const EncodedFramePtr& keyframe, std::vector<uint8_t>& jpeg);
+
+public:
+	SnapshotCache& operator=(const SnapshotCache&) = delete;
+	SnapshotCache(const SnapshotCache& copy) = delete;
+	SnapshotCache() = delete;
+
+	SnapshotCache(const SnapshotCacheConfig& config, std::shared_ptr<EncodedTap> encoded_tap);
+	~SnapshotCache();
+
+	bool start();
+	void stop();
+
+	// Never blocks. Pending means a decode of the newest keyframe was started, ask again later.
+	// allow_stale returns the previous JPEG instead of Pending when there is one.
+	SnapshotState get_snapshot(bool allow_stale, SnapshotData& jpeg, int64_t& wallclock_usec);
+
+	SnapshotStats get_stats() const;
+};
@@ -0,0 +1,291 @@
+#include "SrtOutput.h"
+#include <cassert>
+#include <sstream>
+
+SrtOutput::SrtOutput(const SrtOutputConfig& config)
+{
+	this->config = config;
+}
+
+SrtOutput::~SrtOutput()
+{
+}
+
+std::shared_ptr<spdlog::logger> SrtOutput::logger() const
+{
+	return config.logger_ptr;
+}
+
+std::string SrtOutput::socket_address_to_str(GSocketAddress* address)
+{
+	if (!address || !G_IS_INET_SOCKET_ADDRESS(address))
+	{
+		return "";
+	}
+
+	GInetSocketAddress* inet_address = G_INET_SOCKET_ADDRESS(address);
+	gchar* host = g_inet_address_to_string(g_inet_socket_address_get_address(inet_address));
+
+	std::stringstream address_builder;
+	address_builder << host << ":" << g_inet_socket_address_get_port(inet_address);
+	g_free(host);
+
+	return address_builder.str();
+}
+
+gboolean SrtOutput::caller_connecting_handler(GstElement* sink, GSocketAddress* address, gchar* stream_id, gpointer udata)
+{
+	assert(udata);
+	SrtOutput* output = static_cast<SrtOutput*>(udata);
+
+	std::string address_str = socket_address_to_str(address);
+	std::string stream_id_str = stream_id ? stream_id : "";
+
+	std::lock_guard<std::mutex> lock(output->callers_mutex);
+	if (stream_id_str.empty() || output->allowed_stream_ids.count(stream_id_str) == 0)
+	{
+		output->logger()->warn("SRT caller {} rejected: stream id does not match any lease", address_str);
+		return false;
+	}
+
+	output->pending_callers[address_str] = stream_id_str;
+	output->logger()->info("SRT caller {} accepted for lease {}", address_str, stream_id_str);
+	return true;
+}
+
+void SrtOutput::caller_added_handler(GstElement* sink, gint unused, GSocketAddress* address, gpointer udata)
+{
+	assert(udata);
+	SrtOutput* output = static_cast<SrtOutput*>(udata);
+
+	std::string address_str = socket_address_to_str(address);
+
+	std::lock_guard<std::mutex> lock(output->callers_mutex);
+	auto iter = output->pending_callers.find(address_str);
+	if (iter == output->pending_callers.end())
+	{
+		output->logger()->warn("SRT caller {} added without stream id", address_str);
+		return;
+	}
+
+	output->connected_callers[address_str] = iter->second;
+	output->pending_callers.erase(iter);
+	output->logger()->info("SRT caller {} connected", address_str);
+}
+
+void SrtOutput::caller_removed_handler(GstElement* sink, gint unused, GSocketAddress* address, gpointer udata)
+{
+	assert(udata);
+	SrtOutput* output = static_cast<SrtOutput*>(udata);
+
+	std::string address_str = socket_address_to_str(address);
+
+	std::lock_guard<std::mutex> lock(output->callers_mutex);
+	output->pending_callers.erase(address_str);
+	output->connected_callers.erase(address_str);
+	output->logger()->info("SRT caller {} disconnected", address_str);
+}
+
+GstElement* SrtOutput::make_bin()
+{
+	if (bin)
+	{
+		logger()->error("SRT bin was already created!");
+		return nullptr;
+	}
+
+	GstElement* srt_bin = gst_bin_new("srt-bin");
+	assert(srt_bin);
+
+	GstElement* queue = gst_element_factory_make("queue", "srt_queue");
+	GstElement* parser = gst_element_factory_make("h264parse", "srt_h264parse");
+	GstElement* muxer = gst_element_factory_make("mpegtsmux", "srt_mpegtsmux");
+	GstElement* sink = gst_element_factory_make("srtsink", "srtsink");
+
+	if (!queue || !parser || !muxer || !sink)
+	{
+		logger()->error("Failed to create SRT elements! Is gst-plugins-bad with SRT support installed?");
+		gst_object_unref(srt_bin);
+		return nullptr;
+	}
+
+	if (g_signal_lookup("caller-connecting", G_OBJECT_TYPE(sink)) == 0)
+	{
+		logger()->error("srtsink has no caller-connecting signal (GStreamer 1.22+ required), SRT output disabled: callers cannot be authenticated");
+		gst_object_unref(sink);
+		gst_object_unref(queue);
+		gst_object_unref(parser);
+		gst_object_unref(muxer);
+		gst_object_unref(srt_bin);
+		return nullptr;
+	}
+
+	// Leaky queue: a stalled SRT sender must never block the tee
+	g_object_set(queue, "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", (guint64)(2 * GST_SECOND), NULL);
+	g_object_set(parser, "config-interval", -1, NULL);
+	g_object_set(muxer, "alignment", 7, NULL);
+
+	std::string uri = "srt://:" + std::to_string(config.port) + "?mode=listener";
+	g_object_set(sink, "uri", uri.c_str(), NULL);
+	g_object_set(sink, "latency", config.latency_msec, NULL);
+	g_object_set(sink, "wait-for-connection", false, NULL);
+	g_object_set(sink, "sync", false, NULL);
+	g_object_set(sink, "async", false, NULL);
+	if (!config.passphrase.empty())
+	{
+		g_object_set(sink, "passphrase", config.passphrase.c_str(), NULL);
+		g_object_set(sink, "pbkeylen", config.pbkeylen, NULL);
+	}
+
+	g_signal_connect(sink, "caller-connecting", G_CALLBACK(&SrtOutput::caller_connecting_handler), this);
+	g_signal_connect(sink, "caller-added", G_CALLBACK(&SrtOutput::caller_added_handler), this);
+	g_signal_connect(sink, "caller-removed", G_CALLBACK(&SrtOutput::caller_removed_handler), this);
+
+	gst_bin_add_many(GST_BIN(srt_bin), queue, parser, muxer, sink, NULL);
+	if (!gst_element_link_many(queue, parser, muxer, sink, NULL))
+	{
+		logger()->error("Failed to link SRT elements!");
+		gst_object_unref(srt_bin);
+		return nullptr;
+	}
+
+	GstPad* queue_sink_pad = gst_element_get_static_pad(queue, "sink");
+	GstPad* sink_ghost_pad = gst_ghost_pad_new("sink", queue_sink_pad);
+	gst_element_add_pad(srt_bin, sink_ghost_pad);
+	gst_object_unref(queue_sink_pad);
+
+	bin = srt_bin;
+	srtsink = sink;
+
+	logger()->info("SRT listener configured on port {} with latency {} msec, encryption {}",
+		config.port, config.latency_msec, config.passphrase.empty() ? "disabled" : "enabled");
+	return srt_bin;
+}
+
+void SrtOutput::allow_stream_id(const std::string& stream_id)
+{
+	std::lock_guard<std::mutex> lock(callers_mutex);
+	allowed_stream_ids.insert(stream_id);
+}
+
+void SrtOutput::revoke_stream_id(const std::string& stream_id)
+{
+	std::lock_guard<std::mutex> lock(callers_mutex);
+	allowed_stream_ids.erase(stream_id);
+
+	for (auto& caller : connected_callers)
+	{
+		if (caller.second == stream_id)
+		{
+			// srtsink has no API to drop a single caller, the revoked id only prevents reconnection
+			logger()->warn("SRT lease {} revoked while caller {} is still connected", stream_id, caller.first);
+		}
+	}
+}
+
+int SrtOutput::get_port() const
+{
+	return config.port;
+}
+
+int SrtOutput::get_latency_msec() const
+{
+	return config.latency_msec;
+}
+
+bool SrtOutput::read_caller_stats(const GstStructure* caller_structure, SrtCallerStats& stats)
+{
+	if (!caller_structure)
+	{
+		return false;
+	}
+
+	// srtsink reports the total as gint64 and the loss counters as gint
+	gint64 packets_sent = 0;
+	if (gst_structure_get_int64(caller_structure, "packets-sent", &packets_sent))
+	{
+		stats.packets_sent = packets_sent;
+	}
+	gint packets = 0;
+	if (gst_structure_get_int(caller_structure, "packets-retransmitted", &packets))
+	{
+		stats.packets_retransmitted = packets;
+	}
+	if (gst_structure_get_int(caller_structure, "packets-sent-dropped", &packets))
+	{
+		stats.packets_dropped = packets;
+	}
+	if (gst_structure_get_int(caller_structure, "packets-sent-lost", &packets))
+	{
+		stats.packets_lost = packets;
+	}
+
+	gst_structure_get_double(caller_structure, "rtt-ms", &stats.rtt_ms);
+	gst_structure_get_double(caller_structure, "send-rate-mbps", &stats.send_rate_mbps);
+
+	const GValue* address_value = gst_structure_get_value(caller_structure, "caller-address");
+	if (address_value && G_VALUE_HOLDS_OBJECT(address_value))
+	{
+		stats.address = socket_address_to_str(G_SOCKET_ADDRESS(g_value_get_object(address_value)));
+	}
+
+	return !stats.address.empty();
+}
+
+bool SrtOutput::get_caller_stats(std::map<std::string, SrtCallerStats>& stats) const
+{
+	if (!srtsink)
+	{
+		return false;
+	}
+
+	GstStructure* sink_stats = nullptr;
+	g_object_get(srtsink, "stats", &sink_stats, NULL);
+	if (!sink_stats)
+	{
+		return false;
+	}
+
+	std::vector<SrtCallerStats> callers;
+	const GValue* callers_value = gst_structure_get_value(sink_stats, "callers");
+	if (callers_value && G_VALUE_HOLDS(callers_value, G_TYPE_VALUE_ARRAY))
+	{
+		G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+		GValueArray* callers_array = static_cast<GValueArray*>(g_value_get_boxed(callers_value));
+		for (guint i = 0; callers_array && i < callers_array->n_values; i++)
+		{
+			GValue* caller_value = g_value_array_get_nth(callers_array, i);
+			SrtCallerStats caller_stats;
+			if (read_caller_stats(static_cast<const GstStructure*>(g_value_get_boxed(caller_value)), caller_stats))
+			{
+				callers.push_back(caller_stats);
+			}
+		}
+		G_GNUC_END_IGNORE_DEPRECATIONS
+	}
+	else if (callers_value && GST_VALUE_HOLDS_ARRAY(callers_value))
+	{
+		for (guint i = 0; i < gst_value_array_get_size(callers_value); i++)
+		{
+			SrtCallerStats caller_stats;
+			if (read_caller_stats(gst_value_get_structure(gst_value_array_get_value(callers_value, i)), caller_stats))
+			{
+				callers.push_back(caller_stats);
+			}
+		}
+	}
+
+	gst_structure_free(sink_stats);
+
+	std::lock_guard<std::mutex> lock(callers_mutex);
+	for (auto& caller : callers)
+	{
+		auto iter = connected_callers.find(caller.address);
+		if (iter != connected_callers.end())
+		{
+			stats[iter->second] = caller;
+		}
+	}
+
+	return true;
+}
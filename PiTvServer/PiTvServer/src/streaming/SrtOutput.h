@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <memory>
+#include <gst/gst.h>
+#include <gio/gio.h>
+#include <spdlog/spdlog.h>
+
+struct SrtOutputConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	int port = 0;
+	int latency_msec = 120;
+	std::string passphrase;
+	int pbkeylen = 16;
+};
+
+struct SrtCallerStats
+{
+	std::string address;
+	double rtt_ms = 0;
+	int64_t packets_sent = 0;
+	int64_t packets_retransmitted = 0;
+	int64_t packets_dropped = 0;
+	int64_t packets_lost = 0;
+	double send_rate_mbps = 0;
+};
+
+// SRT listener fed with MPEG-TS muxed H.264 from the main tee.
+// Callers must present a lease GUID as SRT stream id to be accepted.
+class SrtOutput
+{
+private:
+	SrtOutputConfig config;
+	GstElement* bin = nullptr;
+	GstElement* srtsink = nullptr;
+
+	mutable std::mutex callers_mutex;
+	std::set<std::string> allowed_stream_ids;
+	std::map<std::string, std::string> pending_callers;
+	std::map<std::string, std::string> connected_callers;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	static std::string socket_address_to_str(GSocketAddress* address);
+	static gboolean caller_connecting_handler(GstElement* sink, GSocketAddress* address, gchar* stream_id, gpointer udata);
+	static void caller_added_handler(GstElement* sink, gint unused, GSocketAddress* address, gpointer udata);
+	static void caller_removed_handler(GstElement* sink, gint unused, GSocketAddress* address, gpointer udata);
+	static bool read_caller_stats(const GstStructure* caller_structure, SrtCallerStats& stats);
+
+public:
+	SrtOutput& operator=(const SrtOutput&) = delete;
+	SrtOutput(const SrtOutput& copy) = delete;
+	SrtOutput() = delete;
+
+	SrtOutput(const SrtOutputConfig& config);
+	~SrtOutput();
+
+	// Returned bin is owned by the caller and has an H.264 "sink" ghost pad
+	GstElement* make_bin();
+
+	void allow_stream_id(const std::string& stream_id);
+	void revoke_stream_id(const std::string& stream_id);
+
+	int get_port() const;
+	int get_latency_msec() const;
+
+	// Statistics of connected callers, keyed by the stream id they presented
+	bool get_caller_stats(std::map<std::string, SrtCallerStats>& stats) const;
+};
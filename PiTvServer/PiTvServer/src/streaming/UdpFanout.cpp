@@ -0,0 +1,640 @@
+#include "UdpFanout.h"
+#include <algorithm>
+#include <cstring>
+#include <cassert>
+#include <chrono>
+
+#ifdef CM_UNIX
+#include <netdb.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <cerrno>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#endif
+
+const int UdpFanout::max_gso_segments = 64;
+const int UdpFanout::max_batch_messages = 256;
+const int UdpFanout::max_send_retries = 3;
+
+static const size_t max_gso_datagram_size = 65000;
+
+UdpFanout::UdpFanout(const UdpFanoutConfig& config)
+{
+	this->config = config;
+}
+
+UdpFanout::~UdpFanout()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> UdpFanout::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool UdpFanout::start()
+{
+#ifdef CM_UNIX
+	if (is_running.load())
+	{
+		logger()->warn("UdpFanout::start() called for already running fanout!");
+		return true;
+	}
+
+	if (config.sender_threads <= 0)
+	{
+		logger()->error("UdpFanout requires at least one sender thread, {} configured!", config.sender_threads);
+		return false;
+	}
+
+	// Every socket is opened before any sender starts, a failure leaves nothing to join
+	std::vector<std::unique_ptr<Shard>> new_shards;
+	for (int i = 0; i < config.sender_threads; i++)
+	{
+		auto shard = std::make_unique<Shard>();
+		shard->index = i;
+		shard->socket_ipv4 = open_socket(*shard, AF_INET);
+		if (shard->socket_ipv4 < 0)
+		{
+			logger()->error("UdpFanout failed to open IPv4 socket for sender thread {}!", i);
+			for (auto& opened_shard : new_shards)
+			{
+				close_sockets(*opened_shard);
+			}
+			return false;
+		}
+
+		shard->socket_ipv6 = open_socket(*shard, AF_INET6);
+		if (shard->socket_ipv6 < 0)
+		{
+			logger()->warn("UdpFanout failed to open IPv6 socket for sender thread {}, IPv6 endpoints will not be served", i);
+		}
+		new_shards.push_back(std::move(shard));
+	}
+
+	std::unique_lock<std::shared_mutex> shards_lock(shards_mutex);
+	is_running.store(true);
+
+	unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+
+	for (auto& shard : new_shards)
+	{
+		int i = shard->index;
+		Shard* shard_ptr = shard.get();
+		shard->thread = std::thread([this, shard_ptr]() { sender_loop(*shard_ptr); });
+
+		std::string thread_name = "pitv-fanout-" + std::to_string(i);
+		pthread_setname_np(shard->thread.native_handle(), thread_name.c_str());
+
+		if (config.pin_threads)
+		{
+			cpu_set_t cpu_set;
+			CPU_ZERO(&cpu_set);
+			CPU_SET(i % cores, &cpu_set);
+			if (pthread_setaffinity_np(shard->thread.native_handle(), sizeof(cpu_set_t), &cpu_set) != 0)
+			{
+				logger()->warn("UdpFanout failed to pin sender thread {} to core {}", i, i % cores);
+			}
+		}
+
+		logger()->info("UdpFanout sender thread {} started, GSO {}", i, shard->gso_enabled.load() ? "enabled" : "disabled");
+		shards.push_back(std::move(shard));
+	}
+
+	return true;
+#else
+	logger()->error("UdpFanout is not supported on this platform!");
+	return false;
+#endif
+}
+
+void UdpFanout::stop()
+{
+	if (!is_running.exchange(false))
+	{
+		return;
+	}
+
+	// Nobody walks the shards any more once they are taken out
+	std::vector<std::unique_ptr<Shard>> stopped_shards;
+	{
+		std::unique_lock<std::shared_mutex> shards_lock(shards_mutex);
+		stopped_shards.swap(shards);
+	}
+
+	for (auto& shard : stopped_shards)
+	{
+		// Taking the mutex once keeps a sender from missing the wakeup between its check and its wait
+		{
+			std::lock_guard<std::mutex> lock(shard->mutex);
+		}
+		shard->cv.notify_all();
+	}
+
+	for (auto& shard : stopped_shards)
+	{
+		if (shard->thread.joinable())
+		{
+			shard->thread.join();
+		}
+
+		for (GstBufferList* list : shard->queue)
+		{
+			gst_buffer_list_unref(list);
+		}
+		shard->queue.clear();
+
+		close_sockets(*shard);
+	}
+
+	logger()->info("UdpFanout stopped");
+}
+
+void UdpFanout::close_sockets(Shard& shard)
+{
+#ifdef CM_UNIX
+	if (shard.socket_ipv4 >= 0)
+	{
+		close(shard.socket_ipv4);
+		shard.socket_ipv4 = -1;
+	}
+	if (shard.socket_ipv6 >= 0)
+	{
+		close(shard.socket_ipv6);
+		shard.socket_ipv6 = -1;
+	}
+#endif
+}
+
+int UdpFanout::open_socket(Shard& shard, int family)
+{
+#ifdef CM_UNIX
+	int fd = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (fd < 0)
+	{
+		logger()->error("UdpFanout: socket() failed: {}", strerror(errno));
+		return -1;
+	}
+
+	apply_socket_qos(fd, family);
+
+	if (family == AF_INET && config.use_gso)
+	{
+		// Probe kernel support. The actual segment size is passed per message in a cmsg.
+		int gso_size = 1400;
+		shard.gso_enabled = setsockopt(fd, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) == 0;
+		if (shard.gso_enabled)
+		{
+			gso_size = 0;
+			setsockopt(fd, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size));
+		}
+	}
+
+	if (family == AF_INET)
+	{
+		unsigned char ttl = (unsigned char)config.multicast_ttl;
+		if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) != 0)
+		{
+			logger()->warn("UdpFanout: failed to set multicast TTL {}: {}", config.multicast_ttl, strerror(errno));
+		}
+
+		if (!config.multicast_iface.empty())
+		{
+			ip_mreqn iface_req;
+			memset(&iface_req, 0, sizeof(iface_req));
+			iface_req.imr_ifindex = if_nametoindex(config.multicast_iface.c_str());
+			if (iface_req.imr_ifindex == 0 ||
+				setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &iface_req, sizeof(iface_req)) != 0)
+			{
+				logger()->warn("UdpFanout: failed to set multicast interface {}", config.multicast_iface);
+			}
+		}
+	}
+	else if (family == AF_INET6)
+	{
+		int hops = config.multicast_ttl;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+	}
+
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+void UdpFanout::apply_socket_qos(int fd, int family)
+{
+#ifdef CM_UNIX
+	if (config.dscp >= 0)
+	{
+		int tos = (config.dscp & 0x3f) << 2;
+		int ret = family == AF_INET6 ?
+			setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos)) :
+			setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+		if (ret != 0)
+		{
+			logger()->warn("UdpFanout: failed to set DSCP {}: {}", config.dscp, strerror(errno));
+		}
+	}
+
+	if (config.socket_priority >= 0 &&
+		setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &config.socket_priority, sizeof(config.socket_priority)) != 0)
+	{
+		logger()->warn("UdpFanout: failed to set SO_PRIORITY {}: {}", config.socket_priority, strerror(errno));
+	}
+
+	if (config.sndbuf_size > 0)
+	{
+		if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &config.sndbuf_size, sizeof(config.sndbuf_size)) != 0)
+		{
+			logger()->warn("UdpFanout: failed to set SO_SNDBUF {}: {}", config.sndbuf_size, strerror(errno));
+		}
+
+		int actual_size = 0;
+		socklen_t option_len = sizeof(actual_size);
+		getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &actual_size, &option_len);
+		logger()->info("UdpFanout: SO_SNDBUF requested {}, kernel granted {}", config.sndbuf_size, actual_size);
+	}
+#endif
+}
+
+bool UdpFanout::resolve_endpoint(const std::string& host, int port, Endpoint& endpoint)
+{
+#ifdef CM_UNIX
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	addrinfo* result = nullptr;
+	std::string port_str = std::to_string(port);
+	if (getaddrinfo(host.c_str(), port_str.c_str(), &hints, &result) != 0 || !result)
+	{
+		return false;
+	}
+
+	memcpy(&endpoint.addr, result->ai_addr, result->ai_addrlen);
+	endpoint.addr_len = result->ai_addrlen;
+	endpoint.host = host;
+	endpoint.port = port;
+	freeaddrinfo(result);
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool UdpFanout::add_endpoint(std::string host, int port)
+{
+	if (!is_running.load())
+	{
+		logger()->error("UdpFanout::add_endpoint() called for not running fanout!");
+		return false;
+	}
+
+	Endpoint endpoint;
+	if (!resolve_endpoint(host, port, endpoint))
+	{
+		logger()->error("UdpFanout failed to resolve endpoint {}:{}", host, port);
+		return false;
+	}
+
+	std::shared_lock<std::shared_mutex> shards_lock(shards_mutex);
+	Shard* target = nullptr;
+	size_t min_endpoints = SIZE_MAX;
+	for (auto& shard : shards)
+	{
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		if (shard->endpoints.size() < min_endpoints)
+		{
+			min_endpoints = shard->endpoints.size();
+			target = shard.get();
+		}
+	}
+
+	if (!target)
+	{
+		logger()->error("UdpFanout::add_endpoint() called for stopped fanout!");
+		return false;
+	}
+
+#ifdef CM_UNIX
+	if (endpoint.addr.ss_family == AF_INET6 && target->socket_ipv6 < 0)
+	{
+		logger()->error("UdpFanout cannot serve IPv6 endpoint {}:{}, no IPv6 socket", host, port);
+		return false;
+	}
+#endif
+
+	{
+		std::lock_guard<std::mutex> lock(target->mutex);
+		target->endpoints.push_back(endpoint);
+	}
+
+	logger()->info("UdpFanout endpoint {}:{} assigned to sender thread {}", host, port, target->index);
+	return true;
+}
+
+bool UdpFanout::remove_endpoint(std::string host, int port)
+{
+	std::shared_lock<std::shared_mutex> shards_lock(shards_mutex);
+	for (auto& shard : shards)
+	{
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		auto iter = std::find_if(shard->endpoints.begin(), shard->endpoints.end(),
+			[&host, port](const Endpoint& endpoint) { return endpoint.host == host && endpoint.port == port; });
+
+		if (iter != shard->endpoints.end())
+		{
+			shard->endpoints.erase(iter);
+			logger()->info("UdpFanout endpoint {}:{} removed from sender thread {}", host, port, shard->index);
+			return true;
+		}
+	}
+
+	logger()->warn("UdpFanout::remove_endpoint() could not find endpoint {}:{}", host, port);
+	return false;
+}
+
+void UdpFanout::push_packets(GstBufferList* list)
+{
+	assert(list);
+
+	std::shared_lock<std::shared_mutex> shards_lock(shards_mutex);
+	if (is_running.load())
+	{
+		for (auto& shard : shards)
+		{
+			std::lock_guard<std::mutex> lock(shard->mutex);
+			if (shard->endpoints.empty())
+			{
+				continue;
+			}
+
+			if ((int)shard->queue.size() >= config.max_queued_lists)
+			{
+				gst_buffer_list_unref(shard->queue.front());
+				shard->queue.pop_front();
+				shard->queue_drops++;
+			}
+
+			shard->queue.push_back(gst_buffer_list_ref(list));
+			shard->cv.notify_one();
+		}
+	}
+
+	gst_buffer_list_unref(list);
+}
+
+void UdpFanout::sender_loop(Shard& shard)
+{
+	std::vector<Endpoint> endpoints;
+
+	while (is_running.load())
+	{
+		GstBufferList* list = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(shard.mutex);
+			shard.cv.wait(lock, [this, &shard]() { return !shard.queue.empty() || !is_running.load(); });
+
+			if (!is_running.load())
+			{
+				break;
+			}
+
+			list = shard.queue.front();
+			shard.queue.pop_front();
+			endpoints = shard.endpoints;
+		}
+
+		send_list(shard, list, endpoints);
+		gst_buffer_list_unref(list);
+	}
+}
+
+void UdpFanout::send_list(Shard& shard, GstBufferList* list, const std::vector<Endpoint>& endpoints)
+{
+#ifdef CM_UNIX
+	guint length = gst_buffer_list_length(list);
+	std::vector<GstMapInfo> packets;
+	std::vector<GstBuffer*> mapped_buffers;
+	packets.reserve(length);
+	mapped_buffers.reserve(length);
+
+	for (guint i = 0; i < length; i++)
+	{
+		GstBuffer* buffer = gst_buffer_list_get(list, i);
+		GstMapInfo map_info;
+		if (!gst_buffer_map(buffer, &map_info, GST_MAP_READ))
+		{
+			shard.send_errors++;
+			continue;
+		}
+		packets.push_back(map_info);
+		mapped_buffers.push_back(buffer);
+	}
+
+	std::vector<const Endpoint*> endpoints_ipv4;
+	std::vector<const Endpoint*> endpoints_ipv6;
+	for (const Endpoint& endpoint : endpoints)
+	{
+		if (endpoint.addr.ss_family == AF_INET6)
+		{
+			endpoints_ipv6.push_back(&endpoint);
+		}
+		else
+		{
+			endpoints_ipv4.push_back(&endpoint);
+		}
+	}
+
+	if (!endpoints_ipv4.empty())
+	{
+		send_batches(shard, shard.socket_ipv4, endpoints_ipv4, packets);
+	}
+	if (!endpoints_ipv6.empty() && shard.socket_ipv6 >= 0)
+	{
+		send_batches(shard, shard.socket_ipv6, endpoints_ipv6, packets);
+	}
+
+	for (size_t i = 0; i < packets.size(); i++)
+	{
+		gst_buffer_unmap(mapped_buffers[i], &packets[i]);
+	}
+#endif
+}
+
+void UdpFanout::send_batches(Shard& shard, int socket_fd, const std::vector<const Endpoint*>& endpoints, const std::vector<GstMapInfo>& packets)
+{
+#ifdef CM_UNIX
+	struct PacketGroup
+	{
+		size_t first;
+		size_t count;
+		size_t segment_size;
+		size_t total_size;
+	};
+
+	std::vector<iovec> iovs(packets.size());
+	for (size_t i = 0; i < packets.size(); i++)
+	{
+		iovs[i].iov_base = packets[i].data;
+		iovs[i].iov_len = packets[i].size;
+	}
+
+	// With GSO a run of equally sized packets (the last one may be shorter) goes out as one super-datagram
+	bool use_gso = shard.gso_enabled.load() && socket_fd == shard.socket_ipv4;
+	std::vector<PacketGroup> groups;
+	for (size_t i = 0; i < packets.size();)
+	{
+		PacketGroup group = { i, 1, packets[i].size, packets[i].size };
+		size_t j = i + 1;
+		while (use_gso && j < packets.size() && group.count < (size_t)max_gso_segments &&
+			group.total_size + packets[j].size <= max_gso_datagram_size &&
+			packets[j].size <= group.segment_size)
+		{
+			group.total_size += packets[j].size;
+			group.count++;
+			j++;
+			if (packets[j - 1].size < group.segment_size)
+			{
+				break;
+			}
+		}
+		groups.push_back(group);
+		i = j;
+	}
+
+	const size_t control_size = CMSG_SPACE(sizeof(uint16_t));
+	std::vector<char> controls(groups.size() * control_size, 0);
+
+	std::vector<mmsghdr> messages;
+	// Packets carried by each message, counted as sent or dropped once sendmmsg() is done with it
+	std::vector<size_t> message_packets;
+	messages.reserve(std::min(endpoints.size() * groups.size(), (size_t)max_batch_messages));
+	message_packets.reserve(messages.capacity());
+
+	auto flush_messages = [this, &shard, &messages, &message_packets, socket_fd]()
+	{
+		size_t offset = 0;
+		int retries = 0;
+		while (offset < messages.size())
+		{
+			int sent = sendmmsg(socket_fd, messages.data() + offset, messages.size() - offset, 0);
+			if (sent < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				// A full socket buffer drains within moments, the message is worth another try
+				if (errno == ENOBUFS || errno == EAGAIN)
+				{
+					shard.enobufs++;
+					if (retries++ < max_send_retries)
+					{
+						std::this_thread::sleep_for(std::chrono::microseconds(200 << retries));
+						continue;
+					}
+				}
+
+				if (errno == EIO && shard.gso_enabled)
+				{
+					logger()->warn("UdpFanout sender thread {}: GSO send failed, disabling GSO", shard.index);
+					shard.gso_enabled = false;
+				}
+
+				shard.send_errors++;
+				shard.send_drops += message_packets[offset];
+				offset++;
+				retries = 0;
+				continue;
+			}
+
+			for (int i = 0; i < sent; i++)
+			{
+				shard.bytes_sent += messages[offset + i].msg_len;
+				shard.packets_sent += message_packets[offset + i];
+			}
+			offset += sent;
+			retries = 0;
+		}
+		messages.clear();
+		message_packets.clear();
+	};
+
+	for (size_t g = 0; g < groups.size(); g++)
+	{
+		const PacketGroup& group = groups[g];
+		char* control = controls.data() + g * control_size;
+
+		if (group.count > 1)
+		{
+			cmsghdr* cmsg = reinterpret_cast<cmsghdr*>(control);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			uint16_t segment_size = (uint16_t)group.segment_size;
+			memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+		}
+
+		for (const Endpoint* endpoint : endpoints)
+		{
+			mmsghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_hdr.msg_name = (void*)&endpoint->addr;
+			message.msg_hdr.msg_namelen = endpoint->addr_len;
+			message.msg_hdr.msg_iov = &iovs[group.first];
+			message.msg_hdr.msg_iovlen = group.count;
+			if (group.count > 1)
+			{
+				message.msg_hdr.msg_control = control;
+				message.msg_hdr.msg_controllen = control_size;
+			}
+			messages.push_back(message);
+			message_packets.push_back(group.count);
+
+			if (messages.size() >= (size_t)max_batch_messages)
+			{
+				flush_messages();
+			}
+		}
+	}
+
+	flush_messages();
+#endif
+}
+
+UdpFanoutStats UdpFanout::get_stats() const
+{
+	UdpFanoutStats stats;
+	std::shared_lock<std::shared_mutex> shards_lock(shards_mutex);
+	for (auto& shard : shards)
+	{
+		stats.packets_sent += shard->packets_sent.load();
+		stats.bytes_sent += shard->bytes_sent.load();
+		stats.send_errors += shard->send_errors.load();
+		stats.queue_drops += shard->queue_drops.load();
+		stats.enobufs += shard->enobufs.load();
+		stats.send_drops += shard->send_drops.load();
+		stats.shards_with_gso += shard->gso_enabled.load() ? 1 : 0;
+
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		stats.endpoints += (int)shard->endpoints.size();
+	}
+	return stats;
+}
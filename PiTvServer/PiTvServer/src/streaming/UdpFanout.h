@@ -0,0 +1,119 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <gst/gst.h>
+#include <spdlog/spdlog.h>
+
+#ifdef CM_UNIX
+#include <sys/socket.h>
+#endif
+
+struct UdpFanoutConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	int sender_threads = 2;
+	bool pin_threads = true;
+	bool use_gso = true;
+	int max_queued_lists = 64;
+	int multicast_ttl = 1;
+	std::string multicast_iface;
+	int dscp = -1;
+	int socket_priority = -1;
+	int sndbuf_size = 0;
+};
+
+struct UdpFanoutStats
+{
+	uint64_t packets_sent = 0;
+	uint64_t bytes_sent = 0;
+	uint64_t send_errors = 0;
+	uint64_t queue_drops = 0;
+	uint64_t enobufs = 0;
+	uint64_t send_drops = 0;
+	int endpoints = 0;
+	int shards_with_gso = 0;
+};
+
+// Sends every RTP packet to all registered endpoints from a small pool of sender threads.
+// Endpoints are sharded across threads, each pushed GstBufferList is shared by all shards by reference.
+class UdpFanout
+{
+private:
+	struct Endpoint
+	{
+		std::string host;
+		int port = 0;
+#ifdef CM_UNIX
+		sockaddr_storage addr;
+		socklen_t addr_len = 0;
+#endif
+	};
+
+	struct Shard
+	{
+		int index = 0;
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::deque<GstBufferList*> queue;
+		std::vector<Endpoint> endpoints;
+		int socket_ipv4 = -1;
+		int socket_ipv6 = -1;
+		std::atomic<bool> gso_enabled = false;
+
+		std::atomic<uint64_t> packets_sent = 0;
+		std::atomic<uint64_t> bytes_sent = 0;
+		std::atomic<uint64_t> send_errors = 0;
+		std::atomic<uint64_t> queue_drops = 0;
+		std::atomic<uint64_t> enobufs = 0;
+		// Packets given up on after sendmmsg() failed
+		std::atomic<uint64_t> send_drops = 0;
+	};
+
+	UdpFanoutConfig config;
+	// Shared by the streaming thread and endpoint changes, exclusive while start() and stop() change the shards
+	mutable std::shared_mutex shards_mutex;
+	std::vector<std::unique_ptr<Shard>> shards;
+	std::atomic<bool> is_running = false;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	static bool resolve_endpoint(const std::string& host, int port, Endpoint& endpoint);
+	int open_socket(Shard& shard, int family);
+	static void close_sockets(Shard& shard);
+	void apply_socket_qos(int fd, int family);
+	void sender_loop(Shard& shard);
+	void send_list(Shard& shard, GstBufferList* list, const std::vector<Endpoint>& endpoints);
+	void send_batches(Shard& shard, int socket_fd, const std::vector<const Endpoint*>& endpoints, const std::vector<GstMapInfo>& packets);
+
+public:
+	static const int max_gso_segments;
+	static const int max_batch_messages;
+	static const int max_send_retries;
+
+	UdpFanout& operator=(const UdpFanout&) = delete;
+	UdpFanout(const UdpFanout& copy) = delete;
+	UdpFanout() = delete;
+
+	UdpFanout(const UdpFanoutConfig& config);
+	~UdpFanout();
+
+	bool start();
+	void stop();
+
+	bool add_endpoint(std::string host, int port);
+	bool remove_endpoint(std::string host, int port);
+
+	// Takes ownership of one reference to the list
+	void push_packets(GstBufferList* list);
+
+	UdpFanoutStats get_stats() const;
+};
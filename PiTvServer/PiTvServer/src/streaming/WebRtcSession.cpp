@@ -0,0 +1,329 @@
+#include "WebRtcSession.h"
+#include <cassert>
+#include <sstream>
+
+WebRtcSession::WebRtcSession(const WebRtcSessionConfig& config, std::shared_ptr<EncodedTap> encoded_tap)
+{
+	this->config = config;
+	this->encoded_tap = encoded_tap;
+}
+
+WebRtcSession::~WebRtcSession()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> WebRtcSession::logger() const
+{
+	return config.logger_ptr;
+}
+
+std::string WebRtcSession::escape_json_string(const std::string& str)
+{
+	std::stringstream escaped;
+	for (char ch : str)
+	{
+		switch (ch)
+		{
+		case '"':
+			escaped << "\\\"";
+			break;
+		case '\\':
+			escaped << "\\\\";
+			break;
+		case '\r':
+			escaped << "\\r";
+			break;
+		case '\n':
+			escaped << "\\n";
+			break;
+		case '\t':
+			escaped << "\\t";
+			break;
+		default:
+			escaped << ch;
+			break;
+		}
+	}
+	return escaped.str();
+}
+
+void WebRtcSession::enqueue_message(const std::string& message)
+{
+	std::lock_guard<std::mutex> lock(outbox_mutex);
+	outbox.push_back(message);
+}
+
+void WebRtcSession::negotiation_needed_handler(GstElement* webrtc, gpointer udata)
+{
+	assert(udata);
+	WebRtcSession* session = static_cast<WebRtcSession*>(udata);
+
+	GstPromise* promise = gst_promise_new_with_change_func(&WebRtcSession::offer_created_handler, session, NULL);
+	g_signal_emit_by_name(webrtc, "create-offer", NULL, promise);
+}
+
+void WebRtcSession::offer_created_handler(GstPromise* promise, gpointer udata)
+{
+	// Interrupted promises are delivered during teardown, the session must not be touched then
+	if (gst_promise_wait(promise) != GST_PROMISE_RESULT_REPLIED)
+	{
+		gst_promise_unref(promise);
+		return;
+	}
+
+	assert(udata);
+	WebRtcSession* session = static_cast<WebRtcSession*>(udata);
+
+	GstWebRTCSessionDescription* offer = nullptr;
+	const GstStructure* reply = gst_promise_get_reply(promise);
+	gst_structure_get(reply, "offer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &offer, NULL);
+	gst_promise_unref(promise);
+
+	if (!offer)
+	{
+		session->logger()->error("WebRTC session of {}: failed to create SDP offer", session->config.username);
+		session->failed = true;
+		return;
+	}
+
+	g_signal_emit_by_name(session->webrtcbin, "set-local-description", offer, NULL);
+
+	gchar* sdp_text = gst_sdp_message_as_text(offer->sdp);
+	session->enqueue_message("{\"type\": \"offer\", \"sdp\": \"" + escape_json_string(sdp_text) + "\"}");
+	g_free(sdp_text);
+
+	gst_webrtc_session_description_free(offer);
+}
+
+void WebRtcSession::ice_candidate_handler(GstElement* webrtc, guint mline_index, gchar* candidate, gpointer udata)
+{
+	assert(udata);
+	WebRtcSession* session = static_cast<WebRtcSession*>(udata);
+
+	std::stringstream message_builder;
+	message_builder << "{\"type\": \"ice\", \"sdpMLineIndex\": " << mline_index
+		<< ", \"candidate\": \"" << escape_json_string(candidate ? candidate : "") << "\"}";
+	session->enqueue_message(message_builder.str());
+}
+
+void WebRtcSession::ice_connection_state_handler(GstElement* webrtc, GParamSpec* pspec, gpointer udata)
+{
+	assert(udata);
+	WebRtcSession* session = static_cast<WebRtcSession*>(udata);
+
+	GstWebRTCICEConnectionState state = GST_WEBRTC_ICE_CONNECTION_STATE_NEW;
+	g_object_get(webrtc, "ice-connection-state", &state, NULL);
+	session->logger()->info("WebRTC session of {} from {}: ICE connection state {}", session->config.username, session->config.peer_address, static_cast<int>(state));
+
+	if (state == GST_WEBRTC_ICE_CONNECTION_STATE_FAILED)
+	{
+		session->failed = true;
+	}
+}
+
+void WebRtcSession::on_encoded_frame(const EncodedFramePtr& frame)
+{
+	if (waiting_keyframe)
+	{
+		if (!frame->keyframe)
+		{
+			return;
+		}
+		waiting_keyframe = false;
+	}
+
+	if (frame->stream_info && frame->stream_info->caps != appsrc_caps)
+	{
+		gst_app_src_set_caps(GST_APP_SRC(appsrc), frame->stream_info->caps);
+		if (appsrc_caps)
+		{
+			gst_caps_unref(appsrc_caps);
+		}
+		appsrc_caps = gst_caps_ref(frame->stream_info->caps);
+	}
+
+	// Shallow copy shares the memory with the tap, appsrc do-timestamp assigns this pipeline's running time
+	GstBuffer* buffer = gst_buffer_copy(frame->buffer);
+	GST_BUFFER_PTS(buffer) = GST_CLOCK_TIME_NONE;
+	GST_BUFFER_DTS(buffer) = GST_CLOCK_TIME_NONE;
+	gst_app_src_push_buffer(GST_APP_SRC(appsrc), buffer);
+}
+
+bool WebRtcSession::start()
+{
+	if (pipeline)
+	{
+		logger()->warn("WebRTC session of {} is already started!", config.username);
+		return true;
+	}
+
+	if (!encoded_tap)
+	{
+		logger()->error("Cannot start WebRTC session: encoded tap is not available!");
+		return false;
+	}
+
+	GError* error = nullptr;
+	GstElement* pipeline_tmp = gst_parse_launch(
+		"appsrc name=webrtc_appsrc is-live=true format=time do-timestamp=true max-bytes=4194304 ! "
+		"rtph264pay config-interval=-1 ! "
+		"application/x-rtp,media=video,encoding-name=H264,payload=96 ! "
+		"webrtcbin name=webrtcbin bundle-policy=max-bundle",
+		&error);
+	if (!pipeline_tmp || error)
+	{
+		logger()->error("Failed to create WebRTC pipeline: {}. Is gst-plugins-bad with webrtc and nice installed?", error ? error->message : "unknown error");
+		g_clear_error(&error);
+		if (pipeline_tmp)
+		{
+			gst_object_unref(pipeline_tmp);
+		}
+		return false;
+	}
+
+	appsrc = gst_bin_get_by_name(GST_BIN(pipeline_tmp), "webrtc_appsrc");
+	webrtcbin = gst_bin_get_by_name(GST_BIN(pipeline_tmp), "webrtcbin");
+	assert(appsrc && webrtcbin);
+
+	// The camera only sends, the browser answer is expected to be recvonly
+	GstWebRTCRTPTransceiver* transceiver = nullptr;
+	g_signal_emit_by_name(webrtcbin, "get-transceiver", 0, &transceiver);
+	if (transceiver)
+	{
+		g_object_set(transceiver, "direction", GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_SENDONLY, NULL);
+		gst_object_unref(transceiver);
+	}
+
+	g_signal_connect(webrtcbin, "on-negotiation-needed", G_CALLBACK(&WebRtcSession::negotiation_needed_handler), this);
+	g_signal_connect(webrtcbin, "on-ice-candidate", G_CALLBACK(&WebRtcSession::ice_candidate_handler), this);
+	g_signal_connect(webrtcbin, "notify::ice-connection-state", G_CALLBACK(&WebRtcSession::ice_connection_state_handler), this);
+
+	pipeline = pipeline_tmp;
+	bus = gst_element_get_bus(pipeline);
+
+	if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+	{
+		logger()->error("Failed to set WebRTC pipeline of {} to PLAYING state!", config.username);
+		stop();
+		return false;
+	}
+
+	tap_listener_id = encoded_tap->add_listener([this](const EncodedFramePtr& frame)
+		{
+			on_encoded_frame(frame);
+		}
+	);
+
+	logger()->info("WebRTC session of {} from {} started", config.username, config.peer_address);
+	return true;
+}
+
+void WebRtcSession::stop()
+{
+	if (tap_listener_id)
+	{
+		encoded_tap->remove_listener(tap_listener_id);
+		tap_listener_id = 0;
+	}
+
+	if (!pipeline)
+	{
+		return;
+	}
+
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+
+	gst_object_unref(appsrc);
+	appsrc = nullptr;
+	gst_object_unref(webrtcbin);
+	webrtcbin = nullptr;
+	gst_object_unref(bus);
+	bus = nullptr;
+	gst_object_unref(pipeline);
+	pipeline = nullptr;
+
+	if (appsrc_caps)
+	{
+		gst_caps_unref(appsrc_caps);
+		appsrc_caps = nullptr;
+	}
+
+	logger()->info("WebRTC session of {} from {} stopped", config.username, config.peer_address);
+}
+
+bool WebRtcSession::set_remote_answer(const std::string& sdp_text)
+{
+	if (!webrtcbin)
+	{
+		return false;
+	}
+
+	GstSDPMessage* sdp = nullptr;
+	gst_sdp_message_new(&sdp);
+	if (gst_sdp_message_parse_buffer(reinterpret_cast<const guint8*>(sdp_text.data()), sdp_text.size(), sdp) != GST_SDP_OK)
+	{
+		logger()->error("WebRTC session of {}: failed to parse SDP answer", config.username);
+		gst_sdp_message_free(sdp);
+		return false;
+	}
+
+	// Description takes ownership of the SDP message
+	GstWebRTCSessionDescription* answer = gst_webrtc_session_description_new(GST_WEBRTC_SDP_TYPE_ANSWER, sdp);
+	g_signal_emit_by_name(webrtcbin, "set-remote-description", answer, NULL);
+	gst_webrtc_session_description_free(answer);
+
+	logger()->info("WebRTC session of {}: SDP answer applied", config.username);
+	return true;
+}
+
+bool WebRtcSession::add_remote_candidate(int mline_index, const std::string& candidate)
+{
+	if (!webrtcbin || mline_index < 0)
+	{
+		return false;
+	}
+
+	g_signal_emit_by_name(webrtcbin, "add-ice-candidate", static_cast<guint>(mline_index), candidate.c_str());
+	return true;
+}
+
+void WebRtcSession::poll(std::vector<std::string>& messages)
+{
+	{
+		std::lock_guard<std::mutex> lock(outbox_mutex);
+		while (!outbox.empty())
+		{
+			messages.push_back(outbox.front());
+			outbox.pop_front();
+		}
+	}
+
+	if (!bus)
+	{
+		return;
+	}
+
+	GstMessage* msg = nullptr;
+	while ((msg = gst_bus_pop_filtered(bus, static_cast<GstMessageType>(GST_MESSAGE_ERROR))) != nullptr)
+	{
+		GError* err = nullptr;
+		gchar* debug_info = nullptr;
+		gst_message_parse_error(msg, &err, &debug_info);
+		logger()->error("WebRTC session of {}: error received from element {}: {}", config.username, GST_OBJECT_NAME(msg->src), err->message);
+		g_clear_error(&err);
+		g_free(debug_info);
+		gst_message_unref(msg);
+		failed = true;
+	}
+}
+
+bool WebRtcSession::has_failed() const
+{
+	return failed;
+}
+
+std::string WebRtcSession::get_username() const
+{
+	return config.username;
+}
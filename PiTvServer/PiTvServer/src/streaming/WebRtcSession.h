@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/sdp/sdp.h>
+#include <gst/webrtc/webrtc.h>
+#include <spdlog/spdlog.h>
+#include "../video/EncodedTap.h"
+
+struct WebRtcSessionConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	std::string username;
+	std::string peer_address;
+};
+
+// One browser viewer: appsrc fed from the encoded tap, RTP payloader and webrtcbin in a private pipeline.
+// No STUN/TURN server is configured, so only host candidates are gathered.
+// Signaling messages produced on GStreamer threads are queued and sent by the HTTP thread.
+class WebRtcSession
+{
+private:
+	WebRtcSessionConfig config;
+	std::shared_ptr<EncodedTap> encoded_tap;
+	int tap_listener_id = 0;
+
+	GstElement* pipeline = nullptr;
+	GstElement* appsrc = nullptr;
+	GstElement* webrtcbin = nullptr;
+	GstBus* bus = nullptr;
+	GstCaps* appsrc_caps = nullptr;
+	bool waiting_keyframe = true;
+	std::atomic<bool> failed = false;
+
+	mutable std::mutex outbox_mutex;
+	std::deque<std::string> outbox;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	static std::string escape_json_string(const std::string& str);
+	void enqueue_message(const std::string& message);
+
+	static void negotiation_needed_handler(GstElement* webrtc, gpointer udata);
+	static void offer_created_handler(GstPromise* promise, gpointer udata);
+	static void ice_candidate_handler(GstElement* webrtc, guint mline_index, gchar* candidate, gpointer udata);
+	static void ice_connection_state_handler(GstElement* webrtc, GParamSpec* pspec, gpointer udata);
+
+	void on_encoded_frame(const EncodedFramePtr& frame);
+
+public:
+	WebRtcSession& operator=(const WebRtcSession&) = delete;
+	WebRtcSession(const WebRtcSession& copy) = delete;
+	WebRtcSession() = delete;
+
+	WebRtcSession(const WebRtcSessionConfig& config, std::shared_ptr<EncodedTap> encoded_tap);
+	~WebRtcSession();
+
+	// Builds the pipeline, the SDP offer is produced asynchronously and appears in the outbox
+	bool start();
+	void stop();
+
+	bool set_remote_answer(const std::string& sdp_text);
+	bool add_remote_candidate(int mline_index, const std::string& candidate);
+
+	// Moves pending signaling messages to the caller and checks the private bus for errors
+	void poll(std::vector<std::string>& messages);
+	bool has_failed() const;
+
+	std::string get_username() const;
+};
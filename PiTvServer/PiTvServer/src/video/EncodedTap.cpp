@@ -0,0 +1,184 @@
+#include "EncodedTap.h"
+#include <cassert>
+
+EncodedStreamInfo::~EncodedStreamInfo()
+{
+	if (caps)
+	{
+		gst_caps_unref(caps);
+	}
+}
+
+EncodedFrame::~EncodedFrame()
+{
+	if (buffer)
+	{
+		gst_buffer_unref(buffer);
+	}
+}
+
+EncodedTap::EncodedTap(std::shared_ptr<spdlog::logger> logger_ptr)
+{
+	this->logger_ptr = logger_ptr;
+}
+
+EncodedTap::~EncodedTap()
+{
+	if (last_caps)
+	{
+		gst_caps_unref(last_caps);
+	}
+}
+
+GstElement* EncodedTap::make_bin()
+{
+	GstElement* bin = gst_bin_new("encoded-tap-bin");
+	assert(bin);
+
+	GstElement* queue = gst_element_factory_make("queue", "encoded_tap_queue");
+	GstElement* parser = gst_element_factory_make("h264parse", "encoded_tap_h264parse");
+	GstElement* capsfilter = gst_element_factory_make("capsfilter", "encoded_tap_caps");
+	GstElement* appsink = gst_element_factory_make("appsink", "encoded_appsink");
+
+	if (!queue || !parser || !capsfilter || !appsink)
+	{
+		logger_ptr->error("Failed to create encoded tap elements!");
+		gst_object_unref(bin);
+		return nullptr;
+	}
+
+	g_object_set(queue, "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", (guint64)(2 * GST_SECOND), NULL);
+
+	GstCaps* caps = gst_caps_new_simple("video/x-h264",
+		"stream-format", G_TYPE_STRING, "avc",
+		"alignment", G_TYPE_STRING, "au",
+		NULL);
+	g_object_set(capsfilter, "caps", caps, NULL);
+	gst_caps_unref(caps);
+
+	g_object_set(appsink, "sync", false, "emit-signals", false, NULL);
+
+	GstAppSinkCallbacks callbacks = { 0 };
+	callbacks.new_sample = &EncodedTap::appsink_new_sample;
+	gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, this, NULL);
+
+	gst_bin_add_many(GST_BIN(bin), queue, parser, capsfilter, appsink, NULL);
+	if (!gst_element_link_many(queue, parser, capsfilter, appsink, NULL))
+	{
+		logger_ptr->error("Failed to link encoded tap elements!");
+		gst_object_unref(bin);
+		return nullptr;
+	}
+
+	GstPad* queue_sink_pad = gst_element_get_static_pad(queue, "sink");
+	GstPad* sink_ghost_pad = gst_ghost_pad_new("sink", queue_sink_pad);
+	gst_element_add_pad(bin, sink_ghost_pad);
+	gst_object_unref(queue_sink_pad);
+
+	return bin;
+}
+
+void EncodedTap::update_stream_info(GstCaps* caps)
+{
+	auto info = std::make_shared<EncodedStreamInfo>();
+	info->caps = gst_caps_ref(caps);
+
+	GstStructure* structure = gst_caps_get_structure(caps, 0);
+	gst_structure_get_int(structure, "width", &info->width);
+	gst_structure_get_int(structure, "height", &info->height);
+	gst_structure_get_fraction(structure, "framerate", &info->fps_numerator, &info->fps_denominator);
+
+	const GValue* codec_data_value = gst_structure_get_value(structure, "codec_data");
+	if (codec_data_value)
+	{
+		GstBuffer* codec_data = gst_value_get_buffer(codec_data_value);
+		GstMapInfo map_info;
+		if (codec_data && gst_buffer_map(codec_data, &map_info, GST_MAP_READ))
+		{
+			info->codec_data.assign(map_info.data, map_info.data + map_info.size);
+			gst_buffer_unmap(codec_data, &map_info);
+		}
+	}
+
+	gchar* caps_str = gst_caps_to_string(caps);
+	logger_ptr->info("Encoded tap caps: {}", caps_str);
+	g_free(caps_str);
+
+	std::lock_guard<std::mutex> lock(stream_info_mutex);
+	stream_info = info;
+	if (last_caps)
+	{
+		gst_caps_unref(last_caps);
+	}
+	last_caps = gst_caps_ref(caps);
+}
+
+GstFlowReturn EncodedTap::appsink_new_sample(GstAppSink* appsink, gpointer udata)
+{
+	assert(udata);
+	EncodedTap* tap = static_cast<EncodedTap*>(udata);
+
+	GstSample* sample = gst_app_sink_pull_sample(appsink);
+	if (!sample)
+	{
+		return GST_FLOW_EOS;
+	}
+
+	GstCaps* caps = gst_sample_get_caps(sample);
+	GstBuffer* buffer = gst_sample_get_buffer(sample);
+	if (!caps || !buffer)
+	{
+		gst_sample_unref(sample);
+		return GST_FLOW_OK;
+	}
+
+	bool caps_changed = false;
+	{
+		std::lock_guard<std::mutex> lock(tap->stream_info_mutex);
+		caps_changed = tap->last_caps != caps;
+	}
+	if (caps_changed)
+	{
+		tap->update_stream_info(caps);
+	}
+
+	auto frame = std::make_shared<EncodedFrame>();
+	frame->buffer = gst_buffer_ref(buffer);
+	frame->pts = GST_BUFFER_PTS(buffer);
+	frame->dts = GST_BUFFER_DTS(buffer);
+	frame->duration = GST_BUFFER_DURATION(buffer);
+	frame->keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+	frame->wallclock_usec = g_get_real_time();
+	frame->stream_info = tap->get_stream_info();
+
+	gst_sample_unref(sample);
+
+	EncodedFramePtr frame_ptr = frame;
+	std::lock_guard<std::mutex> lock(tap->listeners_mutex);
+	for (auto& listener : tap->listeners)
+	{
+		listener.second(frame_ptr);
+	}
+
+	return GST_FLOW_OK;
+}
+
+int EncodedTap::add_listener(EncodedFrameListener listener)
+{
+	std::lock_guard<std::mutex> lock(listeners_mutex);
+	int listener_id = next_listener_id++;
+	listeners[listener_id] = listener;
+	return listener_id;
+}
+
+void EncodedTap::remove_listener(int listener_id)
+{
+	std::lock_guard<std::mutex> lock(listeners_mutex);
+	listeners.erase(listener_id);
+}
+
+std::shared_ptr<const EncodedStreamInfo> EncodedTap::get_stream_info() const
+{
+	std::lock_guard<std::mutex> lock(stream_info_mutex);
+	return stream_info;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <functional>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <spdlog/spdlog.h>
+
+// Format of the tapped H.264 stream: AVC (length-prefixed) access units described by avcC codec_data
+struct EncodedStreamInfo
+{
+	GstCaps* caps = nullptr;
+	std::vector<uint8_t> codec_data;
+	int width = 0;
+	int height = 0;
+	int fps_numerator = 0;
+	int fps_denominator = 1;
+
+	EncodedStreamInfo() = default;
+	EncodedStreamInfo(const EncodedStreamInfo&) = delete;
+	EncodedStreamInfo& operator=(const EncodedStreamInfo&) = delete;
+	~EncodedStreamInfo();
+};
+
+// One H.264 access unit. The GstBuffer is shared by reference between all consumers and never copied.
+struct EncodedFrame
+{
+	GstBuffer* buffer = nullptr;
+	GstClockTime pts = GST_CLOCK_TIME_NONE;
+	GstClockTime dts = GST_CLOCK_TIME_NONE;
+	GstClockTime duration = GST_CLOCK_TIME_NONE;
+	bool keyframe = false;
+	int64_t wallclock_usec = 0;
+	std::shared_ptr<const EncodedStreamInfo> stream_info;
+
+	EncodedFrame() = default;
+	EncodedFrame(const EncodedFrame&) = delete;
+	EncodedFrame& operator=(const EncodedFrame&) = delete;
+	~EncodedFrame();
+};
+
+typedef std::shared_ptr<const EncodedFrame> EncodedFramePtr;
+typedef std::function<void(const EncodedFramePtr&)> EncodedFrameListener;
+
+// Appsink branch of subpipes_tee delivering parsed access units to in-process consumers.
+// Listeners are called on the streaming thread and must not block.
+class EncodedTap
+{
+private:
+	std::shared_ptr<spdlog::logger> logger_ptr;
+
+	mutable std::mutex listeners_mutex;
+	std::map<int, EncodedFrameListener> listeners;
+	int next_listener_id = 1;
+
+	mutable std::mutex stream_info_mutex;
+	std::shared_ptr<const EncodedStreamInfo> stream_info;
+	GstCaps* last_caps = nullptr;
+
+	static GstFlowReturn appsink_new_sample(GstAppSink* appsink, gpointer udata);
+	void update_stream_info(GstCaps* caps);
+
+public:
+	EncodedTap& operator=(const EncodedTap&) = delete;
+	EncodedTap(const EncodedTap& copy) = delete;
+	EncodedTap() = delete;
+
+	EncodedTap(std::shared_ptr<spdlog::logger> logger_ptr);
+	~EncodedTap();
+
+	// Returned bin is owned by the caller and has an H.264 "sink" ghost pad
+	GstElement* make_bin();
+
+	int add_listener(EncodedFrameListener listener);
+	void remove_listener(int listener_id);
+
+	std::shared_ptr<const EncodedStreamInfo> get_stream_info() const;
+};
@@ -0,0 +1,88 @@
+#include "Fmp4Timeline.h"
+
+void Fmp4Timeline::reset()
+{
+	first_dts = GST_CLOCK_TIME_NONE;
+	pending_frame.reset();
+}
+
+bool Fmp4Timeline::is_started() const
+{
+	return GST_CLOCK_TIME_IS_VALID(first_dts);
+}
+
+uint64_t Fmp4Timeline::decode_ticks(const EncodedFramePtr& frame) const
+{
+	GstClockTime dts = GST_CLOCK_TIME_IS_VALID(frame->dts) ? frame->dts : frame->pts;
+	if (!GST_CLOCK_TIME_IS_VALID(dts) || !GST_CLOCK_TIME_IS_VALID(first_dts) || dts < first_dts)
+	{
+		return 0;
+	}
+
+	return gst_util_uint64_scale(dts - first_dts, Fmp4Writer::video_timescale, GST_SECOND);
+}
+
+uint32_t Fmp4Timeline::default_duration(const EncodedFramePtr& frame)
+{
+	auto& info = frame->stream_info;
+	if (info && info->fps_numerator > 0 && info->fps_denominator > 0)
+	{
+		return static_cast<uint32_t>(gst_util_uint64_scale(Fmp4Writer::video_timescale, info->fps_denominator, info->fps_numerator));
+	}
+	return Fmp4Writer::video_timescale / 30;
+}
+
+void Fmp4Timeline::fill_sample(const EncodedFramePtr& frame, uint32_t duration, Fmp4TimedSample& ready_sample) const
+{
+	ready_sample.frame = frame;
+	ready_sample.decode_time = decode_ticks(frame);
+	ready_sample.sample = Fmp4Sample();
+	ready_sample.sample.duration = duration;
+	ready_sample.sample.size = static_cast<uint32_t>(gst_buffer_get_size(frame->buffer));
+	ready_sample.sample.keyframe = frame->keyframe;
+	if (GST_CLOCK_TIME_IS_VALID(frame->pts) && GST_CLOCK_TIME_IS_VALID(frame->dts))
+	{
+		int64_t offset_ns = static_cast<int64_t>(frame->pts) - static_cast<int64_t>(frame->dts);
+		ready_sample.sample.composition_offset = static_cast<int32_t>(offset_ns * Fmp4Writer::video_timescale / static_cast<int64_t>(GST_SECOND));
+	}
+}
+
+bool Fmp4Timeline::push(const EncodedFramePtr& frame, Fmp4TimedSample& ready_sample)
+{
+	// Decoding has to start with an IDR
+	if (!is_started())
+	{
+		if (!frame->keyframe)
+		{
+			return false;
+		}
+		first_dts = GST_CLOCK_TIME_IS_VALID(frame->dts) ? frame->dts : frame->pts;
+	}
+
+	EncodedFramePtr previous_frame = pending_frame;
+	pending_frame = frame;
+	if (!previous_frame)
+	{
+		return false;
+	}
+
+	uint64_t previous_ticks = decode_ticks(previous_frame);
+	uint64_t frame_ticks = decode_ticks(frame);
+
+	uint32_t duration = frame_ticks > previous_ticks ? static_cast<uint32_t>(frame_ticks - previous_ticks) : default_duration(previous_frame);
+	fill_sample(previous_frame, duration, ready_sample);
+
+	return true;
+}
+
+bool Fmp4Timeline::flush(Fmp4TimedSample& ready_sample)
+{
+	if (!pending_frame)
+	{
+		return false;
+	}
+
+	fill_sample(pending_frame, default_duration(pending_frame), ready_sample);
+	pending_frame.reset();
+	return true;
+}
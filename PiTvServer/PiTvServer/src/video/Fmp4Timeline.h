@@ -0,0 +1,35 @@
+#pragma once
+
+#include <memory>
+#include "EncodedTap.h"
+#include "Fmp4Writer.h"
+
+struct Fmp4TimedSample
+{
+	EncodedFramePtr frame;
+	Fmp4Sample sample;
+	uint64_t decode_time = 0;
+};
+
+// Maps access units of the encoded tap onto an fMP4 timeline starting at the first IDR.
+// A sample duration is known only when the next frame arrives, so output lags one frame.
+class Fmp4Timeline
+{
+private:
+	GstClockTime first_dts = GST_CLOCK_TIME_NONE;
+	EncodedFramePtr pending_frame;
+
+	uint64_t decode_ticks(const EncodedFramePtr& frame) const;
+	static uint32_t default_duration(const EncodedFramePtr& frame);
+	void fill_sample(const EncodedFramePtr& frame, uint32_t duration, Fmp4TimedSample& ready_sample) const;
+
+public:
+	void reset();
+	bool is_started() const;
+
+	// Returns true and fills ready_sample when the previously pushed frame got its duration
+	bool push(const EncodedFramePtr& frame, Fmp4TimedSample& ready_sample);
+
+	// Emits the pending frame with the nominal frame duration, used when the timeline ends
+	bool flush(Fmp4TimedSample& ready_sample);
+};
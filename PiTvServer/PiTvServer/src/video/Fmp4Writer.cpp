@@ -0,0 +1,368 @@
+#include "Fmp4Writer.h"
+#include <cassert>
+#include <cstring>
+#include <cstdio>
+
+const uint32_t Fmp4Writer::video_timescale = 90000;
+
+Fmp4Writer::Fmp4Writer(std::vector<uint8_t>& out) : out(out)
+{
+}
+
+void Fmp4Writer::begin_box(const char* type)
+{
+	assert(strlen(type) == 4);
+
+	open_boxes.push_back(out.size());
+	put_u32(0);
+	put_bytes(reinterpret_cast<const uint8_t*>(type), 4);
+}
+
+void Fmp4Writer::begin_full_box(const char* type, uint8_t version, uint32_t flags)
+{
+	begin_box(type);
+	put_u32((static_cast<uint32_t>(version) << 24) | (flags & 0xFFFFFF));
+}
+
+void Fmp4Writer::end_box()
+{
+	assert(!open_boxes.empty());
+
+	size_t box_start = open_boxes.back();
+	open_boxes.pop_back();
+
+	uint32_t box_size = static_cast<uint32_t>(out.size() - box_start);
+	out[box_start] = static_cast<uint8_t>(box_size >> 24);
+	out[box_start + 1] = static_cast<uint8_t>(box_size >> 16);
+	out[box_start + 2] = static_cast<uint8_t>(box_size >> 8);
+	out[box_start + 3] = static_cast<uint8_t>(box_size);
+}
+
+void Fmp4Writer::put_u8(uint8_t value)
+{
+	out.push_back(value);
+}
+
+void Fmp4Writer::put_u16(uint16_t value)
+{
+	out.push_back(static_cast<uint8_t>(value >> 8));
+	out.push_back(static_cast<uint8_t>(value));
+}
+
+void Fmp4Writer::put_u32(uint32_t value)
+{
+	put_u16(static_cast<uint16_t>(value >> 16));
+	put_u16(static_cast<uint16_t>(value));
+}
+
+void Fmp4Writer::put_u64(uint64_t value)
+{
+	put_u32(static_cast<uint32_t>(value >> 32));
+	put_u32(static_cast<uint32_t>(value));
+}
+
+void Fmp4Writer::put_bytes(const uint8_t* data, size_t size)
+{
+	out.insert(out.end(), data, data + size);
+}
+
+void Fmp4Writer::put_zeros(size_t count)
+{
+	out.insert(out.end(), count, 0);
+}
+
+void Fmp4Writer::put_matrix()
+{
+	static const uint32_t unity_matrix[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+	for (uint32_t value : unity_matrix)
+	{
+		put_u32(value);
+	}
+}
+
+std::vector<uint8_t> Fmp4Writer::make_init_segment(const std::vector<uint8_t>& avcc, int width, int height, uint32_t timescale)
+{
+	std::vector<uint8_t> result;
+	Fmp4Writer writer(result);
+
+	writer.begin_box("ftyp");
+	writer.put_bytes(reinterpret_cast<const uint8_t*>("iso6"), 4);
+	writer.put_u32(0);
+	writer.put_bytes(reinterpret_cast<const uint8_t*>("iso6isomavc1mp41"), 16);
+	writer.end_box();
+
+	// Sample tables are empty, all samples live in fragments
+	writer.put_movie(avcc, width, height, timescale, {}, 0, true);
+
+	return result;
+}
+
+std::vector<uint8_t> Fmp4Writer::make_progressive_movie(const std::vector<uint8_t>& avcc, int width, int height, const std::vector<Fmp4Sample>& samples, uint64_t chunk_offset, uint32_t timescale)
+{
+	std::vector<uint8_t> result;
+	Fmp4Writer writer(result);
+	writer.put_movie(avcc, width, height, timescale, samples, chunk_offset, false);
+	return result;
+}
+
+void Fmp4Writer::put_movie(const std::vector<uint8_t>& avcc, int width, int height, uint32_t timescale, const std::vector<Fmp4Sample>& samples, uint64_t chunk_offset, bool fragmented)
+{
+	uint64_t media_duration = 0;
+	for (auto& sample : samples)
+	{
+		media_duration += sample.duration;
+	}
+	uint32_t movie_duration = static_cast<uint32_t>(media_duration * 1000 / timescale);
+
+	begin_box("moov");
+
+	begin_full_box("mvhd", 0, 0);
+	put_u32(0); // creation_time
+	put_u32(0); // modification_time
+	put_u32(1000); // timescale
+	put_u32(movie_duration); // duration
+	put_u32(0x00010000); // rate
+	put_u16(0x0100); // volume
+	put_zeros(10);
+	put_matrix();
+	put_zeros(24); // pre_defined
+	put_u32(2); // next_track_ID
+	end_box();
+
+	begin_box("trak");
+
+	begin_full_box("tkhd", 0, 0x000007);
+	put_u32(0); // creation_time
+	put_u32(0); // modification_time
+	put_u32(1); // track_ID
+	put_u32(0); // reserved
+	put_u32(movie_duration); // duration
+	put_zeros(8);
+	put_u16(0); // layer
+	put_u16(0); // alternate_group
+	put_u16(0); // volume
+	put_u16(0);
+	put_matrix();
+	put_u32(static_cast<uint32_t>(width) << 16);
+	put_u32(static_cast<uint32_t>(height) << 16);
+	end_box();
+
+	begin_box("mdia");
+
+	begin_full_box("mdhd", 0, 0);
+	put_u32(0); // creation_time
+	put_u32(0); // modification_time
+	put_u32(timescale);
+	put_u32(static_cast<uint32_t>(media_duration)); // duration
+	put_u16(0x55C4); // language "und"
+	put_u16(0);
+	end_box();
+
+	begin_full_box("hdlr", 0, 0);
+	put_u32(0);
+	put_bytes(reinterpret_cast<const uint8_t*>("vide"), 4);
+	put_zeros(12);
+	put_bytes(reinterpret_cast<const uint8_t*>("VideoHandler"), 13);
+	end_box();
+
+	begin_box("minf");
+
+	begin_full_box("vmhd", 0, 0x000001);
+	put_zeros(8);
+	end_box();
+
+	begin_box("dinf");
+	begin_full_box("dref", 0, 0);
+	put_u32(1);
+	begin_full_box("url ", 0, 0x000001);
+	end_box();
+	end_box();
+	end_box();
+
+	begin_box("stbl");
+
+	begin_full_box("stsd", 0, 0);
+	put_u32(1);
+	begin_box("avc1");
+	put_zeros(6);
+	put_u16(1); // data_reference_index
+	put_zeros(16);
+	put_u16(static_cast<uint16_t>(width));
+	put_u16(static_cast<uint16_t>(height));
+	put_u32(0x00480000); // horizresolution
+	put_u32(0x00480000); // vertresolution
+	put_u32(0);
+	put_u16(1); // frame_count
+	put_zeros(32); // compressorname
+	put_u16(0x0018); // depth
+	put_u16(0xFFFF); // pre_defined
+	begin_box("avcC");
+	put_bytes(avcc.data(), avcc.size());
+	end_box();
+	end_box();
+	end_box();
+
+	// Run-length coded durations
+	begin_full_box("stts", 0, 0);
+	size_t stts_count_pos = out.size();
+	put_u32(0);
+	uint32_t stts_count = 0;
+	for (size_t i = 0; i < samples.size();)
+	{
+		size_t run_end = i + 1;
+		while (run_end < samples.size() && samples[run_end].duration == samples[i].duration)
+		{
+			run_end++;
+		}
+		put_u32(static_cast<uint32_t>(run_end - i));
+		put_u32(samples[i].duration);
+		stts_count++;
+		i = run_end;
+	}
+	out[stts_count_pos] = static_cast<uint8_t>(stts_count >> 24);
+	out[stts_count_pos + 1] = static_cast<uint8_t>(stts_count >> 16);
+	out[stts_count_pos + 2] = static_cast<uint8_t>(stts_count >> 8);
+	out[stts_count_pos + 3] = static_cast<uint8_t>(stts_count);
+	end_box();
+
+	if (!samples.empty())
+	{
+		std::vector<uint32_t> sync_samples;
+		for (size_t i = 0; i < samples.size(); i++)
+		{
+			if (samples[i].keyframe)
+			{
+				sync_samples.push_back(static_cast<uint32_t>(i + 1));
+			}
+		}
+		begin_full_box("stss", 0, 0);
+		put_u32(static_cast<uint32_t>(sync_samples.size()));
+		for (uint32_t sample_number : sync_samples)
+		{
+			put_u32(sample_number);
+		}
+		end_box();
+	}
+
+	// All samples form a single chunk at chunk_offset
+	begin_full_box("stsc", 0, 0);
+	put_u32(samples.empty() ? 0 : 1);
+	if (!samples.empty())
+	{
+		put_u32(1); // first_chunk
+		put_u32(static_cast<uint32_t>(samples.size()));
+		put_u32(1); // sample_description_index
+	}
+	end_box();
+
+	begin_full_box("stsz", 0, 0);
+	put_u32(0);
+	put_u32(static_cast<uint32_t>(samples.size()));
+	for (auto& sample : samples)
+	{
+		put_u32(sample.size);
+	}
+	end_box();
+
+	if (samples.empty())
+	{
+		begin_full_box("stco", 0, 0);
+		put_u32(0);
+		end_box();
+	}
+	else
+	{
+		begin_full_box("co64", 0, 0);
+		put_u32(1);
+		put_u64(chunk_offset);
+		end_box();
+	}
+
+	end_box(); // stbl
+	end_box(); // minf
+	end_box(); // mdia
+	end_box(); // trak
+
+	if (fragmented)
+	{
+		begin_box("mvex");
+		begin_full_box("trex", 0, 0);
+		put_u32(1); // track_ID
+		put_u32(1); // default_sample_description_index
+		put_u32(0); // default_sample_duration
+		put_u32(0); // default_sample_size
+		put_u32(0); // default_sample_flags
+		end_box();
+		end_box();
+	}
+
+	end_box(); // moov
+}
+
+std::vector<uint8_t> Fmp4Writer::make_fragment_header(uint32_t sequence_number, uint64_t base_decode_time, const std::vector<Fmp4Sample>& samples)
+{
+	static const uint32_t keyframe_flags = 0x02000000;
+	static const uint32_t delta_frame_flags = 0x01010000;
+
+	std::vector<uint8_t> result;
+	Fmp4Writer writer(result);
+
+	writer.begin_box("moof");
+
+	writer.begin_full_box("mfhd", 0, 0);
+	writer.put_u32(sequence_number);
+	writer.end_box();
+
+	writer.begin_box("traf");
+
+	// default-base-is-moof: data offsets are relative to the start of this moof
+	writer.begin_full_box("tfhd", 0, 0x020000);
+	writer.put_u32(1);
+	writer.end_box();
+
+	writer.begin_full_box("tfdt", 1, 0);
+	writer.put_u64(base_decode_time);
+	writer.end_box();
+
+	// data-offset, sample duration, size, flags and composition offset present
+	writer.begin_full_box("trun", 1, 0x000F01);
+	writer.put_u32(static_cast<uint32_t>(samples.size()));
+	size_t data_offset_pos = result.size();
+	writer.put_u32(0);
+	uint64_t mdat_payload_size = 0;
+	for (auto& sample : samples)
+	{
+		writer.put_u32(sample.duration);
+		writer.put_u32(sample.size);
+		writer.put_u32(sample.keyframe ? keyframe_flags : delta_frame_flags);
+		writer.put_u32(static_cast<uint32_t>(sample.composition_offset));
+		mdat_payload_size += sample.size;
+	}
+	writer.end_box();
+
+	writer.end_box(); // traf
+	writer.end_box(); // moof
+
+	uint32_t data_offset = static_cast<uint32_t>(result.size() + 8);
+	result[data_offset_pos] = static_cast<uint8_t>(data_offset >> 24);
+	result[data_offset_pos + 1] = static_cast<uint8_t>(data_offset >> 16);
+	result[data_offset_pos + 2] = static_cast<uint8_t>(data_offset >> 8);
+	result[data_offset_pos + 3] = static_cast<uint8_t>(data_offset);
+
+	writer.put_u32(static_cast<uint32_t>(mdat_payload_size + 8));
+	writer.put_bytes(reinterpret_cast<const uint8_t*>("mdat"), 4);
+
+	return result;
+}
+
+std::string Fmp4Writer::make_codecs_string(const std::vector<uint8_t>& avcc)
+{
+	if (avcc.size() < 4)
+	{
+		return "avc1";
+	}
+
+	char codecs[16];
+	snprintf(codecs, sizeof(codecs), "avc1.%02x%02x%02x", avcc[1], avcc[2], avcc[3]);
+	return codecs;
+}
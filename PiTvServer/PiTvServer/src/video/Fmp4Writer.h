@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+
+typedef std::shared_ptr<const std::vector<uint8_t>> Fmp4Data;
+
+struct Fmp4Sample
+{
+	uint32_t duration = 0;
+	uint32_t size = 0;
+	int32_t composition_offset = 0;
+	bool keyframe = false;
+};
+
+// Minimal ISO BMFF writer for a single H.264 track: init segment (ftyp+moov) and moof+mdat fragments
+class Fmp4Writer
+{
+private:
+	std::vector<uint8_t>& out;
+	std::vector<size_t> open_boxes;
+
+	void begin_box(const char* type);
+	void begin_full_box(const char* type, uint8_t version, uint32_t flags);
+	void end_box();
+
+	void put_u8(uint8_t value);
+	void put_u16(uint16_t value);
+	void put_u32(uint32_t value);
+	void put_u64(uint64_t value);
+	void put_bytes(const uint8_t* data, size_t size);
+	void put_zeros(size_t count);
+	void put_matrix();
+	void put_movie(const std::vector<uint8_t>& avcc, int width, int height, uint32_t timescale, const std::vector<Fmp4Sample>& samples, uint64_t chunk_offset, bool fragmented);
+
+	Fmp4Writer(std::vector<uint8_t>& out);
+
+public:
+	static const uint32_t video_timescale;
+
+	// avcc is the AVCDecoderConfigurationRecord (codec_data of stream-format=avc caps)
+	static std::vector<uint8_t> make_init_segment(const std::vector<uint8_t>& avcc, int width, int height, uint32_t timescale = video_timescale);
+
+	// moov of a plain MP4 whose samples lie back to back from chunk_offset, used to repair files without one
+	static std::vector<uint8_t> make_progressive_movie(const std::vector<uint8_t>& avcc, int width, int height, const std::vector<Fmp4Sample>& samples, uint64_t chunk_offset, uint32_t timescale = video_timescale);
+
+	// RFC 6381 codecs parameter, e.g. avc1.64001f
+	static std::string make_codecs_string(const std::vector<uint8_t>& avcc);
+
+	// moof and mdat header for samples whose payloads (total of sample sizes) follow immediately
+	static std::vector<uint8_t> make_fragment_header(uint32_t sequence_number, uint64_t base_decode_time, const std::vector<Fmp4Sample>& samples);
+};
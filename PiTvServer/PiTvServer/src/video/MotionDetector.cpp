@@ -0,0 +1,331 @@
+#include "MotionDetector.h"
+#include <cassert>
+#include <algorithm>
+#include <gst/video/video.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+const int MotionDetector::analysis_width = 160;
+const int MotionDetector::analysis_height = 120;
+
+static const int block_width = 16;
+static const int block_height = 8;
+
+MotionDetector::MotionDetector(const MotionDetectorConfig& config, std::shared_ptr<RawTap> raw_tap)
+{
+	this->config = config;
+	this->raw_tap = raw_tap;
+
+	luma.resize(analysis_width * analysis_height);
+	background.resize(analysis_width * analysis_height);
+	background_q8.resize(analysis_width * analysis_height);
+}
+
+MotionDetector::~MotionDetector()
+{
+	stop();
+}
+
+std::shared_ptr<spdlog::logger> MotionDetector::logger() const
+{
+	return config.logger_ptr;
+}
+
+bool MotionDetector::start()
+{
+	if (tap_listener_id)
+	{
+		logger()->warn("Motion detector is already running!");
+		return true;
+	}
+
+	if (!raw_tap)
+	{
+		logger()->error("Cannot start motion detector: raw tap is not available!");
+		return false;
+	}
+
+	tap_listener_id = raw_tap->add_listener([this](const RawFramePtr& frame)
+		{
+			on_raw_frame(frame);
+		}
+	);
+
+	logger()->info("Motion detector started: {}x{} luma every {} msec", analysis_width, analysis_height, config.interval_msec);
+	return true;
+}
+
+void MotionDetector::stop()
+{
+	if (!tap_listener_id)
+	{
+		return;
+	}
+
+	raw_tap->remove_listener(tap_listener_id);
+	tap_listener_id = 0;
+	logger()->info("Motion detector stopped");
+}
+
+uint32_t MotionDetector::block_sad_16x8(const uint8_t* a, const uint8_t* b, int stride)
+{
+#if defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+	for (int row = 0; row < block_height; row++)
+	{
+		__m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + row * stride));
+		__m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + row * stride));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+	}
+	return static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_add_epi32(acc, _mm_srli_si128(acc, 8))));
+#elif defined(__ARM_NEON)
+	uint16x8_t acc = vdupq_n_u16(0);
+	for (int row = 0; row < block_height; row++)
+	{
+		uint8x16_t va = vld1q_u8(a + row * stride);
+		uint8x16_t vb = vld1q_u8(b + row * stride);
+		acc = vabal_u8(acc, vget_low_u8(va), vget_low_u8(vb));
+		acc = vabal_u8(acc, vget_high_u8(va), vget_high_u8(vb));
+	}
+	uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(acc));
+	return static_cast<uint32_t>(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1));
+#else
+	uint32_t sad = 0;
+	for (int row = 0; row < block_height; row++)
+	{
+		for (int col = 0; col < block_width; col++)
+		{
+			int diff = static_cast<int>(a[row * stride + col]) - static_cast<int>(b[row * stride + col]);
+			sad += static_cast<uint32_t>(diff < 0 ? -diff : diff);
+		}
+	}
+	return sad;
+#endif
+}
+
+bool MotionDetector::extract_luma(const RawFramePtr& frame)
+{
+	GstVideoFrame video_frame;
+	GstVideoInfo video_info = frame->stream_info->video_info;
+	if (!gst_video_frame_map(&video_frame, &video_info, frame->buffer, GST_MAP_READ))
+	{
+		return false;
+	}
+
+	// Component 0 is luma for all YUV layouts, packed formats just have a pixel stride of 2
+	const uint8_t* data = GST_VIDEO_FRAME_COMP_DATA(&video_frame, 0);
+	int stride = GST_VIDEO_FRAME_COMP_STRIDE(&video_frame, 0);
+	int pixel_stride = GST_VIDEO_FRAME_COMP_PSTRIDE(&video_frame, 0);
+	int width = GST_VIDEO_FRAME_COMP_WIDTH(&video_frame, 0);
+	int height = GST_VIDEO_FRAME_COMP_HEIGHT(&video_frame, 0);
+
+	if (width < analysis_width || height < analysis_height)
+	{
+		gst_video_frame_unmap(&video_frame);
+		return false;
+	}
+
+	// Average of 2x2 samples in the middle of every source box
+	for (int y = 0; y < analysis_height; y++)
+	{
+		int src_y = (2 * y + 1) * height / (2 * analysis_height);
+		int src_y_next = src_y + 1 < height ? src_y + 1 : src_y;
+		const uint8_t* row = data + static_cast<size_t>(src_y) * stride;
+		const uint8_t* row_next = data + static_cast<size_t>(src_y_next) * stride;
+
+		for (int x = 0; x < analysis_width; x++)
+		{
+			int src_x = (2 * x + 1) * width / (2 * analysis_width);
+			int src_x_next = src_x + 1 < width ? src_x + 1 : src_x;
+			unsigned sum = row[src_x * pixel_stride] + row[src_x_next * pixel_stride] +
+				row_next[src_x * pixel_stride] + row_next[src_x_next * pixel_stride];
+			luma[y * analysis_width + x] = static_cast<uint8_t>((sum + 2) / 4);
+		}
+	}
+
+	gst_video_frame_unmap(&video_frame);
+	return true;
+}
+
+double MotionDetector::compare_background()
+{
+	int blocks_x = analysis_width / block_width;
+	int blocks_y = analysis_height / block_height;
+	uint32_t sad_threshold = static_cast<uint32_t>(config.block_threshold * block_width * block_height);
+
+	int changed_blocks = 0;
+	for (int by = 0; by < blocks_y; by++)
+	{
+		for (int bx = 0; bx < blocks_x; bx++)
+		{
+			size_t offset = static_cast<size_t>(by * block_height) * analysis_width + bx * block_width;
+			if (block_sad_16x8(luma.data() + offset, background.data() + offset, analysis_width) > sad_threshold)
+			{
+				changed_blocks++;
+			}
+		}
+	}
+
+	return 100.0 * changed_blocks / (blocks_x * blocks_y);
+}
+
+void MotionDetector::update_background()
+{
+	if (!background_ready)
+	{
+		for (size_t i = 0; i < luma.size(); i++)
+		{
+			background_q8[i] = static_cast<uint16_t>(luma[i] << 8);
+			background[i] = luma[i];
+		}
+		background_ready = true;
+		return;
+	}
+
+	// Exponential running average in 8.8 fixed point, learning rate 2^-learn_shift
+	for (size_t i = 0; i < luma.size(); i++)
+	{
+		int current_q8 = luma[i] << 8;
+		int background_value = background_q8[i];
+		background_value += (current_q8 - background_value) >> config.learn_shift;
+		background_q8[i] = static_cast<uint16_t>(background_value);
+		background[i] = static_cast<uint8_t>(background_value >> 8);
+	}
+}
+
+void MotionDetector::notify(const MotionEvent& event)
+{
+	std::lock_guard<std::mutex> lock(listeners_mutex);
+	for (auto& listener : listeners)
+	{
+		listener.second(event);
+	}
+}
+
+void MotionDetector::update_state(double area_percent, const RawFramePtr& frame)
+{
+	bool motion = area_percent >= config.min_area_percent;
+	motion_frames = motion ? motion_frames + 1 : 0;
+	if (motion)
+	{
+		last_motion_usec = frame->wallclock_usec;
+	}
+
+	MotionEvent changed_event;
+	bool changed = false;
+	{
+		std::lock_guard<std::mutex> lock(events_mutex);
+		current_area_percent = area_percent;
+
+		if (!active && motion_frames >= config.trigger_frames)
+		{
+			MotionEvent event;
+			event.id = next_event_id++;
+			event.start_wallclock_usec = frame->wallclock_usec;
+			event.start_pts = frame->pts;
+			event.peak_area_percent = area_percent;
+			events.push_back(event);
+			while (events.size() > config.max_events)
+			{
+				events.pop_front();
+			}
+
+			active = true;
+			changed = true;
+		}
+		else if (active)
+		{
+			MotionEvent& event = events.back();
+			event.peak_area_percent = std::max(event.peak_area_percent, area_percent);
+
+			if (frame->wallclock_usec - last_motion_usec > static_cast<int64_t>(config.hold_msec) * 1000)
+			{
+				event.end_wallclock_usec = frame->wallclock_usec;
+				active = false;
+				changed = true;
+			}
+		}
+
+		if (changed)
+		{
+			changed_event = events.back();
+		}
+	}
+
+	if (changed)
+	{
+		if (changed_event.end_wallclock_usec == 0)
+		{
+			logger()->info("Motion event {} started, {:.1f}% of the frame changed", changed_event.id, changed_event.peak_area_percent);
+		}
+		else
+		{
+			logger()->info("Motion event {} ended after {} msec, peak {:.1f}%", changed_event.id,
+				(changed_event.end_wallclock_usec - changed_event.start_wallclock_usec) / 1000, changed_event.peak_area_percent);
+		}
+		notify(changed_event);
+	}
+}
+
+void MotionDetector::on_raw_frame(const RawFramePtr& frame)
+{
+	if (frame->wallclock_usec - last_analysis_usec < static_cast<int64_t>(config.interval_msec) * 1000)
+	{
+		return;
+	}
+	last_analysis_usec = frame->wallclock_usec;
+
+	if (!extract_luma(frame))
+	{
+		return;
+	}
+
+	if (background_ready)
+	{
+		update_state(compare_background(), frame);
+	}
+
+	update_background();
+}
+
+int MotionDetector::add_listener(MotionListener listener)
+{
+	std::lock_guard<std::mutex> lock(listeners_mutex);
+	int listener_id = next_listener_id++;
+	listeners[listener_id] = listener;
+	return listener_id;
+}
+
+void MotionDetector::remove_listener(int listener_id)
+{
+	std::lock_guard<std::mutex> lock(listeners_mutex);
+	listeners.erase(listener_id);
+}
+
+bool MotionDetector::is_active() const
+{
+	std::lock_guard<std::mutex> lock(events_mutex);
+	return active;
+}
+
+double MotionDetector::get_current_area_percent() const
+{
+	std::lock_guard<std::mutex> lock(events_mutex);
+	return current_area_percent;
+}
+
+void MotionDetector::get_events(uint64_t since_id, std::vector<MotionEvent>& result) const
+{
+	std::lock_guard<std::mutex> lock(events_mutex);
+	for (auto& event : events)
+	{
+		if (event.id > since_id)
+		{
+			result.push_back(event);
+		}
+	}
+}
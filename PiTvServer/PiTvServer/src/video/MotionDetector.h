@@ -0,0 +1,100 @@
+#pragma once
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <functional>
+#include <spdlog/spdlog.h>
+#include "RawTap.h"
+
+struct MotionDetectorConfig
+{
+	std::shared_ptr<spdlog::logger> logger_ptr;
+	int interval_msec = 200;
+	int block_threshold = 12;
+	double min_area_percent = 1.0;
+	int trigger_frames = 2;
+	int hold_msec = 3000;
+	int learn_shift = 4;
+	size_t max_events = 256;
+};
+
+// A motion event. end_wallclock_usec stays 0 while the event is active.
+struct MotionEvent
+{
+	uint64_t id = 0;
+	int64_t start_wallclock_usec = 0;
+	int64_t end_wallclock_usec = 0;
+	GstClockTime start_pts = GST_CLOCK_TIME_NONE;
+	double peak_area_percent = 0;
+};
+
+typedef std::function<void(const MotionEvent&)> MotionListener;
+
+// Block-difference motion detector fed from the raw tap. Luma is box-sampled down to
+// analysis_width x analysis_height and compared in 16x8 blocks against a running-average background.
+// Frames arriving faster than interval_msec are skipped before any pixel is touched.
+class MotionDetector
+{
+private:
+	MotionDetectorConfig config;
+	std::shared_ptr<RawTap> raw_tap;
+	int tap_listener_id = 0;
+
+	// Analysis state, touched only by the raw tap streaming thread
+	int64_t last_analysis_usec = 0;
+	std::vector<uint8_t> luma;
+	std::vector<uint8_t> background;
+	std::vector<uint16_t> background_q8;
+	bool background_ready = false;
+	int motion_frames = 0;
+	int64_t last_motion_usec = 0;
+
+	mutable std::mutex events_mutex;
+	std::deque<MotionEvent> events;
+	uint64_t next_event_id = 1;
+	bool active = false;
+	double current_area_percent = 0;
+
+	mutable std::mutex listeners_mutex;
+	std::map<int, MotionListener> listeners;
+	int next_listener_id = 1;
+
+	std::shared_ptr<spdlog::logger> logger() const;
+
+	void on_raw_frame(const RawFramePtr& frame);
+	bool extract_luma(const RawFramePtr& frame);
+	double compare_background();
+	void update_background();
+	void update_state(double area_percent, const RawFramePtr& frame);
+	void notify(const MotionEvent& event);
+
+	static uint32_t block_sad_16x8(const uint8_t* a, const uint8_t* b, int stride);
+
+public:
+	static const int analysis_width;
+	static const int analysis_height;
+
+	MotionDetector& operator=(const MotionDetector&) = delete;
+	MotionDetector(const MotionDetector& copy) = delete;
+	MotionDetector() = delete;
+
+	MotionDetector(const MotionDetectorConfig& config, std::shared_ptr<RawTap> raw_tap);
+	~MotionDetector();
+
+	bool start();
+	void stop();
+
+	// Listeners are called on the raw tap streaming thread when an event starts and when it ends
+	int add_listener(MotionListener listener);
+	void remove_listener(int listener_id);
+
+	bool is_active() const;
+	double get_current_area_percent() const;
+
+	// Events with id greater than since_id, oldest first
+	void get_events(uint64_t since_id, std::vector<MotionEvent>& result) const;
+};
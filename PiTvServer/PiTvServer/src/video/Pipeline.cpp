@@ -1,8 +1,15 @@
 #include <gst/gst.h>
+#include <gio/gio.h>
+#include <gst/video/video.h>
 #include <filesystem>
 #include "Pipeline.h"
 
-const std::string Pipeline::recording_extension = "mp4";
+#ifdef CM_UNIX
+#include <sys/stat.h>
+#include <sys/socket.h>
+#endif
+
+const std::vector<std::string> Pipeline::recording_extensions = { "mp4", "ts" };
 
 void Pipeline::handle_pipeline_message(GstMessage* msg)
 {
@@ -35,6 +42,19 @@ void Pipeline::handle_pipeline_message(GstMessage* msg)
 	case GST_MESSAGE_EOS:
 		logger()->error("\nEnd-Of-Stream reached!\n");
 		break;
+	case GST_MESSAGE_ELEMENT:
+	{
+		const GstStructure* structure = gst_message_get_structure(msg);
+		if (structure && gst_structure_has_name(structure, "splitmuxsink-fragment-closed"))
+		{
+			const gchar* location = gst_structure_get_string(structure, "location");
+			if (location)
+			{
+				on_recording_fragment_closed(location);
+			}
+		}
+	}
+	break;
 	case GST_MESSAGE_STATE_CHANGED:
 	{
 		GstState old_state, new_state, pending_state;
@@ -72,6 +92,9 @@ void Pipeline::handle_pipeline_message(GstMessage* msg)
 			else if (new_state == GST_STATE_PLAYING)
 			{
 				GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(gst_pipeline), graph_details, "pipeline-playing");
+
+				// Once per start of the whole pipeline, element state changes never get here
+				apply_rtp_socket_priority();
 			}
 
 			is_playing = (new_state == GST_STATE_PLAYING);
@@ -104,15 +127,192 @@ gchararray Pipeline::format_location_handler(GstElement* splitmux, guint fragmen
 	assert(udata);
 	Pipeline* pipeline = static_cast<Pipeline*>(udata);
 
-	std::string recording_path = pipeline->get_recording_full_path();
+	std::string path_str = pipeline->make_recording_location(std::to_string(fragment_id), pipeline->get_recording_extension());
+
+	{
+		// The muxer probe opens the fragment's sidecar index with its first buffer
+		std::lock_guard<std::mutex> lock(pipeline->segment_index_mutex);
+		pipeline->next_segment_path = path_str;
+	}
+
+	gchar* file_path_dup = g_strdup(path_str.c_str());
+	return file_path_dup;
+}
+
+void Pipeline::recording_muxer_pad_added(GstElement* muxer, GstPad* pad, gpointer udata)
+{
+	assert(udata);
+
+	if (GST_PAD_DIRECTION(pad) != GST_PAD_SINK)
+	{
+		return;
+	}
+
+	gst_pad_add_probe(pad, static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+		&Pipeline::recording_muxer_probe, udata, NULL);
+}
+
+GstPadProbeReturn Pipeline::recording_muxer_probe(GstPad* pad, GstPadProbeInfo* info, gpointer udata)
+{
+	assert(udata);
+	Pipeline* pipeline = static_cast<Pipeline*>(udata);
+
+	std::lock_guard<std::mutex> lock(pipeline->segment_index_mutex);
+
+	if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM)
+	{
+		// splitmuxsink ends every fragment with EOS into the muxer, the file is final once it reports fragment-closed
+		GstEvent* event = GST_PAD_PROBE_INFO_EVENT(info);
+		if (GST_EVENT_TYPE(event) == GST_EVENT_EOS && pipeline->segment_index_writer)
+		{
+			pipeline->closing_segment_indexes[pipeline->current_segment_path] = std::move(pipeline->segment_index_writer);
+			pipeline->current_segment_path.clear();
+		}
+		return GST_PAD_PROBE_OK;
+	}
+
+	GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	if (!pipeline->segment_index_writer)
+	{
+		if (pipeline->next_segment_path.empty())
+		{
+			return GST_PAD_PROBE_OK;
+		}
+
+		auto writer = std::make_unique<SegmentIndexWriter>(pipeline->config.logger_ptr);
+		if (!writer->open(SegmentIndex::get_index_path(pipeline->next_segment_path), false))
+		{
+			pipeline->next_segment_path.clear();
+			return GST_PAD_PROBE_OK;
+		}
+		pipeline->segment_index_writer = std::move(writer);
+		pipeline->current_segment_path = pipeline->next_segment_path;
+		pipeline->next_segment_path.clear();
+		pipeline->segment_media_bytes = 0;
+	}
+
+	GstClockTime running_time = GST_BUFFER_PTS(buffer);
+	GstEvent* segment_event = gst_pad_get_sticky_event(pad, GST_EVENT_SEGMENT, 0);
+	if (segment_event)
+	{
+		const GstSegment* segment = nullptr;
+		gst_event_parse_segment(segment_event, &segment);
+		running_time = gst_segment_to_running_time(segment, GST_FORMAT_TIME, GST_BUFFER_PTS(buffer));
+		gst_event_unref(segment_event);
+	}
+
+	// Offsets count media bytes in arrival order, finish_segment_index() maps them onto the file
+	size_t size = gst_buffer_get_size(buffer);
+	pipeline->segment_index_writer->append(running_time, pipeline->running_time_to_wallclock(running_time),
+		pipeline->segment_media_bytes, static_cast<uint32_t>(size), !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT));
+	pipeline->segment_media_bytes += size;
+
+	return GST_PAD_PROBE_OK;
+}
+
+void Pipeline::on_recording_fragment_closed(const std::string& location)
+{
+	std::unique_ptr<SegmentIndexWriter> writer;
+	{
+		std::lock_guard<std::mutex> lock(segment_index_mutex);
+		auto iter = closing_segment_indexes.find(location);
+		if (iter == closing_segment_indexes.end())
+		{
+			logger()->warn("Recording fragment {} closed without a sidecar index", location);
+			return;
+		}
+		writer = std::move(iter->second);
+		closing_segment_indexes.erase(iter);
+	}
+
+	finish_segment_index(location, *writer);
+}
+
+void Pipeline::close_segment_indexes()
+{
+	std::map<std::string, std::unique_ptr<SegmentIndexWriter>> writers;
+	{
+		std::lock_guard<std::mutex> lock(segment_index_mutex);
+		writers = std::move(closing_segment_indexes);
+		closing_segment_indexes.clear();
+		if (segment_index_writer)
+		{
+			writers[current_segment_path] = std::move(segment_index_writer);
+			current_segment_path.clear();
+		}
+	}
+
+	for (auto& [location, writer] : writers)
+	{
+		finish_segment_index(location, *writer);
+	}
+}
+
+void Pipeline::finish_segment_index(const std::string& location, SegmentIndexWriter& writer)
+{
+	// Offsets were counted over the muxer input, they are placed in the file now that it is final
+	if (config.recording_container == "mp4")
+	{
+		uint64_t media_offset = 0;
+		bool media_offset_known = SegmentIndex::find_mp4_media_offset(location, media_offset);
+		if (!media_offset_known)
+		{
+			logger()->warn("Failed to locate media data in {}, its index keeps relative offsets", location);
+		}
+		writer.close(media_offset_known, media_offset);
+	}
+	else
+	{
+		writer.close(false, 0);
+		if (config.recording_container == "fmp4" && !SegmentIndex::resolve_fragmented_offsets(location))
+		{
+			logger()->warn("Failed to map the index of {} onto its fragments, it keeps relative offsets", location);
+		}
+	}
+	logger()->info("Recording fragment {} closed, {} entries indexed", location, writer.get_entry_count());
+
+	if (recording_catalog)
+	{
+		recording_catalog->add_segment(location, writer.get_header(), 0);
+	}
+	if (recording_uploader)
+	{
+		recording_uploader->enqueue(location);
+	}
+}
+
+int64_t Pipeline::running_time_to_wallclock(GstClockTime running_time) const
+{
+	int64_t now_usec = g_get_real_time();
+	GstClock* clock = gst_pipeline ? gst_element_get_clock(gst_pipeline) : nullptr;
+	if (!clock || !GST_CLOCK_TIME_IS_VALID(running_time))
+	{
+		if (clock)
+		{
+			gst_object_unref(clock);
+		}
+		return now_usec;
+	}
+
+	// The buffer was captured (now - its running time) ago, queues in between do not skew the stamp
+	GstClockTime now_running_time = gst_clock_get_time(clock) - gst_element_get_base_time(gst_pipeline);
+	gst_object_unref(clock);
+
+	int64_t age_usec = (static_cast<int64_t>(now_running_time) - static_cast<int64_t>(running_time)) / 1000;
+	return now_usec - std::max<int64_t>(0, age_usec);
+}
+
+std::string Pipeline::make_recording_location(const std::string& fragment_tag, const std::string& extension)
+{
+	std::string recording_path = get_recording_full_path();
 	std::string time_str = get_current_date_time_str();
 
 #ifdef __cpp_lib_format
-	std::string file_name = std::format("{}[{}].{}", time_str, fragment_id, Pipeline::recording_extension);
+	std::string file_name = std::format("{}[{}].{}", time_str, fragment_tag, extension);
 #else
 
 	std::stringstream file_name_stream;
-	file_name_stream << time_str << "[" << fragment_id << "]" << "." << Pipeline::recording_extension;
+	file_name_stream << time_str << "[" << fragment_tag << "]" << "." << extension;
 	std::string file_name = file_name_stream.str();
 #endif
 
@@ -121,12 +321,11 @@ gchararray Pipeline::format_location_handler(GstElement* splitmux, guint fragmen
 	std::filesystem::path full_path = dir_path / file;
 	std::string path_str = full_path.string();
 
-	pipeline->config.logger_ptr->info("Recording fragment will be saved to {}", path_str);
+	config.logger_ptr->info("Recording fragment will be saved to {}", path_str);
 
-	pipeline->enforce_recording_max_size_restrictions(path_str, fragment_id);
+	enforce_recording_max_size_restrictions(path_str, 0);
 
-	gchar* file_path_dup = g_strdup(path_str.c_str());
-	return file_path_dup;
+	return path_str;
 }
 
 uintmax_t Pipeline::get_recording_total_size() const
@@ -141,19 +340,63 @@ uintmax_t Pipeline::get_recording_total_size() const
 			continue;
 		}
 
-		if (dir_entry.path().extension() != "." + recording_extension)
+		if (!is_recording_file(dir_entry.path()))
 		{
-			logger()->debug("[get_recording_total_size] entry {} ignored due to not being a .{} video container", dir_entry.path().string(), recording_extension);
+			logger()->debug("[get_recording_total_size] entry {} ignored due to not being a video container", dir_entry.path().string());
 			continue;
 		}
 
-		auto size = dir_entry.file_size();
+		// The sidecar index goes with its segment, it is removed together with it as well. A missing one counts 0.
+		auto size = get_allocated_size(dir_entry.path()) + get_allocated_size(SegmentIndex::get_index_path(dir_entry.path().string()));
 		logger()->debug("[get_recording_total_size] file {} size is {} Mb", dir_entry.path().string(), size / 1024 / 1024);
-		total_size += dir_entry.file_size();
+		total_size += size;
 	}
 	return total_size;
 }
 
+uintmax_t Pipeline::get_recording_staged_size() const
+{
+	// Footage in RAM that the card will get, the segment on the card does not show it yet
+	if (!segment_sink)
+	{
+		return 0;
+	}
+	return segment_sink->get_stats().staged_bytes;
+}
+
+std::string Pipeline::get_recording_extension() const
+{
+	return config.recording_container == "ts" ? "ts" : "mp4";
+}
+
+bool Pipeline::is_recording_file(const std::filesystem::path& path)
+{
+	// Files of every container count, the container may have been changed between runs
+	for (const auto& extension : recording_extensions)
+	{
+		if (path.extension() == "." + extension)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+uintmax_t Pipeline::get_allocated_size(const std::filesystem::path& path)
+{
+#ifdef CM_UNIX
+	// A segment still open, or left behind by a crash, holds its whole preallocation
+	struct stat file_stat;
+	if (stat(path.c_str(), &file_stat) == 0)
+	{
+		return std::max(static_cast<uintmax_t>(file_stat.st_blocks) * 512, static_cast<uintmax_t>(file_stat.st_size));
+	}
+#endif
+	std::error_code size_error;
+	uintmax_t size = std::filesystem::file_size(path, size_error);
+	return size_error ? 0 : size;
+}
+
 std::filesystem::path Pipeline::get_oldest_file() const
 {
 	bool has_file = false;
@@ -168,9 +411,9 @@ std::filesystem::path Pipeline::get_oldest_file() const
 			continue;
 		}
 
-		if (dir_entry.path().extension() != "." + recording_extension)
+		if (!is_recording_file(dir_entry.path()))
 		{
-			logger()->debug("[get_oldest_file] entry {} ignored due to not being a .{} video container", dir_entry.path().string(), recording_extension);
+			logger()->debug("[get_oldest_file] entry {} ignored due to not being a video container", dir_entry.path().string());
 			continue;
 		}
 
@@ -196,8 +439,9 @@ void Pipeline::enforce_recording_max_size_restrictions(std::filesystem::path las
 	int max_iterations = 100;
 	int iteration = 0;
 
-	uintmax_t total_size = get_recording_total_size();
-	logger()->info("[enforce_recording_max_size_restrictions] total size of recordings: {} Mb", total_size / 1024 / 1024);
+	uintmax_t staged_size = get_recording_staged_size();
+	uintmax_t total_size = get_recording_total_size() + staged_size;
+	logger()->info("[enforce_recording_max_size_restrictions] total size of recordings: {} Mb ({} Mb staged)", total_size / 1024 / 1024, staged_size / 1024 / 1024);
 
 	while (total_size >= (uintmax_t)config.recording_max_size * 1024UL * 1024UL && iteration < max_iterations)
 	{
@@ -216,8 +460,14 @@ void Pipeline::enforce_recording_max_size_restrictions(std::filesystem::path las
 
 		logger()->info("[enforce_recording_max_size_restrictions] removing the oldest file: {}", oldest_file.string());
 		std::filesystem::remove(oldest_file);
+		std::error_code remove_error;
+		std::filesystem::remove(SegmentIndex::get_index_path(oldest_file.string()), remove_error);
+		if (recording_catalog)
+		{
+			recording_catalog->remove_segment(oldest_file.string());
+		}
 
-		total_size = get_recording_total_size();
+		total_size = get_recording_total_size() + staged_size;
 		iteration++;
 	}
 
@@ -244,7 +494,8 @@ void Pipeline::bus_poll(int timeout_msec)
 			GST_MESSAGE_WARNING |
 			GST_MESSAGE_ERROR |
 			GST_MESSAGE_EOS |
-			GST_MESSAGE_STATE_CHANGED));
+			GST_MESSAGE_STATE_CHANGED |
+			GST_MESSAGE_ELEMENT));
 
 	if (message)
 	{
@@ -267,7 +518,8 @@ void Pipeline::bus_poll()
 			GST_MESSAGE_WARNING |
 			GST_MESSAGE_ERROR |
 			GST_MESSAGE_EOS |
-			GST_MESSAGE_STATE_CHANGED));
+			GST_MESSAGE_STATE_CHANGED |
+			GST_MESSAGE_ELEMENT));
 
 	if (message)
 	{
@@ -338,12 +590,39 @@ GstElement* Pipeline::make_streaming_subpipe()
 	assert(rtph264pay);
 
 
-	GstElement* multiudpsink = gst_element_factory_make("multiudpsink", "multiudpsink");
-	assert(multiudpsink);
+	GstElement* udp_sink = nullptr;
+	if (config.rtp_fanout_threads > 0)
+	{
+		udp_sink = gst_element_factory_make("appsink", "rtp_appsink");
+		assert(udp_sink);
+
+		gst_app_sink_set_buffer_list_support(GST_APP_SINK(udp_sink), true);
 
-	gst_bin_add_many(GST_BIN(bin), streaming_queue, rtph264pay, multiudpsink, NULL);
+		GstAppSinkCallbacks callbacks = { 0 };
+		callbacks.new_sample = &Pipeline::rtp_appsink_new_sample;
+		gst_app_sink_set_callbacks(GST_APP_SINK(udp_sink), &callbacks, this, NULL);
+	}
+	else
+	{
+		udp_sink = gst_element_factory_make("multiudpsink", "multiudpsink");
+		assert(udp_sink);
 
-	gboolean link_ok = gst_element_link_many(streaming_queue, rtph264pay, multiudpsink, NULL);
+		g_object_set(udp_sink, "auto-multicast", false, NULL);
+		g_object_set(udp_sink, "qos-dscp", config.rtp_dscp, NULL);
+		if (config.rtp_sndbuf_size > 0)
+		{
+			g_object_set(udp_sink, "buffer-size", config.rtp_sndbuf_size, NULL);
+		}
+		g_object_set(udp_sink, "ttl-mc", config.rtp_multicast_ttl, NULL);
+		if (!config.rtp_multicast_iface.empty())
+		{
+			g_object_set(udp_sink, "multicast-iface", config.rtp_multicast_iface.c_str(), NULL);
+		}
+	}
+
+	gst_bin_add_many(GST_BIN(bin), streaming_queue, rtph264pay, udp_sink, NULL);
+
+	gboolean link_ok = gst_element_link_many(streaming_queue, rtph264pay, udp_sink, NULL);
 	assert(link_ok);
 
 	GstPad* sink = gst_element_get_static_pad(streaming_queue, "sink");
@@ -354,6 +633,80 @@ GstElement* Pipeline::make_streaming_subpipe()
 	return bin;
 }
 
+GstFlowReturn Pipeline::rtp_appsink_new_sample(GstAppSink* appsink, gpointer udata)
+{
+	assert(udata);
+	Pipeline* pipeline = static_cast<Pipeline*>(udata);
+
+	GstSample* sample = gst_app_sink_pull_sample(appsink);
+	if (!sample)
+	{
+		return GST_FLOW_EOS;
+	}
+
+	if (pipeline->rtp_fanout)
+	{
+		GstBufferList* list = gst_sample_get_buffer_list(sample);
+		if (list)
+		{
+			pipeline->rtp_fanout->push_packets(gst_buffer_list_ref(list));
+		}
+		else
+		{
+			GstBuffer* buffer = gst_sample_get_buffer(sample);
+			if (buffer)
+			{
+				GstBufferList* single_list = gst_buffer_list_new_sized(1);
+				gst_buffer_list_add(single_list, gst_buffer_ref(buffer));
+				pipeline->rtp_fanout->push_packets(single_list);
+			}
+		}
+	}
+
+	gst_sample_unref(sample);
+	return GST_FLOW_OK;
+}
+
+void Pipeline::apply_rtp_socket_priority()
+{
+#ifdef CM_UNIX
+	if (config.rtp_socket_priority < 0 || rtp_fanout || !gst_pipeline)
+	{
+		return;
+	}
+
+	// multiudpsink has no SO_PRIORITY property, its sockets only exist after the sink is started
+	GstElement* multiudpsink = gst_bin_get_by_name(GST_BIN(gst_pipeline), "multiudpsink");
+	if (!multiudpsink)
+	{
+		return;
+	}
+
+	for (const char* property_name : { "used-socket", "used-socket-v6" })
+	{
+		GSocket* socket = nullptr;
+		g_object_get(multiudpsink, property_name, &socket, NULL);
+		if (!socket)
+		{
+			continue;
+		}
+
+		int fd = g_socket_get_fd(socket);
+		if (setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &config.rtp_socket_priority, sizeof(config.rtp_socket_priority)) != 0)
+		{
+			logger()->warn("Failed to set SO_PRIORITY {} on multiudpsink {}", config.rtp_socket_priority, property_name);
+		}
+		else
+		{
+			logger()->info("SO_PRIORITY {} set on multiudpsink {}", config.rtp_socket_priority, property_name);
+		}
+		g_object_unref(socket);
+	}
+
+	gst_object_unref(multiudpsink);
+#endif
+}
+
 bool Pipeline::attach_rtp_bin(GstElement* element)
 {
 	assert(element);
@@ -484,6 +837,11 @@ bool Pipeline::rtp_add_endpoint(std::string host, int port)
 		return false;
 	}
 
+	if (rtp_fanout)
+	{
+		return rtp_fanout->add_endpoint(host, port);
+	}
+
 	GstElement* multiudpsink = gst_bin_get_by_name(GST_BIN(gst_pipeline), "multiudpsink");
 	if (!multiudpsink)
 	{
@@ -504,6 +862,11 @@ bool Pipeline::rtp_remove_endpoint(std::string host, int port)
 		return false;
 	}
 
+	if (rtp_fanout)
+	{
+		return rtp_fanout->remove_endpoint(host, port);
+	}
+
 	GstElement* multiudpsink = gst_bin_get_by_name(GST_BIN(gst_pipeline), "multiudpsink");
 	if (!multiudpsink)
 	{
@@ -524,6 +887,237 @@ bool Pipeline::rtp_change_endpoint(std::string host_old, int port_old, std::stri
 	return true;
 }
 
+bool Pipeline::rtp_multicast_enabled() const
+{
+	return !config.rtp_multicast_group.empty();
+}
+
+bool Pipeline::rtp_multicast_join()
+{
+	if (!rtp_multicast_enabled())
+	{
+		logger()->error("rtp_multicast_join() called, but multicast group is not configured!");
+		return false;
+	}
+
+	if (rtp_multicast_members == 0)
+	{
+		if (!rtp_add_endpoint(config.rtp_multicast_group, config.rtp_multicast_port))
+		{
+			logger()->error("Failed to start streaming to multicast group {}:{}", config.rtp_multicast_group, config.rtp_multicast_port);
+			return false;
+		}
+		logger()->info("Streaming to multicast group {}:{} started", config.rtp_multicast_group, config.rtp_multicast_port);
+	}
+
+	rtp_multicast_members++;
+	logger()->info("Multicast group {}:{} has {} members", config.rtp_multicast_group, config.rtp_multicast_port, rtp_multicast_members);
+	return true;
+}
+
+bool Pipeline::rtp_multicast_leave()
+{
+	if (rtp_multicast_members <= 0)
+	{
+		logger()->warn("rtp_multicast_leave() called for multicast group without members!");
+		return false;
+	}
+
+	rtp_multicast_members--;
+	logger()->info("Multicast group {}:{} has {} members", config.rtp_multicast_group, config.rtp_multicast_port, rtp_multicast_members);
+
+	if (rtp_multicast_members == 0)
+	{
+		logger()->info("No members left, streaming to multicast group {}:{} stopped", config.rtp_multicast_group, config.rtp_multicast_port);
+		return rtp_remove_endpoint(config.rtp_multicast_group, config.rtp_multicast_port);
+	}
+
+	return true;
+}
+
+std::string Pipeline::get_rtp_multicast_group() const
+{
+	return config.rtp_multicast_group;
+}
+
+int Pipeline::get_rtp_multicast_port() const
+{
+	return config.rtp_multicast_port;
+}
+
+int Pipeline::get_rtp_multicast_ttl() const
+{
+	return config.rtp_multicast_ttl;
+}
+
+std::shared_ptr<SrtOutput> Pipeline::get_srt_output() const
+{
+	return srt_output;
+}
+
+std::shared_ptr<EncodedTap> Pipeline::get_encoded_tap() const
+{
+	return encoded_tap;
+}
+
+std::shared_ptr<RawTap> Pipeline::get_raw_tap() const
+{
+	return raw_tap;
+}
+
+std::shared_ptr<MotionDetector> Pipeline::get_motion_detector() const
+{
+	return motion_detector;
+}
+
+std::shared_ptr<EventRecorder> Pipeline::get_event_recorder() const
+{
+	return event_recorder;
+}
+
+std::shared_ptr<AnalyticsHost> Pipeline::get_analytics_host() const
+{
+	return analytics_host;
+}
+
+std::shared_ptr<RecordingCatalog> Pipeline::get_recording_catalog() const
+{
+	return recording_catalog;
+}
+
+bool Pipeline::is_event_recording_mode() const
+{
+	return config.recording_mode == "event";
+}
+
+bool Pipeline::make_event_recorder()
+{
+	if (!encoded_tap)
+	{
+		logger()->error("Event recording needs the encoded tap!");
+		return false;
+	}
+
+	EventRecorderConfig recorder_config;
+	recorder_config.logger_ptr = config.logger_ptr;
+	recorder_config.preroll_msec = config.event_preroll_msec;
+	recorder_config.postroll_msec = config.event_postroll_msec;
+	recorder_config.location_handler = [this](uint64_t event_id)
+		{
+			// The event recorder always writes fragmented MP4
+			return make_recording_location("event-" + std::to_string(event_id), "mp4");
+		};
+	recorder_config.file_closed_handler = [this](const std::string& path, const SegmentIndexHeader& index_header)
+		{
+			if (recording_catalog)
+			{
+				recording_catalog->add_segment(path, index_header, recording_segment_event);
+			}
+			if (recording_uploader)
+			{
+				recording_uploader->enqueue(path);
+			}
+		};
+
+	event_recorder = std::make_shared<EventRecorder>(recorder_config, encoded_tap);
+	if (!event_recorder->start())
+	{
+		event_recorder.reset();
+		return false;
+	}
+
+	if (motion_detector)
+	{
+		// A motion event holds the recording open, post-roll counts from its end
+		motion_detector->add_listener([this](const MotionEvent& event)
+			{
+				event_recorder->set_hold(event.end_wallclock_usec == 0, "motion event " + std::to_string(event.id));
+			}
+		);
+	}
+	else
+	{
+		logger()->warn("Event recording mode without motion detection, recording is triggered only by the API");
+	}
+
+	return true;
+}
+
+bool Pipeline::request_keyframe()
+{
+	if (!encoder_element)
+	{
+		logger()->warn("Keyframe requested, but the encoder element is unknown");
+		return false;
+	}
+
+	// gst_element_send_event() would push an upstream event out of the encoder's sink pad, past the
+	// encoder. Sent into its src pad, it arrives at the encoder as if it came from downstream.
+	GstPad* encoder_src_pad = gst_element_get_static_pad(encoder_element, "src");
+	if (!encoder_src_pad)
+	{
+		logger()->warn("Keyframe requested, but the encoder has no src pad");
+		return false;
+	}
+
+	GstEvent* event = gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0);
+	bool result = gst_pad_send_event(encoder_src_pad, event);
+	gst_object_unref(encoder_src_pad);
+	return result;
+}
+
+bool Pipeline::get_rtp_fanout_stats(UdpFanoutStats& stats) const
+{
+	if (!rtp_fanout)
+	{
+		return false;
+	}
+
+	stats = rtp_fanout->get_stats();
+	return true;
+}
+
+bool Pipeline::get_recording_write_stats(SegmentSinkStats& stats) const
+{
+	if (!segment_sink)
+	{
+		return false;
+	}
+
+	stats = segment_sink->get_stats();
+	return true;
+}
+
+bool Pipeline::get_recording_tiering_stats(RecordingTieringStats& stats) const
+{
+	if (!recording_tiering)
+	{
+		return false;
+	}
+
+	stats = recording_tiering->get_stats();
+	return true;
+}
+
+bool Pipeline::get_recording_upload_stats(RecordingUploaderStats& stats) const
+{
+	if (!recording_uploader)
+	{
+		return false;
+	}
+
+	stats = recording_uploader->get_stats();
+	return true;
+}
+
+void Pipeline::set_recording_upload_throttled(bool throttled)
+{
+	if (recording_uploader)
+	{
+		recording_uploader->set_throttled(throttled);
+	}
+}
+
 bool Pipeline::splitmux_split_now()
 {
 	if (!gst_pipeline)
@@ -597,6 +1191,31 @@ Pipeline::Pipeline(const PipelineConfig& config)
 
 Pipeline::~Pipeline()
 {
+	if (recording_recovery)
+	{
+		recording_recovery->stop();
+	}
+
+	if (recording_tiering)
+	{
+		recording_tiering->stop();
+	}
+
+	if (motion_detector)
+	{
+		motion_detector->stop();
+	}
+
+	if (event_recorder)
+	{
+		event_recorder->stop();
+	}
+
+	if (analytics_host)
+	{
+		analytics_host->stop();
+	}
+
 	if (gst_pipeline)
 	{
 		GstState state = GstState::GST_STATE_NULL;
@@ -619,9 +1238,24 @@ Pipeline::~Pipeline()
 			}
 		}
 
+		// Segments finished during shutdown never report fragment-closed on the bus
+		close_segment_indexes();
+
 		gst_object_unref(gst_pipeline);
 	}
 
+	// Only after the pipeline is down, its streaming thread pushes into the fanout until then
+	if (rtp_fanout)
+	{
+		rtp_fanout->stop();
+	}
+
+	// Segments closed above are queued for upload, the journal has to be open to keep them
+	if (recording_uploader)
+	{
+		recording_uploader->stop();
+	}
+
 	if (bus)
 	{
 		gst_object_unref(bus);
@@ -637,6 +1271,10 @@ std::shared_ptr<spdlog::logger> Pipeline::logger() const
 GstElement* Pipeline::make_capturing_subpipe(std::string bin_str)
 {
 	logger()->info("Constructing pipeline from user-provided bin description: {}", config.videosource_override);
+	if (config.raw_tap_enabled)
+	{
+		logger()->warn("Raw frame tap is not available with a user-provided video source");
+	}
 	GstElement* bin = gst_parse_bin_from_description(bin_str.c_str(), true, NULL);
 	return bin;
 }
@@ -696,7 +1334,7 @@ GstElement* Pipeline::make_capturing_subpipe()
 		NULL);
 
 
-	if (!gst_element_link_filtered(source, encoder, src_enc_caps))
+	if (!link_source_to_encoder(bin, source, encoder, src_enc_caps))
 	{
 		GST_ERROR("Failed to link %s and %s!", GST_ELEMENT_NAME(source), GST_ELEMENT_NAME(encoder));
 		gst_object_unref(bin);
@@ -774,7 +1412,7 @@ GstElement* Pipeline::make_capturing_subpipe()
 		"format", G_TYPE_STRING, "NV12",
 		NULL);
 
-	if (!gst_element_link_filtered(source, encoder, source_caps))
+	if (!link_source_to_encoder(bin, source, encoder, source_caps))
 	{
 		logger()->error("Failed to link video source elements!");
 		return nullptr;
@@ -795,6 +1433,88 @@ GstElement* Pipeline::make_capturing_subpipe()
 
 }
 
+bool Pipeline::link_source_to_encoder(GstElement* bin, GstElement* source, GstElement* encoder, GstCaps* caps)
+{
+	encoder_element = encoder;
+
+	if (!config.raw_tap_enabled)
+	{
+		return gst_element_link_filtered(source, encoder, caps);
+	}
+
+	raw_tap = std::make_shared<RawTap>(config.logger_ptr);
+	GstElement* raw_tee = gst_element_factory_make("tee", "raw_tee");
+	GstElement* raw_tap_bin = raw_tap->make_bin();
+	if (!raw_tee || !raw_tap_bin)
+	{
+		logger()->error("Failed to create raw tap, raw frame consumers will not be available!");
+		if (raw_tee)
+		{
+			gst_object_unref(raw_tee);
+		}
+		if (raw_tap_bin)
+		{
+			gst_object_unref(raw_tap_bin);
+		}
+		raw_tap.reset();
+		return gst_element_link_filtered(source, encoder, caps);
+	}
+
+	gst_bin_add_many(GST_BIN(bin), raw_tee, raw_tap_bin, NULL);
+	if (!gst_element_link_filtered(source, raw_tee, caps) || !gst_element_link(raw_tee, encoder) || !gst_element_link(raw_tee, raw_tap_bin))
+	{
+		logger()->error("Failed to link raw tap between video source and encoder!");
+		raw_tap.reset();
+		return false;
+	}
+
+	if (!config.analytics_plugins.empty())
+	{
+		link_analytics(bin, raw_tee);
+	}
+
+	return true;
+}
+
+void Pipeline::link_analytics(GstElement* bin, GstElement* raw_tee)
+{
+	AnalyticsHostConfig analytics_config;
+	analytics_config.logger_ptr = config.logger_ptr;
+	analytics_config.plugin_specs = config.analytics_plugins;
+	analytics_config.cpu_budget_percent = config.analytics_cpu_budget_percent;
+	analytics_host = std::make_shared<AnalyticsHost>(analytics_config);
+	if (!analytics_host->load_plugins())
+	{
+		logger()->error("No analytics plugin could be loaded, analytics will not be available!");
+		analytics_host.reset();
+		return;
+	}
+
+	// Workers start before the appsinks are linked, the host must outlive them from here on
+	if (!analytics_host->start())
+	{
+		logger()->error("Failed to start analytics host, analytics will not be available!");
+		analytics_host.reset();
+		return;
+	}
+
+	for (size_t i = 0; i < analytics_host->get_plugin_count(); i++)
+	{
+		GstElement* analytics_bin = analytics_host->make_bin(i);
+		if (!analytics_bin)
+		{
+			continue;
+		}
+
+		gst_bin_add(GST_BIN(bin), analytics_bin);
+		if (!gst_element_link(raw_tee, analytics_bin))
+		{
+			logger()->error("Failed to link bin {} to tee {}!", GST_ELEMENT_NAME(analytics_bin), GST_ELEMENT_NAME(raw_tee));
+			gst_bin_remove(GST_BIN(bin), analytics_bin);
+		}
+	}
+}
+
 GstElement* Pipeline::make_recording_subpipe()
 {
 	GstElement* bin = gst_bin_new("recording-bin");
@@ -813,6 +1533,8 @@ GstElement* Pipeline::make_recording_subpipe()
 		gst_object_unref(bin);
 		return nullptr;
 	}
+	// Parameter sets in front of every keyframe keep a segment decodable when it loses its moov
+	g_object_set(G_OBJECT(parser), "config-interval", -1, NULL);
 	gst_bin_add(GST_BIN(bin), parser);
 
 	if (!gst_element_link(storing_queue, parser))
@@ -831,6 +1553,45 @@ GstElement* Pipeline::make_recording_subpipe()
 	}
 	gst_bin_add(GST_BIN(bin), sink);
 
+	// An explicit muxer lets the sidecar index probe see access units in file order
+	const char* muxer_factory = config.recording_container == "ts" ? "mpegtsmux" : "mp4mux";
+	GstElement* muxer = gst_element_factory_make(muxer_factory, "recording_muxer");
+	if (!muxer)
+	{
+		logger()->error("Failed to create {} element!", muxer_factory);
+		gst_object_unref(bin);
+		return nullptr;
+	}
+	if (config.recording_container == "fmp4")
+	{
+		// moov goes first and every fragment is complete on disk, nothing is rewritten at the end
+		g_object_set(muxer, "fragment-duration", static_cast<guint>(config.recording_fragment_msec), NULL);
+		g_object_set(muxer, "streamable", TRUE, NULL);
+	}
+	g_signal_connect(muxer, "pad-added", G_CALLBACK(&Pipeline::recording_muxer_pad_added), this);
+	g_object_set(sink, "muxer", muxer, NULL);
+
+	// Preallocated for a whole segment at the expected bitrate and written in aligned blocks
+	SegmentSinkConfig segment_sink_config;
+	segment_sink_config.logger_ptr = config.logger_ptr;
+	segment_sink_config.preallocate_bytes = static_cast<uint64_t>(config.recording_bitrate_kbps) * 125 * static_cast<uint64_t>(config.recording_segment_duration);
+	segment_sink_config.write_block_size = static_cast<size_t>(config.recording_write_block_kib) * 1024;
+	segment_sink_config.writer = config.recording_writer;
+	segment_sink_config.writes_in_flight = config.recording_writes_in_flight;
+	segment_sink_config.direct_io = config.recording_direct_io;
+	segment_sink_config.flush_policy = config.recording_flush;
+	segment_sink_config.staging_path = config.recording_staging_path;
+	segment_sink_config.staging_max_bytes = static_cast<uint64_t>(config.recording_staging_max_size_mib) * 1024 * 1024;
+	segment_sink_config.staging_max_loss_sec = config.recording_staging_max_loss_sec;
+	segment_sink = std::make_shared<SegmentSink>(segment_sink_config);
+	if (!segment_sink->start())
+	{
+		logger()->error("Failed to start the recording writer!");
+		gst_object_unref(bin);
+		return nullptr;
+	}
+	g_object_set(sink, "sink", SegmentSink::make_element(segment_sink), NULL);
+
 	g_object_set(sink, "max-size-time", config.recording_segment_duration * GST_SECOND, NULL);
 	g_object_set(sink, "async-finalize", false, NULL);
 	// g_object_set(sink, "location", pipeline_data.config.recording_path, NULL);
@@ -897,20 +1658,50 @@ bool Pipeline::construct_pipeline()
 	}
 	gst_bin_add(GST_BIN(pipeline_tmp), subpipes_tee);
 
-	GstElement* recording_bin = make_recording_subpipe();
-	if (!recording_bin)
+	if (!gst_element_link(video_capturing_bin, subpipes_tee))
 	{
-		logger()->error("Failed to create recording subpipeline!");
+		logger()->error("Failed to link pipeline elements!");
 		gst_object_unref(pipeline_tmp);
 		return false;
 	}
-	gst_bin_add(GST_BIN(pipeline_tmp), recording_bin);
 
-	if (!gst_element_link_many(video_capturing_bin, subpipes_tee, recording_bin, NULL))
+	// In event mode the encoded tap feeds the event recorder instead of a continuous splitmuxsink
+	if (!is_event_recording_mode())
 	{
-		logger()->error("Failed to link pipeline elements!");
-		gst_object_unref(pipeline_tmp);
-		return false;
+		GstElement* recording_bin = make_recording_subpipe();
+		if (!recording_bin)
+		{
+			logger()->error("Failed to create recording subpipeline!");
+			gst_object_unref(pipeline_tmp);
+			return false;
+		}
+		gst_bin_add(GST_BIN(pipeline_tmp), recording_bin);
+
+		if (!gst_element_link(subpipes_tee, recording_bin))
+		{
+			logger()->error("Failed to link pipeline elements!");
+			gst_object_unref(pipeline_tmp);
+			return false;
+		}
+	}
+
+	if (config.rtp_fanout_threads > 0)
+	{
+		UdpFanoutConfig fanout_config;
+		fanout_config.logger_ptr = config.logger_ptr;
+		fanout_config.sender_threads = config.rtp_fanout_threads;
+		fanout_config.multicast_ttl = config.rtp_multicast_ttl;
+		fanout_config.multicast_iface = config.rtp_multicast_iface;
+		fanout_config.dscp = config.rtp_dscp;
+		fanout_config.socket_priority = config.rtp_socket_priority;
+		fanout_config.sndbuf_size = config.rtp_sndbuf_size;
+		rtp_fanout = std::make_shared<UdpFanout>(fanout_config);
+		if (!rtp_fanout->start())
+		{
+			logger()->error("Failed to start RTP fanout, falling back to multiudpsink!");
+			rtp_fanout.reset();
+			config.rtp_fanout_threads = 0;
+		}
 	}
 
 	GstElement* rtp_bin = make_streaming_subpipe();
@@ -931,6 +1722,96 @@ bool Pipeline::construct_pipeline()
 		return false;
 	}
 
+	if (config.srt_port > 0)
+	{
+		SrtOutputConfig srt_config;
+		srt_config.logger_ptr = config.logger_ptr;
+		srt_config.port = config.srt_port;
+		srt_config.latency_msec = config.srt_latency_msec;
+		srt_config.passphrase = config.srt_passphrase;
+		srt_output = std::make_shared<SrtOutput>(srt_config);
+
+		GstElement* srt_bin = srt_output->make_bin();
+		if (!srt_bin)
+		{
+			logger()->error("Failed to create SRT output, SRT leases will not be available!");
+			srt_output.reset();
+		}
+		else
+		{
+			gst_bin_add(GST_BIN(pipeline_tmp), srt_bin);
+			if (!gst_element_link(subpipes_tee, srt_bin))
+			{
+				logger()->error("Failed to link bin {} to tee {}!",
+					GST_ELEMENT_NAME(srt_bin),
+					GST_ELEMENT_NAME(subpipes_tee));
+				gst_bin_remove(GST_BIN(pipeline_tmp), srt_bin);
+				srt_output.reset();
+			}
+		}
+	}
+
+	// Without consumers the tap would still queue, parse and hand every frame to its appsink
+	GstElement* encoded_tap_bin = nullptr;
+	if (config.encoded_tap_enabled || is_event_recording_mode())
+	{
+		encoded_tap = std::make_shared<EncodedTap>(config.logger_ptr);
+		encoded_tap_bin = encoded_tap->make_bin();
+		if (!encoded_tap_bin)
+		{
+			logger()->error("Failed to create encoded tap, in-process consumers will not be available!");
+			encoded_tap.reset();
+		}
+	}
+	if (encoded_tap_bin)
+	{
+		gst_bin_add(GST_BIN(pipeline_tmp), encoded_tap_bin);
+		if (!gst_element_link(subpipes_tee, encoded_tap_bin))
+		{
+			logger()->error("Failed to link bin {} to tee {}!",
+				GST_ELEMENT_NAME(encoded_tap_bin),
+				GST_ELEMENT_NAME(subpipes_tee));
+			gst_bin_remove(GST_BIN(pipeline_tmp), encoded_tap_bin);
+			encoded_tap.reset();
+		}
+	}
+
+	if (config.motion_enabled)
+	{
+		MotionDetectorConfig motion_config;
+		motion_config.logger_ptr = config.logger_ptr;
+		motion_config.interval_msec = config.motion_interval_msec;
+		motion_config.block_threshold = config.motion_block_threshold;
+		motion_config.min_area_percent = config.motion_min_area_percent;
+		motion_config.trigger_frames = config.motion_trigger_frames;
+		motion_config.hold_msec = config.motion_hold_msec;
+		motion_detector = std::make_shared<MotionDetector>(motion_config, raw_tap);
+		if (!motion_detector->start())
+		{
+			logger()->error("Failed to start motion detector, motion events will not be available!");
+			motion_detector.reset();
+		}
+		else if (config.motion_force_keyframe)
+		{
+			// Recordings and live viewers get a clean entry point right at the start of an event
+			motion_detector->add_listener([this](const MotionEvent& event)
+				{
+					if (event.end_wallclock_usec == 0)
+					{
+						request_keyframe();
+					}
+				}
+			);
+		}
+	}
+
+	if (is_event_recording_mode() && !make_event_recorder())
+	{
+		logger()->error("Failed to start the event recorder in event recording mode!");
+		gst_object_unref(pipeline_tmp);
+		return false;
+	}
+
 	GstDebugGraphDetails graph_details = static_cast<GstDebugGraphDetails>(
 		GST_DEBUG_GRAPH_SHOW_MEDIA_TYPE | GST_DEBUG_GRAPH_SHOW_CAPS_DETAILS | GST_DEBUG_GRAPH_SHOW_NON_DEFAULT_PARAMS);
 	GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(pipeline_tmp), graph_details, "pipeline-start");
@@ -950,6 +1831,84 @@ bool Pipeline::start_pipeline()
 		return false;
 	}
 
+	if (!recording_catalog)
+	{
+		RecordingCatalogConfig catalog_config;
+		catalog_config.logger_ptr = config.logger_ptr;
+		catalog_config.recording_path = get_recording_full_path();
+		catalog_config.secondary_path = config.recording_tier_path;
+		catalog_config.recording_extensions = recording_extensions;
+		recording_catalog = std::make_shared<RecordingCatalog>(catalog_config);
+		if (!recording_catalog->open())
+		{
+			// Recording goes on, only time range queries are lost
+			logger()->error("Failed to open the recording catalog, time range queries are disabled");
+			recording_catalog.reset();
+		}
+	}
+
+	if (!recording_recovery)
+	{
+		// Segments interrupted by the previous run are repaired while this one records
+		RecordingRecoveryConfig recovery_config;
+		recovery_config.logger_ptr = config.logger_ptr;
+		recovery_config.recording_path = get_recording_full_path();
+		recovery_config.recording_extensions = recording_extensions;
+		recovery_config.staging_path = config.recording_staging_path;
+		recovery_config.video_width = config.video_width;
+		recovery_config.video_height = config.video_height;
+		recovery_config.video_fps_numerator = config.video_fps_numerator;
+		recovery_config.video_fps_denominator = config.video_fps_denominator;
+		recording_recovery = std::make_shared<RecordingRecovery>(recovery_config, recording_catalog);
+		recording_recovery->start();
+	}
+
+	if (!recording_tiering && !config.recording_tier_path.empty())
+	{
+		RecordingTieringConfig tiering_config;
+		tiering_config.logger_ptr = config.logger_ptr;
+		tiering_config.recording_path = get_recording_full_path();
+		tiering_config.secondary_path = config.recording_tier_path;
+		tiering_config.recording_extensions = recording_extensions;
+		tiering_config.min_age_hours = config.recording_tier_min_age_hours;
+		tiering_config.bandwidth_kib = config.recording_tier_bandwidth_kib;
+		tiering_config.secondary_max_size_mib = config.recording_tier_max_size_mib;
+		// Files of the previous run stay on the card until recovery is done with them
+		tiering_config.ready_handler = [recovery = recording_recovery]() { return recovery->is_done(); };
+		recording_tiering = std::make_shared<RecordingTiering>(tiering_config, recording_catalog);
+		if (!recording_tiering->start())
+		{
+			logger()->error("Failed to start recording tiering, recordings stay on the card");
+			recording_tiering.reset();
+		}
+	}
+
+	if (!recording_uploader && !config.recording_upload_endpoint.empty())
+	{
+		RecordingUploaderConfig uploader_config;
+		uploader_config.logger_ptr = config.logger_ptr;
+		uploader_config.recording_path = get_recording_full_path();
+		uploader_config.s3.endpoint = config.recording_upload_endpoint;
+		uploader_config.s3.region = config.recording_upload_region;
+		uploader_config.s3.bucket = config.recording_upload_bucket;
+		uploader_config.s3.access_key = config.recording_upload_access_key;
+		uploader_config.s3.secret_key = config.recording_upload_secret_key;
+		uploader_config.key_prefix = config.recording_upload_prefix;
+		uploader_config.part_size = static_cast<size_t>(config.recording_upload_part_size_mib) * 1024 * 1024;
+		uploader_config.parallel_parts = config.recording_upload_parallel;
+		uploader_config.bandwidth_kib = config.recording_upload_bandwidth_kib;
+		uploader_config.leased_bandwidth_kib = config.recording_upload_leased_bandwidth_kib;
+		uploader_config.delete_uploaded = config.recording_upload_delete_local;
+		// Segments of the previous run are uploaded once recovery has repaired them
+		uploader_config.ready_handler = [recovery = recording_recovery]() { return recovery->is_done(); };
+		recording_uploader = std::make_shared<RecordingUploader>(uploader_config, recording_catalog);
+		if (!recording_uploader->start())
+		{
+			logger()->error("Failed to start the recording uploader, recordings stay local");
+			recording_uploader.reset();
+		}
+	}
+
 	if (!gst_pipeline)
 	{
 		logger()->error("start_pipeline() called for not constructed pipeline!");
@@ -1,9 +1,27 @@
 #pragma once
 
+#include <map>
+#include <mutex>
+#include <memory>
 #include <string>
+#include <vector>
 #include <gst/gst.h>
 #include <spdlog/spdlog.h>
 #include <filesystem>
+#include <gst/app/gstappsink.h>
+#include "../streaming/UdpFanout.h"
+#include "../streaming/SrtOutput.h"
+#include "EncodedTap.h"
+#include "RawTap.h"
+#include "MotionDetector.h"
+#include "../recording/EventRecorder.h"
+#include "../recording/SegmentIndex.h"
+#include "../recording/RecordingCatalog.h"
+#include "../recording/RecordingRecovery.h"
+#include "../recording/RecordingTiering.h"
+#include "../recording/RecordingUploader.h"
+#include "../recording/SegmentSink.h"
+#include "../analytics/AnalyticsHost.h"
 
 struct PipelineConfig
 {
@@ -17,12 +35,67 @@ struct PipelineConfig
 	int recording_segment_duration = 3600;
 	int recording_max_size = 32 * 1024;
 	std::string videosource_override;
+	int rtp_fanout_threads = 0;
+	std::string rtp_multicast_group;
+	int rtp_multicast_port = 5004;
+	int rtp_multicast_ttl = 1;
+	std::string rtp_multicast_iface;
+	int rtp_dscp = -1;
+	int rtp_socket_priority = -1;
+	int rtp_sndbuf_size = 0;
+	int srt_port = 0;
+	int srt_latency_msec = 120;
+	std::string srt_passphrase;
+	bool raw_tap_enabled = false;
+	// Some in-process consumer reads encoded frames, event recording turns the tap on by itself
+	bool encoded_tap_enabled = false;
+	bool motion_enabled = false;
+	int motion_interval_msec = 200;
+	int motion_block_threshold = 12;
+	double motion_min_area_percent = 1.0;
+	int motion_trigger_frames = 2;
+	int motion_hold_msec = 3000;
+	bool motion_force_keyframe = true;
+	std::string recording_container = "mp4";
+	int recording_fragment_msec = 1000;
+	int recording_bitrate_kbps = 2048;
+	int recording_write_block_kib = 512;
+	std::string recording_writer = "sync";
+	int recording_writes_in_flight = 4;
+	bool recording_direct_io = false;
+	std::string recording_flush = "none";
+	std::string recording_staging_path;
+	int recording_staging_max_size_mib = 64;
+	int recording_staging_max_loss_sec = 10;
+	std::string recording_tier_path;
+	int recording_tier_min_age_hours = 24;
+	int recording_tier_bandwidth_kib = 4096;
+	int recording_tier_max_size_mib = 0;
+	std::string recording_upload_endpoint;
+	std::string recording_upload_region = "us-east-1";
+	std::string recording_upload_bucket;
+	std::string recording_upload_access_key;
+	std::string recording_upload_secret_key;
+	std::string recording_upload_prefix;
+	int recording_upload_part_size_mib = 8;
+	int recording_upload_parallel = 2;
+	int recording_upload_bandwidth_kib = 0;
+	int recording_upload_leased_bandwidth_kib = 256;
+	bool recording_upload_delete_local = false;
+	std::string recording_mode = "continuous";
+	int event_preroll_msec = 5000;
+	int event_postroll_msec = 10000;
+	std::vector<std::string> analytics_plugins;
+	int analytics_cpu_budget_percent = 25;
 };
 
 class Pipeline
 {
 public:
-	static const std::string recording_extension;
+	static const std::vector<std::string> recording_extensions;
+	static bool is_recording_file(const std::filesystem::path& path);
+	// Space the file takes on disk, blocks reserved past its end included
+	static uintmax_t get_allocated_size(const std::filesystem::path& path);
 
 private:
 	PipelineConfig config;
@@ -30,19 +103,55 @@ private:
 	GstBus* bus = nullptr;
 	bool is_playing = false;
 	std::string recording_full_path;
+	std::shared_ptr<UdpFanout> rtp_fanout;
+	int rtp_multicast_members = 0;
+	std::shared_ptr<SrtOutput> srt_output;
+	std::shared_ptr<EncodedTap> encoded_tap;
+	std::shared_ptr<RawTap> raw_tap;
+	std::shared_ptr<MotionDetector> motion_detector;
+	std::shared_ptr<EventRecorder> event_recorder;
+	std::shared_ptr<AnalyticsHost> analytics_host;
+	std::shared_ptr<RecordingCatalog> recording_catalog;
+	std::shared_ptr<RecordingRecovery> recording_recovery;
+	std::shared_ptr<RecordingTiering> recording_tiering;
+	std::shared_ptr<RecordingUploader> recording_uploader;
+	std::shared_ptr<SegmentSink> segment_sink;
+	GstElement* encoder_element = nullptr;
+
+	// Sidecar indexes of splitmuxsink fragments, fed from the muxer's streaming thread
+	std::mutex segment_index_mutex;
+	std::string next_segment_path;
+	std::string current_segment_path;
+	std::unique_ptr<SegmentIndexWriter> segment_index_writer;
+	uint64_t segment_media_bytes = 0;
+	std::map<std::string, std::unique_ptr<SegmentIndexWriter>> closing_segment_indexes;
 
 	std::shared_ptr<spdlog::logger> logger() const;
 
 	GstElement* make_capturing_subpipe(std::string bin_str);
 	GstElement* make_capturing_subpipe();
+	bool link_source_to_encoder(GstElement* bin, GstElement* source, GstElement* encoder, GstCaps* caps);
+	void link_analytics(GstElement* bin, GstElement* raw_tee);
 	GstElement* make_recording_subpipe();
 	GstElement* make_streaming_subpipe();
+	void apply_rtp_socket_priority();
 
 	static const std::string get_current_date_time_str();
 	void handle_pipeline_message(GstMessage* msg);
 	static gchararray format_location_handler(GstElement* splitmux, guint fragment_id, gpointer udata);
+	std::string make_recording_location(const std::string& fragment_tag, const std::string& extension);
+	static void recording_muxer_pad_added(GstElement* muxer, GstPad* pad, gpointer udata);
+	static GstPadProbeReturn recording_muxer_probe(GstPad* pad, GstPadProbeInfo* info, gpointer udata);
+	void on_recording_fragment_closed(const std::string& location);
+	void close_segment_indexes();
+	void finish_segment_index(const std::string& location, SegmentIndexWriter& writer);
+	int64_t running_time_to_wallclock(GstClockTime running_time) const;
+	bool make_event_recorder();
+	static GstFlowReturn rtp_appsink_new_sample(GstAppSink* appsink, gpointer udata);
 
+	std::string get_recording_extension() const;
 	uintmax_t get_recording_total_size() const;
+	uintmax_t get_recording_staged_size() const;
 	std::filesystem::path get_oldest_file() const;
 	void enforce_recording_max_size_restrictions(std::filesystem::path last_fragment_path, int last_fragment_index);
 
@@ -123,6 +232,31 @@ public:
 	bool rtp_add_endpoint(std::string host, int port);
 	bool rtp_remove_endpoint(std::string host, int port);
 	bool rtp_change_endpoint(std::string host_old, int port_old, std::string host, int port);
+	bool get_rtp_fanout_stats(UdpFanoutStats& stats) const;
+	bool get_recording_write_stats(SegmentSinkStats& stats) const;
+	bool get_recording_tiering_stats(RecordingTieringStats& stats) const;
+	bool get_recording_upload_stats(RecordingUploaderStats& stats) const;
+	// Uploads slow down to the leased bandwidth while someone watches
+	void set_recording_upload_throttled(bool throttled);
+
+	bool rtp_multicast_enabled() const;
+	bool rtp_multicast_join();
+	bool rtp_multicast_leave();
+	std::string get_rtp_multicast_group() const;
+	int get_rtp_multicast_port() const;
+	int get_rtp_multicast_ttl() const;
+
+	std::shared_ptr<SrtOutput> get_srt_output() const;
+	std::shared_ptr<EncodedTap> get_encoded_tap() const;
+	std::shared_ptr<RawTap> get_raw_tap() const;
+	std::shared_ptr<MotionDetector> get_motion_detector() const;
+	std::shared_ptr<EventRecorder> get_event_recorder() const;
+	std::shared_ptr<AnalyticsHost> get_analytics_host() const;
+	std::shared_ptr<RecordingCatalog> get_recording_catalog() const;
+	bool is_event_recording_mode() const;
+
+	// Asks the encoder for an IDR as soon as possible
+	bool request_keyframe();
 
 	void dump_pipeline_dot(std::string name) const;
 
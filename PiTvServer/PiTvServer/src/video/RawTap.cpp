@@ -0,0 +1,170 @@
+#include "RawTap.h"
+#include <cassert>
+
+RawStreamInfo::~RawStreamInfo()
+{
+	if (caps)
+	{
+		gst_caps_unref(caps);
+	}
+}
+
+RawFrame::~RawFrame()
+{
+	if (buffer)
+	{
+		gst_buffer_unref(buffer);
+	}
+}
+
+RawTap::RawTap(std::shared_ptr<spdlog::logger> logger_ptr)
+{
+	this->logger_ptr = logger_ptr;
+}
+
+RawTap::~RawTap()
+{
+	if (last_caps)
+	{
+		gst_caps_unref(last_caps);
+	}
+}
+
+GstElement* RawTap::make_bin()
+{
+	GstElement* bin = gst_bin_new("raw-tap-bin");
+	assert(bin);
+
+	GstElement* queue = gst_element_factory_make("queue", "raw_tap_queue");
+	GstElement* appsink = gst_element_factory_make("appsink", "raw_appsink");
+
+	if (!queue || !appsink)
+	{
+		logger_ptr->error("Failed to create raw tap elements!");
+		gst_object_unref(bin);
+		return nullptr;
+	}
+
+	g_object_set(queue, "leaky", 2, "max-size-buffers", 2, "max-size-bytes", 0, "max-size-time", (guint64)0, NULL);
+	g_object_set(appsink, "sync", false, "emit-signals", false, "max-buffers", 1, "drop", true, NULL);
+
+	GstAppSinkCallbacks callbacks = { 0 };
+	callbacks.new_sample = &RawTap::appsink_new_sample;
+	gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, this, NULL);
+
+	gst_bin_add_many(GST_BIN(bin), queue, appsink, NULL);
+	if (!gst_element_link(queue, appsink))
+	{
+		logger_ptr->error("Failed to link raw tap elements!");
+		gst_object_unref(bin);
+		return nullptr;
+	}
+
+	GstPad* queue_sink_pad = gst_element_get_static_pad(queue, "sink");
+	GstPad* sink_ghost_pad = gst_ghost_pad_new("sink", queue_sink_pad);
+	gst_element_add_pad(bin, sink_ghost_pad);
+	gst_object_unref(queue_sink_pad);
+
+	return bin;
+}
+
+void RawTap::update_stream_info(GstCaps* caps)
+{
+	auto info = std::make_shared<RawStreamInfo>();
+	gst_video_info_init(&info->video_info);
+
+	gchar* caps_str = gst_caps_to_string(caps);
+	if (gst_video_info_from_caps(&info->video_info, caps))
+	{
+		info->caps = gst_caps_ref(caps);
+		logger_ptr->info("Raw tap caps: {}", caps_str);
+	}
+	else
+	{
+		logger_ptr->error("Raw tap: unsupported caps {}, raw frames will not be delivered", caps_str);
+		info.reset();
+	}
+	g_free(caps_str);
+
+	std::lock_guard<std::mutex> lock(stream_info_mutex);
+	stream_info = info;
+	if (last_caps)
+	{
+		gst_caps_unref(last_caps);
+	}
+	last_caps = gst_caps_ref(caps);
+}
+
+GstFlowReturn RawTap::appsink_new_sample(GstAppSink* appsink, gpointer udata)
+{
+	assert(udata);
+	RawTap* tap = static_cast<RawTap*>(udata);
+
+	GstSample* sample = gst_app_sink_pull_sample(appsink);
+	if (!sample)
+	{
+		return GST_FLOW_EOS;
+	}
+
+	GstCaps* caps = gst_sample_get_caps(sample);
+	GstBuffer* buffer = gst_sample_get_buffer(sample);
+	if (!caps || !buffer)
+	{
+		gst_sample_unref(sample);
+		return GST_FLOW_OK;
+	}
+
+	bool caps_changed = false;
+	{
+		std::lock_guard<std::mutex> lock(tap->stream_info_mutex);
+		caps_changed = tap->last_caps != caps;
+	}
+	if (caps_changed)
+	{
+		tap->update_stream_info(caps);
+	}
+
+	auto stream_info = tap->get_stream_info();
+	if (!stream_info)
+	{
+		gst_sample_unref(sample);
+		return GST_FLOW_OK;
+	}
+
+	auto frame = std::make_shared<RawFrame>();
+	frame->buffer = gst_buffer_ref(buffer);
+	frame->pts = GST_BUFFER_PTS(buffer);
+	frame->wallclock_usec = g_get_real_time();
+	frame->stream_info = stream_info;
+
+	gst_sample_unref(sample);
+
+	RawFramePtr frame_ptr = frame;
+	std::lock_guard<std::mutex> lock(tap->listeners_mutex);
+	for (auto& listener : tap->listeners)
+	{
+		listener.second(frame_ptr);
+	}
+
+	return GST_FLOW_OK;
+}
+
+int RawTap::add_listener(RawFrameListener listener)
+{
+	std::lock_guard<std::mutex> lock(listeners_mutex);
+	int listener_id = next_listener_id++;
+	listeners[listener_id] = listener;
+	return listener_id;
+}
+
+void RawTap::remove_listener(int listener_id)
+{
+	std::lock_guard<std::mutex> lock(listeners_mutex);
+	listeners.erase(listener_id);
+}
+
+std::shared_ptr<const RawStreamInfo> RawTap::get_stream_info() const
+{
+	std::lock_guard<std::mutex> lock(stream_info_mutex);
+	return stream_info;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <functional>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
+#include <spdlog/spdlog.h>
+
+// Format of the tapped raw frames as negotiated between the camera source and the encoder
+struct RawStreamInfo
+{
+	GstCaps* caps = nullptr;
+	GstVideoInfo video_info;
+
+	RawStreamInfo() = default;
+	RawStreamInfo(const RawStreamInfo&) = delete;
+	RawStreamInfo& operator=(const RawStreamInfo&) = delete;
+	~RawStreamInfo();
+};
+
+// One raw video frame, the GstBuffer is shared by reference with the encoder branch
+struct RawFrame
+{
+	GstBuffer* buffer = nullptr;
+	GstClockTime pts = GST_CLOCK_TIME_NONE;
+	int64_t wallclock_usec = 0;
+	std::shared_ptr<const RawStreamInfo> stream_info;
+
+	RawFrame() = default;
+	RawFrame(const RawFrame&) = delete;
+	RawFrame& operator=(const RawFrame&) = delete;
+	~RawFrame();
+};
+
+typedef std::shared_ptr<const RawFrame> RawFramePtr;
+typedef std::function<void(const RawFramePtr&)> RawFrameListener;
+
+// Leaky appsink branch in front of the encoder. Frames are dropped rather than queued,
+// so slow listeners never stall encoding. Listeners are called on the tap streaming thread.
+class RawTap
+{
+private:
+	std::shared_ptr<spdlog::logger> logger_ptr;
+
+	mutable std::mutex listeners_mutex;
+	std::map<int, RawFrameListener> listeners;
+	int next_listener_id = 1;
+
+	mutable std::mutex stream_info_mutex;
+	std::shared_ptr<const RawStreamInfo> stream_info;
+	GstCaps* last_caps = nullptr;
+
+	static GstFlowReturn appsink_new_sample(GstAppSink* appsink, gpointer udata);
+	void update_stream_info(GstCaps* caps);
+
+public:
+	RawTap& operator=(const RawTap&) = delete;
+	RawTap(const RawTap& copy) = delete;
+	RawTap() = delete;
+
+	RawTap(std::shared_ptr<spdlog::logger> logger_ptr);
+	~RawTap();
+
+	// Returned bin is owned by the caller and has a video/x-raw "sink" ghost pad
+	GstElement* make_bin();
+
+	int add_listener(RawFrameListener listener);
+	void remove_listener(int listener_id);
+
+	std::shared_ptr<const RawStreamInfo> get_stream_info() const;
+};
@@ -0,0 +1,51 @@
+#include <chrono>
+#include <gst/gst.h>
+#include "TestUtil.h"
+#include "../src/video/Pipeline.h"
+
+// Records one-second segments from a test source. Each finished segment has to reach the catalog
+// while the pipeline still runs, through the fragment-closed message on the bus, not at shutdown.
+static void test_segments_reach_catalog(const std::filesystem::path& directory)
+{
+	PipelineConfig config;
+	config.logger_ptr = spdlog::default_logger();
+	config.recording_path = directory.string();
+	config.video_width = 320;
+	config.video_height = 240;
+	config.recording_segment_duration = 1;
+	config.videosource_override = "videotestsrc is-live=true ! video/x-raw,width=320,height=240,framerate=20/1 "
+		"! x264enc tune=zerolatency speed-preset=ultrafast key-int-max=10 ! video/x-h264,profile=baseline";
+
+	Pipeline pipeline(config);
+	CHECK(pipeline.construct_pipeline());
+	CHECK(pipeline.start_pipeline());
+
+	auto catalog = pipeline.get_recording_catalog();
+	CHECK(catalog != nullptr);
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (catalog && catalog->get_segment_count() < 2 && std::chrono::steady_clock::now() < deadline)
+	{
+		pipeline.bus_poll(100);
+	}
+	CHECK(catalog && catalog->get_segment_count() >= 2);
+
+	if (catalog)
+	{
+		std::vector<RecordingSegment> segments = catalog->find_segments(0, INT64_MAX);
+		CHECK(!segments.empty() && segments.front().end_wallclock_usec > segments.front().start_wallclock_usec);
+	}
+
+	pipeline.stop_pipeline();
+}
+
+int main(int argc, char** argv)
+{
+	gst_init(&argc, &argv);
+	spdlog::set_level(spdlog::level::warn);
+
+	TestDirectory directory("pipeline-recording");
+	test_segments_reach_catalog(directory.get_path());
+
+	return test_result();
+}
@@ -0,0 +1,142 @@
+#include "TestUtil.h"
+#include "../src/recording/RecordingCatalog.h"
+
+static const int64_t frame_usec = 40000;
+static const int64_t hour_usec = 3600LL * 1000000;
+static const int64_t base_usec = 1700000000LL * 1000000;
+
+// Writes the index of a segment of frame_count frames with a keyframe every 25 frames.
+// clock_step_usec is added to the clock passed for the second half, as an NTP step would.
+static SegmentIndexHeader write_index(const std::filesystem::path& segment_path, int64_t start_usec, uint64_t start_pts_ns, int frame_count, int64_t clock_step_usec)
+{
+	SegmentIndexWriter writer(spdlog::default_logger());
+	CHECK(writer.open(SegmentIndex::get_index_path(segment_path.string()), true));
+	for (int i = 0; i < frame_count; i++)
+	{
+		int64_t wallclock_usec = start_usec + i * frame_usec + (i >= frame_count / 2 ? clock_step_usec : 0);
+		uint64_t pts_ns = start_pts_ns + static_cast<uint64_t>(i * frame_usec * 1000);
+		writer.append(pts_ns, wallclock_usec, static_cast<uint64_t>(i) * 1000, 1000, i % 25 == 0);
+	}
+	CHECK(writer.close(true, 0));
+	write_test_file(segment_path, std::vector<uint8_t>(static_cast<size_t>(frame_count) * 1000, 0));
+	return writer.get_header();
+}
+
+static bool is_monotonic(const std::vector<SegmentIndexEntry>& entries)
+{
+	for (size_t i = 1; i < entries.size(); i++)
+	{
+		if (entries[i].wallclock_usec < entries[i - 1].wallclock_usec)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// A clock step inside a segment neither stretches it nor reorders its entries
+static void test_index_clock_step(const std::filesystem::path& directory)
+{
+	for (int64_t step_usec : { 3 * hour_usec, -hour_usec })
+	{
+		std::filesystem::path segment_path = directory / "step.mp4";
+		SegmentIndexHeader written = write_index(segment_path, base_usec, 5000000000ULL, 100, step_usec);
+		CHECK(written.end_wallclock_usec - written.start_wallclock_usec == 99 * frame_usec);
+
+		SegmentIndexHeader header;
+		std::vector<SegmentIndexEntry> entries;
+		CHECK(SegmentIndex::read(SegmentIndex::get_index_path(segment_path.string()), header, entries));
+		CHECK(entries.size() == 100);
+		CHECK(is_monotonic(entries));
+		CHECK(header.end_wallclock_usec == base_usec + 99 * frame_usec);
+
+		CHECK(SegmentIndex::find_keyframe(entries, base_usec + 60 * frame_usec) == 50);
+		CHECK(SegmentIndex::find_keyframe(entries, base_usec + 75 * frame_usec) == 75);
+		CHECK(SegmentIndex::find_keyframe(entries, base_usec - hour_usec) == 0);
+		CHECK(SegmentIndex::find_keyframe(entries, base_usec + hour_usec) == 75);
+	}
+}
+
+// Segments of 4 s, one of them recorded across a clock step, stay found by a binary search
+static void test_catalog_query(const std::filesystem::path& directory)
+{
+	RecordingCatalogConfig config;
+	config.logger_ptr = spdlog::default_logger();
+	config.recording_path = directory.string();
+
+	const int segment_count = 50;
+	const int frames_per_segment = 100;
+	const int64_t segment_usec = frames_per_segment * frame_usec;
+	{
+		RecordingCatalog catalog(config);
+		CHECK(catalog.open());
+		for (int i = 0; i < segment_count; i++)
+		{
+			std::filesystem::path segment_path = directory / ("segment" + std::to_string(i) + ".mp4");
+			int64_t step_usec = i == 10 ? 5 * hour_usec : 0;
+			SegmentIndexHeader header = write_index(segment_path, base_usec + i * segment_usec, static_cast<uint64_t>(i * segment_usec * 1000), frames_per_segment, step_usec);
+			CHECK(catalog.add_segment(segment_path.string(), header, 0));
+		}
+		CHECK(catalog.get_segment_count() == segment_count);
+	}
+
+	// Reopened from catalog.bin
+	RecordingCatalog catalog(config);
+	CHECK(catalog.open());
+	CHECK(catalog.get_segment_count() == segment_count);
+
+	std::vector<RecordingSegment> segments = catalog.find_segments(base_usec + 10 * segment_usec + frame_usec, base_usec + 11 * segment_usec - frame_usec);
+	CHECK(segments.size() == 1 && segments[0].name == "segment10.mp4");
+	CHECK(segments.size() == 1 && segments[0].end_wallclock_usec - segments[0].start_wallclock_usec == segment_usec - frame_usec);
+
+	// Nothing is found hours later, where the stepped clock pointed
+	CHECK(catalog.find_segments(base_usec + 5 * hour_usec, base_usec + 6 * hour_usec).empty());
+
+	std::vector<RecordingRange> ranges = catalog.query(base_usec + 10 * segment_usec + 60 * frame_usec, base_usec + 10 * segment_usec + 80 * frame_usec);
+	CHECK(ranges.size() == 1);
+	if (ranges.size() == 1)
+	{
+		CHECK(ranges[0].exact);
+		CHECK(ranges[0].offset == 50 * 1000);
+		CHECK(ranges[0].length == 31 * 1000);
+		CHECK(ranges[0].start_wallclock_usec == base_usec + 10 * segment_usec + 50 * frame_usec);
+		CHECK(ranges[0].end_wallclock_usec == base_usec + 10 * segment_usec + 80 * frame_usec);
+	}
+
+	// A range across a segment boundary returns both segments in order
+	ranges = catalog.query(base_usec + 20 * segment_usec - frame_usec, base_usec + 20 * segment_usec + frame_usec);
+	CHECK(ranges.size() == 2);
+	if (ranges.size() == 2)
+	{
+		CHECK(ranges[0].segment.name == "segment19.mp4" && ranges[1].segment.name == "segment20.mp4");
+	}
+
+	// Removals and moves are appended, the replay keeps the last record of every name
+	// Retention deletes the files first, otherwise reopening picks them up from their sidecars again
+	RecordingSegment segment;
+	std::filesystem::remove(directory / "segment5.mp4");
+	std::filesystem::remove(SegmentIndex::get_index_path((directory / "segment5.mp4").string()));
+	CHECK(catalog.remove_segment((directory / "segment5.mp4").string()));
+	CHECK(!catalog.remove_segment((directory / "segment5.mp4").string()));
+	CHECK(catalog.move_segment((directory / "segment6.mp4").string(), false));
+	catalog.close();
+
+	RecordingCatalog replayed(config);
+	CHECK(replayed.open());
+	CHECK(replayed.get_segment_count() == segment_count - 1);
+	CHECK(!replayed.find_segment("segment5.mp4", segment));
+	CHECK(replayed.find_segment("segment6.mp4", segment) && segment.start_wallclock_usec == base_usec + 6 * segment_usec);
+	CHECK(replayed.find_segments(base_usec + 5 * segment_usec + frame_usec, base_usec + 5 * segment_usec + 2 * frame_usec).empty());
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::warn);
+	TestDirectory index_directory("index");
+	TestDirectory catalog_directory("catalog");
+
+	test_index_clock_step(index_directory.get_path());
+	test_catalog_query(catalog_directory.get_path());
+
+	return test_result();
+}
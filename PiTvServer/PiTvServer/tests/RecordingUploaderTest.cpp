@@ -0,0 +1,96 @@
+#include "TestUtil.h"
+#include "../src/recording/RecordingUploader.h"
+
+static std::string read_journal(const std::filesystem::path& directory)
+{
+	std::vector<uint8_t> data = read_test_file(directory / RecordingUploader::journal_file_name);
+	return std::string(data.begin(), data.end());
+}
+
+// Starts an uploader that never gets ready, so it only replays and compacts the journal
+static uint64_t replay(const std::filesystem::path& directory)
+{
+	RecordingUploaderConfig config;
+	config.logger_ptr = spdlog::default_logger();
+	config.recording_path = directory.string();
+	config.s3.endpoint = "http://127.0.0.1:9";
+	config.s3.bucket = "pitv";
+	config.part_size = 8 * 1024 * 1024;
+	config.ready_handler = []() { return false; };
+
+	RecordingUploader uploader(config, nullptr);
+	CHECK(uploader.start());
+	uint64_t queue_length = uploader.get_stats().queue_length;
+	uploader.stop();
+	return queue_length;
+}
+
+// What a run left appended is replayed: finished files drop out, restarted uploads lose their parts
+static void test_replay(const std::filesystem::path& directory)
+{
+	std::string journal =
+		"Q a.mp4\n"
+		"Q b.mp4\n"
+		"Q c.mp4\n"
+		"Q 2024-01-01 [event-1].mp4\n"
+		"U up-a 8388608 a.mp4\n"
+		"P 1 \"e1\" a.mp4\n"
+		"P 2 \"e2\" a.mp4\n"
+		"U up-b 8388608 b.mp4\n"
+		"P 1 \"f1\" b.mp4\n"
+		"R b.mp4\n"
+		"D c.mp4\n"
+		"Q a.mp4\n"
+		"U up-e 2024-01-01 [event-1].mp4\n"
+		"P 3 \"g3\" 2024-01-01 [event-1].mp4\n";
+	write_test_file(directory / RecordingUploader::journal_file_name, std::vector<uint8_t>(journal.begin(), journal.end()));
+
+	CHECK(replay(directory) == 3);
+	std::string expected =
+		"Q a.mp4\n"
+		"U up-a 8388608 a.mp4\n"
+		"P 1 \"e1\" a.mp4\n"
+		"P 2 \"e2\" a.mp4\n"
+		"Q b.mp4\n"
+		"Q 2024-01-01 [event-1].mp4\n"
+		"U up-e 0 2024-01-01 [event-1].mp4\n"
+		"P 3 \"g3\" 2024-01-01 [event-1].mp4\n";
+	CHECK(read_journal(directory) == expected);
+
+	// The compacted journal replays to itself
+	CHECK(replay(directory) == 3);
+	CHECK(read_journal(directory) == expected);
+}
+
+// A journal cut short by a power loss keeps every complete line
+static void test_torn_journal(const std::filesystem::path& directory)
+{
+	std::string journal =
+		"Q a.mp4\n"
+		"U up-a 8388608 a.mp4\n"
+		"P 1 \"e1\" a.mp4\n"
+		"P 2 \"e2";
+	write_test_file(directory / RecordingUploader::journal_file_name, std::vector<uint8_t>(journal.begin(), journal.end()));
+
+	CHECK(replay(directory) == 1);
+	CHECK(read_journal(directory) ==
+		"Q a.mp4\n"
+		"U up-a 8388608 a.mp4\n"
+		"P 1 \"e1\" a.mp4\n");
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::warn);
+
+	{
+		TestDirectory directory("upload-replay");
+		test_replay(directory.get_path());
+	}
+	{
+		TestDirectory directory("upload-torn");
+		test_torn_journal(directory.get_path());
+	}
+
+	return test_result();
+}
@@ -0,0 +1,92 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include "TestUtil.h"
+#include "../src/recording/SegmentSink.h"
+
+static std::vector<uint8_t> make_pattern(size_t size, uint8_t seed)
+{
+	std::vector<uint8_t> data(size);
+	for (size_t i = 0; i < size; i++)
+	{
+		data[i] = static_cast<uint8_t>(i * 31 + seed) | 1;
+	}
+	return data;
+}
+
+static void test_ranges()
+{
+	std::map<uint64_t, uint64_t> ranges;
+	CHECK(SegmentStaging::add_range(ranges, 0, 100) == 100);
+	CHECK(SegmentStaging::add_range(ranges, 200, 300) == 100);
+	CHECK(SegmentStaging::add_range(ranges, 50, 250) == 100);
+	CHECK(ranges.size() == 1 && ranges[0] == 300);
+
+	SegmentStaging::remove_range(ranges, 100, 150);
+	CHECK(ranges.size() == 2 && ranges[0] == 100 && ranges[150] == 300);
+	SegmentStaging::remove_range(ranges, 0, 400);
+	CHECK(ranges.empty());
+}
+
+// Flushes part of a segment, rewrites a byte range inside a punched page and appends, then salvages
+// the staging file as a crashed run would leave it. The card must end up with every write.
+static void test_punch_and_salvage()
+{
+	// SEEK_DATA reports holes exactly on tmpfs
+	std::filesystem::path staging_parent = std::filesystem::is_directory("/dev/shm") ? "/dev/shm" : std::filesystem::temp_directory_path();
+	TestDirectory staging_dir("staging", staging_parent);
+	TestDirectory recording_dir("recordings");
+
+	SegmentStagingConfig config;
+	config.logger_ptr = spdlog::default_logger();
+	config.staging_path = staging_dir.get_path().string();
+	config.max_loss_sec = 3600;
+	config.write_done_handler = [](SegmentFile&, uint64_t, size_t) {};
+	SegmentStaging staging(config);
+	CHECK(staging.start());
+
+	auto segment_file = std::make_shared<SegmentFile>();
+	segment_file->path = (recording_dir.get_path() / "segment.mp4").string();
+	segment_file->fd = ::open(segment_file->path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	CHECK(segment_file->fd >= 0);
+	CHECK(staging.open(segment_file));
+
+	std::vector<uint8_t> expected = make_pattern(6000, 1);
+	CHECK(staging.write(*segment_file, expected.data(), expected.size(), 0));
+	CHECK(staging.flush(*segment_file));
+	CHECK(read_test_file(segment_file->path) == expected);
+
+	// Only the first page lies entirely inside the flushed range
+	CHECK(lseek(segment_file->staged_fd, 0, SEEK_DATA) == 4096);
+
+	std::vector<uint8_t> appended = make_pattern(100, 2);
+	CHECK(staging.write(*segment_file, appended.data(), appended.size(), 6000));
+	expected.insert(expected.end(), appended.begin(), appended.end());
+
+	// A header rewrite into the punched page brings the rest of the page back from the card
+	std::vector<uint8_t> rewritten = make_pattern(10, 3);
+	CHECK(staging.write(*segment_file, rewritten.data(), rewritten.size(), 10));
+	std::copy(rewritten.begin(), rewritten.end(), expected.begin() + 10);
+	CHECK(staging.get_staged_bytes() == 4096 + 100);
+
+	// Crash: the staging file stays, the card has only the first flush
+	staging.stop();
+	::close(segment_file->staged_fd);
+	::close(segment_file->fd);
+	std::filesystem::path staged_path = segment_file->staged_path;
+
+	SegmentStaging::salvage(config.logger_ptr, config.staging_path, recording_dir.get_path().string(), { "mp4" },
+		std::filesystem::file_time_type::clock::now() - std::chrono::hours(1));
+	CHECK(std::filesystem::exists(staged_path));
+
+	SegmentStaging::salvage(config.logger_ptr, config.staging_path, recording_dir.get_path().string(), { "mp4" },
+		std::filesystem::file_time_type::clock::now() + std::chrono::hours(1));
+	CHECK(!std::filesystem::exists(staged_path));
+	CHECK(read_test_file(segment_file->path) == expected);
+}
+
+int main()
+{
+	test_ranges();
+	test_punch_and_salvage();
+	return test_result();
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <filesystem>
+#include <unistd.h>
+
+// Minimal checks for the unit tests: failures are printed and counted, main() returns test_result().
+// Unlike assert() they stay active in release builds.
+
+inline int& test_failures()
+{
+	static int failures = 0;
+	return failures;
+}
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+			test_failures()++; \
+		} \
+	} while (false)
+
+inline int test_result()
+{
+	if (test_failures() > 0)
+	{
+		std::cerr << test_failures() << " checks failed" << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+// Fresh directory for a test, removed again on destruction
+class TestDirectory
+{
+private:
+	std::filesystem::path path;
+
+public:
+	TestDirectory(const std::string& name, const std::filesystem::path& parent = std::filesystem::temp_directory_path())
+	{
+		path = parent / ("pitv-test-" + name + "-" + std::to_string(getpid()));
+		std::filesystem::remove_all(path);
+		std::filesystem::create_directories(path);
+	}
+
+	~TestDirectory()
+	{
+		std::error_code error;
+		std::filesystem::remove_all(path, error);
+	}
+
+	const std::filesystem::path& get_path() const
+	{
+		return path;
+	}
+};
+
+inline std::vector<uint8_t> read_test_file(const std::filesystem::path& path)
+{
+	std::ifstream stream(path, std::ios::binary);
+	return std::vector<uint8_t>(std::istreambuf_iterator<char>(stream), {});
+}
+
+inline void write_test_file(const std::filesystem::path& path, const std::vector<uint8_t>& data)
+{
+	std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+	stream.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+}
@@ -0,0 +1,189 @@
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <gst/app/gstappsrc.h>
+#include "TestUtil.h"
+#include "../src/streaming/UdpFanout.h"
+
+// Sustained viewers per core of UdpFanout against a single multiudpsink.
+// Both send the same buffer lists (one frame of RTP-sized packets each) to loopback endpoints for a
+// fixed time and the CPU time of the whole process is divided by the packets that went out.
+// Usage: UdpFanoutBenchmark [endpoints] [seconds] [bitrate in kbit/s]
+
+static const size_t packet_size = 1400;
+static const int packets_per_frame = 10;
+
+struct BenchmarkResult
+{
+	uint64_t packets = 0;
+	double cpu_sec = 0;
+};
+
+static double get_cpu_sec()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static GstBufferList* make_frame()
+{
+	GstBufferList* list = gst_buffer_list_new_sized(packets_per_frame);
+	for (int i = 0; i < packets_per_frame; i++)
+	{
+		GstBuffer* buffer = gst_buffer_new_allocate(nullptr, packet_size, nullptr);
+		gst_buffer_memset(buffer, 0, static_cast<guint8>(i), packet_size);
+		gst_buffer_list_add(list, buffer);
+	}
+	return list;
+}
+
+// Bound but never read, the kernel drops what does not fit
+static std::vector<int> open_receivers(int count, std::vector<int>& ports)
+{
+	std::vector<int> sockets;
+	for (int i = 0; i < count; i++)
+	{
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t addr_len = sizeof(addr);
+		if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), addr_len) != 0
+			|| getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &addr_len) != 0)
+		{
+			continue;
+		}
+		sockets.push_back(fd);
+		ports.push_back(ntohs(addr.sin_port));
+	}
+	return sockets;
+}
+
+static BenchmarkResult run_fanout(const std::vector<int>& ports, double seconds)
+{
+	UdpFanoutConfig config;
+	config.logger_ptr = spdlog::default_logger();
+	config.sender_threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+	UdpFanout fanout(config);
+	BenchmarkResult result;
+	if (!fanout.start())
+	{
+		return result;
+	}
+	for (int port : ports)
+	{
+		fanout.add_endpoint("127.0.0.1", port);
+	}
+
+	GstBufferList* frame = make_frame();
+	double cpu_started = get_cpu_sec();
+	auto started = std::chrono::steady_clock::now();
+	while (std::chrono::steady_clock::now() - started < std::chrono::duration<double>(seconds))
+	{
+		fanout.push_packets(gst_buffer_list_ref(frame));
+		// Keeps the queues short instead of measuring queue drops
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	result.cpu_sec = get_cpu_sec() - cpu_started;
+	result.packets = fanout.get_stats().packets_sent;
+	fanout.stop();
+	gst_buffer_list_unref(frame);
+	return result;
+}
+
+static BenchmarkResult run_multiudpsink(const std::vector<int>& ports, double seconds)
+{
+	std::string clients;
+	for (int port : ports)
+	{
+		clients += (clients.empty() ? "" : ",") + std::string("127.0.0.1:") + std::to_string(port);
+	}
+
+	BenchmarkResult result;
+	GError* error = nullptr;
+	std::string description = "appsrc name=src block=true max-bytes=1000000 ! multiudpsink sync=false async=false clients=" + clients;
+	GstElement* pipeline = gst_parse_launch(description.c_str(), &error);
+	if (!pipeline)
+	{
+		std::cerr << "multiudpsink pipeline failed: " << (error ? error->message : "") << std::endl;
+		g_clear_error(&error);
+		return result;
+	}
+	GstElement* source = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+	gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+	GstBufferList* frame = make_frame();
+	uint64_t frames = 0;
+	double cpu_started = get_cpu_sec();
+	auto started = std::chrono::steady_clock::now();
+	while (std::chrono::steady_clock::now() - started < std::chrono::duration<double>(seconds))
+	{
+		if (gst_app_src_push_buffer_list(GST_APP_SRC(source), gst_buffer_list_ref(frame)) != GST_FLOW_OK)
+		{
+			break;
+		}
+		frames++;
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	gst_app_src_end_of_stream(GST_APP_SRC(source));
+	GstBus* bus = gst_element_get_bus(pipeline);
+	GstMessage* message = gst_bus_timed_pop_filtered(bus, 10 * GST_SECOND, static_cast<GstMessageType>(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+	result.cpu_sec = get_cpu_sec() - cpu_started;
+	result.packets = frames * packets_per_frame * ports.size();
+
+	if (message)
+	{
+		gst_message_unref(message);
+	}
+	gst_object_unref(bus);
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+	gst_object_unref(source);
+	gst_object_unref(pipeline);
+	gst_buffer_list_unref(frame);
+	return result;
+}
+
+static void report(const char* name, const BenchmarkResult& result, double packets_per_viewer_sec)
+{
+	double packets_per_cpu_sec = result.cpu_sec > 0 ? result.packets / result.cpu_sec : 0;
+	std::cout << name << ": " << result.packets << " packets in " << result.cpu_sec << " s CPU, "
+		<< static_cast<uint64_t>(packets_per_cpu_sec) << " packets per CPU second, "
+		<< static_cast<uint64_t>(packets_per_cpu_sec / packets_per_viewer_sec) << " viewers per core" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	gst_init(&argc, &argv);
+	int endpoint_count = argc > 1 ? std::atoi(argv[1]) : 32;
+	double seconds = argc > 2 ? std::atof(argv[2]) : 5;
+	int bitrate_kbps = argc > 3 ? std::atoi(argv[3]) : 2048;
+	spdlog::set_level(spdlog::level::warn);
+
+	std::vector<int> ports;
+	std::vector<int> receivers = open_receivers(endpoint_count, ports);
+	CHECK(static_cast<int>(ports.size()) == endpoint_count);
+
+	double packets_per_viewer_sec = bitrate_kbps * 1000.0 / 8 / packet_size;
+	std::cout << ports.size() << " endpoints, " << seconds << " s per run, "
+		<< static_cast<uint64_t>(packets_per_viewer_sec) << " packets/s per viewer at " << bitrate_kbps << " kbit/s" << std::endl;
+
+	BenchmarkResult fanout = run_fanout(ports, seconds);
+	BenchmarkResult multiudpsink = run_multiudpsink(ports, seconds);
+	report("UdpFanout", fanout, packets_per_viewer_sec);
+	report("multiudpsink", multiudpsink, packets_per_viewer_sec);
+	CHECK(fanout.packets > 0);
+	CHECK(multiudpsink.packets > 0);
+
+	for (int fd : receivers)
+	{
+		close(fd);
+	}
+	return test_result();
+}